@@ -5,7 +5,7 @@ import platform
 
 if platform.system() == 'Linux':
     os.environ['CC'] = 'clang' # Clang is known to produce faster binaries.
-    compiler_kwargs = dict(extra_compile_args=['-O3', '-mavx', '-ffast-math', '-DNDEBUG'], extra_link_args=['-lm'])
+    compiler_kwargs = dict(extra_compile_args=['-O3', '-mavx', '-ffast-math', '-DNDEBUG'], extra_link_args=['-lm', '-lpthread'])
     extra_objects = []
     include_dirs = []
 elif platform.system() == 'Darwin':
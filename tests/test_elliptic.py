@@ -9,9 +9,7 @@ class TestElliptic(unittest.TestCase):
     
     def test_ellipk(self):
         x = np.linspace(-1, 1, 40)[1:-1]
-        # ellipk is slightly inaccurate, but is not used in electrostatic
-        # solver. Only ellipkm1 is used
-        assert np.allclose(B.ellipk(x), ellipk(x), atol=0., rtol=1e-5)
+        assert np.allclose(B.ellipk(x), ellipk(x), atol=0., rtol=1e-12)
     
     def test_ellipe(self):
         x = np.linspace(-1, 1, 40)[1:-1]
@@ -28,5 +26,30 @@ class TestElliptic(unittest.TestCase):
     def test_ellipem1_small_many(self):
         x = np.linspace(1, 100, 5)
         assert np.allclose(ellipe(1 - 10**(-x)), B.ellipem1(10**(-x)), atol=0., rtol=1e-12)
-
-
+    
+    def test_elliptic_arrays(self):
+        k = np.linspace(-5, 1, 1000)[:-1].reshape(37, 27)
+        K, E = B.ellipke(k)
+        assert K.shape == E.shape == k.shape
+        assert np.allclose(K, ellipk(k), atol=0., rtol=1e-12)
+        assert np.allclose(E, ellipe(k), atol=0., rtol=1e-12)
+        
+        p = 10**(-np.linspace(0, 15, 1001))
+        K, E = B.ellipkem1(p)
+        assert np.allclose(K, ellipkm1(p), atol=0., rtol=1e-12)
+        assert np.allclose(E, ellipe(1 - p), atol=0., rtol=1e-12)
+        
+        # Scalars are supported
+        assert np.isclose(B.ellipk(0.5), ellipk(0.5), atol=0., rtol=1e-12)
+    
+    def test_elliptic_table(self):
+        p = 10**(-np.linspace(0, 15, 1001))
+        K, E = B.ellipkem1(p)
+        
+        for tolerance in [1e-6, 1e-10, 1e-13]:
+            table = B.EllipticTable(tolerance)
+            assert table.max_error() <= tolerance
+            
+            K_table, E_table = table.ellipkem1(p)
+            assert np.allclose(K_table, K, atol=0., rtol=tolerance)
+            assert np.allclose(E_table, E, atol=0., rtol=tolerance)
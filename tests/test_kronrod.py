@@ -45,3 +45,13 @@ class TestKronrod(unittest.TestCase):
 
     
 
+    
+    def test_log_singularity(self):
+        f = lambda x: log(x)
+        result = B.kronrod_adaptive(f, 0, 1)
+        assert np.isclose(result, -1.0, atol=0., rtol=1e-8)
+    
+    def test_inverse_sqrt_singularity(self):
+        f = lambda x: 1/sqrt(x)
+        result = B.kronrod_adaptive(f, 0, 1)
+        assert np.isclose(result, 2.0, atol=0., rtol=1e-7)
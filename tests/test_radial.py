@@ -1,6 +1,7 @@
 import unittest
 from math import pi, sqrt
 import os.path as path
+import tempfile
 
 import numpy as np
 from scipy.integrate import quad, dblquad
@@ -23,6 +24,28 @@ def get_ring_effective_point_charges(current, r):
         [ [1.] + ([0.]*(B.N_TRIANGLE_QUAD-1)) ],
         [ [[r, 0., 0.]] * B.N_TRIANGLE_QUAD ])
 
+def get_random_effective_point_charges(rng, N=20):
+    return S.EffectivePointCharges(rng.uniform(-1, 1, N), rng.uniform(0, 1, (N, B.N_QUAD_2D)), rng.uniform(0.5, 1.5, (N, B.N_QUAD_2D, 2)))
+
+def get_electrode_dielectric_mesh(mesh_size, electrode_z=0., dielectric_line=([1.0, 0., -0.5], [1.0, 0., 1.5])):
+    # Electrode of unit length at r=0.5 next to a dielectric, used by the tests of the solvers
+    electrode = G.Path.line([0.5, 0., electrode_z], [0.5, 0., electrode_z + 1.])
+    electrode.name = 'electrode'
+    dielectric = G.Path.line(*dielectric_line)
+    dielectric.name = 'dielectric'
+    
+    return electrode.mesh(mesh_size=mesh_size, higher_order=True) + dielectric.mesh(mesh_size=mesh_size, higher_order=True)
+
+def get_electrode_dielectric_excitation(mesh, voltage=10, K=3):
+    exc = E.Excitation(mesh, E.Symmetry.RADIAL)
+    exc.add_voltage(electrode=voltage)
+    exc.add_dielectric(dielectric=K)
+    return exc
+
+def _point_charge_buffers(field):
+    eff = field.electrostatic_point_charges
+    return eff.charges, eff.jacobians, eff.positions
+
 class TestRadial(unittest.TestCase):
     def test_charge_radial_vertical(self):
         vertices = np.array([
@@ -120,6 +143,43 @@ class TestRadial(unittest.TestCase):
             correct = biot_savart_loop(current, p)
             assert np.allclose(field, correct)
     
+    def test_compiled_field(self):
+        rng = np.random.default_rng(0)
+        elec = get_random_effective_point_charges(rng)
+        mag = get_random_effective_point_charges(rng)
+        current = get_ring_effective_point_charges(2.5, 1.)
+        
+        field = S.FieldRadialBEM(elec, mag, current)
+        
+        for point in [np.array([0.1, 0.3]), np.array([0., -0.5]), np.array([2., 1.])]:
+            assert np.isclose(field.electrostatic_potential_at_point(point), B.potential_radial(point, elec.charges, elec.jacobians, elec.positions), rtol=1e-12)
+            assert np.allclose(field.electrostatic_field_at_point(point), B.field_radial(point, elec.charges, elec.jacobians, elec.positions), rtol=1e-12)
+            assert np.isclose(field.magnetostatic_potential_at_point(point), B.potential_radial(point, mag.charges, mag.jacobians, mag.positions), rtol=1e-12)
+            
+            mag_field = B.field_radial(point, mag.charges, mag.jacobians, mag.positions) + field.current_field_at_point(point)
+            assert np.allclose(field.magnetostatic_field_at_point(point), mag_field, rtol=1e-12)
+    
+    def test_field_at_points(self):
+        rng = np.random.default_rng(1)
+        elec = get_random_effective_point_charges(rng)
+        mag = get_random_effective_point_charges(rng)
+        field = S.FieldRadialBEM(elec, mag, get_ring_effective_point_charges(2.5, 1.))
+        axial = S.FieldRadialBEM(elec).axial_derivative_interpolation(-0.5, 2.5, N=200)
+        
+        points = np.column_stack([rng.uniform(0., 0.3, 150), rng.uniform(0., 2., 150)])
+        
+        evaluations = [
+            (field.electrostatic_field_at_points, field.electrostatic_field_at_point),
+            (field.electrostatic_potential_at_points, field.electrostatic_potential_at_point),
+            (field.magnetostatic_field_at_points, field.magnetostatic_field_at_point),
+            (field.magnetostatic_potential_at_points, field.magnetostatic_potential_at_point),
+            (axial.field_at_points, axial.field_at_point),
+            (axial.potential_at_points, axial.potential_at_point)]
+        
+        for at_points, at_point in evaluations:
+            correct = np.array([at_point(p) for p in points])
+            assert np.allclose(at_points(points), correct, rtol=1e-10, atol=1e-10*np.max(np.abs(correct)))
+    
     def test_current_loop(self):
         current = 2.5
         eff = get_ring_effective_point_charges(current, 1.)
@@ -239,4 +299,231 @@ class TestRadial(unittest.TestCase):
         correct = np.array([correct_r, correct_z])
 
         assert np.allclose(computed, correct, atol=0.0, rtol=1e-9) 
-
+    
+    def test_iterative_solver_dielectric(self):
+        exc = get_electrode_dielectric_excitation(get_electrode_dielectric_mesh(0.05))
+        
+        solver = S.ElectrostaticSolver(exc)
+        operator = solver.get_operator()
+        matrix = solver.get_matrix()
+        
+        x = np.random.default_rng(0).uniform(-1, 1, len(matrix))
+        assert np.allclose(operator.matvec(x), matrix @ x, rtol=1e-10, atol=1e-12)
+        
+        direct = solver.solve_matrix()[0]
+        iterative = solver.solve_iterative(tolerance=1e-12)[0]
+        assert np.allclose(direct.electrostatic_point_charges.charges, iterative.electrostatic_point_charges.charges, rtol=1e-8, atol=1e-12)
+    
+    def test_self_terms(self):
+        mesh = get_electrode_dielectric_mesh(0.1, dielectric_line=([1.0, 0., -0.5], [1.2, 0., 1.5]))
+        exc = get_electrode_dielectric_excitation(mesh)
+        
+        solver = S.ElectrostaticSolver(exc)
+        indices = np.arange(solver.get_number_of_matrix_elements())
+        self_terms = B.self_terms_radial(solver.vertices, solver.excitation_types, solver.excitation_values, indices, N_threads=2)
+        
+        for i in indices:
+            if solver.excitation_types[i] == E.ExcitationType.DIELECTRIC:
+                correct = B.self_field_dot_normal_radial(solver.vertices[i], 3) - 1
+            else:
+                correct = B.self_potential_radial(solver.vertices[i])
+            
+            assert np.isfinite(self_terms[i]) and self_terms[i] == correct
+    
+    def test_factorization_cache(self):
+        mesh = get_electrode_dielectric_mesh(0.05)
+        cache = S.FactorizationCache()
+        
+        for voltage, K in [(10, 3), (5, 3), (5, 7)]:
+            exc = get_electrode_dielectric_excitation(mesh, voltage, K)
+            
+            cached = S.solve_bem(exc, factorization_cache=cache)
+            uncached = S.solve_bem(exc)
+            
+            assert len(cache) == 1
+            assert np.allclose(cached.electrostatic_point_charges.charges, uncached.electrostatic_point_charges.charges, rtol=1e-10, atol=1e-14)
+    
+    def test_factorization_cache_moved_electrode(self):
+        # Always update the factorization instead of factorizing again
+        cache = S.FactorizationCache(max_update_fraction=1.0)
+        
+        for z, K in [(0., 3), (0.1, 3), (0.25, 3), (0.25, 5), (0., 5)]:
+            exc = get_electrode_dielectric_excitation(get_electrode_dielectric_mesh(0.05, electrode_z=z), K=K)
+            
+            cached = S.solve_bem(exc, factorization_cache=cache)
+            uncached = S.solve_bem(exc)
+            
+            assert len(cache) == 1
+            assert np.allclose(cached.electrostatic_point_charges.charges, uncached.electrostatic_point_charges.charges, rtol=1e-9, atol=1e-14)
+    
+    def test_mixed_precision(self):
+        exc = get_electrode_dielectric_excitation(get_electrode_dielectric_mesh(0.05))
+        
+        solver = S.ElectrostaticSolver(exc)
+        matrix = solver.get_matrix()
+        assert np.allclose(solver.get_operator().to_float32_matrix(), matrix, rtol=1e-6, atol=1e-6*np.max(np.abs(matrix)))
+        
+        double = S.solve_bem(exc)
+        mixed = S.solve_bem(exc, mixed_precision=True)
+        assert np.allclose(mixed.electrostatic_point_charges.charges, double.electrostatic_point_charges.charges, rtol=1e-9, atol=1e-14)
+    
+    def test_out_of_core(self):
+        mesh = get_electrode_dielectric_mesh(0.05)
+        exc = get_electrode_dielectric_excitation(mesh)
+        
+        in_memory = S.solve_bem(exc)
+        
+        with tempfile.TemporaryDirectory() as directory:
+            # Small memory limit, to use many blocks of rows and column panels
+            N = S.ElectrostaticSolver(exc).get_number_of_matrix_elements()
+            storage = S.OutOfCoreStorage(directory, memory_limit=8*N*10)
+            
+            # Interrupt the computation of the matrix, after which it should be resumed
+            solver = S.ElectrostaticSolver(exc)
+            fill_matrix_rows = solver.fill_matrix_rows
+            calls = []
+            
+            def interrupted(matrix, rows):
+                if len(calls) == 2:
+                    raise KeyboardInterrupt()
+                calls.append(rows)
+                fill_matrix_rows(matrix, rows)
+            
+            solver.fill_matrix_rows = interrupted
+            
+            with self.assertRaises(KeyboardInterrupt):
+                solver.solve_out_of_core(storage)
+            
+            assert storage.progress['rows_done'] == 20
+            
+            out_of_core = S.solve_bem(exc, out_of_core=storage)
+            assert storage.progress['columns_done'] == N
+            assert np.allclose(out_of_core.electrostatic_point_charges.charges, in_memory.electrostatic_point_charges.charges, rtol=1e-10, atol=1e-14)
+            
+            # A magnetostatic solve is stored separately and leaves the electrostatic factorization intact
+            magnetostatic = E.Excitation(mesh, E.Symmetry.RADIAL)
+            magnetostatic.add_magnetostatic_potential(electrode=10)
+            magnetostatic.add_magnetizable(dielectric=3)
+            S.solve_bem(magnetostatic, out_of_core=S.OutOfCoreStorage(directory))
+            
+            # The factorization is reused for a different voltage, without computing the matrix again
+            exc.add_voltage(electrode=5)
+            solver = S.ElectrostaticSolver(exc)
+            solver.fill_matrix_rows = None
+            out_of_core = solver.solve_out_of_core(S.OutOfCoreStorage(directory))[0]
+            assert np.allclose(out_of_core.electrostatic_point_charges.charges, in_memory.electrostatic_point_charges.charges/2, rtol=1e-10, atol=1e-14)
+    
+    def test_conflicting_solver_options(self):
+        exc = get_electrode_dielectric_excitation(get_electrode_dielectric_mesh(0.1))
+        
+        for options in [dict(use_gmres=True, mixed_precision=True),
+                        dict(use_hmatrix=True, factorization_cache=S.FactorizationCache()),
+                        dict(tree_theta=0.2),
+                        dict(use_gmres=True, elliptic_table_tolerance=1e-10)]:
+            with self.assertRaises(AssertionError):
+                S.solve_bem(exc, **options)
+    
+    def test_elliptic_table(self):
+        exc = get_electrode_dielectric_excitation(get_electrode_dielectric_mesh(0.05))
+        
+        exact = S.solve_bem(exc)
+        tabulated = S.solve_bem(exc, elliptic_table_tolerance=1e-10)
+        assert np.allclose(tabulated.electrostatic_point_charges.charges, exact.electrostatic_point_charges.charges, rtol=1e-7, atol=1e-12)
+        
+        tabulated.set_elliptic_table_accuracy(1e-10)
+        
+        for point in [np.array([0.2, 0.5]), np.array([0.75, 1.2]), np.array([0., -0.3])]:
+            assert np.isclose(tabulated.potential_at_point(point), exact.potential_at_point(point), rtol=1e-7)
+            assert np.allclose(tabulated.field_at_point(point), exact.field_at_point(point), rtol=1e-7, atol=1e-9)
+    
+    def test_radial_tree(self):
+        exc = get_electrode_dielectric_excitation(get_electrode_dielectric_mesh(0.02))
+        
+        direct = S.solve_bem(exc, use_gmres=True, gmres_tolerance=1e-12)
+        tree = S.solve_bem(exc, use_gmres=True, gmres_tolerance=1e-12, tree_theta=0.2)
+        assert np.allclose(tree.electrostatic_point_charges.charges, direct.electrostatic_point_charges.charges, rtol=1e-5, atol=1e-9)
+        
+        direct.set_tree_accuracy(0.2)
+        assert len(direct.get_trees()[0]) > 1
+        
+        for point in [np.array([0.2, 0.5]), np.array([0.75, 1.2]), np.array([0., -0.3]), np.array([2., 3.])]:
+            exact_potential = B.potential_radial(point, *_point_charge_buffers(direct))
+            exact_field = B.field_radial(point, *_point_charge_buffers(direct))
+            
+            assert np.isclose(direct.potential_at_point(point), exact_potential, rtol=1e-6)
+            assert np.allclose(direct.field_at_point(point), exact_field, rtol=1e-5, atol=1e-6*np.linalg.norm(exact_field))
+    
+    def test_adaptive_quadrature(self):
+        mesh = get_electrode_dielectric_mesh(0.02, dielectric_line=([0., 0., 1.5], [1.0, 0., 1.5]))
+        exc = get_electrode_dielectric_excitation(mesh)
+        
+        field = S.solve_bem(exc)
+        points = [np.array([0.2, 0.5]), np.array([0.75, 1.2]), np.array([0., -0.3]), np.array([0.3, 1.45]), np.array([2., 3.])]
+        direct = [(field.potential_at_point(p), field.field_at_point(p)) for p in points]
+        
+        field.set_quadrature_tolerance(0.)
+        for p, (pot, f) in zip(points, direct):
+            assert np.isclose(field.potential_at_point(p), pot, rtol=1e-12)
+            assert np.allclose(field.field_at_point(p), f, rtol=1e-12, atol=1e-12*np.linalg.norm(f))
+        
+        field.set_quadrature_tolerance(1e-4)
+        for p, (pot, f) in zip(points, direct):
+            assert np.isclose(field.potential_at_point(p), pot, rtol=1e-3)
+            assert np.allclose(field.field_at_point(p), f, rtol=1e-3, atol=1e-3*np.linalg.norm(f))
+    
+    def test_mirror_symmetry(self):
+        def half(name, sign):
+            electrode = G.Path.line([0.5, 0., 0.2], [0.5, 0., 1.2])
+            electrode.name = name
+            dielectric = G.Path.line([1.0, 0., 0.1], [1.0, 0., 1.5])
+            dielectric.name = 'dielectric'
+            
+            mesh = electrode.mesh(mesh_size=0.05, higher_order=True) + dielectric.mesh(mesh_size=0.05, higher_order=True)
+            # Keep the normals pointing in the mirrored direction
+            return mesh if sign > 0 else mesh.mirror_xy().flip_normals()
+        
+        points = [np.array([0.2, 0.5]), np.array([0.75, -1.2]), np.array([0., 0.]), np.array([1.5, 2.])]
+        
+        for sign in [1, -1]:
+            full = E.Excitation(half('top', 1) + half('bottom', -1), E.Symmetry.RADIAL)
+            full.add_voltage(top=10, bottom=sign*10)
+            full.add_dielectric(dielectric=3)
+            
+            mirrored = E.Excitation(half('top', 1), E.Symmetry.RADIAL)
+            mirrored.add_voltage(top=10)
+            mirrored.add_dielectric(dielectric=3)
+            mirrored.add_discrete_symmetry(mirror_xy=sign)
+            
+            solver = S.ElectrostaticSolver(mirrored)
+            assert 2*solver.get_number_of_matrix_elements() == S.ElectrostaticSolver(full).get_number_of_matrix_elements()
+            
+            field_full, field_mirrored = S.solve_bem(full), S.solve_bem(mirrored)
+            
+            for p in points:
+                correct = field_full.field_at_point(p)
+                assert np.linalg.norm(field_mirrored.field_at_point(p) - correct) < 1e-5*np.linalg.norm(correct)
+        
+        # Magnetic lens, two coils carrying the same current give an antisymmetric magnetostatic potential
+        def half_lens(name, sign):
+            coil = G.Surface.rectangle_xz(2., 3., 1., 2.)
+            coil.name = name
+            pole = G.Path.line([1.0, 0., 0.1], [1.0, 0., 1.5])
+            pole.name = 'pole'
+            
+            mesh = coil.mesh(mesh_size=0.1) + pole.mesh(mesh_size=0.05, higher_order=True)
+            return mesh if sign > 0 else mesh.mirror_xy().flip_normals()
+        
+        full = E.Excitation(half_lens('coil_top', 1) + half_lens('coil_bottom', -1), E.Symmetry.RADIAL)
+        full.add_current(coil_top=1, coil_bottom=1)
+        full.add_magnetizable(pole=100)
+        
+        mirrored = E.Excitation(half_lens('coil_top', 1), E.Symmetry.RADIAL)
+        mirrored.add_current(coil_top=1)
+        mirrored.add_magnetizable(pole=100)
+        mirrored.add_discrete_symmetry(mirror_xy=-1)
+        
+        field_full, field_mirrored = S.solve_bem(full), S.solve_bem(mirrored)
+        
+        for p in points:
+            correct = field_full.magnetostatic_field_at_point(p)
+            assert np.linalg.norm(field_mirrored.magnetostatic_field_at_point(p) - correct) < 1e-5*np.linalg.norm(correct)
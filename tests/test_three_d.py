@@ -0,0 +1,264 @@
+import unittest
+
+import numpy as np
+
+import traceon.backend as B
+import traceon.solver as S
+import traceon.geometry as G
+import traceon.excitation as E
+
+def random_point_charges(N, seed=0):
+    rng = np.random.default_rng(seed)
+    charges = rng.uniform(-1, 1, N)
+    jacobians = rng.uniform(0, 1, (N, B.N_TRIANGLE_QUAD))
+    # Keep the charges away from the optical axis
+    positions = rng.uniform(-1, 1, (N, B.N_TRIANGLE_QUAD, 3))
+    positions[:, :, 0] += np.sign(positions[:, :, 0])*2
+    return S.EffectivePointCharges(charges, jacobians, positions)
+
+def get_electrode_dielectric_excitation(dz, mesh_size):
+    # Square electrode in the xz-plane, with a square dielectric at height dz above it, used by the tests of the solvers
+    electrode = G.Surface.rectangle_xz(-1., 1., -1., 1.)
+    electrode.name = 'electrode'
+    dielectric = G.Surface.rectangle_xy(-1., 1., -1., 1.).move(dz=dz)
+    dielectric.name = 'dielectric'
+    
+    mesh = electrode.mesh(mesh_size=mesh_size) + dielectric.mesh(mesh_size=mesh_size)
+    
+    exc = E.Excitation(mesh, E.Symmetry.THREE_D)
+    exc.add_voltage(electrode=1)
+    exc.add_dielectric(dielectric=4)
+    return exc
+
+class TestThreeD(unittest.TestCase):
+    def test_field_is_gradient_of_potential(self):
+        eff = random_point_charges(25)
+        point = np.array([0.1, -0.2, 0.3])
+        
+        field = B.field_3d(point, eff.charges, eff.jacobians, eff.positions)
+        
+        h = 1e-5
+        grad = np.zeros(3)
+        for i in range(3):
+            dp = np.zeros(3)
+            dp[i] = h
+            grad[i] = (B.potential_3d(point + dp, eff.charges, eff.jacobians, eff.positions) -
+                       B.potential_3d(point - dp, eff.charges, eff.jacobians, eff.positions)) / (2*h)
+        
+        assert np.allclose(field, -grad, rtol=1e-6)
+    
+    def test_trace_3d_against_python_field(self):
+        eff = random_point_charges(10)
+        field = S.Field3D_BEM(electrostatic_point_charges=eff)
+        
+        def python_field(x, y, z, vx, vy, vz):
+            return field.electrostatic_field_at_point(np.array([x, y, z]))
+        
+        p0 = np.array([0., 0., 1.])
+        v0 = np.array([1e3, 0., -1e5])
+        bounds = ((-1., 1.), (-1., 1.), (-1., 1.))
+        
+        times, positions = B.trace_particle(p0, v0, python_field, bounds, 1e-10)
+        times_3d, positions_3d = B.trace_particle_3d(p0, v0, bounds, 1e-10, eff, S.EffectivePointCharges.empty_3d())
+        
+        assert positions.shape == positions_3d.shape
+        assert np.allclose(times, times_3d) and np.allclose(positions, positions_3d)
+    
+    def test_octree_exact_for_zero_theta(self):
+        eff = random_point_charges(500)
+        tree = B.Octree3D(eff, 0.)
+        point = np.array([0.1, -0.2, 0.3])
+        
+        assert np.isclose(tree.potential(point), B.potential_3d(point, eff.charges, eff.jacobians, eff.positions), rtol=1e-12)
+        assert np.allclose(tree.field(point), B.field_3d(point, eff.charges, eff.jacobians, eff.positions), rtol=1e-12)
+    
+    def test_octree_accuracy(self):
+        eff = random_point_charges(2000, seed=1)
+        eff.charges = np.abs(eff.charges)
+        field = S.Field3D_BEM(electrostatic_point_charges=eff)
+        points = [np.array([0., 0., 0.]), np.array([0.5, 0.5, -0.5]), np.array([0.2, 0.1, 0.9])]
+        
+        direct = [field.electrostatic_field_at_point(p) for p in points]
+        
+        field.set_octree_accuracy(0.2)
+        approx = [field.electrostatic_field_at_point(p) for p in points]
+        
+        for d, a in zip(direct, approx):
+            assert np.linalg.norm(d - a) < 1e-3*np.linalg.norm(d)
+        
+        field.set_octree_accuracy(None)
+        assert np.allclose(field.electrostatic_field_at_point(points[0]), direct[0])
+    
+    def test_field_at_points(self):
+        eff = random_point_charges(300, seed=3)
+        field = S.Field3D_BEM(electrostatic_point_charges=eff)
+        points = np.random.default_rng(3).uniform(-1, 1, (200, 3))
+        
+        for at_points, at_point in [(field.field_at_points, field.field_at_point), (field.potential_at_points, field.potential_at_point)]:
+            correct = np.array([at_point(p) for p in points])
+            assert np.allclose(at_points(points), correct, rtol=1e-10, atol=1e-10*np.max(np.abs(correct)))
+    
+    def test_adaptive_quadrature(self):
+        eff = random_point_charges(500, seed=2)
+        # Small triangles, such that the far away triangles are represented by a single point
+        eff.positions = eff.positions[:, :1] + 0.01*(eff.positions - eff.positions[:, :1])
+        eff.charges = np.abs(eff.charges)
+        points = [np.array([0., 0., 0.]), np.array([0.5, 0.5, -0.5]), np.array([2.5, 0.1, 0.9])]
+        
+        for tolerance, rtol in [(0., 1e-12), (1e-3, 1e-3)]:
+            adaptive = B.AdaptiveCharges3D(eff, tolerance)
+            
+            for p in points:
+                potential = B.potential_3d(p, eff.charges, eff.jacobians, eff.positions)
+                field = B.field_3d(p, eff.charges, eff.jacobians, eff.positions)
+                
+                assert np.isclose(adaptive.potential(p), potential, rtol=rtol)
+                assert np.linalg.norm(adaptive.field(p) - field) < rtol*np.linalg.norm(field)
+    
+    def test_iterative_solver(self):
+        exc = get_electrode_dielectric_excitation(dz=1.5, mesh_size=0.4)
+        
+        solver = S.ElectrostaticSolver(exc)
+        operator = solver.get_operator()
+        matrix = solver.get_matrix()
+        
+        x = np.random.default_rng(0).uniform(-1, 1, len(matrix))
+        assert np.allclose(operator.matvec(x), matrix @ x, rtol=1e-10, atol=1e-12)
+        
+        direct = solver.solve_matrix()[0]
+        iterative = solver.solve_iterative(tolerance=1e-12)[0]
+        assert np.allclose(direct.electrostatic_point_charges.charges, iterative.electrostatic_point_charges.charges, rtol=1e-8, atol=1e-12)
+    
+    def test_fill_matrix_rows_threaded(self):
+        exc = get_electrode_dielectric_excitation(dz=1.5, mesh_size=0.4)
+        
+        solver = S.ElectrostaticSolver(exc)
+        N = solver.get_number_of_matrix_elements()
+        args = (solver.vertices, solver.excitation_types, solver.excitation_values, solver.jac_buffer, solver.pos_buffer)
+        
+        serial = np.zeros( (N, N) )
+        B.fill_matrix_3d(serial, *args, 0, N-1)
+        
+        threaded = np.zeros( (N, N) )
+        B.fill_matrix_3d_rows(threaded, *args, np.arange(N)[::-1], N_threads=4)
+        
+        assert np.array_equal(serial, threaded)
+    
+    def test_mixed_precision(self):
+        exc = get_electrode_dielectric_excitation(dz=1.5, mesh_size=0.4)
+        
+        double = S.solve_bem(exc)
+        mixed = S.solve_bem(exc, mixed_precision=True)
+        assert np.allclose(mixed.electrostatic_point_charges.charges, double.electrostatic_point_charges.charges, rtol=1e-9, atol=1e-14)
+    
+    def test_hmatrix_solver(self):
+        exc = get_electrode_dielectric_excitation(dz=3., mesh_size=0.2)
+        
+        solver = S.ElectrostaticSolver(exc)
+        hmatrix = solver.get_hmatrix(tolerance=1e-8)
+        matrix = solver.get_matrix()
+        
+        assert hmatrix.memory() < matrix.nbytes
+        
+        x = np.random.default_rng(0).uniform(-1, 1, len(matrix))
+        assert np.allclose(hmatrix.matvec(x), matrix @ x, rtol=1e-6, atol=1e-10)
+        
+        direct = solver.solve_matrix()[0]
+        iterative = solver.solve_iterative(tolerance=1e-10, hmatrix_tolerance=1e-8)[0]
+        assert np.allclose(direct.electrostatic_point_charges.charges, iterative.electrostatic_point_charges.charges, rtol=1e-5, atol=1e-10)
+    
+    def test_discrete_symmetry(self):
+        # Deflector with a dielectric, the excitation is antisymmetric when mirroring x -> -x
+        def quadrant(sign_x, sign_y):
+            electrode = G.Surface.rectangle_yz(0.2, 1., -1., 1.).move(dx=1.)
+            electrode.name = 'positive' if sign_x > 0 else 'negative'
+            dielectric = G.Surface.rectangle_xy(0.2, 1., 0.2, 1.).move(dz=1.5)
+            dielectric.name = 'dielectric'
+            
+            mesh = electrode.mesh(mesh_size=0.4) + dielectric.mesh(mesh_size=0.4)
+            mesh = mesh.map_points(lambda p: p*np.array([sign_x, sign_y, 1.]))
+            # Keep the normals pointing in the mirrored direction
+            return mesh if sign_x*sign_y > 0 else mesh.flip_normals()
+        
+        full = E.Excitation(quadrant(1, 1) + quadrant(-1, 1) + quadrant(1, -1) + quadrant(-1, -1), E.Symmetry.THREE_D)
+        full.add_voltage(positive=1, negative=-1)
+        full.add_dielectric(dielectric=4)
+        
+        sector = E.Excitation(quadrant(1, 1), E.Symmetry.THREE_D)
+        sector.add_voltage(positive=1)
+        sector.add_dielectric(dielectric=4)
+        sector.add_discrete_symmetry(mirror_yz=-1, mirror_xz=1)
+        
+        solver = S.ElectrostaticSolver(sector)
+        assert 4*solver.get_number_of_matrix_elements() == S.ElectrostaticSolver(full).get_number_of_matrix_elements()
+        
+        field_full = S.solve_bem(full)
+        field_sector = S.solve_bem(sector)
+        
+        for p in [[0.1, 0.2, 0.3], [-0.5, -0.3, 1.], [0.3, -0.6, 2.]]:
+            correct = field_full.field_at_point(np.array(p))
+            assert np.linalg.norm(field_sector.field_at_point(np.array(p)) - correct) < 1e-6*np.linalg.norm(correct)
+        
+        # Quadrupole, the excitation changes sign after every rotation of 90 degrees
+        electrode = G.Surface.rectangle_xz(-0.3, 0.3, -1., 1.).move(dy=1.)
+        electrode.name = 'pole'
+        pole = electrode.mesh(mesh_size=0.3)
+        
+        quadrupole = E.Excitation(pole, E.Symmetry.THREE_D)
+        quadrupole.add_voltage(pole=1)
+        quadrupole.add_discrete_symmetry(rotation=4, rotation_sign=-1)
+        
+        full_mesh = pole + pole.rotate(Rz=np.pi/2) + pole.rotate(Rz=np.pi) + pole.rotate(Rz=3*np.pi/2)
+        full = E.Excitation(full_mesh, E.Symmetry.THREE_D)
+        full.add_voltage(pole=lambda x, y, z: 1. if abs(y) > abs(x) else -1.)
+        
+        field_full = S.solve_bem(full)
+        field_sector = S.solve_bem(quadrupole)
+        
+        for p in [[0.1, 0.2, 0.3], [-0.5, -0.3, 0.5]]:
+            correct = field_full.field_at_point(np.array(p))
+            assert np.linalg.norm(field_sector.field_at_point(np.array(p)) - correct) < 1e-6*np.linalg.norm(correct)
+        
+        with self.assertRaises(ValueError):
+            E.DiscreteSymmetry(rotation=3, rotation_sign=-1)
+    
+    def test_higher_order_triangles(self):
+        # Capacitance of a sphere, curved triangles follow the surface much more closely than flat triangles
+        arc = G.Path.arc([0., 0., 0.], [0., 0., -1.], [1., 0., 0.]).arc_to([0., 0., 0.], [0., 0., 1.])
+        sphere = arc.revolve_z()
+        sphere.name = 'sphere'
+        
+        errors = []
+        
+        for higher_order in [False, True]:
+            mesh = sphere.mesh(mesh_size_factor=4, higher_order=higher_order)
+            assert mesh.is_higher_order() == higher_order
+            
+            exc = E.Excitation(mesh, E.Symmetry.THREE_D)
+            exc.add_voltage(sphere=1)
+            field = S.solve_bem(exc)
+            
+            _, names = exc.get_electrostatic_active_elements()
+            errors.append(abs(field.charge_on_elements(names['sphere'])/(4*np.pi) - 1))
+        
+        assert errors[1] < 2e-3 and errors[1] < errors[0]/5
+        
+        # Singular integral over a curved triangle, compared to the sum over its four subtriangles
+        triangle = mesh.points[mesh.triangles[len(mesh.triangles)//2]]
+        target = -1/9*np.sum(triangle[:3], axis=0) + 4/9*np.sum(triangle[3:], axis=0)
+        whole = B.potential_or_flux_triangle_higher_order(triangle, target)
+        
+        def point(alpha, beta):
+            _, pos = B.position_and_jacobian_3d(alpha, beta, triangle)
+            return pos
+        
+        nodes = [(0., 0.), (1., 0.), (0., 1.), (0.5, 0.), (0.5, 0.5), (0., 0.5)]
+        subtriangles = [[0, 3, 5], [3, 1, 4], [5, 4, 2], [3, 4, 5]]
+        total = 0.
+        
+        for s in subtriangles:
+            corners = [nodes[i] for i in s]
+            edges = [((a[0]+b[0])/2, (a[1]+b[1])/2) for a, b in zip(corners, corners[1:] + corners[:1])]
+            total += B.potential_or_flux_triangle_higher_order(np.array([point(*p) for p in corners + edges]), target)
+        
+        assert np.isclose(whole, total, rtol=1e-8)
@@ -56,6 +56,54 @@ class TestTracing(unittest.TestCase):
 
         assert np.allclose(interp(sol.y[2]), np.array([sol.y[0], sol.y[1]]).T)
     
+    def test_tracing_helix_methods(self):
+        def acceleration(_, y):
+            v = y[3:]
+            B = np.array([0, 0, 1])
+            return np.hstack( (v, np.cross(v, B)) )
+         
+        def traceon_acc(*y):
+            return acceleration(0., y)[3:] / EM
+        
+        p0 = np.zeros(3)
+        v0 = np.array([0., 1, -1.])
+        bounds = ((-5.0, 5.0), (-5.0, 5.0), (-40.0, 10.0))
+        
+        for method, atol, rtol in [('rkf45', 1e-10, 1e-6), ('dop853', 1e-10, 1e-6), ('bs32', 1e-8, 1e-3)]:
+            times, positions = B.trace_particle(p0, v0, traceon_acc, bounds, atol, method=method)
+            
+            # Analytic solution of the helix
+            correct = np.array([1 - np.cos(times), np.sin(times), -times]).T
+            assert np.allclose(positions[:, :3], correct, rtol=rtol, atol=rtol)
+        
+        # At atol=1e-10 the maximum step bounds the steps of both methods. At tighter tolerances RKF45 has
+        # to take smaller steps, while DOP853 can still take the maximum step.
+        N_rkf45 = len(B.trace_particle(p0, v0, traceon_acc, bounds, 1e-14, method='rkf45')[0])
+        N_dop853 = len(B.trace_particle(p0, v0, traceon_acc, bounds, 1e-14, method='dop853')[0])
+        assert N_dop853 < N_rkf45
+    
+    def test_tracing_decimation(self):
+        def traceon_acc(*y):
+            return np.cross(y[3:], [0, 0, 1]) / EM
+        
+        p0 = np.zeros(3)
+        v0 = np.array([0., 1, -1.])
+        bounds = ((-5.0, 5.0), (-5.0, 5.0), (-40.0, 10.0))
+        
+        times, positions = B.trace_particle(p0, v0, traceon_acc, bounds, 1e-10)
+        
+        # Only every 10th step is stored, but the trace itself is not changed
+        times_dec, positions_dec = B.trace_particle(p0, v0, traceon_acc, bounds, 1e-10, decimation=10)
+        assert len(times_dec) == (len(times) - 1) // 10 + 1 + ((len(times) - 1) % 10 != 0)
+        assert np.allclose(times_dec[:-1], times[:-1:10]) and np.allclose(positions_dec[:-1], positions[:-1:10])
+        assert np.allclose(positions_dec[-1], positions[-1])
+        
+        # Stored steps are at least 0.5 mm apart
+        times_sp, positions_sp = B.trace_particle(p0, v0, traceon_acc, bounds, 1e-10, spacing=0.5)
+        distances = np.linalg.norm(np.diff(positions_sp[:-1, :3], axis=0), axis=1)
+        assert np.all(distances >= 0.5) and len(times_sp) < len(times) / 10
+        assert np.allclose(positions_sp[0], positions[0]) and np.allclose(positions_sp[-1], positions[-1])
+    
     def test_tracing_against_scipy_current_loop(self):
         # Constants
         current = 100 # Ampere on current loop
@@ -205,3 +253,45 @@ class TestTracing(unittest.TestCase):
         y_intersection = interp(0.)
         assert np.allclose(y_intersection, np.array([-1., 0, 0, 0, -1, 0]))
      
+    def test_trace_many_against_single(self):
+        eff = get_ring_effective_point_charges(100, 1.)
+         
+        bounds = ((-0.4,0.4), (-0.4, 0.4), (-15, 15))
+        tracer = T.Tracer(S.FieldRadialBEM(current_point_charges=eff), bounds, atol=1e-6)
+        
+        positions = np.array([[r, 0., 15.] for r in np.linspace(0.01, 0.1, 5)])
+        velocities = np.array([T.velocity_vec(1e3, [0, 0, -1]) for _ in positions])
+        
+        times, trajectories, offsets = tracer.trace_many(positions, velocities)
+        assert offsets.shape == (len(positions)+1,) and offsets[-1] == len(times) == len(trajectories)
+         
+        for i, (p, v) in enumerate(zip(positions, velocities)):
+            t_single, p_single = tracer(p, v)
+            assert np.allclose(t_single, times[offsets[i]:offsets[i+1]])
+            assert np.allclose(p_single, trajectories[offsets[i]:offsets[i+1]])
+    
+    def test_trace_to_plane(self):
+        eff = get_ring_effective_point_charges(100, 1.)
+         
+        bounds = ((-0.4,0.4), (-0.4, 0.4), (-15, 15))
+        tracer = T.Tracer(S.FieldRadialBEM(current_point_charges=eff), bounds, atol=1e-8)
+        
+        positions = np.array([[r, 0., 15.] for r in np.linspace(0.01, 0.1, 5)])
+        velocities = np.array([T.velocity_vec(1e3, [0, 0, -1]) for _ in positions])
+        
+        times, states, found = tracer.trace_to_plane(positions, velocities, [0., 0., -5.], [0., 0., 1.])
+        assert times.shape == (len(positions),) and states.shape == (len(positions), 6) and np.all(found)
+        assert np.allclose(states[:, 2], -5.)
+        
+        for i, (p, v) in enumerate(zip(positions, velocities)):
+            t_single, p_single = tracer(p, v)
+            
+            # Map z-position to time and state
+            interp = CubicSpline(p_single[::-1, 2], np.column_stack( (t_single, p_single) )[::-1])
+            correct = interp(-5.)
+            assert np.isclose(times[i], correct[0])
+            assert np.allclose(states[i], correct[1:])
+        
+        # Plane is never reached
+        times, states, found = tracer.trace_to_plane(positions, velocities, [0., 0., -20.], [0., 0., 1.])
+        assert not np.any(found) and np.all(np.isnan(times)) and np.all(np.isnan(states))
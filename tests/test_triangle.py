@@ -332,3 +332,35 @@ class TestTriangle(unittest.TestCase):
             potential_exact_integrated(v0, v1, v2, target), 
             B.potential_triangle(v0, v1, v2, target))
  
+
+    def test_closed_form_matches_kronrod(self):
+        np.random.seed(0)
+        
+        for _ in range(100):
+            v0, v1, v2 = rand(3,3)
+            normal = rand(3)
+            a, b = np.random.rand(2)*2 - 0.5
+            height = 10**np.random.uniform(-3, 1)
+            n = np.cross(v1-v0, v2-v0)
+            target = v0 + a*(v1-v0) + b*(v2-v0) + height*n/np.linalg.norm(n)
+            
+            assert np.isclose(B.potential_triangle(v0, v1, v2, target), B.potential_triangle_kronrod(v0, v1, v2, target), atol=0.0, rtol=1e-9)
+            assert np.isclose(B.flux_triangle(v0, v1, v2, target, normal), B.flux_triangle_kronrod(v0, v1, v2, target, normal), atol=0.0, rtol=1e-7)
+    
+    def test_closed_form_field_is_gradient(self):
+        v0, v1, v2 = np.array([
+            [0., 0., 0.],
+            [2., 0.5, 0.],
+            [0.5, 1.5, 0.3]])
+        
+        for target in [np.array([0.8, 0.6, 0.2]), np.array([3., -1., 0.5]), np.array([0.5, 0.5, -0.05])]:
+            _, field = B.potential_field_triangle(v0, v1, v2, target)
+            
+            delta = 1e-5
+            gradient = np.zeros(3)
+            for i in range(3):
+                dx = np.zeros(3)
+                dx[i] = delta
+                gradient[i] = (B.potential_triangle(v0, v1, v2, target + dx) - B.potential_triangle(v0, v1, v2, target - dx)) / (2*delta)
+            
+            assert np.allclose(field, -gradient, atol=1e-6, rtol=1e-6)
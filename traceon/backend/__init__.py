@@ -8,8 +8,6 @@ import platform
 
 from numpy.ctypeslib import ndpointer
 import numpy as np
-from scipy import LowLevelCallable
-from scipy.integrate import quad
 
 from .. import logging
 
@@ -53,8 +51,6 @@ else:
     backend_lib = C.CDLL(global_path)
 
 
-TRACING_BLOCK_SIZE = C.c_size_t.in_dll(backend_lib, 'TRACING_BLOCK_SIZE').value
-
 DERIV_2D_MAX = C.c_int.in_dll(backend_lib, 'DERIV_2D_MAX_SYM').value
 
 N_QUAD_2D = C.c_int.in_dll(backend_lib, 'N_QUAD_2D_SYM').value
@@ -131,8 +127,9 @@ class EffectivePointCharges3D(C.Structure):
 
 bounds = arr(shape=(3, 2))
 
-times_block = arr(shape=(TRACING_BLOCK_SIZE,))
-tracing_block = arr(shape=(TRACING_BLOCK_SIZE, 6))
+initial_states = arr(ndim=2)
+offsets_buffer = arr(dtype=np.uintp, ndim=1)
+dbl_pp = C.POINTER(dbl_p)
 
 backend_functions = {
     # triangle_contribution.c
@@ -140,56 +137,122 @@ backend_functions = {
     'self_potential_triangle_v0': (dbl, v3, v3, v3),
     'self_potential_triangle': (dbl, v3, v3, v3, v3),
     'flux_triangle': (dbl, v3, v3, v3, v3, v3),
+    'potential_triangle_kronrod': (dbl, v3, v3, v3, v3),
+    'flux_triangle_kronrod': (dbl, v3, v3, v3, v3, v3),
+    'potential_field_triangle': (None, v3, v3, v3, v3, dbl_p, v3),
     'kronrod_adaptive': (dbl, integration_cb_1d, dbl, dbl, vp, dbl, dbl),
      
     'ellipkm1' : (dbl, dbl),
     'ellipk' : (dbl, dbl),
     'ellipem1' : (dbl, dbl),
     'ellipe': (dbl, dbl),
+    'ellipkem1_array': (None, arr(ndim=1), arr(ndim=1), arr(ndim=1), sz),
+    'ellipke_array': (None, arr(ndim=1), arr(ndim=1), arr(ndim=1), sz),
+    'elliptic_table_build': (vp, dbl),
+    'elliptic_table_free': (None, vp),
+    'elliptic_table_max_error': (dbl, vp),
+    'elliptic_table_ellipkem1_array': (None, vp, arr(ndim=1), arr(ndim=1), arr(ndim=1), sz),
     'normal_2d': (None, v2, v2, v2),
     'higher_order_normal_radial': (None, dbl, v2, v2, v2, v2, v2),
     'normal_3d': (None, dbl, dbl, arr(shape=(3,3)), v3),
+    'normal_3d_higher_order': (None, dbl, dbl, arr(shape=(6,3)), v3),
     'position_and_jacobian_3d': (None, dbl, dbl, arr(ndim=2), v3, dbl_p),
+    'position_and_jacobian_3d_higher_order': (None, dbl, dbl, arr(shape=(6,3)), v3, dbl_p),
     'position_and_jacobian_radial': (None, dbl, v2, v2, v2, v2, v2, dbl_p),
-    'trace_particle': (sz, times_block, tracing_block, field_fun, bounds, dbl, vp),
+    'trace_particles': (C.c_bool, initial_states, sz, offsets_buffer, dbl_pp, dbl_pp, field_fun, bounds, dbl, C.c_int, dbl_p, sz, dbl, vp, C.c_int),
     'potential_radial_ring': (dbl, dbl, dbl, dbl, dbl, vp), 
     'dr1_potential_radial_ring': (dbl, dbl, dbl, dbl, dbl, vp), 
     'dz1_potential_radial_ring': (dbl, dbl, dbl, dbl, dbl, vp), 
-    'axial_derivatives_radial': (None, arr(ndim=2), charges_2d, jac_buffer_2d, pos_buffer_2d, sz, z_values, sz),
-    'potential_radial': (dbl, v2, charges_2d, jac_buffer_2d, pos_buffer_2d, sz),
+    'axial_derivatives_radial': (None, arr(ndim=2), charges_2d, jac_buffer_2d, pos_buffer_2d, sz, z_values, sz, C.c_int),
+    'potential_radial': (dbl, v2, charges_2d, jac_buffer_2d, pos_buffer_2d, sz, vp),
     'potential_radial_derivs': (dbl, v2, z_values, arr(ndim=3), sz),
     'flux_density_to_charge_factor': (dbl, dbl),
     'charge_radial': (dbl, arr(ndim=2), dbl),
-    'field_radial': (None, v3, v3, charges_2d, jac_buffer_2d, pos_buffer_2d, sz),
+    'field_radial': (None, v3, v3, charges_2d, jac_buffer_2d, pos_buffer_2d, sz, vp),
     'combine_elec_magnetic_field': (None, v3, v3, v3, v3, v3),
-    'trace_particle_radial': (sz, times_block, tracing_block, bounds, dbl, dbl_p, EffectivePointCharges2D, EffectivePointCharges2D, EffectivePointCharges3D),
     'field_radial_derivs': (None, v3, v3, z_values, arr(ndim=3), sz),
-    'trace_particle_radial_derivs': (sz, times_block, tracing_block, bounds, dbl, z_values, radial_coeffs, radial_coeffs, sz),
     'dx1_potential_3d_point': (dbl, dbl, dbl, dbl, dbl, dbl, dbl, vp),
     'dy1_potential_3d_point': (dbl, dbl, dbl, dbl, dbl, dbl, dbl, vp),
     'dz1_potential_3d_point': (dbl, dbl, dbl, dbl, dbl, dbl, dbl, vp),
     'potential_3d_point': (dbl, dbl, dbl, dbl, dbl, dbl, dbl, vp),
-    'axial_coefficients_3d': (None, charges_3d, jac_buffer_3d, pos_buffer_3d, arr(ndim=3), arr(ndim=3), sz, z_values, arr(ndim=4), sz),
+    'axial_coefficients_3d': (None, charges_3d, jac_buffer_3d, pos_buffer_3d, arr(ndim=3), arr(ndim=3), sz, z_values, arr(ndim=4), sz, C.c_int),
     'potential_3d': (dbl, v3, charges_3d, jac_buffer_3d, pos_buffer_3d, sz),
     'potential_3d_derivs': (dbl, v3, z_values, arr(ndim=5), sz),
     'field_3d': (None, v3, v3, charges_3d, jac_buffer_3d, pos_buffer_3d, sz),
-    'trace_particle_3d': (sz, times_block, tracing_block, bounds, dbl, EffectivePointCharges3D, EffectivePointCharges3D, dbl_p),
     'field_3d_derivs': (None, v3, v3, z_values, arr(ndim=5), sz),
-    'trace_particle_3d_derivs': (sz, times_block, tracing_block, bounds, dbl, z_values, arr(ndim=5), arr(ndim=5), sz),
+    'free_trace_buffers': (None, dbl_p, dbl_p),
+    'trace_particles_radial': (C.c_bool, initial_states, sz, offsets_buffer, dbl_pp, dbl_pp, bounds, dbl, C.c_int, dbl_p, sz, dbl, dbl_p, EffectivePointCharges2D, EffectivePointCharges2D, EffectivePointCharges3D, vp, C.c_int),
+    'trace_particles_radial_derivs': (C.c_bool, initial_states, sz, offsets_buffer, dbl_pp, dbl_pp, bounds, dbl, C.c_int, dbl_p, sz, dbl, z_values, radial_coeffs, radial_coeffs, sz, C.c_int),
+    'trace_particles_3d': (C.c_bool, initial_states, sz, offsets_buffer, dbl_pp, dbl_pp, bounds, dbl, C.c_int, dbl_p, sz, dbl, EffectivePointCharges3D, EffectivePointCharges3D, dbl_p, C.c_int),
+    'octree_3d_build': (vp, charges_3d, jac_buffer_3d, pos_buffer_3d, sz, dbl),
+    'octree_3d_free': (None, vp),
+    'octree_3d_number_of_nodes': (sz, vp),
+    'octree_3d_potential': (dbl, vp, v3),
+    'octree_3d_field': (None, vp, v3, v3),
+    'radial_tree_build': (vp, charges_2d, jac_buffer_2d, pos_buffer_2d, sz, dbl),
+    'radial_tree_free': (None, vp),
+    'radial_tree_number_of_nodes': (sz, vp),
+    'radial_tree_potential': (dbl, vp, v2),
+    'radial_tree_field': (None, vp, v3, v3),
+    'trace_particles_radial_tree': (C.c_bool, initial_states, sz, offsets_buffer, dbl_pp, dbl_pp, bounds, dbl, C.c_int, dbl_p, sz, dbl, dbl_p, vp, vp, EffectivePointCharges3D, C.c_int),
+    'trace_particles_3d_octree': (C.c_bool, initial_states, sz, offsets_buffer, dbl_pp, dbl_pp, bounds, dbl, C.c_int, dbl_p, sz, dbl, vp, vp, dbl_p, C.c_int),
+    'adaptive_charges_3d_build': (vp, charges_3d, jac_buffer_3d, pos_buffer_3d, sz, dbl),
+    'adaptive_charges_3d_free': (None, vp),
+    'adaptive_charges_3d_potential': (dbl, vp, v3),
+    'adaptive_charges_3d_field': (None, vp, v3, v3),
+    'adaptive_charges_radial_build': (vp, charges_2d, jac_buffer_2d, pos_buffer_2d, sz, dbl),
+    'adaptive_charges_radial_free': (None, vp),
+    'adaptive_charges_radial_potential': (dbl, vp, v2, vp),
+    'adaptive_charges_radial_field': (None, vp, v3, v3, vp),
+    'trace_particles_3d_adaptive': (C.c_bool, initial_states, sz, offsets_buffer, dbl_pp, dbl_pp, bounds, dbl, C.c_int, dbl_p, sz, dbl, vp, vp, dbl_p, C.c_int),
+    'trace_particles_radial_adaptive': (C.c_bool, initial_states, sz, offsets_buffer, dbl_pp, dbl_pp, bounds, dbl, C.c_int, dbl_p, sz, dbl, dbl_p, vp, vp, EffectivePointCharges3D, vp, C.c_int),
+    'compiled_field_radial_build': (vp, EffectivePointCharges2D, EffectivePointCharges2D, EffectivePointCharges3D, vp, dbl_p),
+    'compiled_field_3d_build': (vp, EffectivePointCharges3D, EffectivePointCharges3D, dbl_p),
+    'compiled_field_axial_build': (vp, C.c_int, z_values, arr(), arr(), sz),
+    'compiled_field_free': (None, vp),
+    'compiled_field_potential': (dbl, vp, C.c_bool, v3),
+    'compiled_field_field': (None, vp, C.c_bool, v3, v3),
+    'compiled_field_evaluate': (None, vp, C.c_bool, arr(ndim=2), sz, dbl_p, dbl_p, C.c_int),
+    'trace_particles_compiled': (C.c_bool, initial_states, sz, offsets_buffer, dbl_pp, dbl_pp, bounds, dbl, C.c_int, dbl_p, sz, dbl, vp, C.c_int),
+    'trace_particles_3d_derivs': (C.c_bool, initial_states, sz, offsets_buffer, dbl_pp, dbl_pp, bounds, dbl, C.c_int, dbl_p, sz, dbl, z_values, arr(ndim=5), arr(ndim=5), sz, C.c_int),
     'current_potential_axial_radial_ring': (dbl, dbl, dbl, dbl),
     'current_potential_axial': (dbl, dbl, currents_2d, jac_buffer_3d, pos_buffer_3d, sz),
     'current_field_radial_ring': (None, dbl, dbl, dbl, dbl, v2),
     'current_field': (None, v3, v3, currents_2d, jac_buffer_3d, pos_buffer_3d, sz),
-    'current_axial_derivatives_radial': (None, arr(ndim=2), currents_2d, jac_buffer_3d, pos_buffer_3d, sz, z_values, sz),
+    'current_axial_derivatives_radial': (None, arr(ndim=2), currents_2d, jac_buffer_3d, pos_buffer_3d, sz, z_values, sz, C.c_int),
     'fill_jacobian_buffer_radial': (None, jac_buffer_2d, pos_buffer_2d, vertices, sz),
-    'self_potential_radial': (dbl, dbl, vp),
-    'self_field_dot_normal_radial': (dbl, dbl, vp),
-    'fill_matrix_radial': (None, arr(ndim=2), lines, arr(dtype=C.c_uint8, ndim=1), arr(ndim=1), jac_buffer_2d, pos_buffer_2d, sz, sz, C.c_int, C.c_int),
+    'self_potential_radial': (dbl, arr(shape=(4,3))),
+    'self_field_dot_normal_radial': (dbl, arr(shape=(4,3)), dbl),
+    'self_terms_radial': (None, lines, arr(dtype=C.c_uint8, ndim=1), arr(ndim=1), arr(dtype=np.uintp, ndim=1), sz, arr(ndim=1), C.c_int),
+    'fill_matrix_radial': (None, arr(ndim=2), lines, arr(dtype=C.c_uint8, ndim=1), arr(ndim=1), jac_buffer_2d, pos_buffer_2d, sz, sz, C.c_int, C.c_int, vp),
+    'fill_matrix_radial_rows': (None, arr(ndim=2), lines, arr(dtype=C.c_uint8, ndim=1), arr(ndim=1), jac_buffer_2d, pos_buffer_2d, sz, sz, arr(dtype=np.uintp, ndim=1), sz, vp, C.c_int),
+    'fill_matrix_radial_mirror_rows': (None, arr(ndim=2), lines, arr(dtype=C.c_uint8, ndim=1), arr(ndim=1), jac_buffer_2d, pos_buffer_2d, sz, arr(dtype=np.uintp, ndim=1), sz, dbl, vp, C.c_int),
     'fill_jacobian_buffer_3d': (None, jac_buffer_3d, pos_buffer_3d, vertices, sz),
+    'fill_jacobian_buffer_3d_higher_order': (None, jac_buffer_3d, pos_buffer_3d, vertices, sz),
     'fill_matrix_3d': (None, arr(ndim=2), vertices, arr(dtype=C.c_uint8, ndim=1), arr(ndim=1), jac_buffer_3d, pos_buffer_3d, sz, sz, C.c_int, C.c_int),
+    'fill_matrix_3d_rows': (None, arr(ndim=2), vertices, arr(dtype=C.c_uint8, ndim=1), arr(ndim=1), jac_buffer_3d, pos_buffer_3d, sz, sz, arr(dtype=np.uintp, ndim=1), sz, C.c_int),
+    'fill_matrix_3d_higher_order_rows': (None, arr(ndim=2), vertices, arr(dtype=C.c_uint8, ndim=1), arr(ndim=1), jac_buffer_3d, pos_buffer_3d, sz, arr(dtype=np.uintp, ndim=1), sz, C.c_int),
+    'potential_or_flux_triangle_higher_order': (dbl, arr(shape=(6,3)), v3, dbl_p),
+    'fill_matrix_3d_symmetric_rows': (None, arr(ndim=2), vertices, arr(dtype=C.c_uint8, ndim=1), arr(ndim=1), vertices, jac_buffer_3d, pos_buffer_3d, arr(ndim=1), sz, sz, arr(dtype=np.uintp, ndim=1), sz, C.c_int),
+    'bem_operator_3d_build': (vp, vertices, arr(dtype=C.c_uint8, ndim=1), arr(ndim=1), jac_buffer_3d, pos_buffer_3d, sz, C.c_int),
+    'bem_operator_radial_build': (vp, lines, arr(dtype=C.c_uint8, ndim=1), arr(ndim=1), jac_buffer_2d, pos_buffer_2d, arr(ndim=1), sz, C.c_int),
+    'bem_operator_radial_use_tree': (C.c_bool, vp, dbl),
+    'bem_operator_free': (None, vp),
+    'bem_operator_matvec': (None, vp, arr(ndim=1), arr(ndim=1)),
+    'bem_operator_matrix_float': (None, vp, arr(dtype=C.c_float, ndim=2)),
+    'fill_matrix_3d_columns': (C.c_bool, arr(ndim=2), vertices, arr(dtype=C.c_uint8, ndim=1), arr(ndim=1), jac_buffer_3d, pos_buffer_3d, sz, arr(dtype=np.uintp, ndim=1), sz, C.c_int),
+    'fill_matrix_radial_columns': (C.c_bool, arr(ndim=2), lines, arr(dtype=C.c_uint8, ndim=1), arr(ndim=1), jac_buffer_2d, pos_buffer_2d, arr(ndim=1), sz, arr(dtype=np.uintp, ndim=1), sz, C.c_int),
+    'bem_operator_gmres': (C.c_int, vp, arr(ndim=1), arr(ndim=1), dbl, C.c_int, C.c_int, arr(ndim=1)),
+    'hmatrix_3d_build': (vp, vertices, arr(dtype=C.c_uint8, ndim=1), arr(ndim=1), jac_buffer_3d, pos_buffer_3d, sz, dbl, C.c_int),
+    'hmatrix_radial_build': (vp, lines, arr(dtype=C.c_uint8, ndim=1), arr(ndim=1), jac_buffer_2d, pos_buffer_2d, arr(ndim=1), sz, dbl, C.c_int),
+    'hmatrix_free': (None, vp),
+    'hmatrix_matvec': (None, vp, arr(ndim=1), arr(ndim=1)),
+    'hmatrix_gmres': (C.c_int, vp, arr(ndim=1), arr(ndim=1), dbl, C.c_int, C.c_int, arr(ndim=1)),
+    'hmatrix_memory': (sz, vp),
     'plane_intersection': (bool, v3, v3, arr(ndim=2), sz, arr(shape=(6,))),
     'line_intersection': (bool, v2, v2, arr(ndim=2), sz, arr(shape=(4,))),
-    'triangle_areas': (None, vertices, arr(ndim=1), sz)
+    'triangle_areas': (None, vertices, arr(ndim=1), sz),
+    'number_of_threads': (C.c_int,)
 }
 
 
@@ -199,19 +262,14 @@ def ensure_contiguous_aligned(arr):
     assert not DEBUG or (new_arr is arr), "Made copy while ensuring contiguous array"
     return new_arr
 
-# These are passed directly to scipy.LowLevelCallable, so we shouldn't wrap them in a function
-# that checks the numpy arrays
-numpy_wrapper_exceptions = ['self_potential_radial', 'self_field_dot_normal_radial']
-
 for (fun, (res, *args)) in backend_functions.items():
     libfun = getattr(backend_lib, fun)
     
-    if fun not in numpy_wrapper_exceptions:
-        def backend_check_numpy_requirements_wrapper(*args, _cfun_reference=libfun, _cfun_name=fun):
-            new_args = [ (ensure_contiguous_aligned(a) if isinstance(a, np.ndarray) else a) for a in args ]
-            return _cfun_reference(*new_args)
-        
-        setattr(backend_lib, fun, backend_check_numpy_requirements_wrapper)
+    def backend_check_numpy_requirements_wrapper(*args, _cfun_reference=libfun, _cfun_name=fun):
+        new_args = [ (ensure_contiguous_aligned(a) if isinstance(a, np.ndarray) else a) for a in args ]
+        return _cfun_reference(*new_args)
+    
+    setattr(backend_lib, fun, backend_check_numpy_requirements_wrapper)
      
     libfun.restype = res
     libfun.argtypes = args
@@ -220,11 +278,69 @@ self_potential_triangle_v0 = backend_lib.self_potential_triangle_v0
 self_potential_triangle = backend_lib.self_potential_triangle
 potential_triangle = backend_lib.potential_triangle
 flux_triangle = backend_lib.flux_triangle
+potential_triangle_kronrod = backend_lib.potential_triangle_kronrod
+flux_triangle_kronrod = backend_lib.flux_triangle_kronrod
+
+def potential_field_triangle(v0, v1, v2, target):
+    potential = C.c_double(0.0)
+    field = np.zeros(3)
+    backend_lib.potential_field_triangle(v0, v1, v2, target, C.byref(potential), field)
+    return potential.value, field
+
+def _elliptic_array_wrapper(x, array_fun):
+    x = np.asarray(x, dtype=np.float64)
+    flat = np.ascontiguousarray(x.ravel())
+    
+    K = np.empty_like(flat)
+    E = np.empty_like(flat)
+    array_fun(flat, K, E, len(flat))
+    
+    return K.reshape(x.shape), E.reshape(x.shape)
+
+def ellipkem1(p):
+    """Complete elliptic integrals K(1-p) and E(1-p) evaluated together for an array of arguments,
+    returns a tuple (K, E) of arrays with the same shape as `p`."""
+    return _elliptic_array_wrapper(p, backend_lib.ellipkem1_array)
+
+def ellipke(k):
+    """Complete elliptic integrals K(k) and E(k) evaluated together for an array of arguments (using the
+    parameter convention of `scipy.special.ellipk`), returns a tuple (K, E) of arrays with the same shape as `k`."""
+    return _elliptic_array_wrapper(k, backend_lib.ellipke_array)
+
+class EllipticTable:
+    """Table of the complete elliptic integrals K(1-p) and E(1-p), used to speed up the evaluation of the
+    Green's function of a ring of charge (radial symmetric geometries). The degree of the interpolating
+    polynomials and the number of segments of the table are chosen such that the relative error is
+    below `tolerance`. The table is freed when this object is garbage collected."""
+    
+    def __init__(self, tolerance):
+        assert tolerance > 0.
+        self.tolerance = tolerance
+        self.pointer = backend_lib.elliptic_table_build(tolerance)
+        
+        if self.pointer is None:
+            raise ValueError(f'Unable to build elliptic table with relative error smaller than {tolerance}')
+    
+    def __del__(self):
+        if getattr(self, 'pointer', None) is not None:
+            backend_lib.elliptic_table_free(self.pointer)
+            self.pointer = None
+    
+    def max_error(self):
+        """Largest relative error of the table, as found when the table was built."""
+        return backend_lib.elliptic_table_max_error(self.pointer)
+    
+    def ellipkem1(self, p):
+        """Same as `ellipkem1`, but interpolated from the table."""
+        return _elliptic_array_wrapper(p, lambda *args: backend_lib.elliptic_table_ellipkem1_array(self.pointer, *args))
+
+def _table_pointer(table):
+    return table.pointer if table is not None else None
 
-ellipkm1 = np.vectorize(backend_lib.ellipkm1)
-ellipk = np.vectorize(backend_lib.ellipk)
-ellipem1 = np.vectorize(backend_lib.ellipem1)
-ellipe = np.vectorize(backend_lib.ellipe)
+ellipkm1 = lambda p: ellipkem1(p)[0]
+ellipem1 = lambda p: ellipkem1(p)[1]
+ellipk = lambda k: ellipke(k)[0]
+ellipe = lambda k: ellipke(k)[1]
 
 def kronrod_adaptive(fun, a, b, epsabs=1.49e-08, epsrel=1.49e-08):
     callback = integration_cb_1d(lambda x, _: fun(x))
@@ -249,7 +365,12 @@ def remove_arg(fun):
 
 def normal_3d(alpha, beta, tri):
     normal = np.zeros( (3,) )
-    backend_lib.normal_3d(alpha, beta, tri, normal)
+    
+    if tri.shape == (6, 3):
+        backend_lib.normal_3d_higher_order(alpha, beta, tri, normal)
+    else:
+        backend_lib.normal_3d(alpha, beta, tri, normal)
+    
     return normal
    
 def _vec_2d_to_3d(vec):
@@ -269,44 +390,59 @@ def _vec_3d_to_2d(vec):
     return vec
 
 
-def trace_particle_wrapper(position, velocity, fill_positions_fun):
-    position = _vec_2d_to_3d(position)
-    velocity = _vec_2d_to_3d(velocity)
+TRACING_METHODS = {'rkf45': 0, 'dop853': 1, 'bs32': 2}
+
+def trace_particle_wrapper(position, velocity, trace_many_fun):
+    # A single particle is traced as a batch of one particle. The backend traces
+    # directly into a growable buffer, therefore no fixed size blocks are needed.
+    position = _vec_2d_to_3d(np.array(position, dtype=np.float64))
+    velocity = _vec_2d_to_3d(np.array(velocity, dtype=np.float64))
      
     assert position.shape == (3,) and velocity.shape == (3,)
+    
+    times, positions, _ = trace_many_fun(position[np.newaxis], velocity[np.newaxis])
+    return times, positions
+
+def _plane_array(plane):
+    # Plane given as (p0, normal), passed to the backend as six consecutive values
+    if plane is None:
+        return None
+    
+    p0, normal = plane
+    return np.concatenate( (_vec_2d_to_3d(np.array(p0, dtype=np.float64)), _vec_2d_to_3d(np.array(normal, dtype=np.float64))) )
+
+def trace_particles_wrapper(positions, velocities, trace_fun):
+    positions = np.array(positions, dtype=np.float64)
+    velocities = np.array(velocities, dtype=np.float64)
+    
+    N = len(positions)
+    assert positions.shape == velocities.shape and positions.shape in [(N, 2), (N, 3)]
+    
+    if positions.shape == (N, 2):
+        positions = np.stack([positions[:, 0], np.zeros(N), positions[:, 1]], axis=1)
+        velocities = np.stack([velocities[:, 0], np.zeros(N), velocities[:, 1]], axis=1)
+    
+    offsets = np.zeros(N+1, dtype=np.uintp)
      
-    N = TRACING_BLOCK_SIZE
-    pos_blocks = []
-    times_blocks = []
+    if N == 0:
+        return np.zeros(0), np.zeros( (0, 6) ), offsets.astype(np.int64)
      
-    times = np.zeros(TRACING_BLOCK_SIZE)
-    positions = np.zeros( (TRACING_BLOCK_SIZE, 6) )
-    positions[0] = np.concatenate( (position, velocity) )
+    states = np.concatenate( (positions, velocities), axis=1)
+    times_p, positions_p = dbl_p(), dbl_p()
+     
+    success = trace_fun(states, N, offsets, C.byref(times_p), C.byref(positions_p))
     
-    while True:
-        N = fill_positions_fun(times, positions)
-         
-        # Prevent the starting positions to be both at the end of the previous block and the start
-        # of the current block.
-        pos_blocks.append(positions[1:N] if len(pos_blocks) > 0  else positions[:N])
-        times_blocks.append(times[1:N] if len(times_blocks) > 0  else times[:N])
+    try:
+        if not success:
+            raise MemoryError('Not enough memory available to store all traced trajectories')
         
-        if N != TRACING_BLOCK_SIZE:
-            break
-          
-        times = np.zeros(TRACING_BLOCK_SIZE)
-        positions = np.zeros( (TRACING_BLOCK_SIZE, 6) )
-         
-        positions[0] = pos_blocks[-1][-1]
-        times[0] = times_blocks[-1][-1]
-
-    assert len(pos_blocks) == len(times_blocks)
-    
-    # Speedup, usually no concatenation needed
-    if len(pos_blocks) == 1:
-        return times_blocks[0], pos_blocks[0]
-    else:
-        return np.concatenate(times_blocks), np.concatenate(pos_blocks)
+        N_total = int(offsets[-1])
+        times = np.ctypeslib.as_array(times_p, shape=(N_total,)).copy()
+        trajectories = np.ctypeslib.as_array(positions_p, shape=(N_total, 6)).copy()
+    finally:
+        backend_lib.free_trace_buffers(times_p, positions_p)
+     
+    return times, trajectories, offsets.astype(np.int64)
 
 def wrap_field_fun(ff):
 
@@ -320,12 +456,15 @@ def wrap_field_fun(ff):
     return field_fun(wrapper)
 
 def position_and_jacobian_3d(alpha, beta, triangle):
-    assert triangle.shape == (3, 3)
+    assert triangle.shape == (3, 3) or triangle.shape == (6, 3)
      
     pos = np.zeros(3)
     jac = C.c_double(0.0)
-     
-    backend_lib.position_and_jacobian_3d(alpha, beta, triangle, pos, C.pointer(jac))
+    
+    if triangle.shape == (6, 3):
+        backend_lib.position_and_jacobian_3d_higher_order(alpha, beta, triangle, pos, C.pointer(jac))
+    else:
+        backend_lib.position_and_jacobian_3d(alpha, beta, triangle, pos, C.pointer(jac))
         
     return jac.value, pos
 
@@ -346,82 +485,421 @@ def position_and_jacobian_radial(alpha, v1, v2, v3, v4):
     return jac.value, pos
 
 
-def trace_particle(position, velocity, field, bounds, atol):
+def trace_particle(position, velocity, field, bounds, atol, method='rkf45', decimation=1, spacing=0.):
     bounds = np.array(bounds)
+    field_fun = wrap_field_fun(field)
+    
+    # The Python field function is called from the backend, only a single thread can be used
+    trace_fun = lambda S, N, O, T, P: backend_lib.trace_particles(S, N, O, T, P,
+        field_fun, bounds, atol, TRACING_METHODS[method], None, decimation, spacing, None, 1)
     
+    return trace_particle_wrapper(position, velocity, lambda positions, velocities: trace_particles_wrapper(positions, velocities, trace_fun))
+
+def trace_particle_radial(position, velocity, bounds, atol, eff_elec, eff_mag, eff_current, field_bounds=None, method='rkf45', decimation=1, spacing=0., table=None):
+    return trace_particle_wrapper(position, velocity,
+        lambda P, V: trace_particles_radial(P, V, bounds, atol, eff_elec, eff_mag, eff_current,
+            field_bounds=field_bounds, method=method, decimation=decimation, spacing=spacing, table=table))
+
+def trace_particle_radial_derivs(position, velocity, bounds, atol, z, elec_coeffs, mag_coeffs, method='rkf45', decimation=1, spacing=0.):
+    return trace_particle_wrapper(position, velocity,
+        lambda P, V: trace_particles_radial_derivs(P, V, bounds, atol, z, elec_coeffs, mag_coeffs,
+            method=method, decimation=decimation, spacing=spacing))
+
+def trace_particle_3d(position, velocity, bounds, atol, eff_elec, eff_mag, field_bounds=None, method='rkf45', decimation=1, spacing=0.):
+    assert position.shape == (3,)
+    assert velocity.shape == (3,)
+     
     return trace_particle_wrapper(position, velocity,
-        lambda T, P: backend_lib.trace_particle(T, P, wrap_field_fun(field), bounds, atol, None))
+        lambda P, V: trace_particles_3d(P, V, bounds, atol, eff_elec, eff_mag,
+            field_bounds=field_bounds, method=method, decimation=decimation, spacing=spacing))
 
-def trace_particle_radial(position, velocity, bounds, atol, eff_elec, eff_mag, eff_current, field_bounds=None):
+class Octree3D:
+    """Octree built in the backend from 3D effective point charges, used to quickly
+    evaluate the potential and field (Barnes-Hut algorithm). The tree is freed when this
+    object is garbage collected."""
     
-    eff_elec = EffectivePointCharges2D(eff_elec)
-    eff_mag = EffectivePointCharges2D(eff_mag)
+    def __init__(self, eff, theta):
+        assert eff.is_3d()
+        assert 0. <= theta < 1., "Opening angle theta should satisfy 0 <= theta < 1"
+        self.theta = theta
+        self.pointer = backend_lib.octree_3d_build(eff.charges, eff.jacobians, eff.positions, len(eff), theta)
+        
+        if self.pointer is None:
+            raise MemoryError('Not enough memory available to build octree')
+    
+    def __del__(self):
+        if getattr(self, 'pointer', None) is not None:
+            backend_lib.octree_3d_free(self.pointer)
+            self.pointer = None
+     
+    def __len__(self):
+        return backend_lib.octree_3d_number_of_nodes(self.pointer)
+    
+    def potential(self, point):
+        assert point.shape == (3,)
+        return backend_lib.octree_3d_potential(self.pointer, point.astype(np.float64))
+    
+    def field(self, point):
+        assert point.shape == (3,)
+        field = np.zeros( (3,) )
+        backend_lib.octree_3d_field(self.pointer, point.astype(np.float64), field)
+        return field
+
+class RadialTree:
+    """Tree built in the backend from radial symmetric effective point charges (rings), used to quickly
+    evaluate the potential and field. The far field of a group of rings is represented by a small number of
+    rings placed at Chebyshev points (see radial_tree.c). The tree is freed when this object is garbage collected."""
+    
+    def __init__(self, eff, theta):
+        assert eff.is_2d()
+        assert 0. <= theta < 1., "Opening angle theta should satisfy 0 <= theta < 1"
+        self.theta = theta
+        self.pointer = backend_lib.radial_tree_build(eff.charges, eff.jacobians, eff.positions, len(eff), theta)
+        
+        if self.pointer is None:
+            raise MemoryError('Not enough memory available to build radial tree')
+    
+    def __del__(self):
+        if getattr(self, 'pointer', None) is not None:
+            backend_lib.radial_tree_free(self.pointer)
+            self.pointer = None
+     
+    def __len__(self):
+        return backend_lib.radial_tree_number_of_nodes(self.pointer)
+    
+    def potential(self, point):
+        assert point.shape == (2,) or point.shape == (3,)
+        
+        if point.shape == (3,):
+            point = _vec_3d_to_2d(point)
+        
+        return backend_lib.radial_tree_potential(self.pointer, point.astype(np.float64))
+    
+    def field(self, point):
+        point = _vec_2d_to_3d(point)
+        field = np.zeros( (3,) )
+        backend_lib.radial_tree_field(self.pointer, point.astype(np.float64), field)
+        return _vec_3d_to_2d(field)
+
+def trace_particle_radial_tree(position, velocity, bounds, atol, elec_tree, mag_tree, eff_current, field_bounds=None, method='rkf45', decimation=1, spacing=0.):
+    return trace_particle_wrapper(position, velocity,
+        lambda P, V: trace_particles_radial_tree(P, V, bounds, atol, elec_tree, mag_tree, eff_current,
+            field_bounds=field_bounds, method=method, decimation=decimation, spacing=spacing))
+
+def trace_particles_radial_tree(positions, velocities, bounds, atol, elec_tree, mag_tree, eff_current, field_bounds=None, N_threads=1, method='rkf45', plane=None, decimation=1, spacing=0.):
     eff_current = EffectivePointCharges3D(eff_current)
     
     bounds = np.array(bounds)
-     
     field_bounds = field_bounds.ctypes.data_as(dbl_p) if field_bounds is not None else None
      
-    times, positions = trace_particle_wrapper(position, velocity,
-        lambda T, P: backend_lib.trace_particle_radial(T, P, bounds, atol, field_bounds, eff_elec, eff_mag, eff_current))
+    plane = _plane_array(plane)
+    plane_p = plane.ctypes.data_as(dbl_p) if plane is not None else None
     
-    return times, positions
+    return trace_particles_wrapper(positions, velocities,
+        lambda S, N, O, T, P: backend_lib.trace_particles_radial_tree(S, N, O, T, P, bounds, atol, TRACING_METHODS[method], plane_p, decimation, spacing, field_bounds, elec_tree.pointer, mag_tree.pointer, eff_current, N_threads))
 
-def trace_particle_radial_derivs(position, velocity, bounds, atol, z, elec_coeffs, mag_coeffs):
-    assert elec_coeffs.shape == (len(z)-1, DERIV_2D_MAX, 6)
-    assert mag_coeffs.shape == (len(z)-1, DERIV_2D_MAX, 6)
+def trace_particle_3d_octree(position, velocity, bounds, atol, elec_tree, mag_tree, field_bounds=None, method='rkf45', decimation=1, spacing=0.):
+    assert position.shape == (3,)
+    assert velocity.shape == (3,)
+     
+    return trace_particle_wrapper(position, velocity,
+        lambda P, V: trace_particles_3d_octree(P, V, bounds, atol, elec_tree, mag_tree,
+            field_bounds=field_bounds, method=method, decimation=decimation, spacing=spacing))
+
+def trace_particles_3d_octree(positions, velocities, bounds, atol, elec_tree, mag_tree, field_bounds=None, N_threads=1, method='rkf45', plane=None, decimation=1, spacing=0.):
+    assert field_bounds is None or field_bounds.shape == (3,2)
     
     bounds = np.array(bounds)
+    field_bounds = field_bounds.ctypes.data_as(dbl_p) if field_bounds is not None else None
+     
+    plane = _plane_array(plane)
+    plane_p = plane.ctypes.data_as(dbl_p) if plane is not None else None
+    
+    return trace_particles_wrapper(positions, velocities,
+        lambda S, N, O, T, P: backend_lib.trace_particles_3d_octree(S, N, O, T, P, bounds, atol, TRACING_METHODS[method], plane_p, decimation, spacing, elec_tree.pointer, mag_tree.pointer, field_bounds, N_threads))
+
+class AdaptiveCharges3D:
+    """Effective point charges of 3D triangles aggregated at coarser levels, used to evaluate the
+    potential and field with a quadrature rule that adapts to the distance of every triangle. Far away
+    triangles are represented by a single point charge, triangles at intermediate distance by three point charges, and
+    close triangles by the full quadrature rule. The levels are chosen such that the estimated relative
+    error of the contribution of every triangle is below `tolerance` (see adaptive_quadrature.c).
+    The charges are freed when this object is garbage collected."""
+    
+    def __init__(self, eff, tolerance):
+        assert eff.is_3d()
+        assert tolerance >= 0.
+        self.tolerance = tolerance
+        self.pointer = backend_lib.adaptive_charges_3d_build(eff.charges, eff.jacobians, eff.positions, len(eff), tolerance)
+        
+        if self.pointer is None:
+            raise MemoryError('Not enough memory available to build adaptive charges')
+    
+    def __del__(self):
+        if getattr(self, 'pointer', None) is not None:
+            backend_lib.adaptive_charges_3d_free(self.pointer)
+            self.pointer = None
+    
+    def potential(self, point):
+        assert point.shape == (3,)
+        return backend_lib.adaptive_charges_3d_potential(self.pointer, point.astype(np.float64))
+    
+    def field(self, point):
+        assert point.shape == (3,)
+        field = np.zeros( (3,) )
+        backend_lib.adaptive_charges_3d_field(self.pointer, point.astype(np.float64), field)
+        return field
+
+class AdaptiveChargesRadial:
+    """Same as `AdaptiveCharges3D`, but for radial symmetric effective point charges (rings). Far away line
+    elements are represented by a single ring, line elements at intermediate distance by four rings."""
+    
+    def __init__(self, eff, tolerance):
+        assert eff.is_2d()
+        assert tolerance >= 0.
+        self.tolerance = tolerance
+        self.pointer = backend_lib.adaptive_charges_radial_build(eff.charges, eff.jacobians, eff.positions, len(eff), tolerance)
+        
+        if self.pointer is None:
+            raise MemoryError('Not enough memory available to build adaptive charges')
+    
+    def __del__(self):
+        if getattr(self, 'pointer', None) is not None:
+            backend_lib.adaptive_charges_radial_free(self.pointer)
+            self.pointer = None
+    
+    def potential(self, point, table=None):
+        assert point.shape == (2,) or point.shape == (3,)
+        
+        if point.shape == (3,):
+            point = _vec_3d_to_2d(point)
+        
+        return backend_lib.adaptive_charges_radial_potential(self.pointer, point.astype(np.float64), _table_pointer(table))
+    
+    def field(self, point, table=None):
+        point = _vec_2d_to_3d(point)
+        field = np.zeros( (3,) )
+        backend_lib.adaptive_charges_radial_field(self.pointer, point.astype(np.float64), field, _table_pointer(table))
+        return _vec_3d_to_2d(field)
 
-    if bounds.shape[0] == 2:
-        bounds = np.array([bounds[0], bounds[0], bounds[1]])
+def trace_particle_radial_adaptive(position, velocity, bounds, atol, elec_charges, mag_charges, eff_current, field_bounds=None, method='rkf45', decimation=1, spacing=0., table=None):
+    return trace_particle_wrapper(position, velocity,
+        lambda P, V: trace_particles_radial_adaptive(P, V, bounds, atol, elec_charges, mag_charges, eff_current,
+            field_bounds=field_bounds, method=method, decimation=decimation, spacing=spacing, table=table))
+
+def trace_particles_radial_adaptive(positions, velocities, bounds, atol, elec_charges, mag_charges, eff_current, field_bounds=None, N_threads=1, method='rkf45', plane=None, decimation=1, spacing=0., table=None):
+    eff_current = EffectivePointCharges3D(eff_current)
     
-    times, positions = trace_particle_wrapper(position, velocity,
-        lambda T, P: backend_lib.trace_particle_radial_derivs(T, P, bounds, atol, z, elec_coeffs, mag_coeffs, len(z)))
+    bounds = np.array(bounds)
+    field_bounds = field_bounds.ctypes.data_as(dbl_p) if field_bounds is not None else None
+     
+    plane = _plane_array(plane)
+    plane_p = plane.ctypes.data_as(dbl_p) if plane is not None else None
     
-    return times, positions
+    return trace_particles_wrapper(positions, velocities,
+        lambda S, N, O, T, P: backend_lib.trace_particles_radial_adaptive(S, N, O, T, P, bounds, atol, TRACING_METHODS[method], plane_p, decimation, spacing, field_bounds,
+            elec_charges.pointer, mag_charges.pointer, eff_current, _table_pointer(table), N_threads))
 
-def trace_particle_3d(position, velocity, bounds, atol, eff_elec, eff_mag, field_bounds=None):
+def trace_particle_3d_adaptive(position, velocity, bounds, atol, elec_charges, mag_charges, field_bounds=None, method='rkf45', decimation=1, spacing=0.):
     assert position.shape == (3,)
     assert velocity.shape == (3,)
+     
+    return trace_particle_wrapper(position, velocity,
+        lambda P, V: trace_particles_3d_adaptive(P, V, bounds, atol, elec_charges, mag_charges,
+            field_bounds=field_bounds, method=method, decimation=decimation, spacing=spacing))
+
+def trace_particles_3d_adaptive(positions, velocities, bounds, atol, elec_charges, mag_charges, field_bounds=None, N_threads=1, method='rkf45', plane=None, decimation=1, spacing=0.):
     assert field_bounds is None or field_bounds.shape == (3,2)
+    
+    bounds = np.array(bounds)
+    field_bounds = field_bounds.ctypes.data_as(dbl_p) if field_bounds is not None else None
      
+    plane = _plane_array(plane)
+    plane_p = plane.ctypes.data_as(dbl_p) if plane is not None else None
+    
+    return trace_particles_wrapper(positions, velocities,
+        lambda S, N, O, T, P: backend_lib.trace_particles_3d_adaptive(S, N, O, T, P, bounds, atol, TRACING_METHODS[method], plane_p, decimation, spacing, elec_charges.pointer, mag_charges.pointer, field_bounds, N_threads))
+
+class CompiledField:
+    """Field compiled once in the backend, ready for repeated evaluation (see compiled_field.c). The effective point
+    charges are stored with the charges already multiplied by the jacobians, and the axial coefficients are copied, such that
+    evaluating the field or tracing particles does not need to convert or validate the field data again. The compiled field
+    is freed when this object is garbage collected."""
+    
+    def __init__(self, pointer, symmetry_2d, table=None):
+        if pointer is None:
+            raise MemoryError('Not enough memory available to compile field')
+        self.pointer = pointer
+        self.symmetry_2d = symmetry_2d
+        # The compiled field refers to the table, keep it alive
+        self.table = table
+    
+    def __del__(self):
+        if getattr(self, 'pointer', None) is not None:
+            backend_lib.compiled_field_free(self.pointer)
+            self.pointer = None
+    
+    def radial(eff_elec, eff_mag, eff_current, field_bounds=None, table=None):
+        assert field_bounds is None or field_bounds.shape == (3,2)
+        field_bounds = np.array(field_bounds, dtype=np.float64) if field_bounds is not None else None
+        
+        pointer = backend_lib.compiled_field_radial_build(EffectivePointCharges2D(eff_elec), EffectivePointCharges2D(eff_mag),
+            EffectivePointCharges3D(eff_current), _table_pointer(table), field_bounds.ctypes.data_as(dbl_p) if field_bounds is not None else None)
+        return CompiledField(pointer, True, table)
+    
+    def three_d(eff_elec, eff_mag, field_bounds=None):
+        assert field_bounds is None or field_bounds.shape == (3,2)
+        field_bounds = np.array(field_bounds, dtype=np.float64) if field_bounds is not None else None
+        
+        pointer = backend_lib.compiled_field_3d_build(EffectivePointCharges3D(eff_elec), EffectivePointCharges3D(eff_mag),
+            field_bounds.ctypes.data_as(dbl_p) if field_bounds is not None else None)
+        return CompiledField(pointer, False)
+    
+    def radial_axial(z, electrostatic_coeffs, magnetostatic_coeffs):
+        assert electrostatic_coeffs.shape == magnetostatic_coeffs.shape == (len(z)-1, DERIV_2D_MAX, 6)
+        return CompiledField(backend_lib.compiled_field_axial_build(0, z, electrostatic_coeffs, magnetostatic_coeffs, len(z)), True)
+    
+    def three_d_axial(z, electrostatic_coeffs, magnetostatic_coeffs):
+        assert electrostatic_coeffs.shape == magnetostatic_coeffs.shape == (len(z)-1, 2, NU_MAX, M_MAX, 4)
+        return CompiledField(backend_lib.compiled_field_axial_build(1, z, electrostatic_coeffs, magnetostatic_coeffs, len(z)), False)
+    
+    def _point(self, point):
+        point = np.asarray(point, dtype=np.float64)
+        
+        if self.symmetry_2d and point.shape == (2,):
+            return _vec_2d_to_3d(point)
+        
+        assert point.shape == (3,)
+        return point
+    
+    def potential(self, point, magnetostatic=False):
+        """Electrostatic (or magnetostatic) potential at the point. For radial symmetric fields the point can be given
+        as (r, z)."""
+        return backend_lib.compiled_field_potential(self.pointer, magnetostatic, self._point(point))
+    
+    def field(self, point, magnetostatic=False):
+        """Electrostatic (or magnetostatic) field at the point. For radial symmetric fields the point can be given
+        as (r, z), and the (r, z) components of the field are returned."""
+        field = np.zeros( (3,) )
+        backend_lib.compiled_field_field(self.pointer, magnetostatic, self._point(point), field)
+        return _vec_3d_to_2d(field) if self.symmetry_2d else field
+    
+    def _points(self, points):
+        points = np.asarray(points, dtype=np.float64)
+        assert points.ndim == 2
+        
+        if self.symmetry_2d and points.shape[1] == 2:
+            return np.stack([points[:, 0], np.zeros(len(points)), points[:, 1]], axis=1)
+        
+        assert points.shape[1] == 3
+        return np.ascontiguousarray(points)
+    
+    def potentials(self, points, magnetostatic=False, N_threads=1):
+        """Same as `potential`, but evaluated at all the N points in the (N, 2) or (N, 3) array in a single call to the backend."""
+        points = self._points(points)
+        potentials = np.zeros(len(points))
+        backend_lib.compiled_field_evaluate(self.pointer, magnetostatic, points, len(points), potentials.ctypes.data_as(dbl_p), None, N_threads)
+        return potentials
+    
+    def fields(self, points, magnetostatic=False, N_threads=1):
+        """Same as `field`, but evaluated at all the N points in the (N, 2) or (N, 3) array in a single call to the backend."""
+        points = self._points(points)
+        fields = np.zeros( (len(points), 3) )
+        backend_lib.compiled_field_evaluate(self.pointer, magnetostatic, points, len(points), None, fields.ctypes.data_as(dbl_p), N_threads)
+        return fields[:, [0, 2]] if self.symmetry_2d else fields
+
+def trace_particle_compiled(position, velocity, bounds, atol, compiled_field, method='rkf45', decimation=1, spacing=0.):
+    return trace_particle_wrapper(position, velocity,
+        lambda P, V: trace_particles_compiled(P, V, bounds, atol, compiled_field, method=method, decimation=decimation, spacing=spacing))
+
+def trace_particles_compiled(positions, velocities, bounds, atol, compiled_field, N_threads=1, method='rkf45', plane=None, decimation=1, spacing=0.):
     bounds = np.array(bounds)
     
+    plane = _plane_array(plane)
+    plane_p = plane.ctypes.data_as(dbl_p) if plane is not None else None
+    
+    return trace_particles_wrapper(positions, velocities,
+        lambda S, N, O, T, P: backend_lib.trace_particles_compiled(S, N, O, T, P, bounds, atol, TRACING_METHODS[method], plane_p, decimation, spacing, compiled_field.pointer, N_threads))
+
+def trace_particle_3d_derivs(position, velocity, bounds, atol, z, electrostatic_coeffs, magnetostatic_coeffs, method='rkf45', decimation=1, spacing=0.):
+    assert position.shape == (3,)
+    assert velocity.shape == (3,)
+     
+    return trace_particle_wrapper(position, velocity,
+        lambda P, V: trace_particles_3d_derivs(P, V, bounds, atol, z, electrostatic_coeffs, magnetostatic_coeffs,
+            method=method, decimation=decimation, spacing=spacing))
+
+def trace_particles_radial(positions, velocities, bounds, atol, eff_elec, eff_mag, eff_current, field_bounds=None, N_threads=1, method='rkf45', plane=None, decimation=1, spacing=0., table=None):
+    eff_elec = EffectivePointCharges2D(eff_elec)
+    eff_mag = EffectivePointCharges2D(eff_mag)
+    eff_current = EffectivePointCharges3D(eff_current)
+    
+    bounds = np.array(bounds)
     field_bounds = field_bounds.ctypes.data_as(dbl_p) if field_bounds is not None else None
+     
+    plane = _plane_array(plane)
+    plane_p = plane.ctypes.data_as(dbl_p) if plane is not None else None
+    
+    return trace_particles_wrapper(positions, velocities,
+        lambda S, N, O, T, P: backend_lib.trace_particles_radial(S, N, O, T, P, bounds, atol, TRACING_METHODS[method], plane_p, decimation, spacing, field_bounds, eff_elec, eff_mag, eff_current, _table_pointer(table), N_threads))
+
+def trace_particles_radial_derivs(positions, velocities, bounds, atol, z, elec_coeffs, mag_coeffs, N_threads=1, method='rkf45', plane=None, decimation=1, spacing=0.):
+    assert elec_coeffs.shape == (len(z)-1, DERIV_2D_MAX, 6)
+    assert mag_coeffs.shape == (len(z)-1, DERIV_2D_MAX, 6)
+    
+    bounds = np.array(bounds)
+    
+    if bounds.shape[0] == 2:
+        bounds = np.array([bounds[0], bounds[0], bounds[1]])
+     
+    plane = _plane_array(plane)
+    plane_p = plane.ctypes.data_as(dbl_p) if plane is not None else None
+    
+    return trace_particles_wrapper(positions, velocities,
+        lambda S, N, O, T, P: backend_lib.trace_particles_radial_derivs(S, N, O, T, P, bounds, atol, TRACING_METHODS[method], plane_p, decimation, spacing, z, elec_coeffs, mag_coeffs, len(z), N_threads))
 
+def trace_particles_3d(positions, velocities, bounds, atol, eff_elec, eff_mag, field_bounds=None, N_threads=1, method='rkf45', plane=None, decimation=1, spacing=0.):
+    assert field_bounds is None or field_bounds.shape == (3,2)
+    
+    bounds = np.array(bounds)
+    field_bounds = field_bounds.ctypes.data_as(dbl_p) if field_bounds is not None else None
+    
     eff_elec = EffectivePointCharges3D(eff_elec)
     eff_mag = EffectivePointCharges3D(eff_mag)
      
-    return trace_particle_wrapper(position, velocity,
-        lambda T, P: backend_lib.trace_particle_3d(T, P, bounds, atol, eff_elec, eff_mag, field_bounds))
+    plane = _plane_array(plane)
+    plane_p = plane.ctypes.data_as(dbl_p) if plane is not None else None
+    
+    return trace_particles_wrapper(positions, velocities,
+        lambda S, N, O, T, P: backend_lib.trace_particles_3d(S, N, O, T, P, bounds, atol, TRACING_METHODS[method], plane_p, decimation, spacing, eff_elec, eff_mag, field_bounds, N_threads))
 
-def trace_particle_3d_derivs(position, velocity, bounds, atol, z, electrostatic_coeffs, magnetostatic_coeffs):
-    assert position.shape == (3,)
-    assert velocity.shape == (3,)
+def trace_particles_3d_derivs(positions, velocities, bounds, atol, z, electrostatic_coeffs, magnetostatic_coeffs, N_threads=1, method='rkf45', plane=None, decimation=1, spacing=0.):
     assert electrostatic_coeffs.shape == (len(z)-1, 2, NU_MAX, M_MAX, 4)
     assert magnetostatic_coeffs.shape == (len(z)-1, 2, NU_MAX, M_MAX, 4)
     
     bounds = np.array(bounds)
      
-    return trace_particle_wrapper(position, velocity,
-        lambda T, P: backend_lib.trace_particle_3d_derivs(T, P, bounds, atol, z, electrostatic_coeffs, magnetostatic_coeffs, len(z)))
+    plane = _plane_array(plane)
+    plane_p = plane.ctypes.data_as(dbl_p) if plane is not None else None
+    
+    return trace_particles_wrapper(positions, velocities,
+        lambda S, N, O, T, P: backend_lib.trace_particles_3d_derivs(S, N, O, T, P, bounds, atol, TRACING_METHODS[method], plane_p, decimation, spacing, z, electrostatic_coeffs, magnetostatic_coeffs, len(z), N_threads))
 
 potential_radial_ring = lambda *args: backend_lib.potential_radial_ring(*args, None)
 dr1_potential_radial_ring = lambda *args: backend_lib.dr1_potential_radial_ring(*args, None)
 dz1_potential_radial_ring = lambda *args: backend_lib.dz1_potential_radial_ring(*args, None)
 
-def axial_derivatives_radial(z, charges, jac_buffer, pos_buffer):
+def axial_derivatives_radial(z, charges, jac_buffer, pos_buffer, N_threads=1):
     derivs = np.zeros( (z.size, DERIV_2D_MAX) )
     
     assert jac_buffer.shape == (len(charges), N_QUAD_2D)
     assert pos_buffer.shape == (len(charges), N_QUAD_2D, 2)
     assert charges.shape == (len(charges),)
      
-    backend_lib.axial_derivatives_radial(derivs,charges, jac_buffer, pos_buffer, len(charges), z, len(z))
+    backend_lib.axial_derivatives_radial(derivs,charges, jac_buffer, pos_buffer, len(charges), z, len(z), N_threads)
     return derivs
 
-def potential_radial(point, charges, jac_buffer, pos_buffer):
+def potential_radial(point, charges, jac_buffer, pos_buffer, table=None):
     assert point.shape == (2,) or point.shape == (3,)
 
     if point.shape == (3,):
@@ -429,7 +907,7 @@ def potential_radial(point, charges, jac_buffer, pos_buffer):
     
     assert jac_buffer.shape == (len(charges), N_QUAD_2D)
     assert pos_buffer.shape == (len(charges), N_QUAD_2D, 2)
-    return backend_lib.potential_radial(point.astype(np.float64), charges, jac_buffer, pos_buffer, len(charges))
+    return backend_lib.potential_radial(point.astype(np.float64), charges, jac_buffer, pos_buffer, len(charges), _table_pointer(table))
 
 def potential_radial_derivs(point, z, coeffs):
     assert coeffs.shape == (len(z)-1, DERIV_2D_MAX, 6)
@@ -439,13 +917,13 @@ def charge_radial(vertices, charge):
     assert vertices.shape == (len(vertices), 3)
     return backend_lib.charge_radial(vertices, charge)
 
-def field_radial(point, charges, jac_buffer, pos_buffer):
+def field_radial(point, charges, jac_buffer, pos_buffer, table=None):
     point = _vec_2d_to_3d(point)
     assert jac_buffer.shape == (len(charges), N_QUAD_2D)
     assert pos_buffer.shape == (len(charges), N_QUAD_2D, 2)
     assert charges.shape == (len(charges),)
     field = np.zeros( (3,) )
-    backend_lib.field_radial(point.astype(np.float64), field, charges, jac_buffer, pos_buffer, len(charges))
+    backend_lib.field_radial(point.astype(np.float64), field, charges, jac_buffer, pos_buffer, len(charges), _table_pointer(table))
     return _vec_3d_to_2d(field)
 
 def combine_elec_magnetic_field(vel, elec, mag, current):
@@ -466,7 +944,7 @@ dz1_potential_3d_point = remove_arg(backend_lib.dz1_potential_3d_point)
 potential_3d_point = remove_arg(backend_lib.potential_3d_point)
 flux_density_to_charge_factor = backend_lib.flux_density_to_charge_factor
 
-def axial_coefficients_3d(charges, jacobian_buffer, pos_buffer, z):
+def axial_coefficients_3d(charges, jacobian_buffer, pos_buffer, z, N_threads=1):
     assert jacobian_buffer.shape == (len(charges), N_TRIANGLE_QUAD)
     assert pos_buffer.shape == (len(charges), N_TRIANGLE_QUAD, 3)
     
@@ -477,7 +955,7 @@ def axial_coefficients_3d(charges, jacobian_buffer, pos_buffer, z):
      
     backend_lib.axial_coefficients_3d(charges, 
         jacobian_buffer, pos_buffer, trig_cos_buffer, trig_sin_buffer,
-        len(charges), z, output_coeffs, len(z))
+        len(charges), z, output_coeffs, len(z), N_threads)
       
     return output_coeffs
 
@@ -543,7 +1021,7 @@ def current_field(p0, currents, jac_buffer, pos_buffer):
     backend_lib.current_field(p0, result, currents, jac_buffer, pos_buffer, N)
     return result
 
-def current_axial_derivatives_radial(z, currents, jac_buffer, pos_buffer):
+def current_axial_derivatives_radial(z, currents, jac_buffer, pos_buffer, N_threads=1):
     N_z = len(z)
     N_vertices = len(currents)
 
@@ -553,7 +1031,7 @@ def current_axial_derivatives_radial(z, currents, jac_buffer, pos_buffer):
     assert pos_buffer.shape == (N_vertices, N_TRIANGLE_QUAD, 3)
     
     derivs = np.zeros( (z.size, DERIV_2D_MAX) )
-    backend_lib.current_axial_derivatives_radial(derivs, currents, jac_buffer, pos_buffer, N_vertices, z, N_z)
+    backend_lib.current_axial_derivatives_radial(derivs, currents, jac_buffer, pos_buffer, N_vertices, z, N_z, N_threads)
     return derivs
 
 
@@ -571,29 +1049,44 @@ def fill_jacobian_buffer_radial(vertices):
 
 def self_potential_radial(vertices):
     assert vertices.shape == (4,3) and vertices.dtype == np.double
-    user_data = vertices.ctypes.data_as(C.c_void_p)
-    low_level = LowLevelCallable(backend_lib.self_potential_radial, user_data=user_data)
-    return quad(low_level, -1, 1, points=(0,), epsabs=1e-9, epsrel=1e-9, limit=250)[0]
-
-class SelfFieldDotNormalRadialArgs(C.Structure):
-    _fields_ = [("line_points", C.POINTER(C.c_double)), ("K", C.c_double)]
+    return backend_lib.self_potential_radial(vertices)
 
 def self_field_dot_normal_radial(vertices, K):
     assert vertices.shape == (4,3) and vertices.dtype == np.double
-    user_data = vertices.ctypes.data_as(C.c_void_p)
-
-    args = SelfFieldDotNormalRadialArgs()
-    args.K = float(K)
-    args.line_points = vertices.ctypes.data_as(dbl_p)
+    return backend_lib.self_field_dot_normal_radial(vertices, float(K))
 
-    user_data = C.cast(C.pointer(args), vp)
+def self_terms_radial(lines, excitation_types, excitation_values, indices, N_threads=1):
+    N = len(lines)
+    assert lines.shape == (N, 4, 3)
+    assert excitation_types.shape == (N,)
+    assert excitation_values.shape == (N,)
+    assert np.all((0 <= indices) & (indices < N))
     
-    low_level = LowLevelCallable(backend_lib.self_field_dot_normal_radial, user_data=user_data)
-    return quad(low_level, -1, 1, points=(0,), epsabs=1e-9, epsrel=1e-9, limit=250)[0]
-
-
+    indices = np.asarray(indices, dtype=np.uintp)
+    self_terms = np.zeros(len(indices))
+    backend_lib.self_terms_radial(lines, excitation_types, excitation_values, indices, len(indices), self_terms, N_threads)
+    return self_terms
+
+def fill_matrix_radial_columns(lines, excitation_types, excitation_values, jac_buffer, pos_buffer, self_terms, columns, N_threads=1):
+    """Compute the given columns of the matrix filled by `fill_matrix_radial` (with `self_terms` on the diagonal). Returns
+    an array of shape (N, len(columns))."""
+    N = len(lines)
+    assert lines.shape == (N, 4, 3)
+    assert excitation_types.shape == (N,) and excitation_values.shape == (N,)
+    assert jac_buffer.shape == (N, N_QUAD_2D)
+    assert pos_buffer.shape == (N, N_QUAD_2D, 2)
+    assert self_terms.shape == (N,)
+    
+    columns = np.asarray(columns, dtype=np.uintp)
+    assert np.all(columns < N)
+    out = np.zeros( (N, len(columns)) )
+    
+    if not backend_lib.fill_matrix_radial_columns(out, lines, excitation_types, excitation_values, jac_buffer, pos_buffer, self_terms, N, columns, len(columns), N_threads):
+        raise MemoryError('Not enough memory available to compute matrix columns')
+    
+    return out
 
-def fill_matrix_radial(matrix, lines, excitation_types, excitation_values, jac_buffer, pos_buffer, start_index, end_index):
+def fill_matrix_radial(matrix, lines, excitation_types, excitation_values, jac_buffer, pos_buffer, start_index, end_index, table=None):
     N = len(lines)
     assert np.all(lines[:, :, 1] == 0.0)
     assert matrix.shape[0] == N and matrix.shape[1] == N and matrix.shape[0] == matrix.shape[1]
@@ -602,17 +1095,49 @@ def fill_matrix_radial(matrix, lines, excitation_types, excitation_values, jac_b
     assert excitation_values.shape == (N,)
     assert jac_buffer.shape == (N, N_QUAD_2D)
     assert pos_buffer.shape == (N, N_QUAD_2D, 2)
-    assert 0 <= start_index < N and 0 <= end_index < N and start_index < end_index
+    assert 0 <= start_index < N and 0 <= end_index < N and start_index <= end_index
      
-    backend_lib.fill_matrix_radial(matrix, lines, excitation_types, excitation_values, jac_buffer, pos_buffer, N, matrix.shape[0], start_index, end_index)
+    backend_lib.fill_matrix_radial(matrix, lines, excitation_types, excitation_values, jac_buffer, pos_buffer, N, matrix.shape[0], start_index, end_index, _table_pointer(table))
+
+def fill_matrix_radial_rows(matrix, lines, excitation_types, excitation_values, jac_buffer, pos_buffer, rows, N_threads=1, table=None):
+    N = len(lines)
+    assert np.all(lines[:, :, 1] == 0.0)
+    assert matrix.shape[0] == N and matrix.shape[1] == N and matrix.shape[0] == matrix.shape[1]
+    assert lines.shape == (N, 4, 3)
+    assert excitation_types.shape == (N,)
+    assert excitation_values.shape == (N,)
+    assert jac_buffer.shape == (N, N_QUAD_2D)
+    assert pos_buffer.shape == (N, N_QUAD_2D, 2)
+    assert np.all((0 <= rows) & (rows < N))
+    
+    rows = np.asarray(rows, dtype=np.uintp)
+    backend_lib.fill_matrix_radial_rows(matrix, lines, excitation_types, excitation_values, jac_buffer, pos_buffer, N, matrix.shape[0], rows, len(rows), _table_pointer(table), N_threads)
+
+def fill_matrix_radial_mirror_rows(matrix, lines, excitation_types, excitation_values, jac_buffer, pos_buffer, rows, sign, N_threads=1, table=None):
+    N = len(lines)
+    assert np.all(lines[:, :, 1] == 0.0)
+    assert matrix.shape == (N, N)
+    assert lines.shape == (N, 4, 3)
+    assert excitation_types.shape == (N,)
+    assert excitation_values.shape == (N,)
+    assert jac_buffer.shape == (N, N_QUAD_2D)
+    assert pos_buffer.shape == (N, N_QUAD_2D, 2)
+    assert np.all((0 <= rows) & (rows < N))
+    assert sign in [1, -1]
+    
+    rows = np.asarray(rows, dtype=np.uintp)
+    backend_lib.fill_matrix_radial_mirror_rows(matrix, lines, excitation_types, excitation_values, jac_buffer, pos_buffer, N, rows, len(rows), sign, _table_pointer(table), N_threads)
 
 def fill_jacobian_buffer_3d(vertices):
     N = len(vertices)
-    assert vertices.shape == (N, 3, 3)
+    assert vertices.shape == (N, 3, 3) or vertices.shape == (N, 6, 3)
     jac_buffer = np.zeros( (N, N_TRIANGLE_QUAD) )
     pos_buffer = np.zeros( (N, N_TRIANGLE_QUAD, 3) )
     
-    backend_lib.fill_jacobian_buffer_3d(jac_buffer, pos_buffer, vertices, N)
+    if vertices.shape[1] == 6:
+        backend_lib.fill_jacobian_buffer_3d_higher_order(jac_buffer, pos_buffer, vertices, N)
+    else:
+        backend_lib.fill_jacobian_buffer_3d(jac_buffer, pos_buffer, vertices, N)
 
     return jac_buffer, pos_buffer
 
@@ -630,6 +1155,186 @@ def fill_matrix_3d(matrix, vertices, excitation_types, excitation_values, jac_bu
      
     backend_lib.fill_matrix_3d(matrix, vertices, excitation_types, excitation_values, jac_buffer, pos_buffer, N, matrix.shape[0], start_index, end_index)
 
+def fill_matrix_3d_rows(matrix, vertices, excitation_types, excitation_values, jac_buffer, pos_buffer, rows, N_threads=1):
+    N = len(vertices)
+    assert matrix.shape[0] == N and matrix.shape[1] == N and matrix.shape[0] == matrix.shape[1]
+    assert vertices.shape == (N, 3, 3) or vertices.shape == (N, 6, 3)
+    assert excitation_types.shape == (N,)
+    assert excitation_values.shape == (N,)
+    assert jac_buffer.shape == (N, N_TRIANGLE_QUAD)
+    assert pos_buffer.shape == (N, N_TRIANGLE_QUAD, 3)
+    assert np.all((0 <= rows) & (rows < N))
+    
+    rows = np.asarray(rows, dtype=np.uintp)
+    
+    if vertices.shape[1] == 6:
+        backend_lib.fill_matrix_3d_higher_order_rows(matrix, vertices, excitation_types, excitation_values, jac_buffer, pos_buffer, N, rows, len(rows), N_threads)
+    else:
+        backend_lib.fill_matrix_3d_rows(matrix, vertices, excitation_types, excitation_values, jac_buffer, pos_buffer, N, matrix.shape[0], rows, len(rows), N_threads)
+
+def potential_or_flux_triangle_higher_order(triangle, target, normal=None):
+    """Integral of 1/(4 pi r) (or, if a normal is given, of the field dot normal) of a unit charge density
+    over a curved triangle (six points, see `fill_matrix_3d_rows`). The target may lie on the triangle."""
+    assert triangle.shape == (6, 3) and target.shape == (3,)
+    
+    if normal is not None:
+        normal = np.ascontiguousarray(normal, dtype=np.float64)
+        assert normal.shape == (3,)
+    
+    normal_p = normal.ctypes.data_as(dbl_p) if normal is not None else None
+    return backend_lib.potential_or_flux_triangle_higher_order(triangle, target, normal_p)
+
+def fill_matrix_3d_columns(vertices, excitation_types, excitation_values, jac_buffer, pos_buffer, columns, N_threads=1):
+    """Compute the given columns of the matrix filled by `fill_matrix_3d`. Returns an array of shape (N, len(columns))."""
+    N = len(vertices)
+    assert vertices.shape == (N, 3, 3)
+    assert excitation_types.shape == (N,) and excitation_values.shape == (N,)
+    assert jac_buffer.shape == (N, N_TRIANGLE_QUAD)
+    assert pos_buffer.shape == (N, N_TRIANGLE_QUAD, 3)
+    
+    columns = np.asarray(columns, dtype=np.uintp)
+    assert np.all(columns < N)
+    out = np.zeros( (N, len(columns)) )
+    
+    if not backend_lib.fill_matrix_3d_columns(out, vertices, excitation_types, excitation_values, jac_buffer, pos_buffer, N, columns, len(columns), N_threads):
+        raise MemoryError('Not enough memory available to compute matrix columns')
+    
+    return out
+
+def fill_matrix_3d_symmetric_rows(matrix, vertices, excitation_types, excitation_values, image_vertices, image_jac_buffer, image_pos_buffer, characters, rows, N_threads=1):
+    N = len(vertices)
+    N_images = len(characters)
+    assert matrix.shape == (N, N)
+    assert vertices.shape == (N, 3, 3)
+    assert excitation_types.shape == (N,)
+    assert excitation_values.shape == (N,)
+    assert characters.shape == (N_images,)
+    assert image_vertices.shape == (N_images*N, 3, 3)
+    assert image_jac_buffer.shape == (N_images*N, N_TRIANGLE_QUAD)
+    assert image_pos_buffer.shape == (N_images*N, N_TRIANGLE_QUAD, 3)
+    assert np.all((0 <= rows) & (rows < N))
+    
+    rows = np.asarray(rows, dtype=np.uintp)
+    backend_lib.fill_matrix_3d_symmetric_rows(matrix, vertices, excitation_types, excitation_values,
+        image_vertices, image_jac_buffer, image_pos_buffer, characters, N, N_images, rows, len(rows), N_threads)
+
+class BEMOperator:
+    """Matrix-free representation of the BEM matrix, built in the backend. The product of
+    this operator with a vector equals the product of the matrix (as filled by `fill_matrix_3d`
+    or `fill_matrix_radial`) with the vector, but only O(N) memory is used. The operator is freed
+    when this object is garbage collected."""
+    
+    _free = 'bem_operator_free'
+    _matvec = 'bem_operator_matvec'
+    _gmres = 'bem_operator_gmres'
+    
+    def __init__(self, pointer, N):
+        if pointer is None:
+            raise MemoryError(f'Not enough memory available to build {type(self).__name__}')
+        self.pointer = pointer
+        self.N = N
+    
+    def radial(lines, excitation_types, excitation_values, jac_buffer, pos_buffer, self_terms, N_threads=1, tree_theta=None):
+        """Build the operator of a radial symmetric geometry. When `tree_theta` is given the far field part of the
+        matrix-vector products is computed using a tree code with the given opening angle (see `RadialTree`), which
+        makes the products O(N log N) instead of O(N^2), at the cost of a small approximation error."""
+        N = len(lines)
+        assert np.all(lines[:, :, 1] == 0.0)
+        assert lines.shape == (N, 4, 3)
+        assert excitation_types.shape == (N,) and excitation_values.shape == (N,)
+        assert jac_buffer.shape == (N, N_QUAD_2D)
+        assert pos_buffer.shape == (N, N_QUAD_2D, 2)
+        assert self_terms.shape == (N,)
+         
+        operator = BEMOperator(backend_lib.bem_operator_radial_build(lines, excitation_types, excitation_values, jac_buffer, pos_buffer, self_terms, N, N_threads), N)
+        
+        if tree_theta is not None:
+            assert 0. <= tree_theta < 1., "Opening angle theta should satisfy 0 <= theta < 1"
+            
+            if not backend_lib.bem_operator_radial_use_tree(operator.pointer, tree_theta):
+                raise MemoryError('Not enough memory available to build radial tree')
+        
+        return operator
+    
+    def three_d(vertices, excitation_types, excitation_values, jac_buffer, pos_buffer, N_threads=1):
+        N = len(vertices)
+        assert vertices.shape == (N, 3, 3)
+        assert excitation_types.shape == (N,) and excitation_values.shape == (N,)
+        assert jac_buffer.shape == (N, N_TRIANGLE_QUAD)
+        assert pos_buffer.shape == (N, N_TRIANGLE_QUAD, 3)
+         
+        return BEMOperator(backend_lib.bem_operator_3d_build(vertices, excitation_types, excitation_values, jac_buffer, pos_buffer, N, N_threads), N)
+    
+    def __del__(self):
+        if getattr(self, 'pointer', None) is not None:
+            getattr(backend_lib, self._free)(self.pointer)
+            self.pointer = None
+    
+    def matvec(self, x):
+        assert x.shape == (self.N,)
+        y = np.zeros(self.N)
+        getattr(backend_lib, self._matvec)(self.pointer, x.astype(np.float64), y)
+        return y
+    
+    def to_float32_matrix(self):
+        """Get the dense matrix represented by this operator in single precision. The entries are computed
+        in double precision and rounded when stored, which halves the memory compared to the matrix returned by `fill_matrix_3d`."""
+        assert type(self) is BEMOperator, "Only supported for BEMOperator"
+        matrix = np.empty( (self.N, self.N), dtype=np.float32 )
+        backend_lib.bem_operator_matrix_float(self.pointer, matrix)
+        return matrix
+    
+    def gmres(self, right_hand_side, tolerance=1e-10, restart=100, max_iterations=1000):
+        """Solve the system using restarted GMRES. Returns the solution, the number of iterations and the
+        relative residual."""
+        assert right_hand_side.shape == (self.N,)
+        
+        solution = np.zeros(self.N)
+        residual = np.zeros(1)
+        iterations = getattr(backend_lib, self._gmres)(self.pointer,
+            right_hand_side.astype(np.float64), solution, tolerance, restart, max_iterations, residual)
+        
+        if iterations < 0:
+            raise MemoryError('Not enough memory available to run GMRES')
+         
+        return solution, iterations, residual[0]
+
+class HMatrix(BEMOperator):
+    """Hierarchical matrix (H-matrix) approximation of the BEM matrix, built in the backend. Blocks of the
+    matrix coupling groups of elements which are far apart are compressed to low rank using adaptive cross approximation.
+    The accuracy of the compression is determined by `tolerance` (relative accuracy per block). Systems are solved using GMRES,
+    with the inverse of the diagonal blocks as preconditioner."""
+    
+    _free = 'hmatrix_free'
+    _matvec = 'hmatrix_matvec'
+    _gmres = 'hmatrix_gmres'
+    
+    def radial(lines, excitation_types, excitation_values, jac_buffer, pos_buffer, self_terms, tolerance=1e-6, N_threads=1):
+        N = len(lines)
+        assert N > 0
+        assert np.all(lines[:, :, 1] == 0.0)
+        assert lines.shape == (N, 4, 3)
+        assert excitation_types.shape == (N,) and excitation_values.shape == (N,)
+        assert jac_buffer.shape == (N, N_QUAD_2D)
+        assert pos_buffer.shape == (N, N_QUAD_2D, 2)
+        assert self_terms.shape == (N,)
+         
+        return HMatrix(backend_lib.hmatrix_radial_build(lines, excitation_types, excitation_values, jac_buffer, pos_buffer, self_terms, N, tolerance, N_threads), N)
+    
+    def three_d(vertices, excitation_types, excitation_values, jac_buffer, pos_buffer, tolerance=1e-6, N_threads=1):
+        N = len(vertices)
+        assert N > 0
+        assert vertices.shape == (N, 3, 3)
+        assert excitation_types.shape == (N,) and excitation_values.shape == (N,)
+        assert jac_buffer.shape == (N, N_TRIANGLE_QUAD)
+        assert pos_buffer.shape == (N, N_TRIANGLE_QUAD, 3)
+         
+        return HMatrix(backend_lib.hmatrix_3d_build(vertices, excitation_types, excitation_values, jac_buffer, pos_buffer, N, tolerance, N_threads), N)
+    
+    def memory(self):
+        """Number of bytes used to store the compressed matrix."""
+        return backend_lib.hmatrix_memory(self.pointer)
+
 def plane_intersection(positions, p0, normal):
     assert p0.shape == (3,)
     assert normal.shape == (3,)
@@ -651,6 +1356,11 @@ def line_intersection(positions, p0, tangent):
     return result if found else None
 
 
+def number_of_threads():
+    """Number of threads used by the backend. Given by the `TRACEON_THREADS` environment variable
+    if it is set, otherwise by half the number of logical cores."""
+    return backend_lib.number_of_threads()
+
 def triangle_areas(triangles):
     assert triangles.shape == (len(triangles), 3, 3)
     out = np.zeros(len(triangles))
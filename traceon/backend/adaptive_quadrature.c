@@ -0,0 +1,382 @@
+// Distance adaptive quadrature for the field evaluation of effective point charges.
+//
+// The effective point charges store the full quadrature rule of every element (N_TRIANGLE_QUAD
+// points per triangle, N_QUAD_2D points per line element). For elements far away from the
+// evaluation point this is much more accurate than needed. Therefore the quadrature points of
+// every element are aggregated into point charges at two coarser levels:
+//
+// - a single point charge at the center of the element
+// - a few point charges (ADAPTIVE_GROUPS_3D or ADAPTIVE_GROUPS_RADIAL), each aggregating a group of
+//   neighbouring quadrature points
+//
+// A point charge is placed at the center (weighted by the jacobians) of the points it aggregates,
+// which makes the dipole error vanish. For rings the weights also include the radius, since the
+// Green's function of a ring is proportional to its radius. The relative error of the contribution of the element is then
+// of order (radius/distance)^2, where radius is the largest distance of an aggregated point from its
+// point charge. A level is used when ADAPTIVE_QUADRATURE_SAFETY*(radius/distance)^2 < tolerance, otherwise
+// the next finer level is used.
+//
+// Like the octree, the aggregated charges are built once and then reused for any number of field evaluations.
+
+#define ADAPTIVE_GROUPS_3D 3
+#define ADAPTIVE_GROUPS_RADIAL 4
+#define ADAPTIVE_QUADRATURE_SAFETY 2.0
+
+// Group of a quadrature point of a triangle, given by the vertex closest to the point.
+// The symmetric quadrature rule gives every group four points.
+static int
+_adaptive_group_3d(int k) {
+	double b0 = 1. - QUAD_B1[k] - QUAD_B2[k];
+
+	if(b0 >= QUAD_B1[k] && b0 >= QUAD_B2[k]) return 0;
+	return QUAD_B1[k] >= QUAD_B2[k] ? 1 : 2;
+}
+
+// Group of a quadrature point of a line element, consecutive points (along the element)
+// are in the same group.
+static int
+_adaptive_group_radial(int k) {
+	int rank = 0;
+	for(int j = 0; j < N_QUAD_2D; j++) rank += GAUSS_QUAD_POINTS[j] < GAUSS_QUAD_POINTS[k];
+	return rank / (N_QUAD_2D / ADAPTIVE_GROUPS_RADIAL);
+}
+
+// Aggregate the points in group g (or all points if group is NULL) into a single point at the
+// center weighted by the jacobians. The positions are stored contiguously, D values per point.
+// Returns the squared distance of the farthest point to the center.
+static double
+_adaptive_aggregate(int D, int N, double *positions, double *jacobians, const int *group, int g, double *center, double *jacobian_sum) {
+
+	double total = 0.;
+	for(int d = 0; d < D; d++) center[d] = 0.;
+
+	for(int k = 0; k < N; k++) {
+		if(group != NULL && group[k] != g) continue;
+		total += jacobians[k];
+		for(int d = 0; d < D; d++) center[d] += jacobians[k]*positions[k*D + d];
+	}
+
+	for(int d = 0; d < D; d++) center[d] = total != 0. ? center[d]/total : positions[d];
+
+	double radius2 = 0.;
+
+	for(int k = 0; k < N; k++) {
+		if(group != NULL && group[k] != g) continue;
+		double r2 = 0.;
+		for(int d = 0; d < D; d++) r2 += (positions[k*D + d] - center[d])*(positions[k*D + d] - center[d]);
+		radius2 = fmax(radius2, r2);
+	}
+
+	*jacobian_sum = total;
+	return radius2;
+}
+
+// Squared distance beyond which a level with the given squared radius can be used
+INLINE double
+_adaptive_switch_distance2(double radius2, double tolerance) {
+	return tolerance > 0. ? ADAPTIVE_QUADRATURE_SAFETY*radius2/tolerance : INFINITY;
+}
+
+struct adaptive_charges_3d {
+	size_t N; // Number of elements
+
+	// Single point charge per element, in structure of arrays layout
+	double *x, *y, *z, *w;
+
+	double *single_distance2; // Use the single point charge beyond this squared distance
+	double *group_distance2; // Use the group point charges beyond this squared distance
+
+	double (*groups)[ADAPTIVE_GROUPS_3D][4]; // Position and weight of the group point charges
+	double (*points)[N_TRIANGLE_QUAD][4]; // Position and weight of the full quadrature rule
+};
+
+EXPORT void
+adaptive_charges_3d_free(struct adaptive_charges_3d *a) {
+	if(a == NULL) return;
+	free(a->x);
+	free(a->groups);
+	free(a->points);
+	free(a);
+}
+
+EXPORT struct adaptive_charges_3d*
+adaptive_charges_3d_build(double *charges, jacobian_buffer_3d jacobian_buffer, position_buffer_3d position_buffer, size_t N, double tolerance) {
+
+	struct adaptive_charges_3d *a = calloc(1, sizeof(struct adaptive_charges_3d));
+	if(a == NULL) return NULL;
+
+	a->N = N;
+	a->x = malloc(6*(N > 0 ? N : 1)*sizeof(double));
+	a->groups = malloc((N > 0 ? N : 1)*sizeof *a->groups);
+	a->points = malloc((N > 0 ? N : 1)*sizeof *a->points);
+
+	if(a->x == NULL || a->groups == NULL || a->points == NULL) {
+		adaptive_charges_3d_free(a);
+		return NULL;
+	}
+
+	a->y = a->x + N;
+	a->z = a->x + 2*N;
+	a->w = a->x + 3*N;
+	a->single_distance2 = a->x + 4*N;
+	a->group_distance2 = a->x + 5*N;
+
+	int group[N_TRIANGLE_QUAD];
+	for(int k = 0; k < N_TRIANGLE_QUAD; k++) group[k] = _adaptive_group_3d(k);
+
+	for(size_t i = 0; i < N; i++) {
+		double center[3], jacobian_sum;
+		double radius2 = _adaptive_aggregate(3, N_TRIANGLE_QUAD, &position_buffer[i][0][0], jacobian_buffer[i], NULL, 0, center, &jacobian_sum);
+
+		a->x[i] = center[0];
+		a->y[i] = center[1];
+		a->z[i] = center[2];
+		a->w[i] = charges[i]*jacobian_sum;
+		a->single_distance2[i] = _adaptive_switch_distance2(radius2, tolerance);
+
+		double group_radius2 = 0.;
+
+		for(int g = 0; g < ADAPTIVE_GROUPS_3D; g++) {
+			group_radius2 = fmax(group_radius2,
+				_adaptive_aggregate(3, N_TRIANGLE_QUAD, &position_buffer[i][0][0], jacobian_buffer[i], group, g, a->groups[i][g], &jacobian_sum));
+			a->groups[i][g][3] = charges[i]*jacobian_sum;
+		}
+
+		a->group_distance2[i] = _adaptive_switch_distance2(group_radius2, tolerance);
+
+		for(int k = 0; k < N_TRIANGLE_QUAD; k++) {
+			for(int d = 0; d < 3; d++) a->points[i][k][d] = position_buffer[i][k][d];
+			a->points[i][k][3] = charges[i]*jacobian_buffer[i][k];
+		}
+	}
+
+	return a;
+}
+
+INLINE void
+_adaptive_add_point_3d(double point[3], double *p, double *potential, double field[3]) {
+	double dx = point[0] - p[0], dy = point[1] - p[1], dz = point[2] - p[2];
+	double inv_r = 1./norm_3d(dx, dy, dz);
+	double w_inv_r = p[3]*inv_r;
+	double w_inv_r3 = w_inv_r*inv_r*inv_r;
+
+	*potential += w_inv_r;
+	field[0] += w_inv_r3*dx;
+	field[1] += w_inv_r3*dy;
+	field[2] += w_inv_r3*dz;
+}
+
+void
+adaptive_charges_3d_potential_field(struct adaptive_charges_3d *a, double point[3], double *potential_out, double field_out[3]) {
+
+	double x0 = point[0], y0 = point[1], z0 = point[2];
+	double pot = 0., Ex = 0., Ey = 0., Ez = 0.;
+
+	// First the elements far enough away to use a single point charge. This loop
+	// has no branches, so that it can be vectorized by the compiler.
+	for(size_t i = 0; i < a->N; i++) {
+		double dx = x0 - a->x[i], dy = y0 - a->y[i], dz = z0 - a->z[i];
+		double r2 = dx*dx + dy*dy + dz*dz;
+		bool far = r2 >= a->single_distance2[i];
+
+		double w = far ? a->w[i] : 0.;
+		double inv_r = 1./sqrt(far ? r2 : 1.);
+		double w_inv_r = w*inv_r;
+		double w_inv_r3 = w_inv_r*inv_r*inv_r;
+
+		pot += w_inv_r;
+		Ex += w_inv_r3*dx;
+		Ey += w_inv_r3*dy;
+		Ez += w_inv_r3*dz;
+	}
+
+	double field[3] = {Ex, Ey, Ez};
+
+	// Then the elements closer by, using either the groups or the full quadrature rule
+	for(size_t i = 0; i < a->N; i++) {
+		double dx = x0 - a->x[i], dy = y0 - a->y[i], dz = z0 - a->z[i];
+		double r2 = dx*dx + dy*dy + dz*dz;
+
+		if(r2 >= a->single_distance2[i]) continue;
+
+		if(r2 >= a->group_distance2[i]) {
+			for(int g = 0; g < ADAPTIVE_GROUPS_3D; g++) _adaptive_add_point_3d(point, a->groups[i][g], &pot, field);
+		}
+		else {
+			for(int k = 0; k < N_TRIANGLE_QUAD; k++) _adaptive_add_point_3d(point, a->points[i][k], &pot, field);
+		}
+	}
+
+	if(potential_out != NULL) *potential_out = pot/(4*M_PI);
+
+	if(field_out != NULL) {
+		field_out[0] = field[0]/(4*M_PI);
+		field_out[1] = field[1]/(4*M_PI);
+		field_out[2] = field[2]/(4*M_PI);
+	}
+}
+
+EXPORT double
+adaptive_charges_3d_potential(struct adaptive_charges_3d *a, double point[3]) {
+	double potential;
+	adaptive_charges_3d_potential_field(a, point, &potential, NULL);
+	return potential;
+}
+
+EXPORT void
+adaptive_charges_3d_field(struct adaptive_charges_3d *a, double point[3], double result[3]) {
+	adaptive_charges_3d_potential_field(a, point, NULL, result);
+}
+
+struct adaptive_charges_radial {
+	size_t N; // Number of elements
+
+	double (*single)[3]; // Position (r, z) and weight of the single point charge (ring) per element
+	double *single_distance2;
+	double *group_distance2;
+
+	double (*groups)[ADAPTIVE_GROUPS_RADIAL][3];
+	double (*points)[N_QUAD_2D][3];
+};
+
+EXPORT void
+adaptive_charges_radial_free(struct adaptive_charges_radial *a) {
+	if(a == NULL) return;
+	free(a->single);
+	free(a->single_distance2);
+	free(a->groups);
+	free(a->points);
+	free(a);
+}
+
+INLINE double
+_adaptive_ring_charge(double charge, double weight_sum, double r) {
+	return r > 0. ? charge*weight_sum/r : 0.;
+}
+
+EXPORT struct adaptive_charges_radial*
+adaptive_charges_radial_build(double *charges, jacobian_buffer_2d jacobian_buffer, position_buffer_2d position_buffer, size_t N, double tolerance) {
+
+	struct adaptive_charges_radial *a = calloc(1, sizeof(struct adaptive_charges_radial));
+	if(a == NULL) return NULL;
+
+	a->N = N;
+	a->single = malloc((N > 0 ? N : 1)*sizeof *a->single);
+	a->single_distance2 = malloc(2*(N > 0 ? N : 1)*sizeof(double));
+	a->groups = malloc((N > 0 ? N : 1)*sizeof *a->groups);
+	a->points = malloc((N > 0 ? N : 1)*sizeof *a->points);
+
+	if(a->single == NULL || a->single_distance2 == NULL || a->groups == NULL || a->points == NULL) {
+		adaptive_charges_radial_free(a);
+		return NULL;
+	}
+
+	a->group_distance2 = a->single_distance2 + N;
+
+	int group[N_QUAD_2D];
+	for(int k = 0; k < N_QUAD_2D; k++) group[k] = _adaptive_group_radial(k);
+
+	for(size_t i = 0; i < N; i++) {
+		// The ring kernel is proportional to the radius of the ring. Aggregating with weights
+		// jacobian*r makes the first order error vanish (also close to the axis), the weight of the
+		// aggregated ring is then divided by the radius of the center again.
+		double ring_weights[N_QUAD_2D];
+		for(int k = 0; k < N_QUAD_2D; k++) ring_weights[k] = jacobian_buffer[i][k]*position_buffer[i][k][0];
+
+		double weight_sum;
+		double radius2 = _adaptive_aggregate(2, N_QUAD_2D, &position_buffer[i][0][0], ring_weights, NULL, 0, a->single[i], &weight_sum);
+		a->single[i][2] = _adaptive_ring_charge(charges[i], weight_sum, a->single[i][0]);
+		a->single_distance2[i] = _adaptive_switch_distance2(radius2, tolerance);
+
+		double group_radius2 = 0.;
+
+		for(int g = 0; g < ADAPTIVE_GROUPS_RADIAL; g++) {
+			group_radius2 = fmax(group_radius2,
+				_adaptive_aggregate(2, N_QUAD_2D, &position_buffer[i][0][0], ring_weights, group, g, a->groups[i][g], &weight_sum));
+			a->groups[i][g][2] = _adaptive_ring_charge(charges[i], weight_sum, a->groups[i][g][0]);
+		}
+
+		a->group_distance2[i] = _adaptive_switch_distance2(group_radius2, tolerance);
+
+		for(int k = 0; k < N_QUAD_2D; k++) {
+			a->points[i][k][0] = position_buffer[i][k][0];
+			a->points[i][k][1] = position_buffer[i][k][1];
+			a->points[i][k][2] = charges[i]*jacobian_buffer[i][k];
+		}
+	}
+
+	return a;
+}
+
+INLINE void
+_adaptive_add_ring(double r0, double z0, double *p, double *potential, double field[2], const struct elliptic_table *table) {
+	if(p[2] == 0.) return;
+
+	double ring_potential, ring_field[2];
+	potential_field_radial_ring(r0, z0, p[0], p[1], &ring_potential, field != NULL ? ring_field : NULL, table);
+
+	*potential += p[2]*ring_potential;
+
+	if(field != NULL) {
+		field[0] += p[2]*ring_field[0];
+		field[1] += p[2]*ring_field[1];
+	}
+}
+
+// Potential and field (radial and axial component) at (r0, z0). If field_out is NULL only the potential is computed.
+void
+adaptive_charges_radial_potential_field(struct adaptive_charges_radial *a, double r0, double z0,
+		double *potential_out, double field_out[2], const struct elliptic_table *table) {
+
+	double potential = 0.;
+	double field[2] = {0., 0.};
+	double *field_p = field_out != NULL ? field : NULL;
+
+	for(size_t i = 0; i < a->N; i++) {
+		double dr = r0 - a->single[i][0], dz = z0 - a->single[i][1];
+		double r2 = dr*dr + dz*dz;
+
+		if(r2 >= a->single_distance2[i]) {
+			_adaptive_add_ring(r0, z0, a->single[i], &potential, field_p, table);
+		}
+		else if(r2 >= a->group_distance2[i]) {
+			for(int g = 0; g < ADAPTIVE_GROUPS_RADIAL; g++) _adaptive_add_ring(r0, z0, a->groups[i][g], &potential, field_p, table);
+		}
+		else {
+			for(int k = 0; k < N_QUAD_2D; k++) _adaptive_add_ring(r0, z0, a->points[i][k], &potential, field_p, table);
+		}
+	}
+
+	if(potential_out != NULL) *potential_out = potential;
+
+	if(field_out != NULL) {
+		field_out[0] = field[0];
+		field_out[1] = field[1];
+	}
+}
+
+EXPORT double
+adaptive_charges_radial_potential(struct adaptive_charges_radial *a, double point[2], const struct elliptic_table *table) {
+	double potential;
+	adaptive_charges_radial_potential_field(a, point[0], point[1], &potential, NULL, table);
+	return potential;
+}
+
+// Same as field_radial, but using the adaptive quadrature
+EXPORT void
+adaptive_charges_radial_field(struct adaptive_charges_radial *a, double point[3], double result[3], const struct elliptic_table *table) {
+	double r = norm_2d(point[0], point[1]);
+
+	double field[2];
+	adaptive_charges_radial_potential_field(a, r, point[2], NULL, field, table);
+
+	if(r >= MIN_DISTANCE_AXIS) {
+		result[0] = point[0]/r * field[0];
+		result[1] = point[1]/r * field[0];
+	}
+	else {
+		result[0] = 0.;
+		result[1] = 0.;
+	}
+	result[2] = field[1];
+}
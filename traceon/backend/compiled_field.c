@@ -0,0 +1,433 @@
+// A field compiled into a form ready for evaluation. The effective point charges of a field are
+// converted once into flat arrays of source points with the charge already multiplied by the jacobian
+// (and quadrature weight), so that the repeated field evaluations (for example while tracing) do
+// not need to convert, copy or validate the input arrays again. The compiled field owns all its memory,
+// except for the (optional) elliptic table, which should outlive the compiled field.
+
+enum compiled_field_type {
+	COMPILED_FIELD_RADIAL = 0,
+	COMPILED_FIELD_3D = 1,
+	COMPILED_FIELD_RADIAL_AXIAL = 2,
+	COMPILED_FIELD_3D_AXIAL = 3
+};
+
+// Rings of charge, ring i is at radius r[i] and height z[i] and has weight w[i]
+struct radial_rings {
+	double *r;
+	double *z;
+	double *w;
+	size_t N;
+};
+
+struct compiled_field {
+	enum compiled_field_type type;
+
+	bool has_bounds;
+	double bounds[3][2]; // Outside the bounds the field is zero while tracing
+
+	// COMPILED_FIELD_RADIAL
+	struct radial_rings elec_rings;
+	struct radial_rings mag_rings;
+	struct radial_rings current_rings;
+	const struct elliptic_table *table;
+
+	// COMPILED_FIELD_3D
+	struct effective_point_charges_3d_soa elec_points;
+	struct effective_point_charges_3d_soa mag_points;
+
+	// COMPILED_FIELD_RADIAL_AXIAL and COMPILED_FIELD_3D_AXIAL
+	double *z;
+	double *elec_coeffs;
+	double *mag_coeffs;
+	size_t N_z;
+};
+
+static bool
+_radial_rings_allocate(struct radial_rings *rings, size_t N) {
+	// One allocation for all three arrays
+	double *buffer = malloc(3*(N > 0 ? N : 1)*sizeof(double));
+	if(buffer == NULL) return false;
+
+	rings->r = buffer;
+	rings->z = buffer + N;
+	rings->w = buffer + 2*N;
+	rings->N = N;
+	return true;
+}
+
+static bool
+_radial_rings_from_charges(struct effective_point_charges_2d *eff, struct radial_rings *rings) {
+	if(!_radial_rings_allocate(rings, eff->N*N_QUAD_2D)) return false;
+
+	for(size_t i = 0; i < eff->N; i++)
+	for(int k = 0; k < N_QUAD_2D; k++) {
+		size_t index = i*N_QUAD_2D + k;
+		rings->r[index] = eff->positions[i][k][0];
+		rings->z[index] = eff->positions[i][k][1];
+		rings->w[index] = eff->charges[i] * eff->jacobians[i][k];
+	}
+
+	return true;
+}
+
+// The current rings are stored as 3D effective point charges (in the xz-plane)
+static bool
+_radial_rings_from_currents(struct effective_point_charges_3d *eff, struct radial_rings *rings) {
+	if(!_radial_rings_allocate(rings, eff->N*N_TRIANGLE_QUAD)) return false;
+
+	for(size_t i = 0; i < eff->N; i++)
+	for(int k = 0; k < N_TRIANGLE_QUAD; k++) {
+		size_t index = i*N_TRIANGLE_QUAD + k;
+		rings->r[index] = eff->positions[i][k][0];
+		rings->z[index] = eff->positions[i][k][2];
+		rings->w[index] = eff->charges[i] * eff->jacobians[i][k];
+	}
+
+	return true;
+}
+
+static void
+_radial_rings_free(struct radial_rings *rings) {
+	free(rings->r);
+	rings->r = rings->z = rings->w = NULL;
+	rings->N = 0;
+}
+
+// Potential and field (radial and axial component) of the rings at (r0, z0).
+// If potential is NULL only the field is computed, if field is NULL only the potential.
+void
+radial_rings_potential_field(struct radial_rings *rings, double r0, double z0, double *potential, double field[2], const struct elliptic_table *table) {
+	double pot = 0., Er = 0., Ez = 0.;
+
+	for(size_t i = 0; i < rings->N; i++) {
+		double ring_potential, ring_field[2];
+		potential_field_radial_ring(r0, z0, rings->r[i], rings->z[i], potential != NULL ? &ring_potential : NULL, field != NULL ? ring_field : NULL, table);
+
+		if(potential != NULL) pot += rings->w[i] * ring_potential;
+
+		if(field != NULL) {
+			Er += rings->w[i] * ring_field[0];
+			Ez += rings->w[i] * ring_field[1];
+		}
+	}
+
+	if(potential != NULL) *potential = pot;
+
+	if(field != NULL) {
+		field[0] = Er;
+		field[1] = Ez;
+	}
+}
+
+// Convert the radial and axial component of a field at the 3D point to the x, y and z components
+INLINE void
+_radial_to_3d_field(double point[3], double r, double field_rz[2], double result[3]) {
+	if(r >= MIN_DISTANCE_AXIS) {
+		result[0] = point[0]/r * field_rz[0];
+		result[1] = point[1]/r * field_rz[0];
+	}
+	else {
+		result[0] = 0.;
+		result[1] = 0.;
+	}
+	result[2] = field_rz[1];
+}
+
+void
+_compiled_field_current_field(struct compiled_field *cf, double point[3], double result[3]) {
+	double r = norm_2d(point[0], point[1]);
+	double Br = 0., Bz = 0.;
+
+	for(size_t i = 0; i < cf->current_rings.N; i++) {
+		double field[2];
+		current_field_radial_ring(r, point[2], cf->current_rings.r[i], cf->current_rings.z[i], field);
+		Br += cf->current_rings.w[i] * field[0];
+		Bz += cf->current_rings.w[i] * field[1];
+	}
+
+	double field_rz[2] = {Br, Bz};
+	_radial_to_3d_field(point, r, field_rz, result);
+}
+
+EXPORT void
+compiled_field_free(struct compiled_field *cf) {
+	if(cf == NULL) return;
+
+	_radial_rings_free(&cf->elec_rings);
+	_radial_rings_free(&cf->mag_rings);
+	_radial_rings_free(&cf->current_rings);
+	free_effective_point_charges_3d_soa(&cf->elec_points);
+	free_effective_point_charges_3d_soa(&cf->mag_points);
+	free(cf->z);
+	free(cf->elec_coeffs);
+	free(cf->mag_coeffs);
+	free(cf);
+}
+
+static struct compiled_field *
+_compiled_field_new(enum compiled_field_type type, double *bounds) {
+	struct compiled_field *cf = calloc(1, sizeof(struct compiled_field));
+	if(cf == NULL) return NULL;
+
+	cf->type = type;
+	cf->has_bounds = bounds != NULL;
+	if(bounds != NULL) memcpy(cf->bounds, bounds, sizeof cf->bounds);
+
+	return cf;
+}
+
+EXPORT struct compiled_field *
+compiled_field_radial_build(struct effective_point_charges_2d eff_elec, struct effective_point_charges_2d eff_mag,
+		struct effective_point_charges_3d eff_current, const struct elliptic_table *table, double *bounds) {
+
+	struct compiled_field *cf = _compiled_field_new(COMPILED_FIELD_RADIAL, bounds);
+	if(cf == NULL) return NULL;
+
+	cf->table = table;
+
+	if(!_radial_rings_from_charges(&eff_elec, &cf->elec_rings)
+			|| !_radial_rings_from_charges(&eff_mag, &cf->mag_rings)
+			|| !_radial_rings_from_currents(&eff_current, &cf->current_rings)) {
+		compiled_field_free(cf);
+		return NULL;
+	}
+
+	return cf;
+}
+
+EXPORT struct compiled_field *
+compiled_field_3d_build(struct effective_point_charges_3d eff_elec, struct effective_point_charges_3d eff_mag, double *bounds) {
+
+	struct compiled_field *cf = _compiled_field_new(COMPILED_FIELD_3D, bounds);
+	if(cf == NULL) return NULL;
+
+	if(!effective_point_charges_3d_to_soa(&eff_elec, &cf->elec_points)
+			|| !effective_point_charges_3d_to_soa(&eff_mag, &cf->mag_points)) {
+		compiled_field_free(cf);
+		return NULL;
+	}
+
+	return cf;
+}
+
+// Axial fields, the coefficients are copied. For radial symmetric fields the coefficients of one
+// interval are DERIV_2D_MAX*6 values, for 3D fields 2*NU_MAX*M_MAX*4 values.
+EXPORT struct compiled_field *
+compiled_field_axial_build(int three_d, double *z, double *elec_coeffs, double *mag_coeffs, size_t N_z) {
+
+	struct compiled_field *cf = _compiled_field_new(three_d ? COMPILED_FIELD_3D_AXIAL : COMPILED_FIELD_RADIAL_AXIAL, NULL);
+	if(cf == NULL) return NULL;
+
+	size_t N_coeffs = (N_z - 1) * (three_d ? 2*NU_MAX*M_MAX*4 : DERIV_2D_MAX*6);
+
+	cf->N_z = N_z;
+	cf->z = malloc(N_z*sizeof(double));
+	cf->elec_coeffs = malloc(N_coeffs*sizeof(double));
+	cf->mag_coeffs = malloc(N_coeffs*sizeof(double));
+
+	if(cf->z == NULL || cf->elec_coeffs == NULL || cf->mag_coeffs == NULL) {
+		compiled_field_free(cf);
+		return NULL;
+	}
+
+	memcpy(cf->z, z, N_z*sizeof(double));
+	memcpy(cf->elec_coeffs, elec_coeffs, N_coeffs*sizeof(double));
+	memcpy(cf->mag_coeffs, mag_coeffs, N_coeffs*sizeof(double));
+
+	return cf;
+}
+
+// Potential and field of either the electrostatic (magnetic = false) or magnetostatic (magnetic = true) part
+// of the field at the 3D point. For radial symmetric fields the field of the currents is included in the
+// magnetostatic field, but not in the magnetostatic potential. Either potential or field may be NULL.
+void
+compiled_field_potential_field(struct compiled_field *cf, bool magnetic, double point[3], double *potential, double field[3]) {
+
+	switch(cf->type) {
+		case COMPILED_FIELD_RADIAL: {
+			double r = norm_2d(point[0], point[1]);
+			double field_rz[2];
+
+			radial_rings_potential_field(magnetic ? &cf->mag_rings : &cf->elec_rings, r, point[2],
+				potential, field != NULL ? field_rz : NULL, cf->table);
+
+			if(field != NULL) {
+				_radial_to_3d_field(point, r, field_rz, field);
+
+				if(magnetic && cf->current_rings.N > 0) {
+					double current_field[3];
+					_compiled_field_current_field(cf, point, current_field);
+					for(int i = 0; i < 3; i++) field[i] += current_field[i];
+				}
+			}
+			break;
+		}
+		case COMPILED_FIELD_3D: {
+			double pot, f[3];
+			potential_field_3d_soa(point, magnetic ? &cf->mag_points : &cf->elec_points, &pot, f);
+
+			if(potential != NULL) *potential = pot;
+			if(field != NULL) for(int i = 0; i < 3; i++) field[i] = f[i];
+			break;
+		}
+		case COMPILED_FIELD_RADIAL_AXIAL: {
+			double *coeffs = magnetic ? cf->mag_coeffs : cf->elec_coeffs;
+
+			if(potential != NULL) {
+				double point_rz[2] = {norm_2d(point[0], point[1]), point[2]};
+				*potential = potential_radial_derivs(point_rz, cf->z, coeffs, cf->N_z);
+			}
+			if(field != NULL) field_radial_derivs(point, field, cf->z, coeffs, cf->N_z);
+			break;
+		}
+		case COMPILED_FIELD_3D_AXIAL: {
+			double *coeffs = magnetic ? cf->mag_coeffs : cf->elec_coeffs;
+
+			if(potential != NULL) *potential = potential_3d_derivs(point, cf->z, coeffs, cf->N_z);
+			if(field != NULL) field_3d_derivs(point, field, cf->z, coeffs, cf->N_z);
+			break;
+		}
+	}
+}
+
+EXPORT double
+compiled_field_potential(struct compiled_field *cf, bool magnetic, double point[3]) {
+	double potential;
+	compiled_field_potential_field(cf, magnetic, point, &potential, NULL);
+	return potential;
+}
+
+EXPORT void
+compiled_field_field(struct compiled_field *cf, bool magnetic, double point[3], double result[3]) {
+	compiled_field_potential_field(cf, magnetic, point, NULL, result);
+}
+
+// Evaluation of many points at once (see compiled_field_evaluate). The points are split into blocks of
+// EVALUATE_TARGET_BLOCK points, which are handed out to the threads. Every block loops over the source points in
+// blocks of EVALUATE_SOURCE_BLOCK points, such that a block of sources (four arrays of doubles) stays in the
+// cache while it is used for all the points in the target block.
+#define EVALUATE_TARGET_BLOCK 64
+#define EVALUATE_SOURCE_BLOCK 1024
+
+struct _compiled_field_evaluate_args {
+	struct compiled_field *cf;
+	bool magnetic;
+	double (*points)[3];
+	double *potentials;
+	double (*fields)[3];
+};
+
+static void
+_compiled_field_evaluate_range(void *args_p, size_t start, size_t end, int thread_index) {
+	struct _compiled_field_evaluate_args *args = (struct _compiled_field_evaluate_args*) args_p;
+	struct compiled_field *cf = args->cf;
+
+	if(cf->type == COMPILED_FIELD_RADIAL_AXIAL || cf->type == COMPILED_FIELD_3D_AXIAL) {
+		for(size_t i = start; i < end; i++)
+			compiled_field_potential_field(cf, args->magnetic, args->points[i],
+				args->potentials != NULL ? &args->potentials[i] : NULL, args->fields != NULL ? args->fields[i] : NULL);
+		return;
+	}
+
+	bool radial = cf->type == COMPILED_FIELD_RADIAL;
+	struct radial_rings *rings = args->magnetic ? &cf->mag_rings : &cf->elec_rings;
+	struct effective_point_charges_3d_soa *soa = args->magnetic ? &cf->mag_points : &cf->elec_points;
+	size_t N_sources = radial ? rings->N : soa->N;
+
+	// For radial symmetric fields the accumulated field is the (r, z) component
+	double potential[EVALUATE_TARGET_BLOCK];
+	double field[EVALUATE_TARGET_BLOCK][3];
+
+	for(size_t t0 = start; t0 < end; t0 += EVALUATE_TARGET_BLOCK) {
+		size_t t1 = t0 + EVALUATE_TARGET_BLOCK < end ? t0 + EVALUATE_TARGET_BLOCK : end;
+
+		memset(potential, 0, sizeof potential);
+		memset(field, 0, sizeof field);
+
+		for(size_t s0 = 0; s0 < N_sources; s0 += EVALUATE_SOURCE_BLOCK) {
+			size_t s1 = s0 + EVALUATE_SOURCE_BLOCK < N_sources ? s0 + EVALUATE_SOURCE_BLOCK : N_sources;
+
+			for(size_t t = t0; t < t1; t++) {
+				double *point = args->points[t];
+				double block_potential = 0., block_field[3] = {0., 0., 0.};
+
+				if(radial) {
+					struct radial_rings block = {rings->r + s0, rings->z + s0, rings->w + s0, s1 - s0};
+					radial_rings_potential_field(&block, norm_2d(point[0], point[1]), point[2],
+						args->potentials != NULL ? &block_potential : NULL, args->fields != NULL ? block_field : NULL, cf->table);
+				}
+				else {
+					struct effective_point_charges_3d_soa block = {soa->x + s0, soa->y + s0, soa->z + s0, soa->w + s0, s1 - s0};
+					potential_field_3d_soa(point, &block, &block_potential, block_field);
+				}
+
+				potential[t - t0] += block_potential;
+				for(int k = 0; k < 3; k++) field[t - t0][k] += block_field[k];
+			}
+		}
+
+		for(size_t t = t0; t < t1; t++) {
+			if(args->potentials != NULL) args->potentials[t] = potential[t - t0];
+
+			if(args->fields == NULL) continue;
+
+			if(radial) {
+				double *point = args->points[t];
+				_radial_to_3d_field(point, norm_2d(point[0], point[1]), field[t - t0], args->fields[t]);
+
+				if(args->magnetic && cf->current_rings.N > 0) {
+					double current_field[3];
+					_compiled_field_current_field(cf, point, current_field);
+					for(int k = 0; k < 3; k++) args->fields[t][k] += current_field[k];
+				}
+			}
+			else {
+				for(int k = 0; k < 3; k++) args->fields[t][k] = field[t - t0][k];
+			}
+		}
+	}
+}
+
+// Potential and field (see compiled_field_potential_field) at N points, given as an (N, 3) array. The
+// potentials (N values) and fields (an (N, 3) array) are written to the output arrays, either of which may be NULL.
+EXPORT void
+compiled_field_evaluate(struct compiled_field *cf, bool magnetic, double *points, size_t N, double *potentials, double *fields, int N_threads) {
+	struct _compiled_field_evaluate_args args = {cf, magnetic, (double (*)[3]) points, potentials, (double (*)[3]) fields};
+	parallel_for(N, EVALUATE_TARGET_BLOCK, _compiled_field_evaluate_range, &args, N_threads);
+}
+
+void
+compiled_field_traceable(double point[6], double result[3], void *args_p) {
+	struct compiled_field *cf = (struct compiled_field*) args_p;
+
+	// Radial symmetric fields have no bounds in the y direction
+	int N_bounds = cf->type == COMPILED_FIELD_RADIAL ? 2 : 3;
+
+	if(cf->has_bounds) {
+		for(int i = 0; i < N_bounds; i++) {
+			if(!(cf->bounds[i][0] < point[i] && point[i] < cf->bounds[i][1])) {
+				result[0] = 0.;
+				result[1] = 0.;
+				result[2] = 0.;
+				return;
+			}
+		}
+	}
+
+	double elec_field[3], mag_field[3];
+	double curr_field[3] = {0., 0., 0.};
+
+	compiled_field_potential_field(cf, false, point, NULL, elec_field);
+	compiled_field_potential_field(cf, true, point, NULL, mag_field);
+
+	combine_elec_magnetic_field(point + 3, elec_field, mag_field, curr_field, result);
+}
+
+EXPORT bool
+trace_particles_compiled(double *initial_states, size_t N_particles, size_t *offsets, double **times_out, double **positions_out,
+		double tracer_bounds[3][2], double atol, int method, double *plane, size_t decimation, double spacing,
+		struct compiled_field *cf, int N_threads) {
+
+	return trace_particles(initial_states, N_particles, offsets, times_out, positions_out,
+		compiled_field_traceable, tracer_bounds, atol, method, plane, decimation, spacing, (void*) cf, N_threads);
+}
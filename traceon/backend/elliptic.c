@@ -6,66 +6,80 @@
 // Augmented with the tricks shown on the Scipy documentation for ellipe and ellipk.
 // https://docs.scipy.org/doc/scipy/reference/generated/scipy.special.ellipkm1.html#scipy.special.ellipkm1
 
-EXPORT double ellipkm1(double p) {
-	double A[] = {log(4.0),
-			9.65736020516771e-2,
-			3.08909633861795e-2,
-			1.52618320622534e-2,
-			1.25565693543211e-2,
-			1.68695685967517e-2,
-			1.09423810688623e-2,
-			1.40704915496101e-3};
-	
-	double B[] = {1.0/2.0,
-			1.24999998585309e-1,
-			7.03114105853296e-2,
-			4.87379510945218e-2,
-			3.57218443007327e-2,
-			2.09857677336790e-2,
-			5.81807961871996e-3,
-			3.42805719229748e-4};
-	
-	double L = log(1./p);
-	double sum_ = 0.0;
+// Coefficients of the approximations K(1-p) = A(p) + log(1/p)B(p) and
+// E(1-p) = C(p) + log(1/p)D(p), where A, B, C and D are polynomials of degree 7.
+static const double ELLIPK_A[] = {1.38629436111989061883, // log(4)
+		9.65736020516771e-2,
+		3.08909633861795e-2,
+		1.52618320622534e-2,
+		1.25565693543211e-2,
+		1.68695685967517e-2,
+		1.09423810688623e-2,
+		1.40704915496101e-3};
+
+static const double ELLIPK_B[] = {1.0/2.0,
+		1.24999998585309e-1,
+		7.03114105853296e-2,
+		4.87379510945218e-2,
+		3.57218443007327e-2,
+		2.09857677336790e-2,
+		5.81807961871996e-3,
+		3.42805719229748e-4};
+
+static const double ELLIPE_C[] = {1,
+		4.43147193467733e-1,
+		5.68115681053803e-2,
+		2.21862206993846e-2,
+		1.56847700239786e-2,
+		1.92284389022977e-2,
+		1.21819481486695e-2,
+		1.55618744745296e-3};
+
+static const double ELLIPE_D[] = {0,
+		2.49999998448655e-1,
+		9.37488062098189e-2,
+		5.84950297066166e-2,
+		4.09074821593164e-2,
+		2.35091602564984e-2,
+		6.45682247315060e-3,
+		3.78886487349367e-4};
 
-	for(int i = 0; i < 8; i++)
-		sum_ += (A[i] + L*B[i])*pow(p, i);
+// Evaluate a polynomial of degree 7 using Horner's scheme
+INLINE double
+_elliptic_polynomial(const double coeffs[8], double p) {
+	double sum_ = coeffs[7];
+	
+	for(int i = 6; i >= 0; i--)
+		sum_ = sum_*p + coeffs[i];
 	
 	return sum_;
 }
 
+EXPORT double ellipkm1(double p) {
+	double L = log(1./p);
+	return _elliptic_polynomial(ELLIPK_A, p) + L*_elliptic_polynomial(ELLIPK_B, p);
+}
+
 EXPORT double ellipk(double k) {
-	if(k > -1) return ellipkm1(1-k);
+	if(k >= 0) return ellipkm1(1-k);
 	
-	return ellipkm1(1./(1-k))/sqrt(k);
+	// Imaginary modulus transformation, K(k) = K(-k/(1-k))/sqrt(1-k), keeps the
+	// argument of ellipkm1 in (0, 1] where the approximation is accurate.
+	return ellipkm1(1./(1-k))/sqrt(1-k);
 }
 
 EXPORT double ellipem1(double p) {
-	double A[] = {1,
-        4.43147193467733e-1,
-        5.68115681053803e-2,
-        2.21862206993846e-2,
-        1.56847700239786e-2,
-        1.92284389022977e-2,
-        1.21819481486695e-2,
-        1.55618744745296e-3};
-
-    double B[] = {0,
-        2.49999998448655e-1,
-        9.37488062098189e-2,
-        5.84950297066166e-2,
-        4.09074821593164e-2,
-        2.35091602564984e-2,
-        6.45682247315060e-3,
-        3.78886487349367e-4};
-	
 	double L = log(1./p);
-	double sum_ = 0.0;
+	return _elliptic_polynomial(ELLIPE_C, p) + L*_elliptic_polynomial(ELLIPE_D, p);
+}
 
-	for(int i = 0; i < 8; i++)
-		sum_ += (A[i] + L*B[i])*pow(p, i);
-		
-	return sum_;
+// Compute ellipkm1(p) and ellipem1(p) together, which
+// is cheaper since the logarithm is only computed once.
+INLINE void
+ellipkem1(double p, double *K, double *E) {
+	double L = log(1./p);
+	*K = _elliptic_polynomial(ELLIPK_A, p) + L*_elliptic_polynomial(ELLIPK_B, p);
+	*E = _elliptic_polynomial(ELLIPE_C, p) + L*_elliptic_polynomial(ELLIPE_D, p);
 }
 
 EXPORT double ellipe(double k) {
@@ -75,3 +89,270 @@ EXPORT double ellipe(double k) {
 }
 
 
+
+// Array versions, computing K and E together for N arguments. The logarithms are computed first for a
+// block of arguments, after which the polynomials are evaluated in a loop without function calls, which
+// the compiler vectorizes.
+#define ELLIPTIC_BLOCK_SIZE 64
+
+static void
+_ellipkem1_block(const double *restrict p, const double *restrict L, double *restrict K, double *restrict E, size_t N) {
+	for(size_t i = 0; i < N; i++) {
+		K[i] = _elliptic_polynomial(ELLIPK_A, p[i]) + L[i]*_elliptic_polynomial(ELLIPK_B, p[i]);
+		E[i] = _elliptic_polynomial(ELLIPE_C, p[i]) + L[i]*_elliptic_polynomial(ELLIPE_D, p[i]);
+	}
+}
+
+// K[i] = ellipkm1(p[i]) and E[i] = ellipem1(p[i])
+EXPORT void
+ellipkem1_array(double *p, double *K, double *E, size_t N) {
+	double L[ELLIPTIC_BLOCK_SIZE];
+	
+	for(size_t start = 0; start < N; start += ELLIPTIC_BLOCK_SIZE) {
+		size_t M = N - start < ELLIPTIC_BLOCK_SIZE ? N - start : ELLIPTIC_BLOCK_SIZE;
+		
+		for(size_t i = 0; i < M; i++) L[i] = log(1./p[start + i]);
+		
+		_ellipkem1_block(p + start, L, K + start, E + start, M);
+	}
+}
+
+// K[i] = ellipk(k[i]) and E[i] = ellipe(k[i])
+EXPORT void
+ellipke_array(double *k, double *K, double *E, size_t N) {
+	double p[ELLIPTIC_BLOCK_SIZE], L[ELLIPTIC_BLOCK_SIZE], scale[ELLIPTIC_BLOCK_SIZE];
+	
+	for(size_t start = 0; start < N; start += ELLIPTIC_BLOCK_SIZE) {
+		size_t M = N - start < ELLIPTIC_BLOCK_SIZE ? N - start : ELLIPTIC_BLOCK_SIZE;
+		
+		// Same transformations as ellipk and ellipe
+		for(size_t i = 0; i < M; i++) {
+			double k_ = k[start + i];
+			p[i] = k_ >= 0 ? 1 - k_ : 1./(1 - k_);
+			scale[i] = k_ >= 0 ? 1. : sqrt(1 - k_);
+			L[i] = log(1./p[i]);
+		}
+		
+		_ellipkem1_block(p, L, K + start, E + start, M);
+		
+		for(size_t i = 0; i < M; i++) {
+			K[start + i] /= scale[i];
+			E[start + i] *= scale[i];
+		}
+	}
+}
+
+// Tabulated ellipkm1 and ellipem1, used to speed up the evaluation of the Green's function of a ring
+// of charge (see radial_ring.c). All the transcendental work of the Green's function is in K(1-t) and E(1-t),
+// where t = (dr^2 + dz^2)/((r + r0)^2 + dz^2) is the normalized distance between the ring and the
+// evaluation point. The other factors are algebraic.
+//
+// The interval t in [2^-ELLIPTIC_TABLE_OCTAVES, 1] is divided in octaves [2^-(j+1), 2^-j], every octave is
+// divided into a number of equal segments. On every segment K and E are interpolated by a polynomial (through the
+// Chebyshev points of the segment), which is evaluated using Horner's scheme. Finding the segment is cheap, since the
+// octave follows from the exponent of t. When the table is built the degree and number of segments are chosen such
+// that the relative error (checked on a dense set of points in every segment) is below the requested tolerance.
+// Close to the logarithmic singularity (t < 2^-ELLIPTIC_TABLE_OCTAVES) the exact formula is used.
+
+#define ELLIPTIC_TABLE_OCTAVES 40
+#define ELLIPTIC_TABLE_MAX_DEGREE 15
+#define ELLIPTIC_TABLE_MAX_SEGMENTS 16
+#define ELLIPTIC_TABLE_CHECK_POINTS 64
+
+struct elliptic_table {
+	double tolerance;
+	double max_error; // Largest relative error found while checking the table
+	int degree;
+	int segments; // Number of segments per octave, always a power of two
+	int log2_segments;
+	
+	// Coefficients of K and E for every segment (interleaved), in terms of the local coordinate x in [-1, 1]
+	double (*coefficients)[ELLIPTIC_TABLE_MAX_DEGREE+1][2];
+};
+
+// Evaluate the polynomials of the given segment at local coordinate x. If E is NULL only K is computed.
+INLINE void
+_elliptic_table_evaluate(const struct elliptic_table *table, size_t segment, double x, double *K, double *E) {
+	const double (*c)[2] = table->coefficients[segment];
+	
+	// K and E are evaluated in the same loop, which keeps the two (independent) Horner schemes in flight together
+	double K_sum = c[table->degree][0], E_sum = c[table->degree][1];
+	
+	for(int i = table->degree-1; i >= 0; i--) {
+		K_sum = K_sum*x + c[i][0];
+		E_sum = E_sum*x + c[i][1];
+	}
+	
+	*K = K_sum;
+	if(E != NULL) *E = E_sum;
+}
+
+// Find the segment containing t and the local coordinate x in [-1, 1], t should satisfy 2^-ELLIPTIC_TABLE_OCTAVES <= t <= 1.
+// Since the number of segments per octave is a power of two, the octave and segment follow directly from
+// the exponent and the leading bits of the mantissa of t.
+INLINE size_t
+_elliptic_table_segment(const struct elliptic_table *table, double t, double *x) {
+	uint64_t bits;
+	memcpy(&bits, &t, sizeof(double));
+	
+	int octave = 1022 - (int) (bits >> 52); // t in [0.5, 1) has biased exponent 1022
+	uint64_t mantissa = bits & 0xFFFFFFFFFFFFFull;
+	
+	if(octave < 0) { // t == 1
+		octave = 0;
+		mantissa = 0xFFFFFFFFFFFFFull;
+	}
+	
+	size_t segment = (size_t) (mantissa >> (52 - table->log2_segments));
+	
+	// Remaining bits of the mantissa give the position in the segment, as a double y in [1, 2)
+	uint64_t y_bits = ((mantissa << table->log2_segments) & 0xFFFFFFFFFFFFFull) | (1023ull << 52);
+	double y;
+	memcpy(&y, &y_bits, sizeof(double));
+	
+	*x = 2*y - 3;
+	
+	return ((size_t) octave << table->log2_segments) + segment;
+}
+
+// Same as ellipkem1(t, K, E), but using the table. If table is NULL the exact formula is used.
+// If E is NULL only K is computed.
+INLINE void
+elliptic_table_ellipkem1(const struct elliptic_table *table, double t, double *K, double *E) {
+	
+	if(table == NULL || !(t >= ldexp(1., -ELLIPTIC_TABLE_OCTAVES)) || t > 1.) {
+		if(E == NULL) *K = ellipkm1(t);
+		else ellipkem1(t, K, E);
+		return;
+	}
+	
+	double x;
+	size_t segment = _elliptic_table_segment(table, t, &x);
+	
+	_elliptic_table_evaluate(table, segment, x, K, E);
+}
+
+// Compute the monomial coefficients (in x in [-1, 1]) of the polynomial of the given degree interpolating f at the
+// Chebyshev points. First the Chebyshev coefficients are computed, which are then converted to monomial coefficients.
+static void
+_chebyshev_interpolation(const double *values, int degree, double coeffs[][2], int component) {
+	int n = degree + 1;
+	double cheb[ELLIPTIC_TABLE_MAX_DEGREE+1];
+	
+	for(int j = 0; j < n; j++) {
+		double sum_ = 0.;
+		for(int k = 0; k < n; k++) sum_ += values[k] * cos(M_PI * j * (k + 0.5) / n);
+		cheb[j] = (j == 0 ? 1. : 2.) * sum_ / n;
+	}
+	
+	// Monomial coefficients of T_{j-1}, T_j (recurrence T_{j+1} = 2x T_j - T_{j-1})
+	double T_prev[ELLIPTIC_TABLE_MAX_DEGREE+1] = {0.}, T[ELLIPTIC_TABLE_MAX_DEGREE+1] = {0.}, T_next[ELLIPTIC_TABLE_MAX_DEGREE+1];
+	T_prev[0] = 1.;
+	T[1] = 1.;
+	
+	for(int i = 0; i <= degree; i++) coeffs[i][component] = 0.;
+	
+	coeffs[0][component] += cheb[0];
+	
+	for(int j = 1; j < n; j++) {
+		for(int i = 0; i <= degree; i++) coeffs[i][component] += cheb[j] * T[i];
+		
+		for(int i = 0; i <= degree; i++) T_next[i] = (i > 0 ? 2*T[i-1] : 0.) - T_prev[i];
+		for(int i = 0; i <= degree; i++) { T_prev[i] = T[i]; T[i] = T_next[i]; }
+	}
+}
+
+// Fill the table with the given degree and number of segments. Returns the largest relative error
+// found when comparing the table with the exact formula.
+static double
+_elliptic_table_fill(struct elliptic_table *table, int degree, int segments) {
+	table->degree = degree;
+	table->segments = segments;
+	table->log2_segments = 0;
+	while((1 << table->log2_segments) < segments) table->log2_segments++;
+	
+	double max_error = 0.;
+	
+	for(int octave = 0; octave < ELLIPTIC_TABLE_OCTAVES; octave++)
+	for(int s = 0; s < segments; s++) {
+		size_t index = (size_t) octave * segments + s;
+		
+		// Segment is [start, start + width] in t
+		double start = ldexp(0.5 + 0.5*s/segments, -octave);
+		double width = ldexp(0.5/segments, -octave);
+		
+		double K_values[ELLIPTIC_TABLE_MAX_DEGREE+1], E_values[ELLIPTIC_TABLE_MAX_DEGREE+1];
+		
+		for(int k = 0; k <= degree; k++) {
+			double x = cos(M_PI * (k + 0.5) / (degree + 1));
+			ellipkem1(start + (x + 1)/2 * width, &K_values[k], &E_values[k]);
+		}
+		
+		_chebyshev_interpolation(K_values, degree, table->coefficients[index], 0);
+		_chebyshev_interpolation(E_values, degree, table->coefficients[index], 1);
+		
+		// Check the error, including the end points of the segment
+		for(int k = 0; k <= ELLIPTIC_TABLE_CHECK_POINTS; k++) {
+			double x = -1. + 2.*k / ELLIPTIC_TABLE_CHECK_POINTS;
+			
+			double K_exact, E_exact;
+			ellipkem1(start + (x + 1)/2 * width, &K_exact, &E_exact);
+			
+			double K, E;
+			_elliptic_table_evaluate(table, index, x, &K, &E);
+			
+			max_error = fmax(max_error, fabs(K - K_exact)/fabs(K_exact));
+			max_error = fmax(max_error, fabs(E - E_exact)/fabs(E_exact));
+		}
+	}
+	
+	return max_error;
+}
+
+EXPORT void
+elliptic_table_free(struct elliptic_table *table) {
+	if(table == NULL) return;
+	free(table->coefficients);
+	free(table);
+}
+
+// Build a table with a relative error smaller than tolerance. The cheapest table (lowest degree) satisfying
+// the tolerance is chosen, using at most ELLIPTIC_TABLE_MAX_SEGMENTS segments per octave. Returns NULL if
+// the tolerance cannot be reached (or when out of memory).
+EXPORT struct elliptic_table*
+elliptic_table_build(double tolerance) {
+	
+	struct elliptic_table *table = calloc(1, sizeof(struct elliptic_table));
+	if(table == NULL) return NULL;
+	
+	table->tolerance = tolerance;
+	table->coefficients = malloc((size_t) ELLIPTIC_TABLE_OCTAVES * ELLIPTIC_TABLE_MAX_SEGMENTS * sizeof(*table->coefficients));
+	
+	if(table->coefficients == NULL) {
+		free(table);
+		return NULL;
+	}
+	
+	for(int degree = 3; degree <= ELLIPTIC_TABLE_MAX_DEGREE; degree++)
+	for(int segments = 1; segments <= ELLIPTIC_TABLE_MAX_SEGMENTS; segments *= 2) {
+		double error = _elliptic_table_fill(table, degree, segments);
+		
+		if(error <= tolerance) {
+			table->max_error = error;
+			return table;
+		}
+	}
+	
+	elliptic_table_free(table);
+	return NULL;
+}
+
+EXPORT double
+elliptic_table_max_error(const struct elliptic_table *table) {
+	return table->max_error;
+}
+
+EXPORT void
+elliptic_table_ellipkem1_array(const struct elliptic_table *table, double *p, double *K, double *E, size_t N) {
+	for(size_t i = 0; i < N; i++) elliptic_table_ellipkem1(table, p[i], &K[i], &E[i]);
+}
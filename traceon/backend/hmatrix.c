@@ -0,0 +1,603 @@
+// Hierarchical matrix (H-matrix) approximation of the BEM matrix.
+//
+// The elements are clustered in a binary tree (by recursively splitting the bounding box
+// along its longest side). Every block of the matrix that couples two clusters which are
+// far apart compared to their size (the block is 'admissible') is numerically low rank,
+// since the kernel is smooth there. Such a block is compressed using adaptive cross approximation
+// (ACA), which only needs to compute a few rows and columns of the block. The remaining (inadmissible)
+// blocks near the diagonal are stored densely. Both memory use and the cost of a matrix-vector
+// product then scale close to O(N log N) instead of O(N^2).
+//
+// The system is solved using GMRES (see iterative.c), with the inverse of the dense diagonal
+// blocks as (block Jacobi) preconditioner.
+//
+// The matrix entries are computed using bem_operator_entry, so the compressed matrix
+// approximates exactly the matrix that would be filled by fill_matrix_3d or fill_matrix_radial.
+
+#define HMATRIX_LEAF_SIZE 32
+// A block is admissible if min(diameter row cluster, diameter column cluster) < eta * distance between the clusters
+#define HMATRIX_ETA 1.0
+
+struct hmatrix_cluster {
+	size_t start, end; // Range in the permutation array
+	double min[3], max[3]; // Bounding box of the elements in the cluster
+	int32_t children[2]; // -1 if leaf
+};
+
+struct hmatrix_block {
+	int32_t row_cluster, column_cluster;
+	bool low_rank;
+	size_t rank;
+	double *U; // Low rank: block = sum_k U_k V_k^T, where U_k is U[k*rows : (k+1)*rows]
+	double *V; // and V_k is V[k*columns : (k+1)*columns]
+	double *dense; // Dense: row major storage
+	double *lu; // Diagonal blocks only: LU factorization of the block and its pivots
+	size_t *pivots;
+};
+
+struct hmatrix {
+	size_t N;
+	int N_threads;
+	double tolerance;
+
+	struct bem_operator *op; // Used to compute the matrix entries
+
+	size_t *permutation; // Cluster order to original index of the element
+
+	struct hmatrix_cluster *clusters;
+	size_t N_clusters;
+
+	struct hmatrix_block *blocks;
+	size_t N_blocks;
+	size_t blocks_capacity;
+
+	double *y_buffers; // Per thread buffer used in the matrix-vector product
+};
+
+EXPORT void
+hmatrix_free(struct hmatrix *h) {
+	if(h == NULL) return;
+
+	for(size_t i = 0; i < h->N_blocks; i++) {
+		free(h->blocks[i].U);
+		free(h->blocks[i].V);
+		free(h->blocks[i].dense);
+		free(h->blocks[i].lu);
+		free(h->blocks[i].pivots);
+	}
+
+	bem_operator_free(h->op);
+	free(h->permutation);
+	free(h->clusters);
+	free(h->blocks);
+	free(h->y_buffers);
+	free(h);
+}
+
+// LU factorization with partial pivoting of a dense (row major) n x n matrix, in place.
+// Returns false if the matrix is singular.
+bool
+lu_factor(double *A, size_t n, size_t *pivots) {
+	for(size_t k = 0; k < n; k++) {
+		size_t p = k;
+		for(size_t i = k+1; i < n; i++)
+			if(fabs(A[i*n + k]) > fabs(A[p*n + k])) p = i;
+
+		pivots[k] = p;
+		if(A[p*n + k] == 0.) return false;
+
+		if(p != k) {
+			for(size_t j = 0; j < n; j++) {
+				double tmp = A[k*n + j];
+				A[k*n + j] = A[p*n + j];
+				A[p*n + j] = tmp;
+			}
+		}
+
+		for(size_t i = k+1; i < n; i++) {
+			double factor = (A[i*n + k] /= A[k*n + k]);
+			for(size_t j = k+1; j < n; j++) A[i*n + j] -= factor*A[k*n + j];
+		}
+	}
+
+	return true;
+}
+
+// Solve A x = b in place, given the factorization computed by lu_factor
+void
+lu_solve(double *LU, size_t n, size_t *pivots, double *b) {
+	for(size_t k = 0; k < n; k++) {
+		size_t p = pivots[k];
+		if(p != k) {
+			double tmp = b[k]; b[k] = b[p]; b[p] = tmp;
+		}
+	}
+
+	for(size_t i = 0; i < n; i++)
+		for(size_t j = 0; j < i; j++) b[i] -= LU[i*n + j]*b[j];
+
+	for(size_t i = n; i-- > 0;) {
+		for(size_t j = i+1; j < n; j++) b[i] -= LU[i*n + j]*b[j];
+		b[i] /= LU[i*n + i];
+	}
+}
+
+struct _hmatrix_sort_key {
+	double key;
+	size_t index;
+};
+
+static int
+_hmatrix_compare_keys(const void *a, const void *b) {
+	double ka = ((struct _hmatrix_sort_key*) a)->key, kb = ((struct _hmatrix_sort_key*) b)->key;
+	return (ka > kb) - (ka < kb);
+}
+
+static int32_t
+_hmatrix_build_cluster(struct hmatrix *h, size_t start, size_t end, double (*element_min)[3], double (*element_max)[3],
+		struct _hmatrix_sort_key *keys) {
+
+	int32_t index = (int32_t) h->N_clusters++;
+	struct hmatrix_cluster *c = &h->clusters[index];
+
+	c->start = start;
+	c->end = end;
+	c->children[0] = c->children[1] = -1;
+
+	for(int k = 0; k < 3; k++) {
+		c->min[k] = INFINITY;
+		c->max[k] = -INFINITY;
+	}
+
+	for(size_t i = start; i < end; i++) {
+		size_t e = h->permutation[i];
+		for(int k = 0; k < 3; k++) {
+			c->min[k] = fmin(c->min[k], element_min[e][k]);
+			c->max[k] = fmax(c->max[k], element_max[e][k]);
+		}
+	}
+
+	if(end - start <= HMATRIX_LEAF_SIZE) return index;
+
+	int axis = 0;
+	for(int k = 1; k < 3; k++)
+		if(c->max[k] - c->min[k] > c->max[axis] - c->min[axis]) axis = k;
+
+	// Split at the median of the element centers
+	for(size_t i = start; i < end; i++) {
+		keys[i].key = h->op->targets[h->permutation[i]][axis];
+		keys[i].index = h->permutation[i];
+	}
+
+	qsort(keys + start, end - start, sizeof(struct _hmatrix_sort_key), _hmatrix_compare_keys);
+
+	for(size_t i = start; i < end; i++) h->permutation[i] = keys[i].index;
+
+	size_t middle = start + (end - start)/2;
+
+	int32_t left = _hmatrix_build_cluster(h, start, middle, element_min, element_max, keys);
+	int32_t right = _hmatrix_build_cluster(h, middle, end, element_min, element_max, keys);
+
+	h->clusters[index].children[0] = left;
+	h->clusters[index].children[1] = right;
+
+	return index;
+}
+
+static double
+_hmatrix_diameter(struct hmatrix_cluster *c) {
+	return norm_3d(c->max[0]-c->min[0], c->max[1]-c->min[1], c->max[2]-c->min[2]);
+}
+
+static double
+_hmatrix_distance(struct hmatrix_cluster *a, struct hmatrix_cluster *b) {
+	double d[3];
+	for(int k = 0; k < 3; k++)
+		d[k] = fmax(0., fmax(a->min[k] - b->max[k], b->min[k] - a->max[k]));
+	return norm_3d(d[0], d[1], d[2]);
+}
+
+static bool
+_hmatrix_add_block(struct hmatrix *h, int32_t row_cluster, int32_t column_cluster, bool low_rank) {
+	if(h->N_blocks == h->blocks_capacity) {
+		size_t capacity = h->blocks_capacity == 0 ? 64 : 2*h->blocks_capacity;
+		struct hmatrix_block *blocks = realloc(h->blocks, capacity*sizeof(struct hmatrix_block));
+		if(blocks == NULL) return false;
+		h->blocks = blocks;
+		h->blocks_capacity = capacity;
+	}
+
+	struct hmatrix_block b = {row_cluster, column_cluster, low_rank, 0, NULL, NULL, NULL, NULL, NULL};
+	h->blocks[h->N_blocks++] = b;
+	return true;
+}
+
+static bool
+_hmatrix_build_blocks(struct hmatrix *h, int32_t t, int32_t s) {
+	struct hmatrix_cluster *ct = &h->clusters[t], *cs = &h->clusters[s];
+
+	double distance = _hmatrix_distance(ct, cs);
+
+	if(distance > 0. && fmin(_hmatrix_diameter(ct), _hmatrix_diameter(cs)) < HMATRIX_ETA*distance)
+		return _hmatrix_add_block(h, t, s, true);
+
+	bool t_leaf = ct->children[0] < 0, s_leaf = cs->children[0] < 0;
+
+	if(t_leaf || s_leaf)
+		return _hmatrix_add_block(h, t, s, false);
+
+	for(int i = 0; i < 2; i++)
+	for(int j = 0; j < 2; j++)
+		if(!_hmatrix_build_blocks(h, h->clusters[t].children[i], h->clusters[s].children[j])) return false;
+
+	return true;
+}
+
+static bool
+_hmatrix_fill_dense(struct hmatrix *h, struct hmatrix_block *b, size_t *rows, size_t m, size_t *columns, size_t n) {
+	b->low_rank = false;
+	b->rank = 0;
+	b->dense = malloc(m*n*sizeof(double));
+	if(b->dense == NULL) return false;
+
+	for(size_t i = 0; i < m; i++)
+	for(size_t j = 0; j < n; j++)
+		b->dense[i*n + j] = bem_operator_entry(h->op, rows[i], columns[j]);
+
+	if(b->row_cluster == b->column_cluster) {
+		b->lu = malloc(m*m*sizeof(double));
+		b->pivots = malloc(m*sizeof(size_t));
+		if(b->lu == NULL || b->pivots == NULL) return false;
+
+		memcpy(b->lu, b->dense, m*m*sizeof(double));
+
+		if(!lu_factor(b->lu, m, b->pivots)) {
+			// Singular diagonal block, should not happen for a valid geometry. Use identity
+			// as preconditioner for this block.
+			for(size_t i = 0; i < m; i++) {
+				b->pivots[i] = i;
+				for(size_t j = 0; j < m; j++) b->lu[i*m + j] = i == j;
+			}
+		}
+	}
+
+	return true;
+}
+
+// Adaptive cross approximation with partial pivoting. Falls back to a dense block if
+// the rank needed for the given tolerance is so high that compression saves no memory.
+static bool
+_hmatrix_fill_aca(struct hmatrix *h, struct hmatrix_block *b, size_t *rows, size_t m, size_t *columns, size_t n) {
+	size_t max_rank = (m*n)/(m+n);
+
+	double *U = malloc(max_rank*m*sizeof(double));
+	double *V = malloc(max_rank*n*sizeof(double));
+	bool *used_rows = calloc(m, sizeof(bool));
+
+	if(U == NULL || V == NULL || used_rows == NULL) {
+		free(U); free(V); free(used_rows);
+		return false;
+	}
+
+	size_t rank = 0, pivot_row = 0;
+	double norm2 = 0.; // Frobenius norm squared of the approximation
+	bool converged = false;
+
+	while(rank < max_rank) {
+		double *u = U + rank*m, *v = V + rank*n;
+
+		// Residual of the pivot row
+		used_rows[pivot_row] = true;
+
+		for(size_t j = 0; j < n; j++) {
+			v[j] = bem_operator_entry(h->op, rows[pivot_row], columns[j]);
+			for(size_t k = 0; k < rank; k++) v[j] -= U[k*m + pivot_row]*V[k*n + j];
+		}
+
+		size_t pivot_column = 0;
+		for(size_t j = 1; j < n; j++)
+			if(fabs(v[j]) > fabs(v[pivot_column])) pivot_column = j;
+
+		if(v[pivot_column] == 0.) {
+			// Row is already exactly represented, try another row
+			size_t next = 0;
+			while(next < m && used_rows[next]) next++;
+
+			if(next == m) {
+				converged = true;
+				break;
+			}
+
+			pivot_row = next;
+			continue;
+		}
+
+		double pivot = v[pivot_column];
+		for(size_t j = 0; j < n; j++) v[j] /= pivot;
+
+		for(size_t i = 0; i < m; i++) {
+			u[i] = bem_operator_entry(h->op, rows[i], columns[pivot_column]);
+			for(size_t k = 0; k < rank; k++) u[i] -= U[k*m + i]*V[k*n + pivot_column];
+		}
+
+		double u_norm = _vector_norm(u, m), v_norm = _vector_norm(v, n);
+
+		norm2 += u_norm*u_norm*v_norm*v_norm;
+		for(size_t k = 0; k < rank; k++)
+			norm2 += 2*_vector_dot(U + k*m, u, m)*_vector_dot(V + k*n, v, n);
+
+		rank++;
+
+		if(u_norm*v_norm <= h->tolerance*sqrt(fabs(norm2))) {
+			converged = true;
+			break;
+		}
+
+		// Next pivot row is the largest entry of u in the unused rows
+		bool found = false;
+		for(size_t i = 0; i < m; i++) {
+			if(used_rows[i]) continue;
+			if(!found || fabs(u[i]) > fabs(u[pivot_row])) pivot_row = i;
+			found = true;
+		}
+
+		if(!found) {
+			converged = true;
+			break;
+		}
+	}
+
+	free(used_rows);
+
+	if(!converged) {
+		free(U);
+		free(V);
+		return _hmatrix_fill_dense(h, b, rows, m, columns, n);
+	}
+
+	b->low_rank = true;
+	b->rank = rank;
+	b->U = U;
+	b->V = V;
+
+	return true;
+}
+
+struct _hmatrix_threads_args {
+	struct hmatrix *h;
+	size_t next_block;
+	bool failed;
+
+	double *x;
+};
+
+static void
+_hmatrix_fill_blocks(void *args_p, int thread_index) {
+	struct _hmatrix_threads_args *args = args_p;
+	struct hmatrix *h = args->h;
+
+	size_t i;
+	while( (i = atomic_fetch_increment(&args->next_block, 1)) < h->N_blocks ) {
+		struct hmatrix_block *b = &h->blocks[i];
+		struct hmatrix_cluster *t = &h->clusters[b->row_cluster], *s = &h->clusters[b->column_cluster];
+
+		size_t *rows = h->permutation + t->start, *columns = h->permutation + s->start;
+		size_t m = t->end - t->start, n = s->end - s->start;
+
+		bool success = b->low_rank ? _hmatrix_fill_aca(h, b, rows, m, columns, n) : _hmatrix_fill_dense(h, b, rows, m, columns, n);
+
+		if(!success) atomic_set_flag(&args->failed);
+	}
+}
+
+static struct hmatrix*
+_hmatrix_build(struct bem_operator *op, double (*element_min)[3], double (*element_max)[3], double tolerance) {
+
+	struct hmatrix *h = calloc(1, sizeof(struct hmatrix));
+
+	if(h == NULL) {
+		bem_operator_free(op);
+		return NULL;
+	}
+
+	h->op = op;
+	h->N = op->N;
+	h->N_threads = op->N_threads;
+	h->tolerance = tolerance;
+
+	size_t N = h->N;
+
+	// A binary tree with leaves of at least one element has less than 2N nodes
+	h->permutation = malloc(N*sizeof(size_t));
+	h->clusters = malloc(2*N*sizeof(struct hmatrix_cluster));
+	h->y_buffers = malloc(h->N_threads*N*sizeof(double));
+	struct _hmatrix_sort_key *keys = malloc(N*sizeof(struct _hmatrix_sort_key));
+
+	bool success = h->permutation != NULL && h->clusters != NULL && h->y_buffers != NULL && keys != NULL;
+
+	if(success) {
+		for(size_t i = 0; i < N; i++) h->permutation[i] = i;
+		_hmatrix_build_cluster(h, 0, N, element_min, element_max, keys);
+		success = _hmatrix_build_blocks(h, 0, 0);
+	}
+
+	free(keys);
+
+	if(success) {
+		struct _hmatrix_threads_args args = {h, 0, false, NULL};
+		run_threads(_hmatrix_fill_blocks, &args, h->N_threads);
+		success = !args.failed;
+	}
+
+	if(!success) {
+		hmatrix_free(h);
+		return NULL;
+	}
+
+	return h;
+}
+
+EXPORT struct hmatrix*
+hmatrix_3d_build(vertices_3d triangles, uint8_t *excitation_types, double *excitation_values,
+		jacobian_buffer_3d jacobian_buffer, position_buffer_3d pos_buffer, size_t N, double tolerance, int N_threads) {
+
+	if(N == 0) return NULL;
+
+	struct bem_operator *op = bem_operator_3d_setup(triangles, excitation_types, excitation_values, jacobian_buffer, pos_buffer, N, N_threads);
+	double (*element_min)[3] = malloc(N*sizeof(double[3]));
+	double (*element_max)[3] = malloc(N*sizeof(double[3]));
+
+	if(op == NULL || element_min == NULL || element_max == NULL) {
+		bem_operator_free(op);
+		free(element_min);
+		free(element_max);
+		return NULL;
+	}
+
+	for(size_t i = 0; i < N; i++)
+	for(int k = 0; k < 3; k++) {
+		element_min[i][k] = fmin(fmin(triangles[i][0][k], triangles[i][1][k]), triangles[i][2][k]);
+		element_max[i][k] = fmax(fmax(triangles[i][0][k], triangles[i][1][k]), triangles[i][2][k]);
+	}
+
+	struct hmatrix *h = _hmatrix_build(op, element_min, element_max, tolerance);
+
+	free(element_min);
+	free(element_max);
+	return h;
+}
+
+EXPORT struct hmatrix*
+hmatrix_radial_build(vertices_2d line_points, uint8_t *excitation_types, double *excitation_values,
+		jacobian_buffer_2d jacobian_buffer, position_buffer_2d pos_buffer, double *self_terms, size_t N, double tolerance, int N_threads) {
+
+	if(N == 0) return NULL;
+
+	struct bem_operator *op = bem_operator_radial_setup(line_points, excitation_types, excitation_values, jacobian_buffer, pos_buffer, self_terms, N, N_threads);
+	double (*element_min)[3] = malloc(N*sizeof(double[3]));
+	double (*element_max)[3] = malloc(N*sizeof(double[3]));
+
+	if(op == NULL || element_min == NULL || element_max == NULL) {
+		bem_operator_free(op);
+		free(element_min);
+		free(element_max);
+		return NULL;
+	}
+
+	// Clustering is done in the (r, z) plane
+	for(size_t i = 0; i < N; i++) {
+		element_min[i][0] = element_max[i][0] = line_points[i][0][0];
+		element_min[i][1] = element_max[i][1] = line_points[i][0][2];
+		element_min[i][2] = element_max[i][2] = 0.;
+
+		for(int p = 1; p < 4; p++) {
+			element_min[i][0] = fmin(element_min[i][0], line_points[i][p][0]);
+			element_max[i][0] = fmax(element_max[i][0], line_points[i][p][0]);
+			element_min[i][1] = fmin(element_min[i][1], line_points[i][p][2]);
+			element_max[i][1] = fmax(element_max[i][1], line_points[i][p][2]);
+		}
+	}
+
+	struct hmatrix *h = _hmatrix_build(op, element_min, element_max, tolerance);
+
+	free(element_min);
+	free(element_max);
+	return h;
+}
+
+static void
+_hmatrix_matvec_blocks(void *args_p, int thread_index) {
+	struct _hmatrix_threads_args *args = args_p;
+	struct hmatrix *h = args->h;
+	double *x = args->x;
+	double *y = h->y_buffers + thread_index*h->N;
+
+	for(size_t i = 0; i < h->N; i++) y[i] = 0.;
+
+	size_t index;
+	while( (index = atomic_fetch_increment(&args->next_block, 1)) < h->N_blocks ) {
+		struct hmatrix_block *b = &h->blocks[index];
+		struct hmatrix_cluster *t = &h->clusters[b->row_cluster], *s = &h->clusters[b->column_cluster];
+
+		size_t *rows = h->permutation + t->start, *columns = h->permutation + s->start;
+		size_t m = t->end - t->start, n = s->end - s->start;
+
+		if(b->low_rank) {
+			for(size_t k = 0; k < b->rank; k++) {
+				double *u = b->U + k*m, *v = b->V + k*n;
+
+				double dot = 0.;
+				for(size_t j = 0; j < n; j++) dot += v[j]*x[columns[j]];
+				for(size_t i = 0; i < m; i++) y[rows[i]] += u[i]*dot;
+			}
+		}
+		else {
+			for(size_t i = 0; i < m; i++) {
+				double sum = 0.;
+				for(size_t j = 0; j < n; j++) sum += b->dense[i*n + j]*x[columns[j]];
+				y[rows[i]] += sum;
+			}
+		}
+	}
+}
+
+// Compute y = A x, where A is the compressed matrix
+EXPORT void
+hmatrix_matvec(struct hmatrix *h, double *x, double *y) {
+	struct _hmatrix_threads_args args = {h, 0, false, x};
+	int N_threads = h->N_threads > 0 ? h->N_threads : 1;
+	run_threads(_hmatrix_matvec_blocks, &args, N_threads);
+
+	for(size_t i = 0; i < h->N; i++) {
+		y[i] = 0.;
+		for(int t = 0; t < N_threads; t++) y[i] += h->y_buffers[t*h->N + i];
+	}
+}
+
+static void
+_hmatrix_matvec_map(void *h, double *x, double *y) {
+	hmatrix_matvec((struct hmatrix*) h, x, y);
+}
+
+// Block Jacobi preconditioner, using the LU factorization of the diagonal blocks
+static void
+_hmatrix_block_jacobi(void *h_p, double *x, double *y) {
+	struct hmatrix *h = h_p;
+	double buffer[HMATRIX_LEAF_SIZE];
+
+	for(size_t index = 0; index < h->N_blocks; index++) {
+		struct hmatrix_block *b = &h->blocks[index];
+		if(b->lu == NULL) continue;
+
+		struct hmatrix_cluster *t = &h->clusters[b->row_cluster];
+		size_t *rows = h->permutation + t->start;
+		size_t m = t->end - t->start;
+
+		for(size_t i = 0; i < m; i++) buffer[i] = x[rows[i]];
+		lu_solve(b->lu, m, b->pivots, buffer);
+		for(size_t i = 0; i < m; i++) y[rows[i]] = buffer[i];
+	}
+}
+
+// Solve the system using GMRES, with the inverse of the diagonal blocks as preconditioner. See gmres.
+EXPORT int
+hmatrix_gmres(struct hmatrix *h, double *b, double *x, double tolerance, int restart, int max_iterations, double *residual_out) {
+	return gmres(h->N, _hmatrix_matvec_map, h, _hmatrix_block_jacobi, h, b, x, tolerance, restart, max_iterations, residual_out);
+}
+
+// Number of bytes used to store the blocks of the matrix
+EXPORT size_t
+hmatrix_memory(struct hmatrix *h) {
+	size_t doubles = 0;
+
+	for(size_t i = 0; i < h->N_blocks; i++) {
+		struct hmatrix_block *b = &h->blocks[i];
+		size_t m = h->clusters[b->row_cluster].end - h->clusters[b->row_cluster].start;
+		size_t n = h->clusters[b->column_cluster].end - h->clusters[b->column_cluster].start;
+
+		doubles += b->low_rank ? b->rank*(m + n) : m*n;
+		if(b->lu != NULL) doubles += m*m;
+	}
+
+	return doubles*sizeof(double);
+}
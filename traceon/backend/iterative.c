@@ -0,0 +1,654 @@
+// Matrix-free solution of the BEM equations using restarted GMRES.
+//
+// Instead of storing the dense N x N matrix, the matrix-vector product is computed
+// on the fly. Every row of the matrix is the sum of:
+//
+//   - A 'far field' part, which is simply the quadrature rule applied to every element
+//     (the same as used for the far field entries when filling the matrix). Since the
+//     quadrature points of all elements are stored as point charges this is exactly
+//     the kernel used for field evaluations.
+//   - A sparse 'near field' correction for the elements close to the target. The correction
+//     is the difference between the accurate value (as computed by fill_matrix_3d, using
+//     potential_triangle/flux_triangle) and the quadrature approximation. These are
+//     computed once, when the operator is built.
+//
+// Therefore the product of the operator with a vector equals the product of the matrix
+// (as filled by fill_matrix_3d or fill_matrix_radial) with the vector, but the memory
+// use is only O(N). The work per matrix-vector product is still O(N^2). In the radial symmetric case
+// the far field part can instead be computed using a tree code (see radial_tree.c), which reduces the work
+// to O(N log N) at the cost of a small approximation error (see bem_operator_radial_use_tree).
+//
+// The operator supports all row types: rows where the potential is fixed (VOLTAGE_FIXED,
+// VOLTAGE_FUN, MAGNETOSTATIC_POT) and rows where the flux through the element is constrained (DIELECTRIC, MAGNETIZABLE).
+
+#define GMRES_DEFAULT_RESTART 100
+
+struct bem_operator {
+	size_t N;
+	bool three_d;
+	int N_threads;
+
+	// Vertices of the triangles (3D only)
+	double (*triangles)[3][3];
+
+	// Per row: the target point, the normal at the target, whether the row constrains
+	// the flux (instead of the potential) and the factor multiplying the flux.
+	double (*targets)[3];
+	double (*normals)[3];
+	bool *flux_rows;
+	double *flux_factors;
+
+	// Quadrature points of all elements. The weights (w) are set to the jacobian
+	// times the current value of the charge before every matrix-vector product.
+	struct effective_point_charges_3d_soa points;
+	double *jacobians;
+
+	// Near field corrections, in compressed sparse row format
+	size_t *near_start;
+	size_t *near_columns;
+	double *near_values;
+
+	// Diagonal of the matrix, used as (Jacobi) preconditioner
+	double *diagonal;
+
+	// Tree used to compute the far field part (radial symmetric only), NULL for direct summation
+	struct radial_tree *tree;
+};
+
+EXPORT void
+bem_operator_free(struct bem_operator *op) {
+	if(op == NULL) return;
+
+	free(op->triangles);
+	free(op->targets);
+	free(op->normals);
+	free(op->flux_rows);
+	free(op->flux_factors);
+	free_effective_point_charges_3d_soa(&op->points);
+	free(op->jacobians);
+	free(op->near_start);
+	free(op->near_columns);
+	free(op->near_values);
+	free(op->diagonal);
+	radial_tree_free(op->tree);
+	free(op);
+}
+
+static struct bem_operator*
+_bem_operator_allocate(size_t N, int N_quad, bool three_d, int N_threads) {
+	struct bem_operator *op = calloc(1, sizeof(struct bem_operator));
+	if(op == NULL) return NULL;
+
+	op->N = N;
+	op->three_d = three_d;
+	op->N_threads = N_threads > 0 ? N_threads : number_of_threads();
+
+	op->triangles = three_d ? malloc(N*sizeof(double[3][3])) : NULL;
+	op->targets = malloc(N*sizeof(double[3]));
+	op->normals = malloc(N*sizeof(double[3]));
+	op->flux_rows = malloc(N*sizeof(bool));
+	op->flux_factors = malloc(N*sizeof(double));
+	op->jacobians = malloc(N*N_quad*sizeof(double));
+	op->near_start = calloc(N+1, sizeof(size_t));
+	op->diagonal = malloc(N*sizeof(double));
+
+	// Use a (single) allocation compatible with free_effective_point_charges_3d_soa
+	double *buffer = malloc(4*N*N_quad*sizeof(double));
+
+	if(buffer != NULL) {
+		op->points.x = buffer;
+		op->points.y = buffer + N*N_quad;
+		op->points.z = buffer + 2*N*N_quad;
+		op->points.w = buffer + 3*N*N_quad;
+		op->points.N = N*N_quad;
+	}
+
+	if((three_d && op->triangles == NULL) || op->targets == NULL || op->normals == NULL || op->flux_rows == NULL || op->flux_factors == NULL || op->jacobians == NULL
+			|| op->near_start == NULL || op->diagonal == NULL || buffer == NULL) {
+		bem_operator_free(op);
+		return NULL;
+	}
+
+	return op;
+}
+
+static bool
+_bem_operator_allocate_near(struct bem_operator *op) {
+	// near_start contains the number of entries per row, convert to offsets
+	size_t total = 0;
+
+	for(size_t i = 0; i < op->N; i++) {
+		size_t count = op->near_start[i];
+		op->near_start[i] = total;
+		total += count;
+	}
+	op->near_start[op->N] = total;
+
+	op->near_columns = malloc(total*sizeof(size_t));
+	op->near_values = malloc(total*sizeof(double));
+
+	return op->near_columns != NULL && op->near_values != NULL;
+}
+
+// Contribution of a unit point charge (3D) or ring (radial) at (x, y, z) to the given row
+INLINE double
+_bem_operator_kernel(struct bem_operator *op, size_t row, double x, double y, double z) {
+	double *t = op->targets[row];
+	double *normal = op->normals[row];
+
+	if(op->three_d && !op->flux_rows[row])
+		return potential_3d_point(t[0], t[1], t[2], x, y, z, NULL);
+	else if(op->three_d)
+		return op->flux_factors[row] * field_dot_normal_3d(t[0], t[1], t[2], x, y, z, normal);
+	else if(!op->flux_rows[row])
+		return potential_radial_ring(t[0], t[1], x, y, NULL);
+	else {
+		double field[2];
+		potential_field_radial_ring(t[0], t[1], x, y, NULL, field, NULL);
+		return op->flux_factors[row] * (normal[0]*field[0] + normal[1]*field[1]);
+	}
+}
+
+// Value of the matrix at (row, column) using only the quadrature rule
+static double
+_bem_operator_quadrature(struct bem_operator *op, size_t row, size_t column) {
+	int N_quad = op->three_d ? N_TRIANGLE_QUAD : N_QUAD_2D;
+	double sum = 0.;
+
+	for(int k = 0; k < N_quad; k++) {
+		size_t index = column*N_quad + k;
+		sum += op->jacobians[index] * _bem_operator_kernel(op, row, op->points.x[index], op->points.y[index], op->points.z[index]);
+	}
+
+	return sum;
+}
+
+// Same criterion as used in fill_matrix_3d to decide whether the more accurate
+// integration over the triangle is needed
+INLINE bool
+_bem_operator_is_near_3d(struct bem_operator *op, size_t row, size_t column) {
+	double (*t)[3] = op->triangles[column];
+	return row == column || distance_3d(t[0], op->targets[row]) <= 5*distance_3d(t[0], t[1]);
+}
+
+// Value of the matrix at (row, column), equal to the value computed by fill_matrix_3d
+// or fill_matrix_radial (including the self terms).
+double
+bem_operator_entry(struct bem_operator *op, size_t row, size_t column) {
+
+	if(!op->three_d)
+		return row == column ? op->diagonal[row] : _bem_operator_quadrature(op, row, column);
+
+	if(!_bem_operator_is_near_3d(op, row, column))
+		return _bem_operator_quadrature(op, row, column);
+
+	double (*t)[3] = op->triangles[column];
+
+	if(!op->flux_rows[row])
+		return potential_triangle(t[0], t[1], t[2], op->targets[row]) / (4*M_PI);
+	else if(row == column)
+		return -1.0;
+	else
+		return op->flux_factors[row] * flux_triangle(t[0], t[1], t[2], op->targets[row], op->normals[row]) / (4*M_PI);
+}
+
+struct _bem_operator_rows_args {
+	struct bem_operator *op;
+	size_t next_row;
+
+	double *x;
+	double *y;
+};
+
+#define BEM_OPERATOR_CHUNK_SIZE 16
+
+// Count the number of near field entries for every row
+static void
+_bem_operator_count_near(void *args_p, int thread_index) {
+	struct _bem_operator_rows_args *args = args_p;
+	struct bem_operator *op = args->op;
+
+	size_t start;
+	while( (start = atomic_fetch_increment(&args->next_row, BEM_OPERATOR_CHUNK_SIZE)) < op->N ) {
+		size_t end = start + BEM_OPERATOR_CHUNK_SIZE < op->N ? start + BEM_OPERATOR_CHUNK_SIZE : op->N;
+
+		for(size_t i = start; i < end; i++) {
+			// In the radial symmetric case only the self term is computed more accurately
+			size_t count = op->three_d ? 0 : 1;
+
+			if(op->three_d) {
+				for(size_t j = 0; j < op->N; j++)
+					if(_bem_operator_is_near_3d(op, i, j)) count++;
+			}
+
+			op->near_start[i] = count;
+		}
+	}
+}
+
+static void
+_bem_operator_fill_near(void *args_p, int thread_index) {
+	struct _bem_operator_rows_args *args = args_p;
+	struct bem_operator *op = args->op;
+
+	size_t start;
+	while( (start = atomic_fetch_increment(&args->next_row, BEM_OPERATOR_CHUNK_SIZE)) < op->N ) {
+		size_t end = start + BEM_OPERATOR_CHUNK_SIZE < op->N ? start + BEM_OPERATOR_CHUNK_SIZE : op->N;
+
+		for(size_t i = start; i < end; i++) {
+			size_t index = op->near_start[i];
+
+			// In the radial symmetric case only the self term is needed
+			size_t j_start = op->three_d ? 0 : i;
+			size_t j_end = op->three_d ? op->N : i+1;
+
+			for(size_t j = j_start; j < j_end; j++) {
+				if(op->three_d && !_bem_operator_is_near_3d(op, i, j)) continue;
+
+				double exact = bem_operator_entry(op, i, j);
+				if(i == j) op->diagonal[i] = exact;
+
+				op->near_columns[index] = j;
+				op->near_values[index] = exact - _bem_operator_quadrature(op, i, j);
+				index++;
+			}
+		}
+	}
+}
+
+static struct bem_operator*
+_bem_operator_near_field(struct bem_operator *op) {
+	if(op == NULL) return NULL;
+
+	struct _bem_operator_rows_args args = {op, 0, NULL, NULL};
+	run_threads(_bem_operator_count_near, &args, op->N_threads);
+
+	if(!_bem_operator_allocate_near(op)) {
+		bem_operator_free(op);
+		return NULL;
+	}
+
+	args.next_row = 0;
+	run_threads(_bem_operator_fill_near, &args, op->N_threads);
+
+	return op;
+}
+
+// Setup of the operator, without computing the near field corrections. Can be used to compute
+// individual matrix entries using bem_operator_entry. In the radial symmetric case the self terms
+// are passed in, since they are computed by the solver.
+struct bem_operator*
+bem_operator_3d_setup(vertices_3d triangles, uint8_t *excitation_types, double *excitation_values,
+		jacobian_buffer_3d jacobian_buffer, position_buffer_3d pos_buffer, size_t N, int N_threads) {
+
+	struct bem_operator *op = _bem_operator_allocate(N, N_TRIANGLE_QUAD, true, N_threads);
+	if(op == NULL) return NULL;
+
+	memcpy(op->triangles, triangles, N*sizeof(double[3][3]));
+
+	for(size_t i = 0; i < N; i++) {
+		double jac;
+		position_and_jacobian_3d(1/3., 1/3., &triangles[i][0], op->targets[i], &jac);
+		normal_3d(1/3., 1/3., &triangles[i][0], op->normals[i]);
+
+		enum ExcitationType type_ = excitation_types[i];
+		op->flux_rows[i] = type_ == DIELECTRIC || type_ == MAGNETIZABLE;
+		op->flux_factors[i] = op->flux_rows[i] ? flux_density_to_charge_factor(excitation_values[i]) : 0.;
+		op->diagonal[i] = 0.;
+
+		for(int k = 0; k < N_TRIANGLE_QUAD; k++) {
+			size_t index = i*N_TRIANGLE_QUAD + k;
+			op->jacobians[index] = jacobian_buffer[i][k];
+			op->points.x[index] = pos_buffer[i][k][0];
+			op->points.y[index] = pos_buffer[i][k][1];
+			op->points.z[index] = pos_buffer[i][k][2];
+		}
+	}
+
+	return op;
+}
+
+struct bem_operator*
+bem_operator_radial_setup(vertices_2d line_points, uint8_t *excitation_types, double *excitation_values,
+		jacobian_buffer_2d jacobian_buffer, position_buffer_2d pos_buffer, double *self_terms, size_t N, int N_threads) {
+
+	struct bem_operator *op = _bem_operator_allocate(N, N_QUAD_2D, false, N_threads);
+	if(op == NULL) return NULL;
+
+	for(size_t i = 0; i < N; i++) {
+		double *v1 = &line_points[i][0][0];
+		double *v2 = &line_points[i][2][0];
+		double *v3 = &line_points[i][3][0];
+		double *v4 = &line_points[i][1][0];
+
+		double jac;
+		position_and_jacobian_radial(0.0, v1, v2, v3, v4, op->targets[i], &jac);
+		higher_order_normal_radial(0.0, v1, v2, v3, v4, op->normals[i]);
+		op->targets[i][2] = 0.;
+		op->normals[i][2] = 0.;
+
+		enum ExcitationType type_ = excitation_types[i];
+		op->flux_rows[i] = type_ == DIELECTRIC || type_ == MAGNETIZABLE;
+		op->flux_factors[i] = op->flux_rows[i] ? flux_density_to_charge_factor(excitation_values[i]) : 0.;
+		op->diagonal[i] = self_terms[i];
+
+		for(int k = 0; k < N_QUAD_2D; k++) {
+			size_t index = i*N_QUAD_2D + k;
+			op->jacobians[index] = jacobian_buffer[i][k];
+			op->points.x[index] = pos_buffer[i][k][0];
+			op->points.y[index] = pos_buffer[i][k][1];
+			op->points.z[index] = 0.;
+		}
+	}
+
+	return op;
+}
+
+EXPORT struct bem_operator*
+bem_operator_3d_build(vertices_3d triangles, uint8_t *excitation_types, double *excitation_values,
+		jacobian_buffer_3d jacobian_buffer, position_buffer_3d pos_buffer, size_t N, int N_threads) {
+	return _bem_operator_near_field(bem_operator_3d_setup(triangles, excitation_types, excitation_values, jacobian_buffer, pos_buffer, N, N_threads));
+}
+
+EXPORT struct bem_operator*
+bem_operator_radial_build(vertices_2d line_points, uint8_t *excitation_types, double *excitation_values,
+		jacobian_buffer_2d jacobian_buffer, position_buffer_2d pos_buffer, double *self_terms, size_t N, int N_threads) {
+	return _bem_operator_near_field(bem_operator_radial_setup(line_points, excitation_types, excitation_values, jacobian_buffer, pos_buffer, self_terms, N, N_threads));
+}
+
+// Compute the far field part of the matrix-vector products of a radial symmetric operator using a tree code
+// with opening angle theta (see radial_tree.c), instead of direct summation. Returns false if not enough memory is available.
+EXPORT bool
+bem_operator_radial_use_tree(struct bem_operator *op, double theta) {
+	assert(!op->three_d);
+
+	struct radial_tree *tree = radial_tree_build_rings(op->points.x, op->points.y, op->points.N, theta);
+	if(tree == NULL) return false;
+
+	radial_tree_free(op->tree);
+	op->tree = tree;
+	return true;
+}
+
+static void
+_bem_operator_matvec_rows(void *args_p, int thread_index) {
+	struct _bem_operator_rows_args *args = args_p;
+	struct bem_operator *op = args->op;
+
+	size_t start;
+	while( (start = atomic_fetch_increment(&args->next_row, BEM_OPERATOR_CHUNK_SIZE)) < op->N ) {
+		size_t end = start + BEM_OPERATOR_CHUNK_SIZE < op->N ? start + BEM_OPERATOR_CHUNK_SIZE : op->N;
+
+		for(size_t i = start; i < end; i++) {
+			double *target = op->targets[i];
+			double sum = 0.;
+
+			if(op->three_d) {
+				double potential, field[3];
+				potential_field_3d_soa(target, &op->points, &potential, field);
+				sum = op->flux_rows[i] ? op->flux_factors[i]*dot_3d(op->normals[i], field) : potential;
+			}
+			else if(op->tree != NULL) {
+				double potential, field[2];
+				radial_tree_potential_field(op->tree, target[0], target[1], &potential, op->flux_rows[i] ? field : NULL);
+				sum = op->flux_rows[i] ? op->flux_factors[i]*(op->normals[i][0]*field[0] + op->normals[i][1]*field[1]) : potential;
+			}
+			else {
+				double *w = op->points.w;
+
+				for(size_t j = 0; j < op->points.N; j++)
+					if(w[j] != 0.) sum += w[j] * _bem_operator_kernel(op, i, op->points.x[j], op->points.y[j], 0.);
+			}
+
+			for(size_t n = op->near_start[i]; n < op->near_start[i+1]; n++)
+				sum += op->near_values[n] * args->x[op->near_columns[n]];
+
+			args->y[i] = sum;
+		}
+	}
+}
+
+// Compute y = A x, where A is the matrix that would be filled by fill_matrix_3d or fill_matrix_radial
+// (including the self terms). x and y should have length N.
+EXPORT void
+bem_operator_matvec(struct bem_operator *op, double *x, double *y) {
+	int N_quad = op->three_d ? N_TRIANGLE_QUAD : N_QUAD_2D;
+
+	for(size_t j = 0; j < op->N; j++)
+	for(int k = 0; k < N_quad; k++)
+		op->points.w[j*N_quad + k] = op->jacobians[j*N_quad + k] * x[j];
+
+	if(op->tree != NULL) radial_tree_set_charges(op->tree, op->points.w);
+
+	struct _bem_operator_rows_args args = {op, 0, x, y};
+	run_threads(_bem_operator_matvec_rows, &args, op->N_threads);
+}
+
+struct _bem_operator_matrix_args {
+	struct bem_operator *op;
+	float *matrix;
+};
+
+static void
+_bem_operator_matrix_rows(void *args_p, size_t start, size_t end, int thread_index) {
+	struct _bem_operator_matrix_args *args = args_p;
+	struct bem_operator *op = args->op;
+
+	for(size_t i = start; i < end; i++) {
+		float *row = &args->matrix[i*op->N];
+		size_t n = op->near_start[i];
+
+		// Near field columns are sorted, so the corrections can be merged while walking the row
+		for(size_t j = 0; j < op->N; j++) {
+			double value = _bem_operator_quadrature(op, i, j);
+
+			if(n < op->near_start[i+1] && op->near_columns[n] == j)
+				value += op->near_values[n++];
+
+			row[j] = (float) value;
+		}
+	}
+}
+
+// Fill the N x N matrix (as filled by fill_matrix_3d or fill_matrix_radial) in single precision. Every entry
+// is computed in double precision and only rounded when stored, the matrix is used by the mixed precision solver
+// which corrects the rounding errors using iterative refinement (with residuals computed by bem_operator_matvec).
+EXPORT void
+bem_operator_matrix_float(struct bem_operator *op, float *matrix) {
+	struct _bem_operator_matrix_args args = {op, matrix};
+	parallel_for(op->N, BEM_OPERATOR_CHUNK_SIZE, _bem_operator_matrix_rows, &args, op->N_threads);
+}
+
+struct _bem_operator_columns_args {
+	struct bem_operator *op;
+	size_t *columns;
+	size_t N_columns;
+	double *out;
+};
+
+static void
+_bem_operator_columns_rows(void *args_p, size_t start, size_t end, int thread_index) {
+	struct _bem_operator_columns_args *args = args_p;
+	
+	for(size_t i = start; i < end; i++)
+	for(size_t c = 0; c < args->N_columns; c++)
+		args->out[i*args->N_columns + c] = bem_operator_entry(args->op, i, args->columns[c]);
+}
+
+static bool
+_bem_operator_columns(struct bem_operator *op, size_t *columns, size_t N_columns, double *out) {
+	if(op == NULL) return false;
+	
+	struct _bem_operator_columns_args args = {op, columns, N_columns, out};
+	parallel_for(op->N, BEM_OPERATOR_CHUNK_SIZE, _bem_operator_columns_rows, &args, op->N_threads);
+	
+	bem_operator_free(op);
+	return true;
+}
+
+// Compute the given columns of the matrix (as filled by fill_matrix_3d), out has shape (N, N_columns). Only the
+// setup of the operator is needed, since the entries are computed directly. Returns false if not enough memory is available.
+EXPORT bool
+fill_matrix_3d_columns(double *out, vertices_3d triangles, uint8_t *excitation_types, double *excitation_values,
+		jacobian_buffer_3d jacobian_buffer, position_buffer_3d pos_buffer, size_t N, size_t *columns, size_t N_columns, int N_threads) {
+	
+	struct bem_operator *op = bem_operator_3d_setup(triangles, excitation_types, excitation_values, jacobian_buffer, pos_buffer, N, N_threads);
+	return _bem_operator_columns(op, columns, N_columns, out);
+}
+
+// Same as fill_matrix_3d_columns, for the matrix filled by fill_matrix_radial (including the self terms).
+EXPORT bool
+fill_matrix_radial_columns(double *out, vertices_2d line_points, uint8_t *excitation_types, double *excitation_values,
+		jacobian_buffer_2d jacobian_buffer, position_buffer_2d pos_buffer, double *self_terms, size_t N, size_t *columns, size_t N_columns, int N_threads) {
+	
+	struct bem_operator *op = bem_operator_radial_setup(line_points, excitation_types, excitation_values, jacobian_buffer, pos_buffer, self_terms, N, N_threads);
+	return _bem_operator_columns(op, columns, N_columns, out);
+}
+
+static double
+_vector_norm(double *v, size_t N) {
+	double sum = 0.;
+	for(size_t i = 0; i < N; i++) sum += v[i]*v[i];
+	return sqrt(sum);
+}
+
+static double
+_vector_dot(double *v, double *w, size_t N) {
+	double sum = 0.;
+	for(size_t i = 0; i < N; i++) sum += v[i]*w[i];
+	return sum;
+}
+
+// Compute y = f(x), used to pass matrix-vector products and preconditioners to gmres.
+typedef void (*linear_map)(void *args, double *x, double *y);
+
+// Solve A x = b using restarted GMRES, with M as (right) preconditioner. The map 'preconditioner' should
+// compute y = M^-1 x. The initial guess is taken from x. Iterates until the residual norm ||b - Ax|| is smaller than
+// tolerance*||b||, or until max_iterations matrix-vector products are done. The relative
+// residual is written to residual_out. Returns the number of iterations, or -1 if not enough memory is available.
+int
+gmres(size_t N, linear_map matvec, void *matvec_args, linear_map preconditioner, void *preconditioner_args,
+		double *b, double *x, double tolerance, int restart, int max_iterations, double *residual_out) {
+
+	int m = restart > 0 ? restart : GMRES_DEFAULT_RESTART;
+
+	double *V = malloc((m+1)*N*sizeof(double)); // Krylov basis
+	double *H = calloc((m+1)*m, sizeof(double)); // Hessenberg matrix, H[i*m + j]
+	double *cs = malloc(m*sizeof(double)), *sn = malloc(m*sizeof(double));
+	double *g = malloc((m+1)*sizeof(double));
+	double *z = malloc(N*sizeof(double));
+	double *w = malloc(N*sizeof(double));
+
+	int iterations = -1;
+	double b_norm, residual = 0.;
+
+	if(V == NULL || H == NULL || cs == NULL || sn == NULL || g == NULL || z == NULL || w == NULL)
+		goto cleanup;
+
+	iterations = 0;
+
+	b_norm = _vector_norm(b, N);
+
+	if(b_norm == 0.) {
+		for(size_t i = 0; i < N; i++) x[i] = 0.;
+		goto cleanup;
+	}
+
+	while(true) {
+		// r = b - A x, stored as first basis vector
+		matvec(matvec_args, x, w);
+		for(size_t i = 0; i < N; i++) V[i] = b[i] - w[i];
+
+		double beta = _vector_norm(V, N);
+		residual = beta/b_norm;
+
+		if(residual <= tolerance || iterations >= max_iterations) break;
+
+		for(size_t i = 0; i < N; i++) V[i] /= beta;
+		for(int i = 0; i <= m; i++) g[i] = 0.;
+		g[0] = beta;
+
+		int j;
+		for(j = 0; j < m && iterations < max_iterations; j++) {
+			double *v = V + j*N, *v_next = V + (j+1)*N;
+
+			preconditioner(preconditioner_args, v, z);
+			matvec(matvec_args, z, w);
+			iterations++;
+
+			// Modified Gram-Schmidt
+			for(int i = 0; i <= j; i++) {
+				double h = _vector_dot(w, V + i*N, N);
+				H[i*m + j] = h;
+				for(size_t k = 0; k < N; k++) w[k] -= h * V[i*N + k];
+			}
+
+			double h_next = _vector_norm(w, N);
+			H[(j+1)*m + j] = h_next;
+
+			if(h_next != 0.)
+				for(size_t k = 0; k < N; k++) v_next[k] = w[k] / h_next;
+
+			// Apply the previous Givens rotations to the new column
+			for(int i = 0; i < j; i++) {
+				double h0 = H[i*m + j], h1 = H[(i+1)*m + j];
+				H[i*m + j] = cs[i]*h0 + sn[i]*h1;
+				H[(i+1)*m + j] = -sn[i]*h0 + cs[i]*h1;
+			}
+
+			// New rotation eliminating H[j+1][j]
+			double denom = hypot(H[j*m + j], H[(j+1)*m + j]);
+			cs[j] = H[j*m + j]/denom;
+			sn[j] = H[(j+1)*m + j]/denom;
+			H[j*m + j] = denom;
+			H[(j+1)*m + j] = 0.;
+
+			g[j+1] = -sn[j]*g[j];
+			g[j] = cs[j]*g[j];
+
+			if(fabs(g[j+1])/b_norm <= tolerance || h_next == 0.) {
+				j++;
+				break;
+			}
+		}
+
+		// Solve the upper triangular system H y = g, store y in g
+		for(int i = j-1; i >= 0; i--) {
+			for(int k = i+1; k < j; k++) g[i] -= H[i*m + k]*g[k];
+			g[i] /= H[i*m + i];
+		}
+
+		// Update x += M^-1 V y
+		for(size_t k = 0; k < N; k++) {
+			w[k] = 0.;
+			for(int i = 0; i < j; i++) w[k] += V[i*N + k]*g[i];
+		}
+
+		preconditioner(preconditioner_args, w, z);
+		for(size_t k = 0; k < N; k++) x[k] += z[k];
+	}
+
+cleanup:
+	if(residual_out != NULL) *residual_out = iterations >= 0 ? residual : INFINITY;
+
+	free(V); free(H); free(cs); free(sn); free(g); free(z); free(w);
+	return iterations;
+}
+
+static void
+_bem_operator_matvec_map(void *op, double *x, double *y) {
+	bem_operator_matvec((struct bem_operator*) op, x, y);
+}
+
+static void
+_bem_operator_jacobi(void *op_p, double *x, double *y) {
+	struct bem_operator *op = op_p;
+	for(size_t i = 0; i < op->N; i++) y[i] = x[i] / op->diagonal[i];
+}
+
+// Solve the system using GMRES, with the diagonal of the matrix as preconditioner. See gmres.
+EXPORT int
+bem_operator_gmres(struct bem_operator *op, double *b, double *x, double tolerance, int restart, int max_iterations, double *residual_out) {
+	return gmres(op->N, _bem_operator_matvec_map, op, _bem_operator_jacobi, op, b, x, tolerance, restart, max_iterations, residual_out);
+}
+
@@ -1,77 +1,192 @@
 #include <stdio.h>
 #include <math.h>
 
-#define G7_WEIGHTS_SIZE 4
-#define K15_WEIGHTS_SIZE 8
-
-const double G7_WEIGHTS[G7_WEIGHTS_SIZE] = {
-    0.417959183673469,
-    0.381830050505119,
-    0.279705391489277,
-    0.129484966168870,
+// Global adaptive Gauss-Kronrod integration (G7/K15). The intervals are kept in a
+// binary heap ordered by their error estimate. Every iteration the interval with the
+// largest error is bisected, until the sum of the error estimates satisfies the tolerance.
+// The results of the intervals are cached in the heap, so every function evaluation
+// contributes to the final result.
+//
+// The integrand receives all 15 nodes of an interval at once, which allows the
+// integrand to share work between the nodes (and avoids a function call per node).
+
+#define KRONROD_NODES 15
+#define KRONROD_MAX_INTERVALS 256
+#define KRONROD_SMALL_WIDTH 1e-6 // Relative to the integration range
+
+// Nodes on [-1, 1] in increasing order, the Gauss nodes are the odd indices
+const double K15_NODES[KRONROD_NODES] = {
+	-0.991455371120812639206854697526329,
+	-0.949107912342758524526189684047851,
+	-0.864864423359769072789712788640926,
+	-0.741531185599394439863864773280788,
+	-0.586087235467691130294144845693013,
+	-0.405845151377397166906606412076961,
+	-0.207784955007898467600689403773245,
+	0.000000000000000000000000000000000,
+	0.207784955007898467600689403773245,
+	0.405845151377397166906606412076961,
+	0.586087235467691130294144845693013,
+	0.741531185599394439863864773280788,
+	0.864864423359769072789712788640926,
+	0.949107912342758524526189684047851,
+	0.991455371120812639206854697526329,
 };
 
-const double G7_NODES[G7_WEIGHTS_SIZE] = {
-    0.000000000000000,
-    0.405845151377397,
-    0.741531185599394,
-    0.949107912342759,
+const double K15_WEIGHTS[KRONROD_NODES] = {
+	0.022935322010529224963732008058970,
+	0.063092092629978553290700663189204,
+	0.104790010322250183839876322541518,
+	0.140653259715525918745189590510238,
+	0.169004726639267902826583426598550,
+	0.190350578064785409913256402421014,
+	0.204432940075298892414161999234649,
+	0.209482141084727828012999174891714,
+	0.204432940075298892414161999234649,
+	0.190350578064785409913256402421014,
+	0.169004726639267902826583426598550,
+	0.140653259715525918745189590510238,
+	0.104790010322250183839876322541518,
+	0.063092092629978553290700663189204,
+	0.022935322010529224963732008058970,
 };
 
-const double K15_WEIGHTS[K15_WEIGHTS_SIZE] = {
-    0.209482141084728,
-    0.204432940075299,
-    0.190350578064785,
-    0.169004726639268,
-    0.140653259715526,
-    0.104790010322250,
-    0.063092092629979,
-    0.022935322010529,
+// Weights of the Gauss nodes K15_NODES[1], K15_NODES[3], ..., K15_NODES[13]
+const double G7_WEIGHTS[7] = {
+	0.129484966168869693270611432679082,
+	0.279705391489276667901467771423780,
+	0.381830050505118944950369775488975,
+	0.417959183673469387755102040816327,
+	0.381830050505118944950369775488975,
+	0.279705391489276667901467771423780,
+	0.129484966168869693270611432679082,
 };
 
-const double K15_NODES[K15_WEIGHTS_SIZE] = {
-    0.000000000000000,
-    0.207784955007898,
-    0.405845151377397,
-    0.586087235467691,
-    0.741531185599394,
-    0.864864423359769,
-    0.949107912342759,
-    0.991455371120813,
+// Integrand evaluated at all the nodes of an interval, should write f(x[i]) into y[i]
+typedef void (*kronrod_integrand)(const double x[KRONROD_NODES], double y[KRONROD_NODES], void *args);
+
+struct kronrod_interval {
+	double a;
+	double b;
+	double result;
+	double error;
 };
 
+INLINE void
+_kronrod_apply(kronrod_integrand f, void *args, struct kronrod_interval *interval) {
+	double c = (interval->a + interval->b) / 2.0;
+	double h = (interval->b - interval->a) / 2.0;
+
+	double x[KRONROD_NODES], y[KRONROD_NODES];
+	for(int i = 0; i < KRONROD_NODES; i++) x[i] = c + h*K15_NODES[i];
+
+	f(x, y, args);
+
+	double k15 = 0., g7 = 0.;
+	for(int i = 0; i < KRONROD_NODES; i++) k15 += K15_WEIGHTS[i] * y[i];
+	for(int i = 0; i < 7; i++) g7 += G7_WEIGHTS[i] * y[2*i + 1];
+
+	interval->result = h*k15;
+	interval->error = fabs(h*(k15 - g7));
+}
+
+INLINE void
+_kronrod_heap_push(struct kronrod_interval *heap, int *N, struct kronrod_interval interval) {
+	int i = (*N)++;
+
+	while(i > 0 && heap[(i-1)/2].error < interval.error) {
+		heap[i] = heap[(i-1)/2];
+		i = (i-1)/2;
+	}
+
+	heap[i] = interval;
+}
+
+INLINE struct kronrod_interval
+_kronrod_heap_pop(struct kronrod_interval *heap, int *N) {
+	struct kronrod_interval top = heap[0];
+	struct kronrod_interval last = heap[--(*N)];
+
+	int i = 0;
+	while(2*i + 1 < *N) {
+		int child = 2*i + 1;
+		if(child + 1 < *N && heap[child + 1].error > heap[child].error) child++;
+		if(heap[child].error <= last.error) break;
+		heap[i] = heap[child];
+		i = child;
+	}
+
+	heap[i] = last;
+	return top;
+}
+
+// Integrate f over the intervals points[0]..points[1], ..., points[N_points-2]..points[N_points-1].
+// Singularities of the integrand (at which the integrand is never evaluated) should
+// be given as points. Stops when the total error estimate is below max(abs_tol, rel_tol*|result|),
+// or when KRONROD_MAX_INTERVALS intervals are in use.
+EXPORT double
+kronrod_global_adaptive(kronrod_integrand f, void *args, const double *points, int N_points, double abs_tol, double rel_tol) {
+	struct kronrod_interval heap[KRONROD_MAX_INTERVALS];
+	int N = 0;
+
+	double result = 0., error = 0.;
+
+	for(int i = 0; i < N_points - 1 && N < KRONROD_MAX_INTERVALS; i++) {
+		struct kronrod_interval interval = {points[i], points[i+1]};
+		_kronrod_apply(f, args, &interval);
+		_kronrod_heap_push(heap, &N, interval);
+		result += interval.result;
+		error += interval.error;
+	}
+
+	double small_width = KRONROD_SMALL_WIDTH * fabs(points[N_points-1] - points[0]);
+	double accepted = 0.;
+
+	while(N > 0 && N + 1 <= KRONROD_MAX_INTERVALS && error > fmax(abs_tol, rel_tol*fabs(result))) {
+		struct kronrod_interval worst = _kronrod_heap_pop(heap, &N);
+
+		double c = (worst.a + worst.b) / 2.0;
+		struct kronrod_interval left = {worst.a, c}, right = {c, worst.b};
+		_kronrod_apply(f, args, &left);
+		_kronrod_apply(f, args, &right);
+
+		if(fabs(worst.b - worst.a) < small_width && left.error + right.error >= worst.error) {
+			// Bisecting a small interval did not decrease the error. This happens close to a
+			// singularity, where the rounding errors of the integrand start to dominate. Keep
+			// the current estimate, evaluating even closer to the singularity only makes it worse.
+			accepted += worst.result;
+			error -= worst.error;
+			continue;
+		}
+
+		_kronrod_heap_push(heap, &N, left);
+		_kronrod_heap_push(heap, &N, right);
+
+		result += left.result + right.result - worst.result;
+		error += left.error + right.error - worst.error;
+	}
+
+	// Sum again to get rid of the rounding errors accumulated by the updates above
+	result = accepted;
+	for(int i = 0; i < N; i++) result += heap[i].result;
+
+	return result;
+}
+
+struct _kronrod_scalar_args {
+	double (*f)(double, void*);
+	void *args;
+};
+
+static void
+_kronrod_scalar_integrand(const double x[KRONROD_NODES], double y[KRONROD_NODES], void *args_p) {
+	struct _kronrod_scalar_args *args = (struct _kronrod_scalar_args*) args_p;
+	for(int i = 0; i < KRONROD_NODES; i++) y[i] = args->f(x[i], args->args);
+}
+
+// Integrate a scalar function from a to b, see kronrod_global_adaptive.
 EXPORT double kronrod_adaptive(double (*f)(double, void*), double a, double b, void* args, double abs_tol, double rel_tol) {
-    double result = 0.0;
-    double current_start = a;
-    double current_end = b;
-
-    while (current_start < b) {
-        double c = (current_start + current_end) / 2.0;
-        double h = (current_end - current_start) / 2.0;
-
-        double g7 = h * G7_WEIGHTS[0] * f(c, args);
-        double k15 = h * K15_WEIGHTS[0] * f(c, args);
-
-        for (int i = 1; i < G7_WEIGHTS_SIZE; i++) {
-            double x = h * G7_NODES[i];
-            g7 += h * G7_WEIGHTS[i] * (f(c - x, args) + f(c + x, args));
-        }
-
-        for (int i = 1; i < K15_WEIGHTS_SIZE; i++) {
-            double x = h * K15_NODES[i];
-            k15 += h * K15_WEIGHTS[i] * (f(c - x, args) + f(c + x, args));
-        }
-
-        double error = fabs(k15 - g7);
-
-        if (error <= abs_tol || error <= rel_tol * fabs(k15)) {
-            result += k15;
-            current_start = current_end;
-            current_end = b;
-        } else {
-            current_end = c;
-        }
-    }
-
-    return result;
+	struct _kronrod_scalar_args scalar_args = {f, args};
+	double points[2] = {a, b};
+	return kronrod_global_adaptive(_kronrod_scalar_integrand, &scalar_args, points, 2, abs_tol, rel_tol);
 }
@@ -0,0 +1,336 @@
+// Octree (Barnes-Hut) acceleration of the field evaluation of 3D effective point charges.
+//
+// The point charges are sorted into an octree. For every node a multipole expansion
+// (up to and including the quadrupole term) is computed around the charge center of
+// the node. When evaluating the potential or field at a point, a node is approximated by its
+// multipole expansion if r_max/distance < theta, where r_max is the distance from the expansion
+// center to the farthest point charge in the node. Otherwise the children of the node are
+// visited, and at the leaves the contributions are summed directly. A smaller theta is more accurate
+// but slower, theta = 0 reduces to the direct summation.
+//
+// The tree is built once (from the effective point charges returned by the solver) and can
+// then be reused for any number of field evaluations, for example while tracing.
+
+#define OCTREE_LEAF_SIZE 64
+#define OCTREE_MAX_DEPTH 32
+
+struct octree_node {
+	double expansion_center[3];
+	double r_max;
+
+	double monopole;
+	double dipole[3];
+	double quadrupole[6]; // Traceless, components xx, yy, zz, xy, xz, yz
+
+	size_t start, end; // Range of the point charges contained in this node
+	int32_t children[8]; // Index of the children, -1 if not present
+	bool leaf;
+};
+
+struct octree_3d {
+	struct octree_node *nodes;
+	size_t N_nodes;
+	size_t capacity;
+
+	// Point charges, sorted such that every node contains a contiguous range
+	struct effective_point_charges_3d_soa points;
+	double theta;
+};
+
+static int32_t
+_octree_new_node(struct octree_3d *tree) {
+
+	if(tree->N_nodes == tree->capacity) {
+		size_t capacity = tree->capacity == 0 ? 64 : 2*tree->capacity;
+		struct octree_node *nodes = realloc(tree->nodes, capacity*sizeof(struct octree_node));
+		if(nodes == NULL) return -1;
+		tree->nodes = nodes;
+		tree->capacity = capacity;
+	}
+
+	return (int32_t) tree->N_nodes++;
+}
+
+static void
+_octree_compute_expansion(struct effective_point_charges_3d_soa *p, struct octree_node *node) {
+
+	// Expansion center is the center of the absolute value of the charges, which
+	// keeps the expansion well behaved when both positive and negative charges are present.
+	double center[3] = {0., 0., 0.};
+	double total_weight = 0.;
+
+	for(size_t i = node->start; i < node->end; i++) {
+		double w = fabs(p->w[i]);
+		center[0] += w*p->x[i];
+		center[1] += w*p->y[i];
+		center[2] += w*p->z[i];
+		total_weight += w;
+	}
+
+	if(total_weight > 0.) {
+		for(int k = 0; k < 3; k++) center[k] /= total_weight;
+	}
+	else {
+		size_t N = node->end - node->start;
+		for(size_t i = node->start; i < node->end; i++) {
+			center[0] += p->x[i]/N;
+			center[1] += p->y[i]/N;
+			center[2] += p->z[i]/N;
+		}
+	}
+
+	node->monopole = 0.;
+	node->r_max = 0.;
+	for(int k = 0; k < 3; k++) node->dipole[k] = 0.;
+	for(int k = 0; k < 6; k++) node->quadrupole[k] = 0.;
+
+	for(size_t i = node->start; i < node->end; i++) {
+		double w = p->w[i];
+		double dx = p->x[i] - center[0], dy = p->y[i] - center[1], dz = p->z[i] - center[2];
+		double d2 = dx*dx + dy*dy + dz*dz;
+
+		node->monopole += w;
+		node->dipole[0] += w*dx;
+		node->dipole[1] += w*dy;
+		node->dipole[2] += w*dz;
+		node->quadrupole[0] += w*(3*dx*dx - d2);
+		node->quadrupole[1] += w*(3*dy*dy - d2);
+		node->quadrupole[2] += w*(3*dz*dz - d2);
+		node->quadrupole[3] += w*3*dx*dy;
+		node->quadrupole[4] += w*3*dx*dz;
+		node->quadrupole[5] += w*3*dy*dz;
+
+		node->r_max = fmax(node->r_max, sqrt(d2));
+	}
+
+	for(int k = 0; k < 3; k++) node->expansion_center[k] = center[k];
+}
+
+static bool
+_octree_build_node(struct octree_3d *tree, int32_t index, double cube_center[3], double half_size, int depth,
+		struct effective_point_charges_3d_soa *scratch) {
+
+	struct effective_point_charges_3d_soa *p = &tree->points;
+	struct octree_node *node = &tree->nodes[index];
+
+	_octree_compute_expansion(p, node);
+
+	for(int c = 0; c < 8; c++) node->children[c] = -1;
+	node->leaf = (node->end - node->start <= OCTREE_LEAF_SIZE) || depth >= OCTREE_MAX_DEPTH;
+
+	if(node->leaf) return true;
+
+	size_t start = node->start, end = node->end;
+
+	// Counting sort of the points into the eight octants
+	size_t counts[8] = {0};
+
+	for(size_t i = start; i < end; i++) {
+		int octant = (p->x[i] > cube_center[0]) | ((p->y[i] > cube_center[1]) << 1) | ((p->z[i] > cube_center[2]) << 2);
+		counts[octant]++;
+	}
+
+	size_t octant_start[8];
+	size_t position[8];
+	octant_start[0] = start;
+	for(int c = 1; c < 8; c++) octant_start[c] = octant_start[c-1] + counts[c-1];
+	for(int c = 0; c < 8; c++) position[c] = octant_start[c];
+
+	for(size_t i = start; i < end; i++) {
+		int octant = (p->x[i] > cube_center[0]) | ((p->y[i] > cube_center[1]) << 1) | ((p->z[i] > cube_center[2]) << 2);
+		size_t j = position[octant]++;
+		scratch->x[j] = p->x[i];
+		scratch->y[j] = p->y[i];
+		scratch->z[j] = p->z[i];
+		scratch->w[j] = p->w[i];
+	}
+
+	memcpy(p->x + start, scratch->x + start, (end-start)*sizeof(double));
+	memcpy(p->y + start, scratch->y + start, (end-start)*sizeof(double));
+	memcpy(p->z + start, scratch->z + start, (end-start)*sizeof(double));
+	memcpy(p->w + start, scratch->w + start, (end-start)*sizeof(double));
+
+	for(int c = 0; c < 8; c++) {
+		if(counts[c] == 0) continue;
+
+		int32_t child = _octree_new_node(tree);
+		if(child < 0) return false;
+
+		// Note: tree->nodes might have been reallocated
+		tree->nodes[index].children[c] = child;
+		tree->nodes[child].start = octant_start[c];
+		tree->nodes[child].end = octant_start[c] + counts[c];
+
+		double quarter = half_size/2.;
+		double child_center[3] = {
+			cube_center[0] + ((c & 1) ? quarter : -quarter),
+			cube_center[1] + ((c & 2) ? quarter : -quarter),
+			cube_center[2] + ((c & 4) ? quarter : -quarter)};
+
+		if(!_octree_build_node(tree, child, child_center, quarter, depth+1, scratch)) return false;
+	}
+
+	return true;
+}
+
+EXPORT void
+octree_3d_free(struct octree_3d *tree) {
+	if(tree == NULL) return;
+	free(tree->nodes);
+	free_effective_point_charges_3d_soa(&tree->points);
+	free(tree);
+}
+
+EXPORT struct octree_3d*
+octree_3d_build(double *charges, jacobian_buffer_3d jacobian_buffer, position_buffer_3d position_buffer, size_t N_vertices, double theta) {
+
+	struct octree_3d *tree = calloc(1, sizeof(struct octree_3d));
+	if(tree == NULL) return NULL;
+
+	tree->theta = theta;
+
+	struct effective_point_charges_3d eff = {charges, jacobian_buffer, position_buffer, N_vertices};
+
+	if(!effective_point_charges_3d_to_soa(&eff, &tree->points)) {
+		free(tree);
+		return NULL;
+	}
+
+	size_t N = tree->points.N;
+	if(N == 0) return tree;
+
+	struct effective_point_charges_3d_soa *p = &tree->points;
+	double min[3] = {p->x[0], p->y[0], p->z[0]};
+	double max[3] = {p->x[0], p->y[0], p->z[0]};
+
+	for(size_t i = 0; i < N; i++) {
+		min[0] = fmin(min[0], p->x[i]); max[0] = fmax(max[0], p->x[i]);
+		min[1] = fmin(min[1], p->y[i]); max[1] = fmax(max[1], p->y[i]);
+		min[2] = fmin(min[2], p->z[i]); max[2] = fmax(max[2], p->z[i]);
+	}
+
+	double center[3] = {(min[0]+max[0])/2, (min[1]+max[1])/2, (min[2]+max[2])/2};
+	double half_size = fmax(fmax(max[0]-min[0], max[1]-min[1]), max[2]-min[2])/2;
+
+	struct effective_point_charges_3d_soa scratch;
+	struct effective_point_charges_3d scratch_eff = {charges, jacobian_buffer, position_buffer, N_vertices};
+
+	if(!effective_point_charges_3d_to_soa(&scratch_eff, &scratch)) {
+		octree_3d_free(tree);
+		return NULL;
+	}
+
+	int32_t root = _octree_new_node(tree);
+	bool success = root == 0;
+
+	if(success) {
+		tree->nodes[root].start = 0;
+		tree->nodes[root].end = N;
+		success = _octree_build_node(tree, root, center, half_size, 0, &scratch);
+	}
+
+	free_effective_point_charges_3d_soa(&scratch);
+
+	if(!success) {
+		octree_3d_free(tree);
+		return NULL;
+	}
+
+	return tree;
+}
+
+EXPORT size_t
+octree_3d_number_of_nodes(struct octree_3d *tree) {
+	return tree->N_nodes;
+}
+
+INLINE void
+_octree_node_expansion(struct octree_node *node, double point[3], double *potential, double field[3]) {
+	double R[3] = {
+		point[0] - node->expansion_center[0],
+		point[1] - node->expansion_center[1],
+		point[2] - node->expansion_center[2]};
+
+	double inv_r = 1./norm_3d(R[0], R[1], R[2]);
+	double inv_r2 = inv_r*inv_r;
+	double inv_r3 = inv_r2*inv_r;
+	double inv_r5 = inv_r3*inv_r2;
+
+	double *D = node->dipole, *Q = node->quadrupole;
+	double D_dot_R = dot_3d(D, R);
+
+	double QR[3] = {
+		Q[0]*R[0] + Q[3]*R[1] + Q[4]*R[2],
+		Q[3]*R[0] + Q[1]*R[1] + Q[5]*R[2],
+		Q[4]*R[0] + Q[5]*R[1] + Q[2]*R[2]};
+
+	double RQR = dot_3d(R, QR);
+
+	*potential += node->monopole*inv_r + D_dot_R*inv_r3 + 0.5*RQR*inv_r5;
+
+	// Field is minus the gradient of the above expression
+	double radial = node->monopole*inv_r3 + 3*D_dot_R*inv_r5 + 2.5*RQR*inv_r5*inv_r2;
+
+	for(int k = 0; k < 3; k++)
+		field[k] += radial*R[k] - D[k]*inv_r3 - QR[k]*inv_r5;
+}
+
+void
+octree_3d_potential_field(struct octree_3d *tree, double point[3], double *potential_out, double field_out[3]) {
+
+	double potential = 0.;
+	double field[3] = {0., 0., 0.};
+
+	if(tree->N_nodes > 0) {
+		int32_t stack[8*OCTREE_MAX_DEPTH + 8];
+		int stack_size = 0;
+		stack[stack_size++] = 0;
+
+		while(stack_size > 0) {
+			struct octree_node *node = &tree->nodes[stack[--stack_size]];
+
+			double distance = distance_3d(point, node->expansion_center);
+
+			if(node->r_max < tree->theta*distance) {
+				_octree_node_expansion(node, point, &potential, field);
+			}
+			else if(node->leaf) {
+				struct effective_point_charges_3d_soa leaf = {
+					tree->points.x + node->start,
+					tree->points.y + node->start,
+					tree->points.z + node->start,
+					tree->points.w + node->start,
+					node->end - node->start};
+
+				double leaf_potential, leaf_field[3];
+				potential_field_3d_soa(point, &leaf, &leaf_potential, leaf_field);
+
+				// potential_field_3d_soa already divides by 4pi
+				potential += 4*M_PI*leaf_potential;
+				for(int k = 0; k < 3; k++) field[k] += 4*M_PI*leaf_field[k];
+			}
+			else {
+				for(int c = 0; c < 8; c++)
+					if(node->children[c] >= 0) stack[stack_size++] = node->children[c];
+			}
+		}
+	}
+
+	if(potential_out != NULL) *potential_out = potential/(4*M_PI);
+
+	if(field_out != NULL) {
+		for(int k = 0; k < 3; k++) field_out[k] = field[k]/(4*M_PI);
+	}
+}
+
+EXPORT double
+octree_3d_potential(struct octree_3d *tree, double point[3]) {
+	double potential;
+	octree_3d_potential_field(tree, point, &potential, NULL);
+	return potential;
+}
+
+EXPORT void
+octree_3d_field(struct octree_3d *tree, double point[3], double result[3]) {
+	octree_3d_potential_field(tree, point, NULL, result);
+}
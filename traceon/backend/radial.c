@@ -15,15 +15,27 @@ struct effective_point_charges_2d {
 };
 
 
-EXPORT void
-axial_derivatives_radial(double *derivs_p, double *charges, jacobian_buffer_2d jac_buffer, position_buffer_2d pos_buffer, size_t N_lines, double *z, size_t N_z) {
+struct _axial_derivatives_radial_args {
+	double (*derivs)[DERIV_2D_MAX];
+	double *charges;
+	jacobian_buffer_2d jac_buffer;
+	position_buffer_2d pos_buffer;
+	size_t N_lines;
+	double *z;
+};
 
-	double (*derivs)[DERIV_2D_MAX] = (double (*)[DERIV_2D_MAX]) derivs_p;	
-		
-	for(int i = 0; i < N_z; i++) 
-	for(int j = 0; j < N_lines; j++)
+static void
+_axial_derivatives_radial_range(void *args_p, size_t start, size_t end, int thread_index) {
+	struct _axial_derivatives_radial_args *args = (struct _axial_derivatives_radial_args*) args_p;
+	
+	double (*derivs)[DERIV_2D_MAX] = args->derivs;
+	jacobian_buffer_2d jac_buffer = args->jac_buffer;
+	position_buffer_2d pos_buffer = args->pos_buffer;
+	
+	for(size_t i = start; i < end; i++) 
+	for(int j = 0; j < args->N_lines; j++)
 	for(int k = 0; k < N_QUAD_2D; k++) {
-		double z0 = z[i];
+		double z0 = args->z[i];
 		double r = pos_buffer[j][k][0];
 		double z = pos_buffer[j][k][1];
 
@@ -31,10 +43,17 @@ axial_derivatives_radial(double *derivs_p, double *charges, jacobian_buffer_2d j
 
 		axial_derivatives_radial_ring(z0, r, z, D);
 		
-		for(int l = 0; l < DERIV_2D_MAX; l++) derivs[i][l] += jac_buffer[j][k] * charges[j] * D[l];
+		for(int l = 0; l < DERIV_2D_MAX; l++) derivs[i][l] += jac_buffer[j][k] * args->charges[j] * D[l];
 	}
 }
 
+EXPORT void
+axial_derivatives_radial(double *derivs_p, double *charges, jacobian_buffer_2d jac_buffer, position_buffer_2d pos_buffer, size_t N_lines, double *z, size_t N_z, int N_threads) {
+
+	struct _axial_derivatives_radial_args args = {(double (*)[DERIV_2D_MAX]) derivs_p, charges, jac_buffer, pos_buffer, N_lines, z};
+	parallel_for(N_z, 1, _axial_derivatives_radial_range, &args, N_threads);
+}
+
 EXPORT double
 current_potential_axial(double z0, double *currents,
 	jacobian_buffer_3d jacobian_buffer, position_buffer_3d position_buffer, size_t N_vertices) {
@@ -82,35 +101,56 @@ current_field(double point[3], double result[3], double *currents,
 	result[2] = Bz;
 }
 
-EXPORT void
-current_axial_derivatives_radial(double *derivs_p,
-		double *currents, jacobian_buffer_3d jac_buffer, position_buffer_3d pos_buffer, size_t N_vertices, double *z, size_t N_z) {
+struct _current_axial_derivatives_radial_args {
+	double (*derivs)[DERIV_2D_MAX];
+	double *currents;
+	jacobian_buffer_3d jac_buffer;
+	position_buffer_3d pos_buffer;
+	size_t N_vertices;
+	double *z;
+};
 
-	double (*derivs)[DERIV_2D_MAX] = (double (*)[DERIV_2D_MAX]) derivs_p;	
+static void
+_current_axial_derivatives_radial_range(void *args_p, size_t start, size_t end, int thread_index) {
+	struct _current_axial_derivatives_radial_args *args = (struct _current_axial_derivatives_radial_args*) args_p;
+	
+	double (*derivs)[DERIV_2D_MAX] = args->derivs;
+	jacobian_buffer_3d jac_buffer = args->jac_buffer;
+	position_buffer_3d pos_buffer = args->pos_buffer;
 		
-	for(int i = 0; i < N_z; i++) 
-	for(int j = 0; j < N_vertices; j++)
+	for(size_t i = start; i < end; i++) 
+	for(int j = 0; j < args->N_vertices; j++)
 	for(int k = 0; k < N_TRIANGLE_QUAD; k++) {
-		double z0 = z[i];
+		double z0 = args->z[i];
 		double r = pos_buffer[j][k][0], z = pos_buffer[j][k][1];
 
 		double D[DERIV_2D_MAX];
 		
 		current_axial_derivatives_radial_ring(z0, r, z, D);
 			
-		for(int l = 0; l < DERIV_2D_MAX; l++) derivs[i][l] += jac_buffer[j][k] * currents[j] * D[l];
+		for(int l = 0; l < DERIV_2D_MAX; l++) derivs[i][l] += jac_buffer[j][k] * args->currents[j] * D[l];
 	}
 }
 
+EXPORT void
+current_axial_derivatives_radial(double *derivs_p,
+		double *currents, jacobian_buffer_3d jac_buffer, position_buffer_3d pos_buffer, size_t N_vertices, double *z, size_t N_z, int N_threads) {
+	
+	struct _current_axial_derivatives_radial_args args = {(double (*)[DERIV_2D_MAX]) derivs_p, currents, jac_buffer, pos_buffer, N_vertices, z};
+	parallel_for(N_z, 1, _current_axial_derivatives_radial_range, &args, N_threads);
+}
+
 EXPORT double
-potential_radial(double point[2], double* charges, jacobian_buffer_2d jacobian_buffer, position_buffer_2d position_buffer, size_t N_vertices) {
+potential_radial(double point[2], double* charges, jacobian_buffer_2d jacobian_buffer, position_buffer_2d position_buffer, size_t N_vertices,
+		const struct elliptic_table *table) {
 
 	double sum_ = 0.0;  
 	
 	for(int i = 0; i < N_vertices; i++) {  
 		for(int k = 0; k < N_QUAD_2D; k++) {
 			double *pos = &position_buffer[i][k][0];
-			double potential = potential_radial_ring(point[0], point[1], pos[0], pos[1], NULL);
+			double potential;
+			potential_field_radial_ring(point[0], point[1], pos[0], pos[1], &potential, NULL, table);
 			sum_ += charges[i] * jacobian_buffer[i][k] * potential;
 		}
 	}  
@@ -146,7 +186,8 @@ charge_radial(double *vertices_p, double charge) {
 }
 
 EXPORT void
-field_radial(double point[3], double result[3], double* charges, jacobian_buffer_2d jacobian_buffer, position_buffer_2d position_buffer, size_t N_vertices) {
+field_radial(double point[3], double result[3], double* charges, jacobian_buffer_2d jacobian_buffer, position_buffer_2d position_buffer, size_t N_vertices,
+		const struct elliptic_table *table) {
 	
 	double Er = 0.0, Ez = 0.0;
 	double r = norm_2d(point[0], point[1]);
@@ -154,8 +195,10 @@ field_radial(double point[3], double result[3], double* charges, jacobian_buffer
 	for(int i = 0; i < N_vertices; i++) {  
 		for(int k = 0; k < N_QUAD_2D; k++) {
 			double *pos = &position_buffer[i][k][0];
-			Er -= charges[i] * jacobian_buffer[i][k] * dr1_potential_radial_ring(r, point[2], pos[0], pos[1], NULL);
-			Ez -= charges[i] * jacobian_buffer[i][k] * dz1_potential_radial_ring(r, point[2], pos[0], pos[1], NULL);
+			double field[2];
+			potential_field_radial_ring(r, point[2], pos[0], pos[1], NULL, field, table);
+			Er += charges[i] * jacobian_buffer[i][k] * field[0];
+			Ez += charges[i] * jacobian_buffer[i][k] * field[1];
 		}
 	}
 				
@@ -175,48 +218,102 @@ struct field_evaluation_args {
 	void *mag_charges;
 	void *current_charges;
 	double *bounds;
+	const struct elliptic_table *table; // Used by the radial symmetric field, NULL for the exact Green's function
 };
 
-EXPORT double self_potential_radial(double alpha, double line_points[4][3]) {
+// The self terms integrate over the element itself, with a (logarithmic) singularity
+// at the target, which is the middle of the element (alpha = 0).
+struct _self_radial_args {
+	double *v1, *v2, *v3, *v4;
+	double target[2];
+	struct field_dot_normal_radial_args field_args;
+};
 
-	double *v1 = line_points[0];
-	double *v2 = line_points[2];
-	double *v3 = line_points[3];
-	double *v4 = line_points[1];
+static void
+_self_radial_setup(double line_points[4][3], struct _self_radial_args *args) {
+	args->v1 = line_points[0];
+	args->v2 = line_points[2];
+	args->v3 = line_points[3];
+	args->v4 = line_points[1];
 	
-	double pos[2], jac;
-	position_and_jacobian_radial(alpha, v1, v2, v3, v4, pos, &jac);
-	
-	double target[2], jac2;
-	position_and_jacobian_radial(0, v1, v2, v3, v4, target, &jac2);
-
-	return jac*potential_radial_ring(target[0], target[1], pos[0], pos[1], NULL);
+	double jac;
+	position_and_jacobian_radial(0, args->v1, args->v2, args->v3, args->v4, args->target, &jac);
 }
 
-struct self_field_dot_normal_radial_args {
-	double (*line_points)[3];
-	double K;
-};
-
-EXPORT double self_field_dot_normal_radial(double alpha, struct self_field_dot_normal_radial_args* args) {
+static void
+_self_potential_radial_integrand(const double alpha[KRONROD_NODES], double out[KRONROD_NODES], void *args_p) {
+	struct _self_radial_args *args = (struct _self_radial_args*) args_p;
 	
-	double *v1 = args->line_points[0];
-	double *v2 = args->line_points[2];
-	double *v3 = args->line_points[3];
-	double *v4 = args->line_points[1];
+	for(int i = 0; i < KRONROD_NODES; i++) {
+		double pos[2], jac;
+		position_and_jacobian_radial(alpha[i], args->v1, args->v2, args->v3, args->v4, pos, &jac);
+		out[i] = jac*potential_radial_ring(args->target[0], args->target[1], pos[0], pos[1], NULL);
+	}
+}
+
+static void
+_self_field_dot_normal_radial_integrand(const double alpha[KRONROD_NODES], double out[KRONROD_NODES], void *args_p) {
+	struct _self_radial_args *args = (struct _self_radial_args*) args_p;
 	
-	double pos[2], jac;
-	position_and_jacobian_radial(alpha, v1, v2, v3, v4, pos, &jac);
+	for(int i = 0; i < KRONROD_NODES; i++) {
+		double pos[2], jac;
+		position_and_jacobian_radial(alpha[i], args->v1, args->v2, args->v3, args->v4, pos, &jac);
+		out[i] = jac*field_dot_normal_radial(args->target[0], args->target[1], pos[0], pos[1], (void*) &args->field_args);
+	}
+}
+
+EXPORT double self_potential_radial(double line_points[4][3]) {
+	struct _self_radial_args args;
+	_self_radial_setup(line_points, &args);
 	
-	double target[2], jac2;
-	position_and_jacobian_radial(0, v1, v2, v3, v4, target, &jac2);
+	double points[3] = {-1., 0., 1.};
+	return kronrod_global_adaptive(_self_potential_radial_integrand, &args, points, 3, 1e-9, 1e-9);
+}
+
+EXPORT double self_field_dot_normal_radial(double line_points[4][3], double K) {
+	struct _self_radial_args args;
+	_self_radial_setup(line_points, &args);
 	
 	double normal[2];
-	higher_order_normal_radial(0.0, v1, v2, v3, v4, normal);
+	higher_order_normal_radial(0.0, args.v1, args.v2, args.v3, args.v4, normal);
+	args.field_args = (struct field_dot_normal_radial_args) {normal, K, NULL};
+	
+	double points[3] = {-1., 0., 1.};
+	return kronrod_global_adaptive(_self_field_dot_normal_radial_integrand, &args, points, 3, 1e-9, 1e-9);
+}
+
+struct _self_terms_radial_args {
+	vertices_2d line_points;
+	uint8_t *excitation_types;
+	double *excitation_values;
+	size_t *indices;
+	double *self_terms;
+};
+
+static void
+_self_terms_radial_range(void *args_p, size_t start, size_t end, int thread_index) {
+	struct _self_terms_radial_args *a = (struct _self_terms_radial_args*) args_p;
 	
-	struct {double *normal; double K;} cb_args = {normal, args->K};
+	for(size_t j = start; j < end; j++) {
+		size_t i = a->indices[j];
+		enum ExcitationType type_ = a->excitation_types[i];
+		
+		if(type_ == DIELECTRIC || type_ == MAGNETIZABLE)
+			// -1 follows from matrix equation
+			a->self_terms[j] = self_field_dot_normal_radial(a->line_points[i], a->excitation_values[i]) - 1;
+		else
+			a->self_terms[j] = self_potential_radial(a->line_points[i]);
+	}
+}
 
-	return jac*field_dot_normal_radial(target[0], target[1], pos[0], pos[1], (void*) &cb_args);
+// Compute the diagonal entries of the matrix (see fill_matrix_radial) of the elements
+// with the given indices. These cannot be computed using the quadrature of the jacobian buffer.
+EXPORT void
+self_terms_radial(vertices_2d line_points, uint8_t *excitation_types, double *excitation_values,
+		size_t *indices, size_t N_indices, double *self_terms, int N_threads) {
+	
+	struct _self_terms_radial_args args = {line_points, excitation_types, excitation_values, indices, self_terms};
+	parallel_for(N_indices, 0, _self_terms_radial_range, &args, N_threads);
 }
 
 EXPORT void fill_jacobian_buffer_radial(
@@ -253,7 +350,8 @@ EXPORT void fill_matrix_radial(double *matrix,
 						size_t N_lines,
 						size_t N_matrix,
                         int lines_range_start, 
-                        int lines_range_end) {
+                        int lines_range_end,
+						const struct elliptic_table *table) {
     
 	assert(lines_range_start < N_lines && lines_range_end < N_lines);
 	assert(N_matrix >= N_lines);
@@ -278,7 +376,9 @@ EXPORT void fill_matrix_radial(double *matrix,
 						
 					double *pos = pos_buffer[j][k];
 					double jac = jacobian_buffer[j][k];
-					matrix[i*N_matrix + j] += jac * potential_radial_ring(target[0], target[1], pos[0], pos[1], NULL);
+					double potential;
+					potential_field_radial_ring(target[0], target[1], pos[0], pos[1], &potential, NULL, table);
+					matrix[i*N_matrix + j] += jac * potential;
 				}
             }
 		}
@@ -289,7 +389,7 @@ EXPORT void fill_matrix_radial(double *matrix,
 				//normal_2d(target_v1, target_v2, normal);
 				higher_order_normal_radial(0.0, target_v1, target_v2, target_v3, target_v4, normal);
 					
-				struct {double *normal; double K;} args = {normal, excitation_values[i]};
+				struct field_dot_normal_radial_args args = {normal, excitation_values[i], table};
 					
 				UNROLL
 				for(int k = 0; k < N_QUAD_2D; k++) {
@@ -307,6 +407,151 @@ EXPORT void fill_matrix_radial(double *matrix,
 	}
 }
 
+struct _fill_matrix_radial_rows_args {
+	double *matrix;
+	vertices_2d line_points;
+	uint8_t *excitation_types;
+	double *excitation_values;
+	jacobian_buffer_2d jacobian_buffer;
+	position_buffer_2d pos_buffer;
+	size_t N_lines;
+	size_t N_matrix;
+	size_t *rows;
+	const struct elliptic_table *table;
+};
+
+static void
+_fill_matrix_radial_rows_range(void *args_p, size_t start, size_t end, int thread_index) {
+	struct _fill_matrix_radial_rows_args *a = (struct _fill_matrix_radial_rows_args*) args_p;
+	
+	for(size_t r = start; r < end; r++)
+		fill_matrix_radial(a->matrix, a->line_points, a->excitation_types, a->excitation_values,
+			a->jacobian_buffer, a->pos_buffer, a->N_lines, a->N_matrix, (int) a->rows[r], (int) a->rows[r], a->table);
+}
+
+// Fill the given rows of the matrix (see fill_matrix_radial) using N_threads threads. Rows are
+// handed out one at a time, since the cost of a row depends on its excitation type.
+EXPORT void
+fill_matrix_radial_rows(double *matrix, 
+						vertices_2d line_points,
+                        uint8_t *excitation_types, 
+                        double *excitation_values, 
+						jacobian_buffer_2d jacobian_buffer,
+						position_buffer_2d pos_buffer,
+						size_t N_lines,
+						size_t N_matrix,
+						size_t *rows,
+						size_t N_rows,
+						const struct elliptic_table *table,
+						int N_threads) {
+	
+	struct _fill_matrix_radial_rows_args args = {matrix, line_points, excitation_types, excitation_values,
+		jacobian_buffer, pos_buffer, N_lines, N_matrix, rows, table};
+	
+	parallel_for(N_rows, 1, _fill_matrix_radial_rows_range, &args, N_threads);
+}
+
+// Geometries symmetric under z -> -z only need to be meshed for z > 0. When the excitation is symmetric
+// (sign = 1) or antisymmetric (sign = -1) the charge on the image of a line element equals sign times
+// the charge on the element itself. The image rings are folded into the kernel, which gives a system
+// with only the meshed elements as unknowns:
+//
+//     matrix[i][j] = (potential or flux at target i due to line j) + sign * (... due to the image of line j)
+//
+// As in fill_matrix_radial, the self term of the line itself (i == j) cannot be computed with
+// the quadrature of the jacobian buffer. Its entry only contains the contribution of the image,
+// the self term should be added afterwards (see self_terms_radial).
+struct _fill_matrix_radial_mirror_rows_args {
+	double *matrix;
+	vertices_2d line_points;
+	uint8_t *excitation_types;
+	double *excitation_values;
+	jacobian_buffer_2d jacobian_buffer;
+	position_buffer_2d pos_buffer;
+	size_t N_lines;
+	size_t *rows;
+	double sign;
+	const struct elliptic_table *table;
+};
+
+static void
+_fill_matrix_radial_mirror_rows_range(void *args_p, size_t start, size_t end, int thread_index) {
+	struct _fill_matrix_radial_mirror_rows_args *a = (struct _fill_matrix_radial_mirror_rows_args*) args_p;
+
+	for(size_t r = start; r < end; r++) {
+		size_t i = a->rows[r];
+
+		double *target_v1 = &a->line_points[i][0][0];
+		double *target_v2 = &a->line_points[i][2][0];
+		double *target_v3 = &a->line_points[i][3][0];
+		double *target_v4 = &a->line_points[i][1][0];
+
+		double target[2], jac;
+		position_and_jacobian_radial(0.0, target_v1, target_v2, target_v3, target_v4, target, &jac);
+
+		enum ExcitationType type_ = a->excitation_types[i];
+
+		if(type_ != VOLTAGE_FIXED && type_ != VOLTAGE_FUN && type_ != MAGNETOSTATIC_POT && type_ != DIELECTRIC && type_ != MAGNETIZABLE) {
+			printf("ExcitationType unknown\n");
+			exit(1);
+		}
+
+		bool flux = type_ == DIELECTRIC || type_ == MAGNETIZABLE;
+
+		double normal[2] = {0., 0.};
+		if(flux) higher_order_normal_radial(0.0, target_v1, target_v2, target_v3, target_v4, normal);
+		struct field_dot_normal_radial_args field_args = {normal, a->excitation_values[i], a->table};
+
+		double *row = &a->matrix[i*a->N_lines];
+
+		for(size_t j = 0; j < a->N_lines; j++) {
+			double direct = 0., image = 0.;
+
+			UNROLL
+			for(int k = 0; k < N_QUAD_2D; k++) {
+				double *pos = a->pos_buffer[j][k];
+				double jac = a->jacobian_buffer[j][k];
+
+				if(flux) {
+					direct += jac * field_dot_normal_radial(target[0], target[1], pos[0], pos[1], &field_args);
+					image += jac * field_dot_normal_radial(target[0], target[1], pos[0], -pos[1], &field_args);
+				}
+				else {
+					double potential;
+					potential_field_radial_ring(target[0], target[1], pos[0], pos[1], &potential, NULL, a->table);
+					direct += jac * potential;
+					potential_field_radial_ring(target[0], target[1], pos[0], -pos[1], &potential, NULL, a->table);
+					image += jac * potential;
+				}
+			}
+
+			row[j] = (i == j ? 0. : direct) + a->sign*image;
+		}
+	}
+}
+
+// Fill the given rows of the matrix of a geometry that is symmetric under z -> -z (see above)
+// using N_threads threads.
+EXPORT void
+fill_matrix_radial_mirror_rows(double *matrix,
+						vertices_2d line_points,
+                        uint8_t *excitation_types,
+                        double *excitation_values,
+						jacobian_buffer_2d jacobian_buffer,
+						position_buffer_2d pos_buffer,
+						size_t N_lines,
+						size_t *rows,
+						size_t N_rows,
+						double sign,
+						const struct elliptic_table *table,
+						int N_threads) {
+
+	struct _fill_matrix_radial_mirror_rows_args args = {matrix, line_points, excitation_types, excitation_values,
+		jacobian_buffer, pos_buffer, N_lines, rows, sign, table};
+
+	parallel_for(N_rows, 1, _fill_matrix_radial_mirror_rows_range, &args, N_threads);
+}
+
 EXPORT double
 potential_radial_derivs(double point[2], double *z_inter, double *coeff_p, size_t N_z) {
 	
@@ -18,41 +18,69 @@ INLINE double flux_density_to_charge_factor(double K) {
 }
 
 
-EXPORT double dr1_potential_radial_ring(double r0, double z0, double r, double z, void *_) {
+// Potential and field at (r0, z0) of a ring of unit charge at (r, z). The potential, radial field and axial
+// field share the argument of the elliptic integrals and a square root, and the field needs both K and E, which
+// are computed with a single logarithm. If field is NULL only the potential is computed (which needs only K).
+// If table is not NULL the elliptic integrals are interpolated from the table (see elliptic.c), which is faster
+// but has the (relative) error of the table.
+INLINE void
+potential_field_radial_ring(double r0, double z0, double r, double z, double *potential, double field[2], const struct elliptic_table *table) {
+	double delta_r = r - r0;
+	double delta_z = z - z0;
+	
+	double distance2 = delta_r*delta_r + delta_z*delta_z;
+	double S2 = (r + r0)*(r + r0) + delta_z*delta_z;
+	double S = sqrt(S2);
+	double t = distance2 / S2;
 	
-	if(r0 < MIN_DISTANCE_AXIS) {
-		return 0.0;
+	if(field == NULL) {
+		double K;
+		elliptic_table_ellipkem1(table, t, &K, NULL);
+		*potential = 1./M_PI * K * r / S;
+		return;
 	}
 	
-	double delta_r = r - r0;
-	double delta_z = z - z0;
-    double common_arg = (delta_z * delta_z + delta_r * delta_r) / (4 * r * r - 4 * delta_r * r + delta_z * delta_z + delta_r * delta_r);
-    double denominator = ((-2 * delta_r * delta_r * r) + delta_z * delta_z * (2 * delta_r - 2 * r) + 2 * delta_r * delta_r * delta_r) * sqrt(4 * r * r - 4 * delta_r * r + delta_z * delta_z + delta_r * delta_r);
-    double ellipkm1_term = (delta_z * delta_z * r + delta_r * delta_r * r) * ellipkm1(common_arg);
-    double ellipem1_term = ((-2 * delta_r * r * r) - delta_z * delta_z * r + delta_r * delta_r * r) * ellipem1(common_arg);
-    return 1./M_PI * (ellipkm1_term + ellipem1_term) / denominator;
+	double K, E;
+	elliptic_table_ellipkem1(table, t, &K, &E);
+	
+	if(potential != NULL) *potential = 1./M_PI * K * r / S;
+	
+	if(r0 < MIN_DISTANCE_AXIS) field[0] = 0.;
+	else field[0] = 1./(2*M_PI) * r/(r0*S) * (K + (r0*r0 - r*r - delta_z*delta_z)/distance2 * E);
+	
+	field[1] = -1./M_PI * delta_z * r * E / (distance2 * S);
+}
+
+EXPORT double dr1_potential_radial_ring(double r0, double z0, double r, double z, void *_) {
+	double field[2];
+	potential_field_radial_ring(r0, z0, r, z, NULL, field, NULL);
+	return -field[0];
 }
 
 EXPORT double potential_radial_ring(double r0, double z0, double r, double z, void *_) {
-    double delta_z = z - z0;
-    double delta_r = r - r0;
-    double t = (pow(delta_z, 2) + pow(delta_r, 2)) / (pow(delta_z, 2) + pow(delta_r, 2) + 4 * r0 * delta_r + 4 * pow(r0, 2));
-    return 1./M_PI * ellipkm1(t) * (delta_r + r0) / sqrt(pow(delta_z, 2) + pow((delta_r + 2 * r0), 2));
+	double potential;
+	potential_field_radial_ring(r0, z0, r, z, &potential, NULL, NULL);
+	return potential;
 }
 
 EXPORT double dz1_potential_radial_ring(double r0, double z0, double r, double z, void *_) {
-	double delta_z = z - z0;
-    double delta_r = r - r0;
-    double common_arg = (delta_z * delta_z + delta_r * delta_r) / (4 * r0 * r0 + 4 * delta_r * r0 + delta_z * delta_z + delta_r * delta_r);
-    double denominator = (delta_z * delta_z + delta_r * delta_r) * sqrt(4 * r0 * r0 + 4 * delta_r * r0 + delta_z * delta_z + delta_r * delta_r);
-    double ellipem1_term = -delta_z * (r0 + delta_r) * ellipem1(common_arg);
-    return 1./M_PI * -ellipem1_term / denominator;
+	double field[2];
+	potential_field_radial_ring(r0, z0, r, z, NULL, field, NULL);
+	return -field[1];
 }
 
+// Anonymous structs are distinct types, so the callers should use this
+// named struct (otherwise the compiler may assume the fields are never read).
+struct field_dot_normal_radial_args {
+	double *normal;
+	double K;
+	const struct elliptic_table *table; // NULL to use the exact Green's function
+};
+
 double
 field_dot_normal_radial(double r0, double z0, double r, double z, void* args_p) {
 
-	struct {double *normal; double K;} *args = args_p;
+	struct field_dot_normal_radial_args *args = args_p;
 	
 	// This factor is hard to derive. It takes into account that the field
 	// calculated at the edge of the dielectric is basically the average of the
@@ -60,10 +88,10 @@ field_dot_normal_radial(double r0, double z0, double r, double z, void* args_p)
 	double K = args->K;
 	double factor = flux_density_to_charge_factor(K);
 	
-	double Er = -dr1_potential_radial_ring(r0, z0, r, z, NULL);
-	double Ez = -dz1_potential_radial_ring(r0, z0, r, z, NULL);
+	double field[2];
+	potential_field_radial_ring(r0, z0, r, z, NULL, field, args->table);
 	
-	return factor*(args->normal[0]*Er + args->normal[1]*Ez);
+	return factor*(args->normal[0]*field[0] + args->normal[1]*field[1]);
 
 }
 
@@ -0,0 +1,440 @@
+// Tree code (Barnes-Hut) acceleration of the field evaluation of radial symmetric effective point charges (rings).
+//
+// The rings are sorted into a tree in the (r, z) half-plane. Every node stores the tight bounding box of its rings,
+// and is split in half along the dimensions which are not much smaller than the largest dimension (giving two or
+// four children). Since the Green's function of a ring has no simple multipole expansion, the far field of a node is
+// represented by a small number of 'proxy' rings placed at the tensor product Chebyshev points of the bounding box of the node
+// (as in the black-box fast multipole method). The charge of the proxy rings is found by interpolation: a ring with charge w at
+// (r, z) contributes w*L_a(r)*L_b(z) to the proxy ring (a, b), where L are the Lagrange polynomials through the Chebyshev points.
+// The charges of the proxy rings are computed from the rings in the leaves, and then moved up the tree by interpolating the
+// proxy rings of the children onto the proxy rings of the parent.
+//
+// When evaluating the potential or field at a point, a node is replaced by its proxy rings if half the diagonal of the bounding box
+// is smaller than theta times the distance to the center of the box. The Green's function is smooth (as a function of the source
+// position) in such a box, which makes the interpolation accurate. Since the bounding boxes only contain positive radii, the
+// proxy rings never cross the axis. A smaller theta is more accurate but slower.
+//
+// The tree can be reused for different charges (with the same positions), which is used by the matrix-vector product of the
+// iterative solver (see iterative.c).
+
+#define RADIAL_TREE_LEAF_SIZE 128
+#define RADIAL_TREE_MAX_DEPTH 48
+#define RADIAL_TREE_ORDER 6
+#define RADIAL_TREE_PROXIES (RADIAL_TREE_ORDER*RADIAL_TREE_ORDER)
+
+struct radial_tree_node {
+	double center[2];
+	double half_size[2];
+	double radius; // Half of the diagonal of the bounding box
+
+	double proxy_charges[RADIAL_TREE_PROXIES];
+
+	size_t start, end; // Range of the rings contained in this node
+	int32_t children[4]; // Index of the children, -1 if not present
+	bool leaf;
+};
+
+struct radial_tree {
+	struct radial_tree_node *nodes;
+	size_t N_nodes;
+	size_t capacity;
+
+	// Rings, sorted such that every node contains a contiguous range
+	double *r, *z, *w;
+	size_t *permutation; // Original index of every ring
+	size_t N;
+
+	double theta;
+};
+
+static const double _radial_tree_chebyshev_points[RADIAL_TREE_ORDER] = {
+	0.96592582628906831, 0.70710678118654757, 0.25881904510252074,
+	-0.25881904510252074, -0.70710678118654757, -0.96592582628906831};
+
+// Lagrange polynomials through the Chebyshev points, evaluated at x in [-1, 1]. Uses
+// L_a(x) = 1/n + 2/n sum_k T_k(x_a) T_k(x), where the Chebyshev polynomials T_k are evaluated by their recurrence.
+INLINE void
+_radial_tree_lagrange(double x, double L[RADIAL_TREE_ORDER]) {
+	double T[RADIAL_TREE_ORDER];
+	T[0] = 1.;
+	T[1] = x;
+	for(int k = 2; k < RADIAL_TREE_ORDER; k++) T[k] = 2*x*T[k-1] - T[k-2];
+
+	for(int a = 0; a < RADIAL_TREE_ORDER; a++) {
+		double xa = _radial_tree_chebyshev_points[a];
+		double Ta_prev = 1., Ta = xa;
+		double sum_ = 0.5 + Ta*T[1];
+
+		for(int k = 2; k < RADIAL_TREE_ORDER; k++) {
+			double Ta_next = 2*xa*Ta - Ta_prev;
+			Ta_prev = Ta;
+			Ta = Ta_next;
+			sum_ += Ta*T[k];
+		}
+
+		L[a] = 2.*sum_/RADIAL_TREE_ORDER;
+	}
+}
+
+// Local coordinate in [-1, 1] of a position in the bounding box of the node
+INLINE double
+_radial_tree_local(double x, double center, double half_size) {
+	if(half_size == 0.) return 0.;
+	return fmax(-1., fmin(1., (x - center)/half_size));
+}
+
+INLINE void
+_radial_tree_proxy_position(struct radial_tree_node *node, int index, double *r, double *z) {
+	*r = node->center[0] + node->half_size[0]*_radial_tree_chebyshev_points[index / RADIAL_TREE_ORDER];
+	*z = node->center[1] + node->half_size[1]*_radial_tree_chebyshev_points[index % RADIAL_TREE_ORDER];
+}
+
+// Add a ring with charge w at (r, z) to the proxy charges of the node
+INLINE void
+_radial_tree_add_charge(struct radial_tree_node *node, double r, double z, double w) {
+	double Lr[RADIAL_TREE_ORDER], Lz[RADIAL_TREE_ORDER];
+	_radial_tree_lagrange(_radial_tree_local(r, node->center[0], node->half_size[0]), Lr);
+	_radial_tree_lagrange(_radial_tree_local(z, node->center[1], node->half_size[1]), Lz);
+
+	for(int a = 0; a < RADIAL_TREE_ORDER; a++)
+	for(int b = 0; b < RADIAL_TREE_ORDER; b++)
+		node->proxy_charges[a*RADIAL_TREE_ORDER + b] += w*Lr[a]*Lz[b];
+}
+
+// Compute the proxy charges of all nodes, from the leaves up. Children always have
+// a larger index than their parent, so iterating backwards visits the children first.
+static void
+_radial_tree_upward_pass(struct radial_tree *tree) {
+
+	for(size_t n = tree->N_nodes; n-- > 0;) {
+		struct radial_tree_node *node = &tree->nodes[n];
+
+		for(int k = 0; k < RADIAL_TREE_PROXIES; k++) node->proxy_charges[k] = 0.;
+
+		if(node->leaf) {
+			for(size_t i = node->start; i < node->end; i++)
+				if(tree->w[i] != 0.) _radial_tree_add_charge(node, tree->r[i], tree->z[i], tree->w[i]);
+		}
+		else {
+			for(int c = 0; c < 4; c++) {
+				if(node->children[c] < 0) continue;
+				struct radial_tree_node *child = &tree->nodes[node->children[c]];
+
+				for(int k = 0; k < RADIAL_TREE_PROXIES; k++) {
+					if(child->proxy_charges[k] == 0.) continue;
+
+					double r, z;
+					_radial_tree_proxy_position(child, k, &r, &z);
+					_radial_tree_add_charge(node, r, z, child->proxy_charges[k]);
+				}
+			}
+		}
+	}
+}
+
+static int32_t
+_radial_tree_new_node(struct radial_tree *tree) {
+
+	if(tree->N_nodes == tree->capacity) {
+		size_t capacity = tree->capacity == 0 ? 64 : 2*tree->capacity;
+		struct radial_tree_node *nodes = realloc(tree->nodes, capacity*sizeof(struct radial_tree_node));
+		if(nodes == NULL) return -1;
+		tree->nodes = nodes;
+		tree->capacity = capacity;
+	}
+
+	return (int32_t) tree->N_nodes++;
+}
+
+static void
+_radial_tree_bounding_box(struct radial_tree *tree, struct radial_tree_node *node) {
+	double min[2] = {tree->r[node->start], tree->z[node->start]};
+	double max[2] = {tree->r[node->start], tree->z[node->start]};
+
+	for(size_t i = node->start; i < node->end; i++) {
+		min[0] = fmin(min[0], tree->r[i]); max[0] = fmax(max[0], tree->r[i]);
+		min[1] = fmin(min[1], tree->z[i]); max[1] = fmax(max[1], tree->z[i]);
+	}
+
+	for(int k = 0; k < 2; k++) {
+		node->center[k] = (min[k] + max[k])/2;
+		node->half_size[k] = (max[k] - min[k])/2;
+	}
+
+	node->radius = norm_2d(node->half_size[0], node->half_size[1]);
+}
+
+static bool
+_radial_tree_build_node(struct radial_tree *tree, int32_t index, int depth, double *scratch, size_t *scratch_permutation) {
+
+	struct radial_tree_node *node = &tree->nodes[index];
+
+	_radial_tree_bounding_box(tree, node);
+
+	for(int c = 0; c < 4; c++) node->children[c] = -1;
+	node->leaf = (node->end - node->start <= RADIAL_TREE_LEAF_SIZE) || depth >= RADIAL_TREE_MAX_DEPTH || node->radius == 0.;
+
+	if(node->leaf) return true;
+
+	// Only split the dimensions which are not much smaller than the largest dimension,
+	// which keeps the children of long and thin nodes (for example a single electrode) close to square.
+	double largest = fmax(node->half_size[0], node->half_size[1]);
+	bool split_r = node->half_size[0] >= 0.5*largest;
+	bool split_z = node->half_size[1] >= 0.5*largest;
+
+	double center[2] = {node->center[0], node->center[1]};
+	size_t start = node->start, end = node->end;
+
+	// Counting sort of the rings into the (at most) four quadrants
+	size_t counts[4] = {0};
+
+	#define _QUADRANT(i) ((split_r && tree->r[i] > center[0]) | ((split_z && tree->z[i] > center[1]) << 1))
+
+	for(size_t i = start; i < end; i++) counts[_QUADRANT(i)]++;
+
+	size_t quadrant_start[4], position[4];
+	quadrant_start[0] = start;
+	for(int c = 1; c < 4; c++) quadrant_start[c] = quadrant_start[c-1] + counts[c-1];
+	for(int c = 0; c < 4; c++) position[c] = quadrant_start[c];
+
+	size_t N = end - start;
+	double *r = scratch, *z = scratch + N, *w = scratch + 2*N;
+
+	for(size_t i = start; i < end; i++) {
+		size_t j = position[_QUADRANT(i)]++ - start;
+		r[j] = tree->r[i];
+		z[j] = tree->z[i];
+		w[j] = tree->w[i];
+		scratch_permutation[j] = tree->permutation[i];
+	}
+
+	#undef _QUADRANT
+
+	memcpy(tree->r + start, r, N*sizeof(double));
+	memcpy(tree->z + start, z, N*sizeof(double));
+	memcpy(tree->w + start, w, N*sizeof(double));
+	memcpy(tree->permutation + start, scratch_permutation, N*sizeof(size_t));
+
+	for(int c = 0; c < 4; c++) {
+		if(counts[c] == 0) continue;
+
+		int32_t child = _radial_tree_new_node(tree);
+		if(child < 0) return false;
+
+		// Note: tree->nodes might have been reallocated
+		tree->nodes[index].children[c] = child;
+		tree->nodes[child].start = quadrant_start[c];
+		tree->nodes[child].end = quadrant_start[c] + counts[c];
+
+		if(!_radial_tree_build_node(tree, child, depth+1, scratch, scratch_permutation)) return false;
+	}
+
+	return true;
+}
+
+EXPORT void
+radial_tree_free(struct radial_tree *tree) {
+	if(tree == NULL) return;
+	free(tree->nodes);
+	free(tree->r);
+	free(tree->permutation);
+	free(tree);
+}
+
+static struct radial_tree*
+_radial_tree_allocate(size_t N, double theta) {
+	struct radial_tree *tree = calloc(1, sizeof(struct radial_tree));
+	if(tree == NULL) return NULL;
+
+	tree->theta = theta;
+	tree->N = N;
+
+	// Single allocation for r, z and w
+	tree->r = malloc(3*(N > 0 ? N : 1)*sizeof(double));
+	tree->permutation = malloc((N > 0 ? N : 1)*sizeof(size_t));
+
+	if(tree->r == NULL || tree->permutation == NULL) {
+		radial_tree_free(tree);
+		return NULL;
+	}
+
+	tree->z = tree->r + N;
+	tree->w = tree->r + 2*N;
+
+	for(size_t i = 0; i < N; i++) tree->permutation[i] = i;
+
+	return tree;
+}
+
+// Build the nodes of a tree of which the rings are filled in. The tree is freed if not enough memory is available.
+static struct radial_tree*
+_radial_tree_build_nodes(struct radial_tree *tree) {
+	if(tree == NULL || tree->N == 0) return tree;
+
+	size_t N = tree->N;
+	double *scratch = malloc(3*N*sizeof(double));
+	size_t *scratch_permutation = malloc(N*sizeof(size_t));
+
+	bool success = scratch != NULL && scratch_permutation != NULL;
+
+	if(success) {
+		int32_t root = _radial_tree_new_node(tree);
+		success = root == 0;
+
+		if(success) {
+			tree->nodes[root].start = 0;
+			tree->nodes[root].end = N;
+			success = _radial_tree_build_node(tree, root, 0, scratch, scratch_permutation);
+		}
+	}
+
+	free(scratch);
+	free(scratch_permutation);
+
+	if(!success) {
+		radial_tree_free(tree);
+		return NULL;
+	}
+
+	_radial_tree_upward_pass(tree);
+	return tree;
+}
+
+// Build the tree from the rings at the given positions. The charge of a ring is the charge
+// of its line element times the jacobian. The order of the rings is the order of the position buffer
+// (line element i, quadrature point k has index i*N_QUAD_2D + k).
+EXPORT struct radial_tree*
+radial_tree_build(double *charges, jacobian_buffer_2d jacobian_buffer, position_buffer_2d position_buffer, size_t N_lines, double theta) {
+
+	struct radial_tree *tree = _radial_tree_allocate(N_lines*N_QUAD_2D, theta);
+	if(tree == NULL) return NULL;
+
+	for(size_t i = 0; i < N_lines; i++)
+	for(int k = 0; k < N_QUAD_2D; k++) {
+		size_t index = i*N_QUAD_2D + k;
+		tree->r[index] = position_buffer[i][k][0];
+		tree->z[index] = position_buffer[i][k][1];
+		tree->w[index] = charges[i]*jacobian_buffer[i][k];
+	}
+
+	return _radial_tree_build_nodes(tree);
+}
+
+// Build the tree from rings at (r[i], z[i]), all charges are initially zero (see radial_tree_set_charges).
+struct radial_tree*
+radial_tree_build_rings(double *r, double *z, size_t N, double theta) {
+
+	struct radial_tree *tree = _radial_tree_allocate(N, theta);
+	if(tree == NULL) return NULL;
+
+	for(size_t i = 0; i < N; i++) {
+		tree->r[i] = r[i];
+		tree->z[i] = z[i];
+		tree->w[i] = 0.;
+	}
+
+	return _radial_tree_build_nodes(tree);
+}
+
+// Set new charges for the rings, where the charges are given in the original order (see radial_tree_build).
+void
+radial_tree_set_charges(struct radial_tree *tree, double *w) {
+	for(size_t i = 0; i < tree->N; i++) tree->w[i] = w[tree->permutation[i]];
+	_radial_tree_upward_pass(tree);
+}
+
+EXPORT size_t
+radial_tree_number_of_nodes(struct radial_tree *tree) {
+	return tree->N_nodes;
+}
+
+// Potential and field (radial and axial component) at (r0, z0). If field_out is NULL only the potential is computed.
+void
+radial_tree_potential_field(struct radial_tree *tree, double r0, double z0, double *potential_out, double field_out[2]) {
+
+	double potential = 0.;
+	double field[2] = {0., 0.};
+
+	double ring_potential, ring_field[2];
+	double *ring_field_p = field_out != NULL ? ring_field : NULL;
+
+	if(tree->N_nodes > 0) {
+		int32_t stack[4*RADIAL_TREE_MAX_DEPTH + 4];
+		int stack_size = 0;
+		stack[stack_size++] = 0;
+
+		while(stack_size > 0) {
+			struct radial_tree_node *node = &tree->nodes[stack[--stack_size]];
+
+			double distance = norm_2d(r0 - node->center[0], z0 - node->center[1]);
+
+			if(node->radius < tree->theta*distance) {
+				for(int k = 0; k < RADIAL_TREE_PROXIES; k++) {
+					double w = node->proxy_charges[k];
+					if(w == 0.) continue;
+
+					double r, z;
+					_radial_tree_proxy_position(node, k, &r, &z);
+					potential_field_radial_ring(r0, z0, r, z, &ring_potential, ring_field_p, NULL);
+
+					potential += w*ring_potential;
+					if(field_out != NULL) {
+						field[0] += w*ring_field[0];
+						field[1] += w*ring_field[1];
+					}
+				}
+			}
+			else if(node->leaf) {
+				for(size_t i = node->start; i < node->end; i++) {
+					double w = tree->w[i];
+					if(w == 0.) continue;
+
+					potential_field_radial_ring(r0, z0, tree->r[i], tree->z[i], &ring_potential, ring_field_p, NULL);
+
+					potential += w*ring_potential;
+					if(field_out != NULL) {
+						field[0] += w*ring_field[0];
+						field[1] += w*ring_field[1];
+					}
+				}
+			}
+			else {
+				for(int c = 0; c < 4; c++)
+					if(node->children[c] >= 0) stack[stack_size++] = node->children[c];
+			}
+		}
+	}
+
+	if(potential_out != NULL) *potential_out = potential;
+
+	if(field_out != NULL) {
+		field_out[0] = field[0];
+		field_out[1] = field[1];
+	}
+}
+
+EXPORT double
+radial_tree_potential(struct radial_tree *tree, double point[2]) {
+	double potential;
+	radial_tree_potential_field(tree, point[0], point[1], &potential, NULL);
+	return potential;
+}
+
+// Same as field_radial, but using the tree
+EXPORT void
+radial_tree_field(struct radial_tree *tree, double point[3], double result[3]) {
+	double r = norm_2d(point[0], point[1]);
+
+	double field[2];
+	radial_tree_potential_field(tree, r, point[2], NULL, field);
+
+	if(r >= MIN_DISTANCE_AXIS) {
+		result[0] = point[0]/r * field[0];
+		result[1] = point[1]/r * field[0];
+	}
+	else {
+		result[0] = 0.;
+		result[1] = 0.;
+	}
+	result[2] = field[1];
+}
@@ -0,0 +1,357 @@
+// Minimal portable threading layer. The Python side used to do all the
+// parallelization by splitting the work over Python threads (ctypes releases
+// the GIL). That partitioning is static, while the cost of a work item (a row of
+// the matrix, a particle trace) varies a lot. Therefore the parallel work is
+// scheduled inside C, on a pool of worker threads which is started once and then
+// kept alive for the lifetime of the process. Work items are handed out dynamically,
+// so threads that finish early keep taking work from the threads that are still busy.
+
+#ifdef _MSC_VER
+	#define WIN32_LEAN_AND_MEAN
+	#define NOMINMAX
+	#include <windows.h>
+#else
+	#include <pthread.h>
+	#include <unistd.h>
+#endif
+
+#ifdef __linux__
+	#include <sched.h>
+#endif
+
+#define THREAD_POOL_MAX_WORKERS 256
+
+typedef void (*thread_fun)(void *args, int thread_index);
+
+#ifdef _MSC_VER
+	typedef SRWLOCK _pool_mutex;
+	typedef CONDITION_VARIABLE _pool_cond;
+	#define _POOL_MUTEX_INIT SRWLOCK_INIT
+	#define _POOL_COND_INIT CONDITION_VARIABLE_INIT
+	#define _pool_lock(m) AcquireSRWLockExclusive(m)
+	#define _pool_unlock(m) ReleaseSRWLockExclusive(m)
+	#define _pool_wait(c, m) SleepConditionVariableSRW(c, m, INFINITE, 0)
+	#define _pool_broadcast(c) WakeAllConditionVariable(c)
+#else
+	typedef pthread_mutex_t _pool_mutex;
+	typedef pthread_cond_t _pool_cond;
+	#define _POOL_MUTEX_INIT PTHREAD_MUTEX_INITIALIZER
+	#define _POOL_COND_INIT PTHREAD_COND_INITIALIZER
+	#define _pool_lock(m) pthread_mutex_lock(m)
+	#define _pool_unlock(m) pthread_mutex_unlock(m)
+	#define _pool_wait(c, m) pthread_cond_wait(c, m)
+	#define _pool_broadcast(c) pthread_cond_broadcast(c)
+#endif
+
+// Atomically increment the counter and return its previous value.
+// Used to hand out work items dynamically to the threads.
+INLINE size_t
+atomic_fetch_increment(size_t *counter, size_t increment) {
+#ifdef _MSC_VER
+	return (size_t) InterlockedExchangeAdd64((volatile LONG64*) counter, (LONG64) increment);
+#else
+	return __atomic_fetch_add(counter, increment, __ATOMIC_RELAXED);
+#endif
+}
+
+// Atomically set the flag to true. Used for flags shared between the threads,
+// which are read after the threads are joined.
+INLINE void
+atomic_set_flag(bool *flag) {
+#ifdef _MSC_VER
+	InterlockedExchange8((volatile char*) flag, 1);
+#else
+	__atomic_store_n(flag, true, __ATOMIC_RELAXED);
+#endif
+}
+
+// Number of threads used when no explicit number is given (also used by
+// util.get_number_of_threads on the Python side). Given by the TRACEON_THREADS environment variable
+// if it is set, otherwise half the number of logical cores (assuming two hardware threads per core).
+// On Linux only the cores the process is allowed to run on are counted (taskset, cgroups, Slurm).
+EXPORT int
+number_of_threads(void) {
+	char *env = getenv("TRACEON_THREADS");
+
+	if(env != NULL && *env != '\0') {
+		int threads = atoi(env);
+		return threads > 0 ? threads : 1;
+	}
+
+#ifdef _MSC_VER
+	SYSTEM_INFO info;
+	GetSystemInfo(&info);
+	long cpu_count = (long) info.dwNumberOfProcessors;
+#else
+	long cpu_count = 0;
+	
+	#ifdef __linux__
+	cpu_set_t allowed;
+	if(sched_getaffinity(0, sizeof(allowed), &allowed) == 0) cpu_count = CPU_COUNT(&allowed);
+	#endif
+	
+	if(cpu_count <= 0) cpu_count = sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+
+	return cpu_count >= 2 ? (int) (cpu_count/2) : 1;
+}
+
+// The pool runs one job at a time. A job consists of the thread indices 1..N_tasks-1
+// of a call to run_threads, index 0 is executed by the calling thread.
+static struct {
+	_pool_mutex lock;
+	_pool_cond work_available;
+	_pool_cond work_done;
+
+	int N_workers;
+	bool busy;
+
+	thread_fun fun;
+	void *args;
+	int N_tasks;
+	int next_task;
+	int tasks_remaining;
+} _pool = {_POOL_MUTEX_INIT, _POOL_COND_INIT, _POOL_COND_INIT};
+
+#ifdef _MSC_VER
+static DWORD WINAPI _pool_worker(LPVOID unused) {
+#else
+static void* _pool_worker(void *unused) {
+#endif
+	_pool_lock(&_pool.lock);
+
+	for(;;) {
+		while(_pool.next_task >= _pool.N_tasks) _pool_wait(&_pool.work_available, &_pool.lock);
+
+		int index = _pool.next_task++;
+		thread_fun fun = _pool.fun;
+		void *args = _pool.args;
+
+		_pool_unlock(&_pool.lock);
+		fun(args, index);
+		_pool_lock(&_pool.lock);
+
+		if(--_pool.tasks_remaining == 0) _pool_broadcast(&_pool.work_done);
+	}
+
+	return 0;
+}
+
+#ifndef _MSC_VER
+// After a fork only the forking thread exists in the child, the
+// pool has to be started again when it's needed.
+static void _pool_prepare_fork(void) { pthread_mutex_lock(&_pool.lock); }
+static void _pool_parent_fork(void) { pthread_mutex_unlock(&_pool.lock); }
+static void _pool_child_fork(void) {
+	pthread_mutex_init(&_pool.lock, NULL);
+	pthread_cond_init(&_pool.work_available, NULL);
+	pthread_cond_init(&_pool.work_done, NULL);
+	_pool.N_workers = 0;
+	_pool.busy = false;
+	_pool.N_tasks = _pool.next_task = _pool.tasks_remaining = 0;
+}
+#endif
+
+// Start worker threads until at least N_workers are running. Should
+// be called with the pool locked. If a thread cannot be started the pool
+// continues with fewer workers (the calling thread picks up the remaining work).
+static void
+_pool_grow(int N_workers) {
+
+	N_workers = N_workers < THREAD_POOL_MAX_WORKERS ? N_workers : THREAD_POOL_MAX_WORKERS;
+
+#ifndef _MSC_VER
+	static bool atfork_registered = false;
+
+	if(!atfork_registered) {
+		pthread_atfork(_pool_prepare_fork, _pool_parent_fork, _pool_child_fork);
+		atfork_registered = true;
+	}
+#endif
+
+	while(_pool.N_workers < N_workers) {
+#ifdef _MSC_VER
+		HANDLE handle = CreateThread(NULL, 0, _pool_worker, NULL, 0, NULL);
+		if(handle == NULL) return;
+		CloseHandle(handle);
+#else
+		pthread_t handle;
+		if(pthread_create(&handle, NULL, _pool_worker, NULL) != 0) return;
+		pthread_detach(handle);
+#endif
+		_pool.N_workers++;
+	}
+}
+
+struct _thread_start_args {
+	thread_fun fun;
+	void *args;
+	int thread_index;
+	bool started;
+};
+
+#ifdef _MSC_VER
+static DWORD WINAPI _thread_start(LPVOID p) {
+	struct _thread_start_args *a = (struct _thread_start_args*) p;
+	a->fun(a->args, a->thread_index);
+	return 0;
+}
+#else
+static void* _thread_start(void *p) {
+	struct _thread_start_args *a = (struct _thread_start_args*) p;
+	a->fun(a->args, a->thread_index);
+	return NULL;
+}
+#endif
+
+// Run fun(args, i) for i = 0..N_threads-1 on newly created threads. Only
+// used when the pool is already busy, for example when run_threads is called
+// concurrently from multiple Python threads.
+static void
+_run_threads_spawn(thread_fun fun, void *args, int N_threads) {
+
+	struct _thread_start_args *start_args = malloc(N_threads * sizeof(struct _thread_start_args));
+
+#ifdef _MSC_VER
+	HANDLE *handles = malloc(N_threads * sizeof(HANDLE));
+#else
+	pthread_t *handles = malloc(N_threads * sizeof(pthread_t));
+#endif
+
+	if(start_args == NULL || handles == NULL) {
+		// Not able to allocate, do all the work on the calling thread
+		free(start_args);
+		free(handles);
+		for(int i = 0; i < N_threads; i++) fun(args, i);
+		return;
+	}
+
+	for(int i = 0; i < N_threads; i++) {
+		start_args[i].fun = fun;
+		start_args[i].args = args;
+		start_args[i].thread_index = i;
+	}
+
+	for(int i = 1; i < N_threads; i++) {
+#ifdef _MSC_VER
+		handles[i] = CreateThread(NULL, 0, _thread_start, &start_args[i], 0, NULL);
+		start_args[i].started = handles[i] != NULL;
+#else
+		start_args[i].started = pthread_create(&handles[i], NULL, _thread_start, &start_args[i]) == 0;
+#endif
+		// Could not start the thread, do the work on the calling thread instead
+		if(!start_args[i].started) fun(args, i);
+	}
+
+	fun(args, 0);
+
+	for(int i = 1; i < N_threads; i++) {
+		if(!start_args[i].started) continue;
+#ifdef _MSC_VER
+		WaitForSingleObject(handles[i], INFINITE);
+		CloseHandle(handles[i]);
+#else
+		pthread_join(handles[i], NULL);
+#endif
+	}
+
+	free(start_args);
+	free(handles);
+}
+
+// Run fun(args, i) for i = 0..N_threads-1, every call on its own thread. The calling
+// thread executes index zero, the other indices run on the thread pool. Returns when all
+// calls are finished. If N_threads <= 0 the number of threads is given by number_of_threads().
+void
+run_threads(thread_fun fun, void *args, int N_threads) {
+
+	if(N_threads <= 0) N_threads = number_of_threads();
+
+	if(N_threads == 1) {
+		fun(args, 0);
+		return;
+	}
+
+	_pool_lock(&_pool.lock);
+
+	if(_pool.busy) {
+		_pool_unlock(&_pool.lock);
+		_run_threads_spawn(fun, args, N_threads);
+		return;
+	}
+
+	_pool.busy = true;
+	_pool_grow(N_threads - 1);
+
+	_pool.fun = fun;
+	_pool.args = args;
+	_pool.N_tasks = N_threads;
+	_pool.next_task = 1;
+	_pool.tasks_remaining = N_threads - 1;
+	_pool_broadcast(&_pool.work_available);
+
+	_pool_unlock(&_pool.lock);
+
+	fun(args, 0);
+
+	_pool_lock(&_pool.lock);
+
+	// Execute the tasks that were not yet picked up by a worker (there might
+	// be fewer workers than tasks, if not all threads could be started)
+	while(_pool.next_task < _pool.N_tasks) {
+		int index = _pool.next_task++;
+		_pool_unlock(&_pool.lock);
+		fun(args, index);
+		_pool_lock(&_pool.lock);
+		_pool.tasks_remaining--;
+	}
+
+	while(_pool.tasks_remaining > 0) _pool_wait(&_pool.work_done, &_pool.lock);
+
+	_pool.N_tasks = _pool.next_task = 0;
+	_pool.busy = false;
+
+	_pool_unlock(&_pool.lock);
+}
+
+typedef void (*range_fun)(void *args, size_t start, size_t end, int thread_index);
+
+struct _parallel_for_args {
+	range_fun fun;
+	void *args;
+	size_t N;
+	size_t chunk_size;
+	size_t next;
+};
+
+static void
+_parallel_for_thread(void *args_p, int thread_index) {
+	struct _parallel_for_args *a = (struct _parallel_for_args*) args_p;
+
+	size_t start;
+	while( (start = atomic_fetch_increment(&a->next, a->chunk_size)) < a->N ) {
+		size_t end = start + a->chunk_size < a->N ? start + a->chunk_size : a->N;
+		a->fun(a->args, start, end, thread_index);
+	}
+}
+
+// Call fun(args, start, end, thread_index) on disjoint ranges covering 0..N-1. The
+// ranges are at most chunk_size long and are handed out dynamically to N_threads threads.
+// When chunk_size is zero a chunk size is chosen which gives every thread multiple chunks.
+void
+parallel_for(size_t N, size_t chunk_size, range_fun fun, void *args, int N_threads) {
+
+	if(N == 0) return;
+	if(N_threads <= 0) N_threads = number_of_threads();
+
+	if(chunk_size == 0) {
+		chunk_size = N / (8*(size_t)N_threads);
+		if(chunk_size == 0) chunk_size = 1;
+	}
+
+	if((N + chunk_size - 1)/chunk_size < (size_t) N_threads) N_threads = (int) ((N + chunk_size - 1)/chunk_size);
+
+	struct _parallel_for_args a = {fun, args, N, chunk_size, 0};
+	run_threads(_parallel_for_thread, &a, N_threads);
+}
+
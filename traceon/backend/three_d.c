@@ -14,6 +14,7 @@ EXPORT const int M_MAX_SYM = M_MAX;
 typedef double (*jacobian_buffer_3d)[N_TRIANGLE_QUAD];
 typedef double (*position_buffer_3d)[N_TRIANGLE_QUAD][3];
 typedef double (*vertices_3d)[3][3];
+typedef double (*vertices_3d_higher_order)[6][3];
 
 struct effective_point_charges_3d {
 	double *charges;
@@ -31,6 +32,148 @@ struct field_derivs_args {
 
 
 
+// Structure of arrays layout of the effective point charges. Every quadrature point
+// is stored at index i*N_TRIANGLE_QUAD + k in the x,y,z arrays. The weight w is the charge
+// of the element multiplied by the jacobian (and quadrature weight) of the point.
+// This layout allows the field evaluation to be vectorized over the source points.
+struct effective_point_charges_3d_soa {
+	double *x;
+	double *y;
+	double *z;
+	double *w;
+	size_t N; // Number of points
+};
+
+bool
+effective_point_charges_3d_to_soa(struct effective_point_charges_3d *eff, struct effective_point_charges_3d_soa *soa) {
+	size_t N = eff->N*N_TRIANGLE_QUAD;
+	
+	// One allocation for all four arrays
+	double *buffer = malloc(4*(N > 0 ? N : 1)*sizeof(double));
+	if(buffer == NULL) return false;
+	
+	soa->x = buffer;
+	soa->y = buffer + N;
+	soa->z = buffer + 2*N;
+	soa->w = buffer + 3*N;
+	soa->N = N;
+	
+	for(size_t i = 0; i < eff->N; i++)
+	for(int k = 0; k < N_TRIANGLE_QUAD; k++) {
+		size_t index = i*N_TRIANGLE_QUAD + k;
+		soa->x[index] = eff->positions[i][k][0];
+		soa->y[index] = eff->positions[i][k][1];
+		soa->z[index] = eff->positions[i][k][2];
+		soa->w[index] = eff->charges[i] * eff->jacobians[i][k];
+	}
+	
+	return true;
+}
+
+void
+free_effective_point_charges_3d_soa(struct effective_point_charges_3d_soa *soa) {
+	free(soa->x);
+	soa->x = soa->y = soa->z = soa->w = NULL;
+	soa->N = 0;
+}
+
+#if defined(__AVX__)
+INLINE double
+_horizontal_sum_avx(__m256d v) {
+	__m128d low = _mm256_castpd256_pd128(v);
+	__m128d high = _mm256_extractf128_pd(v, 1);
+	low = _mm_add_pd(low, high);
+	__m128d shuffled = _mm_unpackhi_pd(low, low);
+	return _mm_cvtsd_f64(_mm_add_sd(low, shuffled));
+}
+#endif
+
+// Compute the potential and field of all the point charges in a single pass. For every
+// source point 1/r and 1/r^3 are computed only once.
+void
+potential_field_3d_soa(double point[3], struct effective_point_charges_3d_soa *soa, double *potential, double field[3]) {
+	
+	double x0 = point[0], y0 = point[1], z0 = point[2];
+	double pot = 0., Ex = 0., Ey = 0., Ez = 0.;
+	
+	size_t i = 0;
+
+#if defined(__AVX512F__)
+	__m512d px = _mm512_set1_pd(x0), py = _mm512_set1_pd(y0), pz = _mm512_set1_pd(z0);
+	__m512d one = _mm512_set1_pd(1.0);
+	__m512d vpot = _mm512_setzero_pd(), vEx = _mm512_setzero_pd(), vEy = _mm512_setzero_pd(), vEz = _mm512_setzero_pd();
+	
+	for(; i + 8 <= soa->N; i += 8) {
+		__m512d dx = _mm512_sub_pd(px, _mm512_loadu_pd(soa->x + i));
+		__m512d dy = _mm512_sub_pd(py, _mm512_loadu_pd(soa->y + i));
+		__m512d dz = _mm512_sub_pd(pz, _mm512_loadu_pd(soa->z + i));
+		__m512d w = _mm512_loadu_pd(soa->w + i);
+		
+		__m512d r2 = _mm512_fmadd_pd(dx, dx, _mm512_fmadd_pd(dy, dy, _mm512_mul_pd(dz, dz)));
+		__m512d inv_r = _mm512_div_pd(one, _mm512_sqrt_pd(r2));
+		__m512d w_inv_r = _mm512_mul_pd(w, inv_r);
+		__m512d w_inv_r3 = _mm512_mul_pd(w_inv_r, _mm512_mul_pd(inv_r, inv_r));
+		
+		vpot = _mm512_add_pd(vpot, w_inv_r);
+		vEx = _mm512_fmadd_pd(w_inv_r3, dx, vEx);
+		vEy = _mm512_fmadd_pd(w_inv_r3, dy, vEy);
+		vEz = _mm512_fmadd_pd(w_inv_r3, dz, vEz);
+	}
+	
+	pot += _mm512_reduce_add_pd(vpot);
+	Ex += _mm512_reduce_add_pd(vEx);
+	Ey += _mm512_reduce_add_pd(vEy);
+	Ez += _mm512_reduce_add_pd(vEz);
+#elif defined(__AVX__)
+	__m256d px = _mm256_set1_pd(x0), py = _mm256_set1_pd(y0), pz = _mm256_set1_pd(z0);
+	__m256d one = _mm256_set1_pd(1.0);
+	__m256d vpot = _mm256_setzero_pd(), vEx = _mm256_setzero_pd(), vEy = _mm256_setzero_pd(), vEz = _mm256_setzero_pd();
+	
+	for(; i + 4 <= soa->N; i += 4) {
+		__m256d dx = _mm256_sub_pd(px, _mm256_loadu_pd(soa->x + i));
+		__m256d dy = _mm256_sub_pd(py, _mm256_loadu_pd(soa->y + i));
+		__m256d dz = _mm256_sub_pd(pz, _mm256_loadu_pd(soa->z + i));
+		__m256d w = _mm256_loadu_pd(soa->w + i);
+		
+		__m256d r2 = _mm256_add_pd(_mm256_mul_pd(dx, dx), _mm256_add_pd(_mm256_mul_pd(dy, dy), _mm256_mul_pd(dz, dz)));
+		__m256d inv_r = _mm256_div_pd(one, _mm256_sqrt_pd(r2));
+		__m256d w_inv_r = _mm256_mul_pd(w, inv_r);
+		__m256d w_inv_r3 = _mm256_mul_pd(w_inv_r, _mm256_mul_pd(inv_r, inv_r));
+		
+		vpot = _mm256_add_pd(vpot, w_inv_r);
+		vEx = _mm256_add_pd(vEx, _mm256_mul_pd(w_inv_r3, dx));
+		vEy = _mm256_add_pd(vEy, _mm256_mul_pd(w_inv_r3, dy));
+		vEz = _mm256_add_pd(vEz, _mm256_mul_pd(w_inv_r3, dz));
+	}
+	
+	pot += _horizontal_sum_avx(vpot);
+	Ex += _horizontal_sum_avx(vEx);
+	Ey += _horizontal_sum_avx(vEy);
+	Ez += _horizontal_sum_avx(vEz);
+#endif
+	
+	// Remaining points (or all points if no vector instructions are available)
+	for(; i < soa->N; i++) {
+		double dx = x0 - soa->x[i], dy = y0 - soa->y[i], dz = z0 - soa->z[i];
+		double inv_r = 1./norm_3d(dx, dy, dz);
+		double w_inv_r = soa->w[i]*inv_r;
+		double w_inv_r3 = w_inv_r*inv_r*inv_r;
+		
+		pot += w_inv_r;
+		Ex += w_inv_r3*dx;
+		Ey += w_inv_r3*dy;
+		Ez += w_inv_r3*dz;
+	}
+	
+	if(potential != NULL) *potential = pot/(4*M_PI);
+	
+	if(field != NULL) {
+		field[0] = Ex/(4*M_PI);
+		field[1] = Ey/(4*M_PI);
+		field[2] = Ez/(4*M_PI);
+	}
+}
+
 EXPORT double  
 potential_3d(double point[3], double *charges, jacobian_buffer_3d jacobian_buffer, position_buffer_3d position_buffer, size_t N_vertices) {  
 	
@@ -60,6 +203,173 @@ field_dot_normal_3d(double x0, double y0, double z0, double x, double y, double
     return normal[0]*Ex + normal[1]*Ey + normal[2]*Ez;
 }
 
+// Parameters (alpha, beta) of the point on a curved triangle closest to the target. A few Gauss-Newton
+// iterations are used to find the closest point on the (extended) surface. If this point falls
+// outside the reference triangle the closest point is searched for on each of the three edges instead.
+static void
+_closest_point_higher_order(triangle6 t, double target[3], double *alpha_out, double *beta_out) {
+	double alpha = 1/3., beta = 1/3.;
+	*alpha_out = alpha;
+	*beta_out = beta;
+	
+	for(int it = 0; it < 8; it++) {
+		double pos[3], da[3], db[3];
+		_higher_order_triangle_3d(alpha, beta, t, pos, da, db);
+		
+		double r[3] = {target[0]-pos[0], target[1]-pos[1], target[2]-pos[2]};
+		double aa = dot_3d(da, da), ab = dot_3d(da, db), bb = dot_3d(db, db);
+		double ra = dot_3d(r, da), rb = dot_3d(r, db);
+		double det = aa*bb - ab*ab;
+		
+		if(det <= 0.) break;
+		
+		alpha += (bb*ra - ab*rb)/det;
+		beta += (aa*rb - ab*ra)/det;
+		
+		// Keep the iteration close to the reference triangle
+		alpha = fmin(fmax(alpha, -1.), 2.);
+		beta = fmin(fmax(beta, -1.), 2.);
+	}
+	
+	if(alpha >= 0. && beta >= 0. && alpha + beta <= 1.) {
+		*alpha_out = alpha;
+		*beta_out = beta;
+		return;
+	}
+	
+	double corners[3][2] = {{0., 0.}, {1., 0.}, {0., 1.}};
+	double min_distance = 0.;
+	
+	for(int s = 0; s < 3; s++) {
+		double *B = corners[s], *C = corners[(s+1)%3];
+		double e[2] = {C[0] - B[0], C[1] - B[1]};
+		double tau = 0.5, pos[3];
+		
+		for(int it = 0; it < 8; it++) {
+			double da[3], db[3];
+			_higher_order_triangle_3d(B[0] + tau*e[0], B[1] + tau*e[1], t, pos, da, db);
+			
+			double tangent[3] = {e[0]*da[0] + e[1]*db[0], e[0]*da[1] + e[1]*db[1], e[0]*da[2] + e[1]*db[2]};
+			double r[3] = {target[0]-pos[0], target[1]-pos[1], target[2]-pos[2]};
+			
+			tau += dot_3d(r, tangent)/dot_3d(tangent, tangent);
+			tau = fmin(fmax(tau, 0.), 1.);
+		}
+		
+		double da[3], db[3];
+		_higher_order_triangle_3d(B[0] + tau*e[0], B[1] + tau*e[1], t, pos, da, db);
+		double distance = distance_3d(pos, target);
+		
+		// Seeded from the first edge, since infinities are assumed absent under -ffast-math
+		if(s == 0 || distance < min_distance) {
+			min_distance = distance;
+			*alpha_out = B[0] + tau*e[0];
+			*beta_out = B[1] + tau*e[1];
+		}
+	}
+}
+
+// Contribution of the triangle (apex, F + x0*e, F + x1*e) in reference coordinates to
+// potential_or_flux_triangle_higher_order. F is the foot of the perpendicular from the apex onto the
+// opposite edge and e the unit vector along that edge (both measured in the metric of the surface at the apex),
+// d is the distance between the apex and F. Substituting x = d*sinh(s) and
+// integrating in (u, s), with u the Duffy coordinate running from the apex (u=0) to the edge (u=1),
+// removes the near singularities of thin triangles. The u direction is split geometrically towards the
+// apex to resolve targets at a small distance from the surface.
+static double
+_higher_order_polar_triangle(triangle6 t, double target[3], double *normal, double apex[2],
+		double F[2], double e[2], double d, double x0, double x1, int levels) {
+	
+	double s0 = asinh(x0/d), s1 = asinh(x1/d);
+	double dF[2] = {F[0] - apex[0], F[1] - apex[1]};
+	double area_factor = fabs(dF[0]*e[1] - dF[1]*e[0]);
+
+	double sum = 0.;
+	double u_high = 1.;
+	
+	for(int l = 0; l <= levels; l++) {
+		double u_low = l == levels ? 0. : u_high/4.;
+		
+		for(int i = 0; i < N_QUAD_2D; i++)
+		for(int j = 0; j < N_QUAD_2D; j++) {
+			double u = u_low + (u_high - u_low)*(1 + GAUSS_QUAD_POINTS[i])/2;
+			double s = s0 + (s1 - s0)*(1 + GAUSS_QUAD_POINTS[j])/2;
+			double x = d*sinh(s);
+			
+			double w = GAUSS_QUAD_WEIGHTS[i]*GAUSS_QUAD_WEIGHTS[j]/4 * (u_high - u_low)*(s1 - s0)
+				* u*area_factor*d*cosh(s);
+			
+			double alpha = apex[0] + u*(dF[0] + x*e[0]);
+			double beta = apex[1] + u*(dF[1] + x*e[1]);
+			
+			double pos[3], jac;
+			position_and_jacobian_3d_higher_order(alpha, beta, t, pos, &jac);
+			
+			if(normal == NULL)
+				sum += w*jac*potential_3d_point(target[0], target[1], target[2], pos[0], pos[1], pos[2], NULL);
+			else
+				sum += w*jac*field_dot_normal_3d(target[0], target[1], target[2], pos[0], pos[1], pos[2], normal);
+		}
+		
+		u_high = u_low;
+	}
+	
+	return sum;
+}
+
+// Integral of the potential (normal == NULL) or the field dot normal of a unit charge density on a curved
+// triangle, evaluated at target. The target is allowed to be on (or close to) the triangle: the reference triangle
+// is split in three triangles meeting at the point closest to the target, which are then integrated
+// in (scaled) polar coordinates around this point (see _higher_order_polar_triangle). The kernels are the same as used
+// with the jacobian buffers (potential_3d_point, field_dot_normal_3d).
+EXPORT double
+potential_or_flux_triangle_higher_order(triangle6 t, double target[3], double *normal) {
+	double apex[2];
+	_closest_point_higher_order(t, target, &apex[0], &apex[1]);
+	
+	// Metric of the surface at the closest point, used to measure lengths and angles in the reference triangle
+	double pos0[3], da[3], db[3];
+	_higher_order_triangle_3d(apex[0], apex[1], t, pos0, da, db);
+	double g_aa = dot_3d(da, da), g_ab = dot_3d(da, db), g_bb = dot_3d(db, db);
+	
+	// Number of geometric refinements needed to resolve the distance between target and surface
+	double size = sqrt(fmax(g_aa, g_bb));
+	double h = distance_3d(pos0, target);
+	int levels = h > 0. ? (int) ceil(log(size/h)/log(4.)) : 0;
+	levels = levels < 0 ? 0 : (levels > 12 ? 12 : levels);
+	
+	double corners[3][2] = {{0., 0.}, {1., 0.}, {0., 1.}};
+	double sum = 0.;
+	
+	for(int s = 0; s < 3; s++) {
+		double *B = corners[s], *C = corners[(s+1)%3];
+		
+		double e[2] = {C[0] - B[0], C[1] - B[1]};
+		double length = sqrt(g_aa*e[0]*e[0] + 2*g_ab*e[0]*e[1] + g_bb*e[1]*e[1]);
+		e[0] /= length, e[1] /= length;
+		
+		double AB[2] = {B[0] - apex[0], B[1] - apex[1]};
+		double xB = -(g_aa*AB[0]*e[0] + g_ab*(AB[0]*e[1] + AB[1]*e[0]) + g_bb*AB[1]*e[1]);
+		
+		double F[2] = {B[0] + xB*e[0], B[1] + xB*e[1]};
+		double AF[2] = {F[0] - apex[0], F[1] - apex[1]};
+		double d = sqrt(g_aa*AF[0]*AF[0] + 2*g_ab*AF[0]*AF[1] + g_bb*AF[1]*AF[1]);
+		
+		if(d < 1e-12*length) continue; // Closest point lies on this edge
+		
+		double x0 = -xB, x1 = length - xB; // Positions of B and C relative to F
+		
+		if(x0 < 0. && x1 > 0.) {
+			sum += _higher_order_polar_triangle(t, target, normal, apex, F, e, d, x0, 0., levels);
+			sum += _higher_order_polar_triangle(t, target, normal, apex, F, e, d, 0., x1, levels);
+		}
+		else
+			sum += _higher_order_polar_triangle(t, target, normal, apex, F, e, d, x0, x1, levels);
+	}
+	
+	return sum;
+}
+
 EXPORT void
 field_3d(double point[3], double result[3], double *charges,
 	jacobian_buffer_3d jacobian_buffer, position_buffer_3d position_buffer, size_t N_vertices) {
@@ -69,57 +379,56 @@ field_3d(double point[3], double result[3], double *charges,
 	for(int i = 0; i < N_vertices; i++) {
 		for(int k = 0; k < N_TRIANGLE_QUAD; k++) {
 			double *pos = &position_buffer[i][k][0];
-			double field_x = dx1_potential_3d_point(point[0], point[1], point[2], pos[0], pos[1], pos[2], NULL);
-			double field_y = dy1_potential_3d_point(point[0], point[1], point[2], pos[0], pos[1], pos[2], NULL);
-			double field_z = dz1_potential_3d_point(point[0], point[1], point[2], pos[0], pos[1], pos[2], NULL);
-		
-			Ex -= charges[i] * jacobian_buffer[i][k] * field_x;
-			Ey -= charges[i] * jacobian_buffer[i][k] * field_y;
-			Ez -= charges[i] * jacobian_buffer[i][k] * field_z;
+			double dx = point[0] - pos[0], dy = point[1] - pos[1], dz = point[2] - pos[2];
+			
+			// Compute the square root only once for all three components
+			double inv_r = 1./norm_3d(dx, dy, dz);
+			double factor = charges[i] * jacobian_buffer[i][k] * inv_r*inv_r*inv_r;
+			
+			Ex += factor * dx;
+			Ey += factor * dy;
+			Ez += factor * dz;
 		}
 	}
 		
-	result[0] = Ex;
-	result[1] = Ey;
-	result[2] = Ez;
+	result[0] = Ex/(4*M_PI);
+	result[1] = Ey/(4*M_PI);
+	result[2] = Ez/(4*M_PI);
 }
 
 
 
-EXPORT void
-axial_coefficients_3d(double *restrict charges,
-	jacobian_buffer_3d restrict jacobian_buffer,
-	position_buffer_3d restrict position_buffer,
-	double *trig_cos_buffer_p, double *trig_sin_buffer_p,
-	size_t N_v,
-	double *restrict zs, double *restrict output_coeffs_p, size_t N_z) {
-		
-	double (*output_coeffs)[2][NU_MAX][M_MAX] = (double (*)[2][NU_MAX][M_MAX]) output_coeffs_p;
-		
-	double (*trig_cos_buffer)[N_TRIANGLE_QUAD][M_MAX] = (double (*)[N_TRIANGLE_QUAD][M_MAX]) trig_cos_buffer_p;
-	double (*trig_sin_buffer)[N_TRIANGLE_QUAD][M_MAX] = (double (*)[N_TRIANGLE_QUAD][M_MAX]) trig_sin_buffer_p;
+struct _axial_coefficients_3d_args {
+	double *charges;
+	jacobian_buffer_3d jacobian_buffer;
+	position_buffer_3d position_buffer;
+	double (*trig_cos_buffer)[N_TRIANGLE_QUAD][M_MAX];
+	double (*trig_sin_buffer)[N_TRIANGLE_QUAD][M_MAX];
+	size_t N_v;
+	double *zs;
+	double (*output_coeffs)[2][NU_MAX][M_MAX];
+};
 
+static void
+_axial_coefficients_3d_range(void *args_p, size_t start, size_t end, int thread_index) {
+	struct _axial_coefficients_3d_args *args = (struct _axial_coefficients_3d_args*) args_p;
+	
+	double *restrict charges = args->charges;
+	jacobian_buffer_3d restrict jacobian_buffer = args->jacobian_buffer;
+	position_buffer_3d restrict position_buffer = args->position_buffer;
+	double (*trig_cos_buffer)[N_TRIANGLE_QUAD][M_MAX] = args->trig_cos_buffer;
+	double (*trig_sin_buffer)[N_TRIANGLE_QUAD][M_MAX] = args->trig_sin_buffer;
+	size_t N_v = args->N_v;
+	double *restrict zs = args->zs;
+	double (*output_coeffs)[2][NU_MAX][M_MAX] = args->output_coeffs;
+	
 	double factorial[NU_MAX][M_MAX] = {
 		{1.0,1.0,0.5,0.1666666666666666,0.04166666666666666,0.008333333333333334,0.001388888888888889,1.984126984126984E-4},
 		{0.5,0.1666666666666666,0.04166666666666666,0.008333333333333334,0.001388888888888889,1.984126984126984E-4,2.48015873015873E-5,2.755731922398589E-6},
 		{0.04166666666666666,0.008333333333333334,0.001388888888888889,1.984126984126984E-4,2.48015873015873E-5,2.755731922398589E-6,2.755731922398589E-7,2.505210838544172E-8},
 		{0.001388888888888889,1.984126984126984E-4,2.48015873015873E-5,2.755731922398589E-6,2.755731922398589E-7,2.505210838544172E-8,2.08767569878681E-9,1.605904383682161E-10}};
-		
-	for(int h = 0; h < N_v; h++)
-	for(int k = 0; k < N_TRIANGLE_QUAD; k++)
-	for(int m = 0; m < M_MAX; m++) {
-		
-		double x = position_buffer[h][k][0];
-		double y = position_buffer[h][k][1];
-		double mu = atan2(y, x);
-			
-		// The integration factor needs to be adjusted for m=0, since the
-		// cos(m*phi) term in the integral vanishes.
-		trig_cos_buffer[h][k][m] = (1./M_PI) * cos(m*mu) * (m == 0 ? 1/2. : 1.);
-		trig_sin_buffer[h][k][m] = (1./M_PI) * sin(m*mu);
-	}
-		
-	for (int i=0; i < N_z; i++) 
+	
+	for (size_t i=start; i < end; i++) 
 	for(int h = 0; h < N_v; h++)
 	for (int k=0; k < N_TRIANGLE_QUAD; k++) {
 		double x = position_buffer[h][k][0];
@@ -197,6 +506,40 @@ axial_coefficients_3d(double *restrict charges,
 	}
 }
 
+EXPORT void
+axial_coefficients_3d(double *restrict charges,
+	jacobian_buffer_3d restrict jacobian_buffer,
+	position_buffer_3d restrict position_buffer,
+	double *trig_cos_buffer_p, double *trig_sin_buffer_p,
+	size_t N_v,
+	double *restrict zs, double *restrict output_coeffs_p, size_t N_z, int N_threads) {
+		
+	double (*output_coeffs)[2][NU_MAX][M_MAX] = (double (*)[2][NU_MAX][M_MAX]) output_coeffs_p;
+		
+	double (*trig_cos_buffer)[N_TRIANGLE_QUAD][M_MAX] = (double (*)[N_TRIANGLE_QUAD][M_MAX]) trig_cos_buffer_p;
+	double (*trig_sin_buffer)[N_TRIANGLE_QUAD][M_MAX] = (double (*)[N_TRIANGLE_QUAD][M_MAX]) trig_sin_buffer_p;
+		
+	for(int h = 0; h < N_v; h++)
+	for(int k = 0; k < N_TRIANGLE_QUAD; k++)
+	for(int m = 0; m < M_MAX; m++) {
+		
+		double x = position_buffer[h][k][0];
+		double y = position_buffer[h][k][1];
+		double mu = atan2(y, x);
+			
+		// The integration factor needs to be adjusted for m=0, since the
+		// cos(m*phi) term in the integral vanishes.
+		trig_cos_buffer[h][k][m] = (1./M_PI) * cos(m*mu) * (m == 0 ? 1/2. : 1.);
+		trig_sin_buffer[h][k][m] = (1./M_PI) * sin(m*mu);
+	}
+	
+	struct _axial_coefficients_3d_args args = {charges, jacobian_buffer, position_buffer,
+		trig_cos_buffer, trig_sin_buffer, N_v, zs, output_coeffs};
+	
+	// Every z is independent, and writes to its own output coefficients
+	parallel_for(N_z, 1, _axial_coefficients_3d_range, &args, N_threads);
+}
+
 EXPORT double
 potential_3d_derivs(double point[3], double *zs, double *coeffs_p, size_t N_z) {
 
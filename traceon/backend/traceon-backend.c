@@ -1,3 +1,8 @@
+// Needed for sched_getaffinity (see number_of_threads), has to be defined before any system header is included
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+	#define _GNU_SOURCE
+#endif
+
 #include <stdio.h>
 #include <assert.h>
 #include <math.h>
@@ -5,8 +10,14 @@
 #include <stdint.h>
 #include <stdbool.h>
 #include <time.h>
+#include <string.h>
+
+#if defined(__AVX__)
+#include <immintrin.h>
+#endif
 
 #include "definitions.c"
+#include "threads.c"
 #include "elliptic.c"
 #include "kronrod.c"
 #include "utilities_2d.c"
@@ -15,11 +26,17 @@
 
 #include "three_d_point.c"
 #include "three_d.c"
+#include "octree.c"
 
 #include "radial_ring.c"
 #include "radial.c"
+#include "radial_tree.c"
+#include "adaptive_quadrature.c"
 
 #include "tracing.c"
+#include "compiled_field.c"
+#include "iterative.c"
+#include "hmatrix.c"
 
 
 
@@ -4,111 +4,435 @@ typedef double (*positions_3d)[6];
 
 #define TRACING_STEP_MAX 0.01
 
-EXPORT const size_t TRACING_BLOCK_SIZE = (size_t) 1e5;
+// Embedded Runge-Kutta pairs used by the tracer. Since the field does not depend
+// on time the nodes (c coefficients) of the methods are not needed.
+//
+// RKF45: Fehlberg's 4(5) pair https://en.wikipedia.org/wiki/Runge%E2%80%93Kutta%E2%80%93Fehlberg_method
+// DOP853: Dormand-Prince 8(5,3) pair, coefficients from the DOP853 code by E. Hairer and G. Wanner,
+//	see Solving Ordinary Differential Equations I, Hairer, Norsett and Wanner (1993).
+// BOGACKI_SHAMPINE: the 3(2) pair by P. Bogacki and L.F. Shampine (1989), cheap but low order. Useful for previews.
 
-const double A[]  = {0.0, 2./9., 1./3., 3./4., 1., 5./6.};	// https://en.wikipedia.org/wiki/Runge%E2%80%93Kutta%E2%80%93Fehlberg_method
-const double B6[] = {65./432., -5./16., 13./16., 4./27., 5./144.};
-const double B5[] = {-17./12., 27./4., -27./5., 16./15.};
-const double B4[] = {69./128., -243./128., 135./64.};
-const double B3[] = {1./12., 1./4.};
-const double B2[] = {2./9.};
-const double CH[] = {47./450., 0., 12./25., 32./225., 1./30., 6./25.};
-const double CT[] = {-1./150., 0., 3./100., -16./75., -1./20., 6./25.};
+enum tracing_method {
+	TRACING_RKF45 = 0,
+	TRACING_DOP853 = 1,
+	TRACING_BOGACKI_SHAMPINE = 2
+};
+
+#define RK_MAX_STAGES 12
+
+struct runge_kutta_tableau {
+	int stages;
+	double a[RK_MAX_STAGES][RK_MAX_STAGES];
+	double b[RK_MAX_STAGES]; // Weights of the propagated solution
+	double e[RK_MAX_STAGES]; // Weights giving the error estimate
+	double e3[RK_MAX_STAGES]; // Weights giving the secondary error estimate (only DOP853)
+	bool combined_error; // Combine both error estimates
+	double exponent; // Exponent used in the step size control
+	bool fsal; // Last stage is evaluated at the new solution ('first same as last')
+	double step_max; // Maximum distance travelled in a single step
+};
+
+static const struct runge_kutta_tableau RKF45_TABLEAU = {
+	.stages = 6,
+	.a = {
+		{0.},
+		{2./9.},
+		{1./12., 1./4.},
+		{69./128., -243./128., 135./64.},
+		{-17./12., 27./4., -27./5., 16./15.},
+		{65./432., -5./16., 13./16., 4./27., 5./144.}},
+	.b = {47./450., 0., 12./25., 32./225., 1./30., 6./25.},
+	.e = {-1./150., 0., 3./100., -16./75., -1./20., 6./25.},
+	.exponent = 1./5.,
+	.fsal = false,
+	.step_max = TRACING_STEP_MAX
+};
+
+static const struct runge_kutta_tableau BOGACKI_SHAMPINE_TABLEAU = {
+	.stages = 4,
+	.a = {
+		{0.},
+		{1./2.},
+		{0., 3./4.},
+		{2./9., 1./3., 4./9.}},
+	.b = {2./9., 1./3., 4./9., 0.},
+	.e = {2./9. - 7./24., 1./3. - 1./4., 4./9. - 1./3., -1./8.},
+	.exponent = 1./3.,
+	.fsal = true,
+	.step_max = TRACING_STEP_MAX
+};
+
+#define DOP853_B {5.42937341165687622380535766363e-2, 0., 0., 0., 0., 4.45031289275240888144113950566, \
+	1.89151789931450038304281599044, -5.8012039600105847814672114227, 3.1116436695781989440891606237e-1, \
+	-1.52160949662516078556178806805e-1, 2.01365400804030348374776537501e-1, 4.47106157277725905176885569043e-2}
+
+static const struct runge_kutta_tableau DOP853_TABLEAU = {
+	.stages = 12,
+	.a = {
+		{0.},
+		{5.26001519587677318785587544488e-2},
+		{1.97250569845378994544595329183e-2, 5.91751709536136983633785987549e-2},
+		{2.95875854768068491816892993775e-2, 0., 8.87627564304205475450678981324e-2},
+		{2.41365134159266685502369798665e-1, 0., -8.84549479328286085344864962717e-1, 9.24834003261792003115737966543e-1},
+		{3.7037037037037037037037037037e-2, 0., 0., 1.70828608729473871279604482173e-1, 1.25467687566822425016691814123e-1},
+		{3.7109375e-2, 0., 0., 1.70252211019544039314978060272e-1, 6.02165389804559606850219397283e-2, -1.7578125e-2},
+		{3.70920001185047927108779319836e-2, 0., 0., 1.70383925712239993810214054705e-1, 1.07262030446373284651809199168e-1,
+			-1.53194377486244017527936158236e-2, 8.27378916381402288758473766002e-3},
+		{6.24110958716075717114429577812e-1, 0., 0., -3.36089262944694129406857109825, -8.68219346841726006818189891453e-1,
+			2.75920996994467083049415600797e1, 2.01540675504778934086186788979e1, -4.34898841810699588477366255144e1},
+		{4.77662536438264365890433908527e-1, 0., 0., -2.48811461997166764192642586468, -5.90290826836842996371446475743e-1,
+			2.12300514481811942347288949897e1, 1.52792336328824235832596922938e1, -3.32882109689848629194453265587e1,
+			-2.03312017085086261358222928593e-2},
+		{-9.3714243008598732571704021658e-1, 0., 0., 5.18637242884406370830023853209, 1.09143734899672957818500254654,
+			-8.14978701074692612513997267357, -1.85200656599969598641566180701e1, 2.27394870993505042818970056734e1,
+			2.49360555267965238987089396762, -3.0467644718982195003823669022},
+		{2.27331014751653820792359768449, 0., 0., -1.05344954667372501984066689879e1, -2.00087205822486249909675718444,
+			-1.79589318631187989172765950534e1, 2.79488845294199600508499808837e1, -2.85899827713502369474065508674,
+			-8.87285693353062954433549289258, 1.23605671757943030647266201528e1, 6.43392746015763530355970484046e-1}},
+	.b = DOP853_B,
+	.e = {0.1312004499419488073250102996e-01, 0., 0., 0., 0., -0.1225156446376204440720569753e+01,
+		-0.4957589496572501915214079952, 0.1664377182454986536961530415e+01, -0.3503288487499736816886487290,
+		0.3341791187130174790297318841, 0.8192320648511571246570742613e-01, -0.2235530786388629525884427845e-01},
+	// b minus the weights of the embedded third order method
+	.e3 = {5.42937341165687622380535766363e-2 - 0.244094488188976377952755905512, 0., 0., 0., 0., 4.45031289275240888144113950566,
+		1.89151789931450038304281599044, -5.8012039600105847814672114227, 3.1116436695781989440891606237e-1 - 0.733846688281611857341361741547,
+		-1.52160949662516078556178806805e-1, 2.01365400804030348374776537501e-1, 4.47106157277725905176885569043e-2 - 0.220588235294117647058823529412e-01},
+	.combined_error = true,
+	.exponent = 1./8.,
+	.fsal = false,
+	// The same maximum step as the other methods. Larger steps would sample the field more sparsely
+	// than RKF45 (twelve evaluations over ten times the distance) and could step over small features in the field.
+	.step_max = TRACING_STEP_MAX
+};
+
+static const struct runge_kutta_tableau*
+runge_kutta_tableau(enum tracing_method method) {
+	switch(method) {
+		case TRACING_DOP853: return &DOP853_TABLEAU;
+		case TRACING_BOGACKI_SHAMPINE: return &BOGACKI_SHAMPINE_TABLEAU;
+		default: return &RKF45_TABLEAU;
+	}
+}
 
 typedef void (*field_fun)(double pos[6], double field[3], void* args);
 
-void
-produce_new_y(double y[6], double ys[6][6], double ks[6][6], size_t index) {
+// Time derivative of the state y = (x, y, z, vx, vy, vz)
+INLINE void
+particle_derivative(double y[6], double dy[6], field_fun ff, void *args) {
+	double field[3] = { 0. };
+	ff(y, field, args);
 	
-	const double* coefficients[] = {NULL, B2, B3, B4, B5, B6};
+	dy[0] = y[3];
+	dy[1] = y[4];
+	dy[2] = y[5];
+	dy[3] = EM*field[0];
+	dy[4] = EM*field[1];
+	dy[5] = EM*field[2];
+}
+
+// Error of a step, given the weights of an error estimate. The position and velocity
+// errors are combined by multiplying the velocity error by the step size.
+static double
+step_error(const double *weights, double F[RK_MAX_STAGES][6], int stages, double h) {
+	double max_position_error = 0.0;
+	double max_velocity_error = 0.0;
+
+	for(int i = 0; i < 3; i++) {
+		double err = 0.0;
+		for(int j = 0; j < stages; j++) err += weights[j]*h*F[j][i];
+		if(fabs(err) > max_position_error) max_position_error = fabs(err);
+	}
+	
+	for(int i = 3; i < 6; i++) {
+		double err = 0.0;
+		for(int j = 0; j < stages; j++) err += weights[j]*h*F[j][i];
+		if(fabs(err) > max_velocity_error) max_velocity_error = fabs(err);
+	}
+	
+	return max_position_error + h*max_velocity_error;
+}
+
+// Take a single step of size h starting from y, where F[0] should already contain
+// the derivative at y. Fills in the other stages of F and the new state y_new.
+// Returns the estimated error of the step.
+static double
+runge_kutta_step(const struct runge_kutta_tableau *rk, double y[6], double h, double F[RK_MAX_STAGES][6], double y_new[6],
+		field_fun field, void *args) {
+	
+	for(int s = 1; s < rk->stages; s++) {
+		double ys[6];
+		
+		for(int i = 0; i < 6; i++) {
+			double sum = 0.0;
+			for(int j = 0; j < s; j++) sum += rk->a[s][j]*F[j][i];
+			ys[i] = y[i] + h*sum;
+		}
+		
+		particle_derivative(ys, F[s], field, args);
+	}
 	
 	for(int i = 0; i < 6; i++) {
+		double sum = 0.0;
+		for(int j = 0; j < rk->stages; j++) sum += rk->b[j]*F[j][i];
+		y_new[i] = y[i] + h*sum;
+	}
+	
+	double error = step_error(rk->e, F, rk->stages, h);
+	
+	if(rk->combined_error) {
+		// Combination of the fifth and third order error estimates, as in DOP853
+		double error3 = step_error(rk->e3, F, rk->stages, h);
+		double denominator = sqrt(error*error + 0.01*error3*error3);
+		error = denominator > 0. ? error*error/denominator : 0.;
+	}
+	
+	return error;
+}
+
+// State of the adaptive integration of a single particle.
+struct tracer {
+	const struct runge_kutta_tableau *rk;
+	field_fun field;
+	void *args;
+	double atol;
+	
+	double t;
+	double y[6];
+	double F[RK_MAX_STAGES][6]; // Stage derivatives, F[0] is the derivative at y
+	double h, hmax;
+	
+	// State at the start of the last accepted step, used to interpolate within the step
+	double t_prev;
+	double y_prev[6];
+	double F_prev[6];
+};
+
+static void
+tracer_init(struct tracer *tr, double t, double y[6], field_fun field, double atol, int method, void *args) {
+	tr->rk = runge_kutta_tableau(method);
+	tr->field = field;
+	tr->args = args;
+	tr->atol = atol;
+	
+	tr->t = t;
+	for(int i = 0; i < 6; i++) tr->y[i] = y[i];
+	
+	double V = norm_3d(y[3], y[4], y[5]);
+	tr->hmax = tr->rk->step_max/V;
+	tr->h = tr->hmax;
+	
+	// The derivative at the start of the step does not change when a step is
+	// rejected, and is known after an accepted step when the method is FSAL.
+	particle_derivative(tr->y, tr->F[0], field, args);
+}
+
+static bool
+tracer_in_bounds(struct tracer *tr, double bounds[3][2]) {
+	double *y = tr->y;
+	
+	return (bounds[0][0] <= y[0]) && (y[0] <= bounds[0][1]) &&
+		   (bounds[1][0] <= y[1]) && (y[1] <= bounds[1][1]) &&
+		   (bounds[2][0] <= y[2]) && (y[2] <= bounds[2][1]);
+}
+
+// Attempt a single step, returns whether the step was accepted. In
+// both cases the step size is adapted for the next attempt.
+static bool
+tracer_try_step(struct tracer *tr) {
+	const struct runge_kutta_tableau *rk = tr->rk;
+	
+	double y_new[6];
+	double error = runge_kutta_step(rk, tr->y, tr->h, tr->F, y_new, tr->field, tr->args);
+	bool accepted = error <= tr->atol;
+	
+	if(accepted) {
+		tr->t_prev = tr->t;
 		
-		ys[index][i] = y[i];
+		for(int i = 0; i < 6; i++) {
+			tr->y_prev[i] = tr->y[i];
+			tr->F_prev[i] = tr->F[0][i];
+			tr->y[i] = y_new[i];
+		}
 		
-		for(int j = 0; j < index; j++) 
-			ys[index][i] += coefficients[index][j]*ks[j][i];
+		tr->t += tr->h;
+		
+		if(rk->fsal) for(int i = 0; i < 6; i++) tr->F[0][i] = tr->F[rk->stages-1][i];
+		else particle_derivative(tr->y, tr->F[0], tr->field, tr->args);
 	}
+	
+	tr->h = fmin(0.9 * tr->h * pow(tr->atol / error, rk->exponent), tr->hmax);
+	return accepted;
 }
 
-void
-produce_new_k(double ys[6][6], double ks[6][6], size_t index, double h, field_fun ff, void *args) {
+// Cubic Hermite interpolation of the state within the last accepted step. Uses the
+// states and derivatives at both ends of the step, theta = 0 corresponds to the start
+// of the step and theta = 1 to the end.
+static void
+tracer_interpolate(struct tracer *tr, double theta, double y[6]) {
+	double h = tr->t - tr->t_prev;
 	
-	double field[3] = { 0. };
-	ff(ys[index], field, args);
+	double theta2 = theta*theta, theta3 = theta2*theta;
+	double h00 = 2*theta3 - 3*theta2 + 1;
+	double h10 = theta3 - 2*theta2 + theta;
+	double h01 = -2*theta3 + 3*theta2;
+	double h11 = theta3 - theta2;
 	
-	ks[index][0] = h*ys[index][3];
-	ks[index][1] = h*ys[index][4];
-	ks[index][2] = h*ys[index][5];
-	ks[index][3] = h*EM*field[0];
-	ks[index][4] = h*EM*field[1];
-	ks[index][5] = h*EM*field[2];
+	for(int i = 0; i < 6; i++)
+		y[i] = h00*tr->y_prev[i] + h10*h*tr->F_prev[i] + h01*tr->y[i] + h11*h*tr->F[0][i];
 }
 
+INLINE double
+_plane_distance(double y[3], double p0[3], double normal[3]) {
+	return (y[0]-p0[0])*normal[0] + (y[1]-p0[1])*normal[1] + (y[2]-p0[2])*normal[2];
+}
 
-EXPORT size_t
-trace_particle(double *times_array, double *pos_array, field_fun field, double bounds[3][2], double atol, void *args) {
+// Check whether the last accepted step crossed the plane through p0 with the given normal.
+// If so, the crossing is located by bisection on the interpolated trajectory, the time and
+// state at the crossing are computed and true is returned.
+static bool
+tracer_plane_crossing(struct tracer *tr, double p0[3], double normal[3], double *t_out, double y_out[6]) {
+	double d0 = _plane_distance(tr->y_prev, p0, normal);
+	double d1 = _plane_distance(tr->y, p0, normal);
 	
-	double (*positions)[6] = (double (*)[6]) pos_array;
+	if(!((d0 < 0. && d1 >= 0.) || (d0 > 0. && d1 <= 0.))) return false;
 	
+	double low = 0., high = 1.;
 	double y[6];
-	for(int i = 0; i < 6; i++) y[i] = positions[0][i];
 	
-    double V = norm_3d(y[3], y[4], y[5]);
-    double hmax = TRACING_STEP_MAX/V;
-    double h = hmax;
+	for(int i = 0; i < 64 && high - low > 1e-15; i++) {
+		double mid = (low + high)/2.;
+		tracer_interpolate(tr, mid, y);
+		double d = _plane_distance(y, p0, normal);
+		
+		if( (d0 < 0.) == (d < 0.) && d != 0. ) low = mid;
+		else high = mid;
+	}
+	
+	// The interpolation is only accurate to third order, which is not enough for the large steps taken
+	// by the higher order methods. Therefore the crossing is refined by Newton iterations, every iteration
+	// integrating from the start of the step to the estimated crossing with the integration method itself.
+	double dt = (low + high)/2. * (tr->t - tr->t_prev);
+	double F[RK_MAX_STAGES][6];
 	
-    int N = 1;
+	for(int i = 0; i < 3; i++) {
+		for(int k = 0; k < 6; k++) F[0][k] = tr->F_prev[k];
+		runge_kutta_step(tr->rk, tr->y_prev, dt, F, y_out, tr->field, tr->args);
 		
-    double xmin = bounds[0][0], xmax = bounds[0][1];
-	double ymin = bounds[1][0], ymax = bounds[1][1];
-	double zmin = bounds[2][0], zmax = bounds[2][1];
+		double velocity = dot_3d(normal, y_out + 3);
+		if(i == 2 || velocity == 0.) break;
+		
+		dt -= _plane_distance(y_out, p0, normal) / velocity;
+	}
+	
+	*t_out = tr->t_prev + dt;
+	
+	return true;
+}
 
-	 
-    while( (xmin <= y[0]) && (y[0] <= xmax) &&
-		   (ymin <= y[1]) && (y[1] <= ymax) &&
-		   (zmin <= y[2]) && (y[2] <= zmax) ) {
+// Growable trajectory, the steps of a trace are appended while tracing.
+struct trajectory {
+	double *times;
+	double (*positions)[6];
+	size_t N;
+	size_t capacity;
+};
+
+static bool
+trajectory_append(struct trajectory *t, double *times, double (*positions)[6], size_t N) {
+	
+	if(t->N + N > t->capacity) {
+		size_t capacity = t->capacity == 0 ? 1024 : t->capacity;
+		while(capacity < t->N + N) capacity *= 2;
 		
-		double k[6][6] = { {0.} };
-		double ys[6][6] = { {0.} };
+		double *new_times = realloc(t->times, capacity*sizeof(double));
+		if(new_times == NULL) return false;
+		t->times = new_times;
 		
-		for(int index = 0; index < 6; index++) {
-			produce_new_y(y, ys, k, index);
-			produce_new_k(ys, k, index, h, field, args);
-		}
+		double (*new_positions)[6] = realloc(t->positions, capacity*sizeof(double[6]));
+		if(new_positions == NULL) return false;
+		t->positions = new_positions;
 		
-		double max_position_error = 0.0;
-		double max_velocity_error = 0.0;
+		t->capacity = capacity;
+	}
+	
+	memcpy(t->times + t->N, times, N*sizeof(double));
+	memcpy(t->positions + t->N, positions, N*sizeof(double[6]));
+	t->N += N;
+	
+	return true;
+}
 
-		for(int i = 0; i < 3; i++) {
-			double err = 0.0;
-			for(int j = 0; j < 6; j++) err += CT[j]*k[j][i];
-			if(fabs(err) > max_position_error) max_position_error = fabs(err);
-		}
+// Trace a particle, appending the steps to the trajectory. To limit the memory usage of long traces
+// the trajectory can be decimated: a step is only stored if at least decimation steps were taken and the
+// particle moved at least a distance spacing since the last stored step. The initial and final state are
+// always stored. Returns false if the trajectory could not be allocated.
+static bool
+trace_particle_trajectory(struct trajectory *t, double time, double state[6], field_fun field, double bounds[3][2],
+		double atol, int method, size_t decimation, double spacing, void *args) {
+	
+	struct tracer tr;
+	tracer_init(&tr, time, state, field, atol, method, args);
+	
+	if(!trajectory_append(t, &tr.t, &tr.y, 1)) return false;
+	
+	double last_stored[3] = {tr.y[0], tr.y[1], tr.y[2]};
+	size_t steps = 0;
+	
+	while(tracer_in_bounds(&tr, bounds)) {
 		
-		for(int i = 3; i < 6; i++) {
-			double err = 0.0;
-			for(int j = 0; j < 6; j++) err += CT[j]*k[j][i];
-			if(fabs(err) > max_velocity_error) max_velocity_error = fabs(err);
-		}
+		if(!tracer_try_step(&tr)) continue;
+		steps++;
 		
-		double error = max_position_error + h*max_velocity_error;
-			
-		if(error <= atol) {
-			for(int i = 0; i < 6; i++) {
-				y[i] += CH[0]*k[0][i] + CH[1]*k[1][i] + CH[2]*k[2][i] + CH[3]*k[3][i] + CH[4]*k[4][i] + CH[5]*k[5][i];
-				positions[N][i] = y[i];
-				times_array[N] = times_array[N-1] + h;
-			}
-				
-			N += 1;
-			if(N==TRACING_BLOCK_SIZE) return N;
-		}
+		if(steps < decimation || distance_3d(last_stored, tr.y) < spacing) continue;
 		
-		h = fmin(0.9 * h * pow(atol / error, 0.2), hmax);
-	}
+		if(!trajectory_append(t, &tr.t, &tr.y, 1)) return false;
 		
-	return N;
+		for(int k = 0; k < 3; k++) last_stored[k] = tr.y[k];
+		steps = 0;
+	}
+	
+	// Final state (outside the bounds) was not yet stored
+	if(steps > 0 && !trajectory_append(t, &tr.t, &tr.y, 1)) return false;
+	
+	return true;
+}
+
+// Trace a particle until it crosses the plane through p0 with the given normal. The
+// trajectory is not stored, on return state and time contain the state and time at the
+// crossing. Returns
+// false if the particle left the bounds without crossing the plane.
+EXPORT bool
+trace_particle_plane_crossing(double state[6], double *time, field_fun field, double bounds[3][2], double atol, int method,
+		double p0[3], double normal[3], void *args) {
+	
+	struct tracer tr;
+	tracer_init(&tr, *time, state, field, atol, method, args);
+	
+	while(tracer_in_bounds(&tr, bounds)) {
+		if(tracer_try_step(&tr) && tracer_plane_crossing(&tr, p0, normal, time, state)) return true;
+	}
+	
+	return false;
+}
+
+// The field is only evaluated inside the field bounds (if given), outside the field is taken to be zero.
+// Returns true and sets the result to zero if the point lies outside the first N_dims bounds.
+INLINE bool
+outside_field_bounds(double *bounds_p, double point[6], int N_dims, double result[3]) {
+	if(bounds_p == NULL) return false;
+	
+	double (*bounds)[2] = (double (*)[2]) bounds_p;
+	
+	for(int i = 0; i < N_dims; i++) {
+		if(!((bounds[i][0] < point[i]) && (point[i] < bounds[i][1]))) {
+			result[0] = 0.;
+			result[1] = 0.;
+			result[2] = 0.;
+			return true;
+		}
+	}
+	
+	return false;
 }
 
 void
@@ -120,49 +444,72 @@ field_radial_traceable(double point[6], double result[3], void *args_p) {
 	struct effective_point_charges_2d *mag_charges = (struct effective_point_charges_2d*) args->mag_charges;
 	struct effective_point_charges_3d *current_charges = (struct effective_point_charges_3d*) args->current_charges;
 	
-	double (*bounds)[2] = (double (*)[2]) args->bounds;
+	if(outside_field_bounds(args->bounds, point, 2, result)) return;
 	
-	if(args->bounds == NULL || ((bounds[0][0] < point[0]) && (point[0] < bounds[0][1])
-						 && (bounds[1][0] < point[1]) && (point[1] < bounds[1][1]))) {
-		
-		double elec_field[3] = {0.};
-		double mag_field[3] = {0.};
-		double curr_field[3] = {0.};
-		
-		field_radial(point, elec_field,
-			elec_charges->charges, elec_charges->jacobians, elec_charges->positions, elec_charges->N);
-		
-		field_radial(point, mag_field,
-			mag_charges->charges, mag_charges->jacobians, mag_charges->positions, mag_charges->N);
-			
-		current_field(point, curr_field,
-			current_charges->charges, current_charges->jacobians, current_charges->positions, current_charges->N);
-			
-		combine_elec_magnetic_field(point + 3, elec_field, mag_field, curr_field, result);
-	}
-	else {
-		result[0] = 0.;
-		result[1] = 0.;
-		result[2] = 0.;
-	}
+	double elec_field[3] = {0.};
+	double mag_field[3] = {0.};
+	double curr_field[3] = {0.};
+	
+	field_radial(point, elec_field,
+		elec_charges->charges, elec_charges->jacobians, elec_charges->positions, elec_charges->N, args->table);
+	
+	field_radial(point, mag_field,
+		mag_charges->charges, mag_charges->jacobians, mag_charges->positions, mag_charges->N, args->table);
+	
+	current_field(point, curr_field,
+		current_charges->charges, current_charges->jacobians, current_charges->positions, current_charges->N);
+	
+	combine_elec_magnetic_field(point + 3, elec_field, mag_field, curr_field, result);
 }
 
 
 
-EXPORT size_t
-trace_particle_radial(double *times_array, double *pos_array, double tracer_bounds[3][2], double atol, double *field_bounds,
-		struct effective_point_charges_2d eff_elec,
-		struct effective_point_charges_2d eff_mag,
-		struct effective_point_charges_3d eff_current) {
+void
+field_radial_tree_traceable(double point[6], double result[3], void *args_p) {
 	
-	struct field_evaluation_args args = {
-		.elec_charges = (void*) &eff_elec,
-		.mag_charges = (void*) &eff_mag,
-		.current_charges = (void*) &eff_current,
-		.bounds = field_bounds
-	};
-		
-	return trace_particle(times_array, pos_array, field_radial_traceable, tracer_bounds, atol, (void*) &args);
+	struct field_evaluation_args *args = (struct field_evaluation_args*) args_p;
+	
+	struct radial_tree *elec_tree = (struct radial_tree*) args->elec_charges;
+	struct radial_tree *mag_tree = (struct radial_tree*) args->mag_charges;
+	struct effective_point_charges_3d *current_charges = (struct effective_point_charges_3d*) args->current_charges;
+	
+	if(outside_field_bounds(args->bounds, point, 2, result)) return;
+	
+	double elec_field[3] = {0.};
+	double mag_field[3] = {0.};
+	double curr_field[3] = {0.};
+	
+	radial_tree_field(elec_tree, point, elec_field);
+	radial_tree_field(mag_tree, point, mag_field);
+	
+	current_field(point, curr_field,
+		current_charges->charges, current_charges->jacobians, current_charges->positions, current_charges->N);
+	
+	combine_elec_magnetic_field(point + 3, elec_field, mag_field, curr_field, result);
+}
+
+void
+field_radial_adaptive_traceable(double point[6], double result[3], void *args_p) {
+	
+	struct field_evaluation_args *args = (struct field_evaluation_args*) args_p;
+	
+	struct adaptive_charges_radial *elec_charges = (struct adaptive_charges_radial*) args->elec_charges;
+	struct adaptive_charges_radial *mag_charges = (struct adaptive_charges_radial*) args->mag_charges;
+	struct effective_point_charges_3d *current_charges = (struct effective_point_charges_3d*) args->current_charges;
+	
+	if(outside_field_bounds(args->bounds, point, 2, result)) return;
+	
+	double elec_field[3] = {0.};
+	double mag_field[3] = {0.};
+	double curr_field[3] = {0.};
+	
+	adaptive_charges_radial_field(elec_charges, point, elec_field, args->table);
+	adaptive_charges_radial_field(mag_charges, point, mag_field, args->table);
+	
+	current_field(point, curr_field,
+		current_charges->charges, current_charges->jacobians, current_charges->positions, current_charges->N);
+	
+	combine_elec_magnetic_field(point + 3, elec_field, mag_field, curr_field, result);
 }
 
 void
@@ -179,52 +526,56 @@ field_radial_derivs_traceable(double point[6], double field[3], void *args_p) {
 	combine_elec_magnetic_field(point + 3, elec_field, mag_field, curr_field, field);
 }
 
-EXPORT size_t
-trace_particle_radial_derivs(double *times_array, double *pos_array, double bounds[3][2], double atol,
-	double *z_interpolation, double *electrostatic_coeffs, double *magnetostatic_coeffs, size_t N_z) {
-
-	struct field_derivs_args args = { z_interpolation, electrostatic_coeffs, magnetostatic_coeffs, N_z };
-		
-	return trace_particle(times_array, pos_array, field_radial_derivs_traceable, bounds, atol, (void*) &args);
-}
-
 void
 field_3d_traceable(double point[6], double result[3], void *args_p) {
 	struct field_evaluation_args *args = (struct field_evaluation_args*)args_p;
-	struct effective_point_charges_3d *elec_charges = (struct effective_point_charges_3d*) args->elec_charges;
-	struct effective_point_charges_3d *mag_charges = (struct effective_point_charges_3d*) args->mag_charges;
+	struct effective_point_charges_3d_soa *elec_charges = (struct effective_point_charges_3d_soa*) args->elec_charges;
+	struct effective_point_charges_3d_soa *mag_charges = (struct effective_point_charges_3d_soa*) args->mag_charges;
 	
-	double (*bounds)[2] = (double (*)[2]) args->bounds;
+	if(outside_field_bounds(args->bounds, point, 3, result)) return;
 	
-	if(	bounds == NULL || ((bounds[0][0] < point[0]) && (point[0] < bounds[0][1])
-		&& (bounds[1][0] < point[1]) && (point[1] < bounds[1][1])
-		&& (bounds[2][0] < point[2]) && (point[2] < bounds[2][1])) ) {
-
-		double elec_field[3] = {0.};
-		double mag_field[3] = {0.};
-		double curr_field[3] = {0.};
-			
-		field_3d(point, elec_field, elec_charges->charges, elec_charges->jacobians, elec_charges->positions, elec_charges->N);
-		field_3d(point, mag_field, mag_charges->charges, mag_charges->jacobians, mag_charges->positions, mag_charges->N);
-		combine_elec_magnetic_field(point + 3, elec_field, mag_field, curr_field, result);
-	}
-	else {
-		result[0] = 0.0;
-		result[1] = 0.0;
-		result[2] = 0.0;
-	}
+	double elec_field[3] = {0.};
+	double mag_field[3] = {0.};
+	double curr_field[3] = {0.};
+	
+	potential_field_3d_soa(point, elec_charges, NULL, elec_field);
+	potential_field_3d_soa(point, mag_charges, NULL, mag_field);
+	combine_elec_magnetic_field(point + 3, elec_field, mag_field, curr_field, result);
 }
 
-EXPORT size_t
-trace_particle_3d(double *times_array, double *pos_array, double tracer_bounds[3][2], double atol,
-		struct effective_point_charges_3d eff_elec, struct effective_point_charges_3d eff_mag, double *field_bounds) {
+void
+field_3d_octree_traceable(double point[6], double result[3], void *args_p) {
+	struct field_evaluation_args *args = (struct field_evaluation_args*)args_p;
+	struct octree_3d *elec_tree = (struct octree_3d*) args->elec_charges;
+	struct octree_3d *mag_tree = (struct octree_3d*) args->mag_charges;
+	
+	if(outside_field_bounds(args->bounds, point, 3, result)) return;
 	
-	struct field_evaluation_args args = {.elec_charges = (void*) &eff_elec, .mag_charges = (void*) &eff_mag, .bounds = field_bounds};
+	double elec_field[3] = {0.};
+	double mag_field[3] = {0.};
+	double curr_field[3] = {0.};
 	
-	return trace_particle(times_array, pos_array, field_3d_traceable, tracer_bounds, atol, (void*) &args);
+	octree_3d_potential_field(elec_tree, point, NULL, elec_field);
+	octree_3d_potential_field(mag_tree, point, NULL, mag_field);
+	combine_elec_magnetic_field(point + 3, elec_field, mag_field, curr_field, result);
 }
 
-
+void
+field_3d_adaptive_traceable(double point[6], double result[3], void *args_p) {
+	struct field_evaluation_args *args = (struct field_evaluation_args*)args_p;
+	struct adaptive_charges_3d *elec_charges = (struct adaptive_charges_3d*) args->elec_charges;
+	struct adaptive_charges_3d *mag_charges = (struct adaptive_charges_3d*) args->mag_charges;
+	
+	if(outside_field_bounds(args->bounds, point, 3, result)) return;
+	
+	double elec_field[3] = {0.};
+	double mag_field[3] = {0.};
+	double curr_field[3] = {0.};
+	
+	adaptive_charges_3d_potential_field(elec_charges, point, NULL, elec_field);
+	adaptive_charges_3d_potential_field(mag_charges, point, NULL, mag_field);
+	combine_elec_magnetic_field(point + 3, elec_field, mag_field, curr_field, result);
+}
 
 void
 field_3d_derivs_traceable(double point[6], double field[3], void *args_p) {
@@ -240,13 +591,263 @@ field_3d_derivs_traceable(double point[6], double field[3], void *args_p) {
 	combine_elec_magnetic_field(point + 3, elec_field, mag_field, curr_field, field);
 }
 
-EXPORT size_t
-trace_particle_3d_derivs(double *times_array, double *pos_array, double bounds[3][2], double atol,
-	double *z_interpolation, double *electrostatic_coeffs, double *magnetostatic_coeffs, size_t N_z) {
+// Tracing many particles at once. Every particle is traced on one of N_threads
+// threads (particles are handed out dynamically, since the runtime of a single
+// trace varies a lot). Each particle is traced directly into its own growable trajectory
+// (decimated as described at trace_particle_trajectory). At the end all trajectories are
+// packed into one times and one positions buffer, particle i occupying the
+// steps offsets[i] <= j < offsets[i+1].
+//
+// When plane is not NULL (six values, a point in the plane followed by the normal) the
+// trajectories are not stored. Instead every particle is traced until it first crosses the
+// plane, and its trajectory consists of only the state at the crossing (or is empty
+// if the particle leaves the bounds without crossing the plane).
+
+struct trace_many_args {
+	double (*initial_states)[6];
+	size_t N_particles;
+	struct trajectory *trajectories;
+	size_t next_particle;
+	
+	field_fun field;
+	void *field_args;
+	double (*bounds)[2];
+	double atol;
+	int method;
+	double *plane;
+	size_t decimation;
+	double spacing;
+	
+	bool failed; // Written by several threads, only through atomic_set_flag
+};
+
+static void
+trace_many_thread(void *args_p, int thread_index) {
+	struct trace_many_args *args = (struct trace_many_args*) args_p;
+	
+	size_t i;
+	while( (i = atomic_fetch_increment(&args->next_particle, 1)) < args->N_particles ) {
+		struct trajectory *t = &args->trajectories[i];
+		
+		double time = 0., state[6];
+		for(int k = 0; k < 6; k++) state[k] = args->initial_states[i][k];
+		
+		if(args->plane != NULL) {
+			bool found = trace_particle_plane_crossing(state, &time, args->field, args->bounds, args->atol, args->method,
+				args->plane, args->plane + 3, args->field_args);
+			
+			if(found && !trajectory_append(t, &time, &state, 1)) atomic_set_flag(&args->failed);
+		}
+		else if(!trace_particle_trajectory(t, time, state, args->field, args->bounds, args->atol, args->method,
+				args->decimation, args->spacing, args->field_args)) {
+			atomic_set_flag(&args->failed);
+		}
+	}
+}
+
+EXPORT bool
+trace_particles(double *initial_states, size_t N_particles, size_t *offsets, double **times_out, double **positions_out,
+		field_fun field, double bounds[3][2], double atol, int method, double *plane, size_t decimation, double spacing,
+		void *field_args, int N_threads) {
+	
+	*times_out = NULL;
+	*positions_out = NULL;
+	
+	struct trajectory *trajectories = calloc(N_particles, sizeof(struct trajectory));
+	if(trajectories == NULL) return false;
+	
+	struct trace_many_args args = {
+		.initial_states = (double (*)[6]) initial_states,
+		.N_particles = N_particles,
+		.trajectories = trajectories,
+		.next_particle = 0,
+		.field = field,
+		.field_args = field_args,
+		.bounds = bounds,
+		.atol = atol,
+		.method = method,
+		.plane = plane,
+		.decimation = decimation,
+		.spacing = spacing,
+		.failed = false
+	};
+	
+	run_threads(trace_many_thread, &args, N_threads);
+	
+	offsets[0] = 0;
+	for(size_t i = 0; i < N_particles; i++) offsets[i+1] = offsets[i] + trajectories[i].N;
+	
+	size_t N_total = offsets[N_particles];
+	
+	// A single trajectory can be handed over as is, without packing
+	if(!args.failed && N_particles == 1 && N_total > 0) {
+		*times_out = trajectories[0].times;
+		*positions_out = (double*) trajectories[0].positions;
+		free(trajectories);
+		return true;
+	}
+	
+	if(!args.failed) {
+		// Allocate at least one element, malloc(0) might return NULL
+		*times_out = malloc((N_total > 0 ? N_total : 1)*sizeof(double));
+		*positions_out = malloc((N_total > 0 ? N_total : 1)*sizeof(double[6]));
+	}
+		
+	bool success = !args.failed && *times_out != NULL && *positions_out != NULL;
+	
+	for(size_t i = 0; i < N_particles; i++) {
+		struct trajectory *t = &trajectories[i];
+		
+		if(success) {
+			memcpy(*times_out + offsets[i], t->times, t->N*sizeof(double));
+			memcpy(*positions_out + 6*offsets[i], t->positions, t->N*sizeof(double[6]));
+		}
+		
+		free(t->times);
+		free(t->positions);
+	}
+	
+	free(trajectories);
+	
+	if(!success) {
+		free(*times_out);
+		free(*positions_out);
+		*times_out = NULL;
+		*positions_out = NULL;
+	}
+	
+	return success;
+}
+
+EXPORT void
+free_trace_buffers(double *times, double *positions) {
+	free(times);
+	free(positions);
+}
+
+EXPORT bool
+trace_particles_radial(double *initial_states, size_t N_particles, size_t *offsets, double **times_out, double **positions_out,
+		double tracer_bounds[3][2], double atol, int method, double *plane, size_t decimation, double spacing, double *field_bounds,
+		struct effective_point_charges_2d eff_elec,
+		struct effective_point_charges_2d eff_mag,
+		struct effective_point_charges_3d eff_current, struct elliptic_table *table, int N_threads) {
+	
+	struct field_evaluation_args args = {
+		.elec_charges = (void*) &eff_elec,
+		.mag_charges = (void*) &eff_mag,
+		.current_charges = (void*) &eff_current,
+		.bounds = field_bounds,
+		.table = table
+	};
+	
+	return trace_particles(initial_states, N_particles, offsets, times_out, positions_out,
+		field_radial_traceable, tracer_bounds, atol, method, plane, decimation, spacing, (void*) &args, N_threads);
+}
+
+EXPORT bool
+trace_particles_radial_tree(double *initial_states, size_t N_particles, size_t *offsets, double **times_out, double **positions_out,
+		double tracer_bounds[3][2], double atol, int method, double *plane, size_t decimation, double spacing, double *field_bounds,
+		struct radial_tree *elec_tree, struct radial_tree *mag_tree, struct effective_point_charges_3d eff_current, int N_threads) {
+	
+	struct field_evaluation_args args = {
+		.elec_charges = (void*) elec_tree,
+		.mag_charges = (void*) mag_tree,
+		.current_charges = (void*) &eff_current,
+		.bounds = field_bounds
+	};
+	
+	return trace_particles(initial_states, N_particles, offsets, times_out, positions_out,
+		field_radial_tree_traceable, tracer_bounds, atol, method, plane, decimation, spacing, (void*) &args, N_threads);
+}
+
+EXPORT bool
+trace_particles_radial_adaptive(double *initial_states, size_t N_particles, size_t *offsets, double **times_out, double **positions_out,
+		double tracer_bounds[3][2], double atol, int method, double *plane, size_t decimation, double spacing, double *field_bounds,
+		struct adaptive_charges_radial *elec_charges, struct adaptive_charges_radial *mag_charges,
+		struct effective_point_charges_3d eff_current, struct elliptic_table *table, int N_threads) {
+	
+	struct field_evaluation_args args = {
+		.elec_charges = (void*) elec_charges,
+		.mag_charges = (void*) mag_charges,
+		.current_charges = (void*) &eff_current,
+		.bounds = field_bounds,
+		.table = table
+	};
+	
+	return trace_particles(initial_states, N_particles, offsets, times_out, positions_out,
+		field_radial_adaptive_traceable, tracer_bounds, atol, method, plane, decimation, spacing, (void*) &args, N_threads);
+}
+
+EXPORT bool
+trace_particles_radial_derivs(double *initial_states, size_t N_particles, size_t *offsets, double **times_out, double **positions_out,
+		double bounds[3][2], double atol, int method, double *plane, size_t decimation, double spacing,
+		double *z_interpolation, double *electrostatic_coeffs, double *magnetostatic_coeffs, size_t N_z, int N_threads) {
+	
+	struct field_derivs_args args = { z_interpolation, electrostatic_coeffs, magnetostatic_coeffs, N_z };
+	
+	return trace_particles(initial_states, N_particles, offsets, times_out, positions_out,
+		field_radial_derivs_traceable, bounds, atol, method, plane, decimation, spacing, (void*) &args, N_threads);
+}
+
+EXPORT bool
+trace_particles_3d(double *initial_states, size_t N_particles, size_t *offsets, double **times_out, double **positions_out,
+		double tracer_bounds[3][2], double atol, int method, double *plane, size_t decimation, double spacing,
+		struct effective_point_charges_3d eff_elec, struct effective_point_charges_3d eff_mag, double *field_bounds, int N_threads) {
+	
+	struct effective_point_charges_3d_soa elec_soa, mag_soa;
+	
+	*times_out = NULL;
+	*positions_out = NULL;
+	
+	if(!effective_point_charges_3d_to_soa(&eff_elec, &elec_soa)) return false;
+	
+	if(!effective_point_charges_3d_to_soa(&eff_mag, &mag_soa)) {
+		free_effective_point_charges_3d_soa(&elec_soa);
+		return false;
+	}
+	
+	struct field_evaluation_args args = {.elec_charges = (void*) &elec_soa, .mag_charges = (void*) &mag_soa, .bounds = field_bounds};
+	
+	bool success = trace_particles(initial_states, N_particles, offsets, times_out, positions_out,
+		field_3d_traceable, tracer_bounds, atol, method, plane, decimation, spacing, (void*) &args, N_threads);
+	
+	free_effective_point_charges_3d_soa(&elec_soa);
+	free_effective_point_charges_3d_soa(&mag_soa);
+	
+	return success;
+}
+
+EXPORT bool
+trace_particles_3d_octree(double *initial_states, size_t N_particles, size_t *offsets, double **times_out, double **positions_out,
+		double tracer_bounds[3][2], double atol, int method, double *plane, size_t decimation, double spacing,
+		struct octree_3d *elec_tree, struct octree_3d *mag_tree, double *field_bounds, int N_threads) {
+	
+	struct field_evaluation_args args = {.elec_charges = (void*) elec_tree, .mag_charges = (void*) mag_tree, .bounds = field_bounds};
+	
+	return trace_particles(initial_states, N_particles, offsets, times_out, positions_out,
+		field_3d_octree_traceable, tracer_bounds, atol, method, plane, decimation, spacing, (void*) &args, N_threads);
+}
+
+EXPORT bool
+trace_particles_3d_adaptive(double *initial_states, size_t N_particles, size_t *offsets, double **times_out, double **positions_out,
+		double tracer_bounds[3][2], double atol, int method, double *plane, size_t decimation, double spacing,
+		struct adaptive_charges_3d *elec_charges, struct adaptive_charges_3d *mag_charges, double *field_bounds, int N_threads) {
+	
+	struct field_evaluation_args args = {.elec_charges = (void*) elec_charges, .mag_charges = (void*) mag_charges, .bounds = field_bounds};
+	
+	return trace_particles(initial_states, N_particles, offsets, times_out, positions_out,
+		field_3d_adaptive_traceable, tracer_bounds, atol, method, plane, decimation, spacing, (void*) &args, N_threads);
+}
 
+EXPORT bool
+trace_particles_3d_derivs(double *initial_states, size_t N_particles, size_t *offsets, double **times_out, double **positions_out,
+		double bounds[3][2], double atol, int method, double *plane, size_t decimation, double spacing,
+		double *z_interpolation, double *electrostatic_coeffs, double *magnetostatic_coeffs, size_t N_z, int N_threads) {
+	
 	struct field_derivs_args args = { z_interpolation, electrostatic_coeffs, magnetostatic_coeffs, N_z };
 	
-	return trace_particle(times_array, pos_array, field_3d_derivs_traceable, bounds, atol, (void*) &args);
+	return trace_particles(initial_states, N_particles, offsets, times_out, positions_out,
+		field_3d_derivs_traceable, bounds, atol, method, plane, decimation, spacing, (void*) &args, N_threads);
 }
 
 
@@ -280,6 +881,22 @@ EXPORT void fill_jacobian_buffer_3d(
     }
 }
 
+// Same as fill_jacobian_buffer_3d, for curved triangles (see position_and_jacobian_3d_higher_order)
+EXPORT void fill_jacobian_buffer_3d_higher_order(
+	jacobian_buffer_3d jacobian_buffer,
+	position_buffer_3d pos_buffer,
+	vertices_3d_higher_order t,
+	size_t N_triangles) {
+
+	for(size_t i = 0; i < N_triangles; i++) {
+		for(int k = 0; k < N_TRIANGLE_QUAD; k++) {
+			double jac;
+			position_and_jacobian_3d_higher_order(QUAD_B1[k], QUAD_B2[k], t[i], pos_buffer[i][k], &jac);
+			jacobian_buffer[i][k] = QUAD_WEIGHTS[k] * jac;
+		}
+	}
+}
+
 EXPORT void fill_matrix_3d(double *restrict matrix, 
                     vertices_3d triangle_points, 
                     uint8_t *excitation_types, 
@@ -365,7 +982,233 @@ EXPORT void fill_matrix_3d(double *restrict matrix,
     }
 }
 
+struct _fill_matrix_3d_rows_args {
+	double *matrix;
+	vertices_3d triangle_points;
+	uint8_t *excitation_types;
+	double *excitation_values;
+	jacobian_buffer_3d jacobian_buffer;
+	position_buffer_3d pos_buffer;
+	size_t N_lines;
+	size_t N_matrix;
+	size_t *rows;
+};
+
+static void
+_fill_matrix_3d_rows_range(void *args_p, size_t start, size_t end, int thread_index) {
+	struct _fill_matrix_3d_rows_args *a = (struct _fill_matrix_3d_rows_args*) args_p;
+	
+	for(size_t r = start; r < end; r++)
+		fill_matrix_3d(a->matrix, a->triangle_points, a->excitation_types, a->excitation_values,
+			a->jacobian_buffer, a->pos_buffer, a->N_lines, a->N_matrix, (int) a->rows[r], (int) a->rows[r]);
+}
+
+// Fill the given rows of the matrix (see fill_matrix_3d) using N_threads threads. Rows are handed
+// out one at a time, since rows with many nearby triangles (which need the exact integrals) are
+// much more expensive than other rows.
+EXPORT void fill_matrix_3d_rows(double *matrix, 
+                    vertices_3d triangle_points, 
+                    uint8_t *excitation_types, 
+                    double *excitation_values, 
+					jacobian_buffer_3d jacobian_buffer,
+					position_buffer_3d pos_buffer,
+					size_t N_lines,
+					size_t N_matrix,
+					size_t *rows,
+					size_t N_rows,
+					int N_threads) {
+	
+	struct _fill_matrix_3d_rows_args args = {matrix, triangle_points, excitation_types, excitation_values,
+		jacobian_buffer, pos_buffer, N_lines, N_matrix, rows};
+	
+	parallel_for(N_rows, 1, _fill_matrix_3d_rows_range, &args, N_threads);
+}
+
+// Matrix of a geometry meshed by curved triangles, see fill_matrix_3d. The same criterion is used to decide
+// whether the quadrature of the jacobian buffer is accurate enough. Closer to the target (and for the triangle
+// itself) the integral over the curved triangle is computed by potential_or_flux_triangle_higher_order. For the
+// flux rows the triangle itself contributes the jump of the field (-1) and, as the triangle is curved, the principal
+// value of the flux integral.
+struct _fill_matrix_3d_higher_order_args {
+	double *matrix;
+	vertices_3d_higher_order triangle_points;
+	uint8_t *excitation_types;
+	double *excitation_values;
+	jacobian_buffer_3d jacobian_buffer;
+	position_buffer_3d pos_buffer;
+	size_t N_lines;
+	size_t *rows;
+};
+
+static void
+_fill_matrix_3d_higher_order_range(void *args_p, size_t start, size_t end, int thread_index) {
+	struct _fill_matrix_3d_higher_order_args *a = (struct _fill_matrix_3d_higher_order_args*) args_p;
+	size_t N = a->N_lines;
+
+	for(size_t r = start; r < end; r++) {
+		size_t i = a->rows[r];
+
+		double target[3], normal[3], jac;
+		position_and_jacobian_3d_higher_order(1/3., 1/3., a->triangle_points[i], target, &jac);
+		normal_3d_higher_order(1/3., 1/3., a->triangle_points[i], normal);
+
+		enum ExcitationType type_ = a->excitation_types[i];
+
+		if(type_ != VOLTAGE_FIXED && type_ != VOLTAGE_FUN && type_ != MAGNETOSTATIC_POT && type_ != DIELECTRIC && type_ != MAGNETIZABLE) {
+			printf("ExcitationType unknown\n");
+			exit(1);
+		}
+
+		bool flux = type_ == DIELECTRIC || type_ == MAGNETIZABLE;
+		double factor = flux ? flux_density_to_charge_factor(a->excitation_values[i]) : 1.;
+
+		double *row = &a->matrix[i*N];
+
+		for(size_t j = 0; j < N; j++) {
+			double (*t)[3] = a->triangle_points[j];
+			double value = 0.;
+
+			if(i != j && distance_3d(t[0], target) > 5*distance_3d(t[0], t[1])) {
+				for(int k = 0; k < N_TRIANGLE_QUAD; k++) {
+					double *pos = a->pos_buffer[j][k];
+					double jac = a->jacobian_buffer[j][k];
+
+					if(flux)
+						value += jac * field_dot_normal_3d(target[0], target[1], target[2], pos[0], pos[1], pos[2], normal);
+					else
+						value += jac * potential_3d_point(target[0], target[1], target[2], pos[0], pos[1], pos[2], NULL);
+				}
+			}
+			else {
+				value = potential_or_flux_triangle_higher_order(a->triangle_points[j], target, flux ? normal : NULL);
+			}
+
+			row[j] = factor*value - (flux && i == j ? 1.0 : 0.);
+		}
+	}
+}
+
+// Fill the given rows of the matrix of a geometry meshed by curved triangles (see above) using N_threads threads.
+EXPORT void fill_matrix_3d_higher_order_rows(double *matrix,
+                    vertices_3d_higher_order triangle_points,
+                    uint8_t *excitation_types,
+                    double *excitation_values,
+					jacobian_buffer_3d jacobian_buffer,
+					position_buffer_3d pos_buffer,
+					size_t N_lines,
+					size_t *rows,
+					size_t N_rows,
+					int N_threads) {
+
+	struct _fill_matrix_3d_higher_order_args args = {matrix, triangle_points, excitation_types, excitation_values,
+		jacobian_buffer, pos_buffer, N_lines, rows};
+
+	parallel_for(N_rows, 1, _fill_matrix_3d_higher_order_range, &args, N_threads);
+}
+
+// Geometries with a discrete symmetry (mirror planes, n-fold rotation) are meshed by a single
+// sector. The full geometry consists of the images g(T) of the sector triangles T under every
+// element g of the symmetry group. When the excitation transforms according to a one dimensional
+// representation of the group (the voltage on g(T) equals character(g) times the voltage on T)
+// the charge densities transform in the same way. The rows belonging to the images then carry no
+// extra information, and the system reduces to one with the sector triangles as unknowns:
+//
+//     matrix[i][j] = sum over g of character(g) * (potential or flux at target i due to g(T_j))
+//
+// The images are passed in as triangles, image_points[g*N_lines + j] = g(T_j), the first image
+// being the identity. Mirrored images should have their vertex order reversed, such that their normals
+// are the mirror images of the normals of the sector triangles.
+struct _fill_matrix_3d_symmetric_args {
+	double *matrix;
+	vertices_3d triangle_points;
+	uint8_t *excitation_types;
+	double *excitation_values;
+	vertices_3d image_points;
+	jacobian_buffer_3d image_jacobians;
+	position_buffer_3d image_positions;
+	double *characters;
+	size_t N_lines;
+	size_t N_images;
+	size_t *rows;
+};
+
+static void
+_fill_matrix_3d_symmetric_range(void *args_p, size_t start, size_t end, int thread_index) {
+	struct _fill_matrix_3d_symmetric_args *a = (struct _fill_matrix_3d_symmetric_args*) args_p;
+	size_t N = a->N_lines;
+
+	for(size_t r = start; r < end; r++) {
+		size_t i = a->rows[r];
+
+		double target[3], normal[3], jac;
+		position_and_jacobian_3d(1/3., 1/3., &a->triangle_points[i][0], target, &jac);
+		normal_3d(1/3., 1/3., &a->triangle_points[i][0], normal);
+
+		enum ExcitationType type_ = a->excitation_types[i];
 
+		if(type_ != VOLTAGE_FIXED && type_ != VOLTAGE_FUN && type_ != MAGNETOSTATIC_POT && type_ != DIELECTRIC && type_ != MAGNETIZABLE) {
+			printf("ExcitationType unknown\n");
+			exit(1);
+		}
+
+		bool flux = type_ == DIELECTRIC || type_ == MAGNETIZABLE;
+		double factor = flux ? flux_density_to_charge_factor(a->excitation_values[i]) : 0.;
+
+		double *row = &a->matrix[i*N];
+		for(size_t j = 0; j < N; j++) row[j] = 0.;
+
+		for(size_t g = 0; g < a->N_images; g++)
+		for(size_t j = 0; j < N; j++) {
+			size_t s = g*N + j;
+			double (*t)[3] = a->image_points[s];
+			double value = 0.;
+
+			if(flux && g == 0 && i == j) {
+				value = -1.0;
+			}
+			else if(!(g == 0 && i == j) && distance_3d(t[0], target) > 5*distance_3d(t[0], t[1])) {
+				for(int k = 0; k < N_TRIANGLE_QUAD; k++) {
+					double *pos = a->image_positions[s][k];
+					double jac = a->image_jacobians[s][k];
+
+					if(flux)
+						value += factor * jac * field_dot_normal_3d(target[0], target[1], target[2], pos[0], pos[1], pos[2], normal);
+					else
+						value += jac * potential_3d_point(target[0], target[1], target[2], pos[0], pos[1], pos[2], NULL);
+				}
+			}
+			else if(flux) {
+				value = factor * flux_triangle(t[0], t[1], t[2], target, normal) / (4*M_PI);
+			}
+			else {
+				value = potential_triangle(t[0], t[1], t[2], target) / (4*M_PI);
+			}
+
+			row[j] += a->characters[g] * value;
+		}
+	}
+}
+
+// Fill the given rows of the reduced matrix of a symmetric geometry (see above) using N_threads threads.
+EXPORT void fill_matrix_3d_symmetric_rows(double *matrix,
+                    vertices_3d triangle_points,
+                    uint8_t *excitation_types,
+                    double *excitation_values,
+					vertices_3d image_points,
+					jacobian_buffer_3d image_jacobians,
+					position_buffer_3d image_positions,
+					double *characters,
+					size_t N_lines,
+					size_t N_images,
+					size_t *rows,
+					size_t N_rows,
+					int N_threads) {
+
+	struct _fill_matrix_3d_symmetric_args args = {matrix, triangle_points, excitation_types, excitation_values,
+		image_points, image_jacobians, image_positions, characters, N_lines, N_images, rows};
+
+	parallel_for(N_rows, 1, _fill_matrix_3d_symmetric_range, &args, N_threads);
+}
 
 
 
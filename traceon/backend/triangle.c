@@ -47,8 +47,15 @@ double _potential_integrand(double y, void *args_p) {
     return asinh(xmax/denom) - asinh(xmin/denom);
 }
 
+static void
+_potential_integrand_nodes(const double y[KRONROD_NODES], double out[KRONROD_NODES], void *args_p) {
+	for(int i = 0; i < KRONROD_NODES; i++) out[i] = _potential_integrand(y[i], args_p);
+}
+
+// Reference implementation of potential_triangle, which integrates the inner
+// integral analytically and the outer integral by adaptive Gauss-Kronrod.
 EXPORT double
-potential_triangle(double v0[3], double v1[3], double v2[3], double target[3]) {
+potential_triangle_kronrod(double v0[3], double v1[3], double v2[3], double target[3]) {
 	double vec1[3] = {v1[0]-v0[0], v1[1]-v0[1], v1[2]-v0[2]};
 	double vec2[3] = {v2[0]-v0[0], v2[1]-v0[1], v2[2]-v0[2]};
 
@@ -73,7 +80,8 @@ potential_triangle(double v0[3], double v1[3], double v2[3], double target[3]) {
 	
 	struct _normalized_triangle tri = {x0, y0, a,b,c,z};
 
-	return kronrod_adaptive(_potential_integrand, 0, c, (void*) &tri, 1e-9, 1e-9);
+	double points[2] = {0., c};
+	return kronrod_global_adaptive(_potential_integrand_nodes, (void*) &tri, points, 2, 1e-11, 1e-11);
 }
 
 EXPORT double self_potential_triangle_v0(double v0[3], double v1[3], double v2[3]) {
@@ -147,8 +155,14 @@ double _flux_integrand(double y, void *args_p) {
 
 
 
+static void
+_flux_integrand_nodes(const double y[KRONROD_NODES], double out[KRONROD_NODES], void *args_p) {
+	for(int i = 0; i < KRONROD_NODES; i++) out[i] = _flux_integrand(y[i], args_p);
+}
+
+// Reference implementation of flux_triangle, see potential_triangle_kronrod.
 EXPORT double
-flux_triangle(double v0[3], double v1[3], double v2[3], double target[3], double normal[3]) {
+flux_triangle_kronrod(double v0[3], double v1[3], double v2[3], double target[3], double normal[3]) {
 	double vec1[3] = {v1[0]-v0[0], v1[1]-v0[1], v1[2]-v0[2]};
 	double vec2[3] = {v2[0]-v0[0], v2[1]-v0[1], v2[2]-v0[2]};
 
@@ -178,23 +192,117 @@ flux_triangle(double v0[3], double v1[3], double v2[3], double target[3], double
 		
 	struct _normalized_triangle tri = {x0, y0, a, b, c, z, new_normal};
 	
-	return kronrod_adaptive(_flux_integrand, 0, c, (void*) &tri, 1e-9, 1e-9);
+	double points[2] = {0., c};
+	return kronrod_global_adaptive(_flux_integrand_nodes, (void*) &tri, points, 2, 1e-11, 1e-11);
 }
 
+// Closed form integrals over a flat triangle with unit charge density, following
+// Wilton et al. (1984) and Graglia (1993). Let h be the height of the target above
+// the plane of the triangle and Omega the solid angle subtended by the triangle. For
+// every edge i let m_i be the outward normal in the plane of the triangle, t_i the
+// distance from the projected target to the line through the edge (positive when
+// the projection is on the inner side) and f_i the integral of 1/R along the edge. Then
+//
+// potential = sum_i t_i f_i - |h| Omega
+// field     = sum_i m_i f_i + sign(h) Omega n
+//
+// where the field is the integral of (target - r)/|target - r|^3. This replaces the
+// adaptive quadrature in the near field, which is about 70 times as expensive.
+
+// Integral of 1/R along the edge from p to q. Uses R^2 - s^2 = R0^2 to avoid the
+// cancellation in R + s when s is negative (target behind the start of the edge).
+INLINE double
+_triangle_edge_log(double s_minus, double s_plus, double R_minus, double R_plus, double R0_2) {
+	if(s_plus < 0.)
+		return log((R_minus - s_minus) / (R_plus - s_plus));
+	else if(s_minus < 0.)
+		return log((R_plus + s_plus) * (R_minus - s_minus) / R0_2);
+	else
+		return log((R_plus + s_plus) / (R_minus + s_minus));
+}
 
-
-
-
+EXPORT void
+potential_field_triangle(double v0[3], double v1[3], double v2[3], double target[3], double *potential, double field[3]) {
+	double *v[3] = {v0, v1, v2};
 	
+	double vec1[3] = {v1[0]-v0[0], v1[1]-v0[1], v1[2]-v0[2]};
+	double vec2[3] = {v2[0]-v0[0], v2[1]-v0[1], v2[2]-v0[2]};
+	
+	double n[3];
+	cross_product_3d(vec1, vec2, n);
+	normalize_3d(n);
+	
+	// Vectors from the target to the vertices
+	double d[3][3], R[3];
+	
+	for(int i = 0; i < 3; i++) {
+		d[i][0] = v[i][0] - target[0];
+		d[i][1] = v[i][1] - target[1];
+		d[i][2] = v[i][2] - target[2];
+		R[i] = norm_3d(d[i][0], d[i][1], d[i][2]);
+	}
+	
+	double h = -dot_3d(n, d[0]);
+	
+	// Solid angle (Van Oosterom and Strackee), the sign of the triple product is opposite to the sign of h.
+	double bc[3];
+	cross_product_3d(d[1], d[2], bc);
+	double triple = dot_3d(d[0], bc);
+	double denom = R[0]*R[1]*R[2] + dot_3d(d[0], d[1])*R[2] + dot_3d(d[0], d[2])*R[1] + dot_3d(d[1], d[2])*R[0];
+	double omega = -2*atan2(triple, denom);
+	
+	double pot = -fabs(h) * fabs(omega);
+	
+	// On the plane of the triangle the field normal to the triangle is discontinuous,
+	// return the average of both sides (zero).
+	double omega_normal = triple != 0. ? omega : 0.;
+	double f[3] = {n[0]*omega_normal, n[1]*omega_normal, n[2]*omega_normal};
+	
+	for(int i = 0; i < 3; i++) {
+		int j = (i + 1) % 3;
+		
+		double edge[3] = {v[j][0]-v[i][0], v[j][1]-v[i][1], v[j][2]-v[i][2]};
+		double length = norm_3d(edge[0], edge[1], edge[2]);
+		double l[3] = {edge[0]/length, edge[1]/length, edge[2]/length};
+		
+		double m[3];
+		cross_product_3d(l, n, m);
+		
+		double s_minus = dot_3d(d[i], l);
+		double s_plus = dot_3d(d[j], l);
+		double t = dot_3d(d[i], m);
+		double R0_2 = t*t + h*h;
+		
+		// Target on the edge (or a vertex), the potential contribution vanishes and
+		// the field diverges logarithmically
+		if(R0_2 == 0. && s_minus <= 0. && s_plus >= 0.) continue;
+		
+		double log_ = _triangle_edge_log(s_minus, s_plus, R[i], R[j], R0_2);
+		
+		pot += t * log_;
+		f[0] += m[0]*log_;
+		f[1] += m[1]*log_;
+		f[2] += m[2]*log_;
+	}
+	
+	if(potential != NULL) *potential = pot;
+	if(field != NULL) {
+		field[0] = f[0];
+		field[1] = f[1];
+		field[2] = f[2];
+	}
+}
 
+EXPORT double
+potential_triangle(double v0[3], double v1[3], double v2[3], double target[3]) {
+	double potential;
+	potential_field_triangle(v0, v1, v2, target, &potential, NULL);
+	return potential;
+}
 
-
-
-
-
-
-
-
-
-
-
+EXPORT double
+flux_triangle(double v0[3], double v1[3], double v2[3], double target[3], double normal[3]) {
+	double field[3];
+	potential_field_triangle(v0, v1, v2, target, NULL, field);
+	return dot_3d(normal, field);
+}
@@ -133,6 +133,51 @@ INLINE void position_and_jacobian_3d(double alpha, double beta, triangle t, doub
 	*jac = 2*triangle_area(t[0], t[1], t[2]);
 }
 
+// Curved (higher order) triangles are represented by six points (triangle6 in GMSH terminology),
+// the three corner points followed by the midpoints of the edges v0-v1, v1-v2 and v2-v0. The
+// position is a quadratic polynomial in the same parameters alpha, beta as used for flat triangles
+// (alpha along v0-v1 and beta along v0-v2).
+typedef double (triangle6)[6][3];
+
+INLINE void
+_higher_order_triangle_3d(double alpha, double beta, triangle6 t, double pos[3], double d_alpha[3], double d_beta[3]) {
+	double l = 1 - alpha - beta;
+
+	double N[6] = {l*(2*l-1), alpha*(2*alpha-1), beta*(2*beta-1), 4*l*alpha, 4*alpha*beta, 4*beta*l};
+	double dN_alpha[6] = {1-4*l, 4*alpha-1, 0., 4*(l-alpha), 4*beta, -4*beta};
+	double dN_beta[6] = {1-4*l, 0., 4*beta-1, -4*alpha, 4*alpha, 4*(l-beta)};
+
+	for(int d = 0; d < 3; d++) {
+		pos[d] = 0., d_alpha[d] = 0., d_beta[d] = 0.;
+
+		for(int k = 0; k < 6; k++) {
+			pos[d] += N[k]*t[k][d];
+			d_alpha[d] += dN_alpha[k]*t[k][d];
+			d_beta[d] += dN_beta[k]*t[k][d];
+		}
+	}
+}
+
+// Same as position_and_jacobian_3d, but for a curved triangle. The jacobian is the
+// area element |dx/dalpha x dx/dbeta|, which equals 2*area for a flat triangle.
+EXPORT void
+position_and_jacobian_3d_higher_order(double alpha, double beta, triangle6 t, double pos_out[3], double *jac) {
+	double d_alpha[3], d_beta[3], cross[3];
+	_higher_order_triangle_3d(alpha, beta, t, pos_out, d_alpha, d_beta);
+
+	cross_product_3d(d_alpha, d_beta, cross);
+	*jac = norm_3d(cross[0], cross[1], cross[2]);
+}
+
+EXPORT void
+normal_3d_higher_order(double alpha, double beta, triangle6 t, double *normal) {
+	double pos[3], d_alpha[3], d_beta[3];
+	_higher_order_triangle_3d(alpha, beta, t, pos, d_alpha, d_beta);
+
+	cross_product_3d(d_alpha, d_beta, normal);
+	normalize_3d(normal);
+}
+
 // Compute E + v x B, which is used in the Lorentz force law to calculate the force
 // on the particle. The magnetic field produced by magnetiziation and the magnetic field
 // produced by currents are passed in separately, but can simpy be summed to find the total
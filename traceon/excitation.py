@@ -39,6 +39,83 @@ class Symmetry(IntEnum):
     def is_3d(self):
         return self == Symmetry.THREE_D
 
+class DiscreteSymmetry:
+    """Discrete symmetry of a geometry, consisting of an n-fold rotation around the z-axis and/or mirror planes
+    through the origin (radially symmetric geometries only support the z = 0 plane). Only a single sector of the geometry is meshed, the rest of the geometry consists of the images
+    of this sector under the elements of the symmetry group. See `Excitation.add_discrete_symmetry`.
+
+    Every symmetry operation is assigned a sign, which specifies how the excitation transforms. When the sign is 1 the
+    excitation of an image equals the excitation of the sector (for example a round lens, or the two halves of an einzel lens).
+    When the sign is -1 the excitation changes sign (for example the positive and negative electrodes of a deflector,
+    or the neighbouring poles of a quadrupole)."""
+
+    def __init__(self, rotation=1, rotation_sign=1, mirror_yz=None, mirror_xz=None, mirror_xy=None):
+        assert isinstance(rotation, int) and rotation >= 1, "Rotation should be a positive integer"
+        assert rotation_sign in [1, -1], "Sign of the rotation should be 1 or -1"
+        assert all(s in [None, 1, -1] for s in [mirror_yz, mirror_xz, mirror_xy]), "Sign of a mirror plane should be None, 1 or -1"
+
+        self.rotation = rotation
+        self.rotation_sign = rotation_sign
+        self.mirror_yz = mirror_yz
+        self.mirror_xz = mirror_xz
+        self.mirror_xy = mirror_xy
+
+        self.transformations, self.characters = self._generate_group()
+
+    def __str__(self):
+        mirrors = [f'{n}={s}' for n, s in [('yz', self.mirror_yz), ('xz', self.mirror_xz), ('xy', self.mirror_xy)] if s is not None]
+        return f'rotation={self.rotation} (sign {self.rotation_sign}), mirrors: ' + (', '.join(mirrors) if len(mirrors) else 'none')
+
+    def __len__(self):
+        return len(self.transformations)
+
+    def _generate_group(self):
+        generators = []
+
+        if self.rotation > 1:
+            angle = 2*np.pi/self.rotation
+            rotation = np.array([[np.cos(angle), -np.sin(angle), 0.],
+                                 [np.sin(angle), np.cos(angle), 0.],
+                                 [0., 0., 1.]])
+            generators.append( (rotation, self.rotation_sign) )
+
+        for axis, sign in enumerate([self.mirror_yz, self.mirror_xz, self.mirror_xy]):
+            if sign is not None:
+                mirror = np.eye(3)
+                mirror[axis, axis] = -1.
+                generators.append( (mirror, sign) )
+
+        # Close the group under multiplication, the identity is always the first element
+        transformations, characters = [np.eye(3)], [1]
+
+        i = 0
+        while i < len(transformations):
+            for generator, sign in generators:
+                product, character = generator @ transformations[i], sign*characters[i]
+
+                existing = [j for j, t in enumerate(transformations) if np.allclose(t, product, atol=1e-12)]
+
+                if not len(existing):
+                    transformations.append(product)
+                    characters.append(character)
+                elif characters[existing[0]] != character:
+                    raise ValueError('The signs given are not consistent with the symmetry group, note that a rotation with sign -1 requires an even number of sectors')
+            i += 1
+
+        return np.array(transformations), np.array(characters, dtype=np.float64)
+
+    def get_images(self, triangles):
+        """Get the images of the given triangles (shape (N, 3, 3)) under every element of the symmetry group. The result has shape
+        (len(self)*N, 3, 3), the first N triangles being equal to the input. The vertex order of mirrored triangles is reversed, such
+        that their normals are the mirror images of the original normals."""
+        images = []
+
+        for t in self.transformations:
+            image = triangles @ t.T
+            images.append(image if np.linalg.det(t) > 0 else image[:, [0, 2, 1]])
+
+        return np.concatenate(images, axis=0)
+
 class ExcitationType(IntEnum):
     """Possible excitation that can be applied to elements of the geometry. See the methods of `Excitation` for documentation."""
     VOLTAGE_FIXED = 1
@@ -84,7 +161,8 @@ class Excitation:
         self.electrodes = mesh.get_electrodes()
         self.excitation_types = {}
         self.symmetry = symmetry
-         
+        self.discrete_symmetry = None
+
         if symmetry == Symmetry.RADIAL:
             assert self.mesh.points.shape[1] == 2 or np.all(self.mesh.points[:, 1] == 0.), \
                 "When symmetry is RADIAL, the geometry should lie in the XZ plane"
@@ -219,7 +297,33 @@ class Excitation:
         """
 
         self.add_magnetizable(**{a:0 for a in args})
-    
+
+    def add_discrete_symmetry(self, rotation=1, rotation_sign=1, mirror_yz=None, mirror_xz=None, mirror_xy=None):
+        """
+        Declare that the mesh is a single sector of a geometry with a discrete symmetry. The full geometry consists of the images of the mesh
+        under an n-fold rotation around the z-axis and/or the given mirror planes. The solver then only uses the elements of the sector as unknowns,
+        which reduces the size of the matrix by the number of sectors (and the memory by the square of this number). The returned field contains the
+        charges of the full geometry.
+
+        The sector should be chosen such that its images do not overlap. In particular, no elements should lie on a mirror plane.
+        Radially symmetric geometries only support the `mirror_xy` plane (z → -z), in which case only the half z > 0 (or z < 0) is meshed.
+        Note that the magnetostatic potential of a current loop is antisymmetric under z → -z. When the mirrored coils carry the same current
+        the sign is therefore -1.
+
+        Parameters
+        ----------
+        rotation : int
+            The geometry is invariant under a rotation of 2π/rotation around the z-axis.
+        rotation_sign : int
+            1 if the excitation is the same after the rotation, -1 if the excitation changes sign (requires an even `rotation`).
+        mirror_yz, mirror_xz, mirror_xy : int
+            The geometry is invariant under a mirroring in the given plane (for example x → -x for `mirror_yz`). The value is the sign of the excitation
+            after mirroring: 1 if the excitation is the same, -1 if the excitation changes sign. Use None (the default) if the geometry has no such mirror plane.
+        """
+        assert self.symmetry == Symmetry.THREE_D or (rotation == 1 and mirror_yz is None and mirror_xz is None), \
+            "Radially symmetric geometries only support the mirror_xy plane"
+        self.discrete_symmetry = DiscreteSymmetry(rotation, rotation_sign, mirror_yz, mirror_xz, mirror_xy)
+
     def _split_for_superposition(self):
         
         # Names that have a fixed voltage excitation, not equal to 0.0
@@ -245,8 +349,9 @@ class Excitation:
                 else:
                     new_types_dict[n] = (t, v)
             
-            exc = Excitation(self.mesh)
+            exc = Excitation(self.mesh, self.symmetry)
             exc.excitation_types = new_types_dict
+            exc.discrete_symmetry = self.discrete_symmetry
             excitations.append(exc)
 
         assert len(non_zero_fixed) == len(excitations)
@@ -996,7 +996,26 @@ class Surface(GeometricObject):
         else:
             return SurfaceCollection([self] + other.surfaces)
      
-    def mesh(self, mesh_size=None, mesh_size_factor=None):
+    def mesh(self, mesh_size=None, mesh_size_factor=None, higher_order=False):
+        """Mesh the surface, so it can be used in the BEM solver.
+
+        Parameters
+        --------------------------
+        mesh_size: float
+            Determines amount of elements in the mesh. A smaller
+            mesh size leads to more elements.
+        mesh_size_factor: float
+            Alternative way to specify the mesh size, which scales
+            with the dimensions of the geometry, and therefore more
+            easily translates between different geometries.
+        higher_order: bool
+            Whether to generate a higher order mesh. A higher order
+            produces curved triangles (determined by 6 points on
+            each curved triangle).
+
+        Returns
+        ----------------------------
+        Mesh"""
           
         if mesh_size is None:
             path_length = min(self.path_length1, self.path_length2)
@@ -1006,7 +1025,7 @@ class Surface(GeometricObject):
             if mesh_size_factor is not None:
                 mesh_size /= sqrt(mesh_size_factor)
          
-        return _mesh(self, mesh_size, name=self.name)
+        return _mesh(self, mesh_size, name=self.name, higher_order=higher_order)
 
 
 
@@ -1022,14 +1041,14 @@ class SurfaceCollection(GeometricObject):
     def map_points(self, fun):
         return SurfaceCollection([s.map_points(fun) for s in self.surfaces])
      
-    def mesh(self, mesh_size=None, mesh_size_factor=None, name=None):
+    def mesh(self, mesh_size=None, mesh_size_factor=None, name=None, higher_order=False):
         mesh = Mesh()
         
         for s in self.surfaces:
             if self.name is not None:
                 s.name = self.name
             
-            mesh = mesh + s.mesh(mesh_size=mesh_size, mesh_size_factor=mesh_size_factor)
+            mesh = mesh + s.mesh(mesh_size=mesh_size, mesh_size_factor=mesh_size_factor, higher_order=higher_order)
          
         return mesh
      
@@ -184,7 +184,9 @@ class Mesh(Saveable, GeometricObject):
         Returns
         ----------------------------
         bool"""
-        return isinstance(self.lines, np.ndarray) and len(self.lines.shape) == 2 and self.lines.shape[1] == 4
+        higher_order_lines = isinstance(self.lines, np.ndarray) and len(self.lines.shape) == 2 and self.lines.shape[1] == 4
+        higher_order_triangles = len(self.triangles) > 0 and self.triangles.shape[1] == 6
+        return higher_order_lines or higher_order_triangles
     
     def map_points(self, fun):
         """See `GeometricObject`
@@ -616,11 +618,19 @@ class PointsWithQuads:
         
         self.shape = indices.shape
     
-    def to_triangles(self):
+    def to_triangles(self, pstack=None):
+        # If a point stack is given, curved triangles are returned. The midpoints of the edges
+        # are then taken from the next level of the point stack.
         triangles = []
 
         def add_triangle(p0, p1, p2):
-            triangles.append([self.indices[p0[0], p0[1]], self.indices[p1[0], p1[1]], self.indices[p2[0], p2[1]]])
+            triangle = [self.indices[p0[0], p0[1]], self.indices[p1[0], p1[1]], self.indices[p2[0], p2[1]]]
+            
+            if pstack is not None:
+                for a, b in [(p0, p1), (p1, p2), (p2, p0)]:
+                    triangle.append(pstack.to_point_index(self.depth+1, a[0]+b[0], a[1]+b[1]))
+             
+            triangles.append(triangle)
          
         for quad in self.quads:
             depth, i0, i1, j0, j1 = quad 
@@ -731,7 +741,7 @@ def _copy_over_edge(e1, e2):
     mask = e1 != -1
     e2[mask] = e1[mask]
 
-def _mesh(surface, mesh_size, start_depth=2, name=None):
+def _mesh(surface, mesh_size, start_depth=2, name=None, higher_order=False):
     # Create a point stack for each subsection
     points, point_stacks, quads = _mesh_subsections_to_quads(surface, mesh_size, start_depth)
      
@@ -752,11 +762,15 @@ def _mesh(surface, mesh_size, start_depth=2, name=None):
         for j in range(Ny-1): # Vertical copying
             _copy_over_edge(point_with_quads[j*Nx + i][:, -1], point_with_quads[(j+1)*Nx + i][:, 0])
      
+    if not higher_order:
+        triangles = np.concatenate([pq.to_triangles() for pq in point_with_quads], axis=0)
+    else:
+        triangles = np.concatenate([pq.to_triangles(p) for p, pq in zip(point_stacks, point_with_quads)], axis=0)
+    
     points = np.array(points)
-    triangles = np.concatenate([pq.to_triangles() for pq in point_with_quads], axis=0)
     
     assert points.shape == (len(points), 3)
-    assert triangles.shape == (len(triangles), 3)
+    assert triangles.shape == (len(triangles), 6 if higher_order else 3)
     assert np.all( (0 <= triangles) & (triangles < len(points)) )
      
     if name is not None:
@@ -46,13 +46,16 @@ __pdoc__['Solver'] = False
 
 import math as m
 import time
-from threading import Thread
+import os
 import os.path as path
 import copy
+import hashlib
+import json
 
 import numpy as np
 from scipy.interpolate import CubicSpline, BPoly, PPoly
 from scipy.special import legendre
+from scipy.linalg import lu_factor, lu_solve, solve_triangular
 
 from . import geometry as G
 from . import excitation as E
@@ -66,7 +69,7 @@ FACTOR_AXIAL_DERIV_SAMPLING_3D = 0.06
 
 class Solver:
     
-    def __init__(self, excitation):
+    def __init__(self, excitation, elliptic_table_tolerance=None):
         self.excitation = excitation
         vertices, names = self.get_active_elements()
         
@@ -94,8 +97,6 @@ class Solver:
         two_d = self.is_2d()
         higher_order = self.is_higher_order()
 
-        assert not higher_order or two_d, "Higher order not supported in 3D"
-        
         if two_d and higher_order:
             jac, pos = backend.fill_jacobian_buffer_radial(vertices)
         elif not two_d:
@@ -105,6 +106,30 @@ class Solver:
         
         self.jac_buffer = jac
         self.pos_buffer = pos
+        
+        # Only a single sector of a geometry with a discrete symmetry is meshed, the elements of the full
+        # geometry are the images of the sector (see `Excitation.add_discrete_symmetry`)
+        self.discrete_symmetry = excitation.discrete_symmetry
+        
+        if self.discrete_symmetry is not None:
+            assert two_d or not higher_order, "Discrete symmetries are not supported for 3D higher order meshes"
+            centers = np.mean(vertices, axis=1)
+            
+            for t in self.discrete_symmetry.transformations[1:]:
+                assert not np.any(np.all(np.isclose(centers @ t.T, centers), axis=1)), \
+                    "Elements are mapped onto themselves by the discrete symmetry, the mesh should only contain a single sector of the geometry"
+            
+            if two_d:
+                # The only symmetry supported is the mirror z -> -z, the image rings are folded into
+                # the kernel by the backend and only needed for the charges of the full geometry
+                self.image_jac_buffer = np.concatenate([jac, jac])
+                self.image_pos_buffer = np.concatenate([pos, pos*np.array([1., -1.])])
+            else:
+                self.image_vertices = self.discrete_symmetry.get_images(vertices)
+                self.image_jac_buffer, self.image_pos_buffer = backend.fill_jacobian_buffer_3d(self.image_vertices)
+        
+        # Table of elliptic integrals, used to speed up the filling of the matrix of radial symmetric geometries
+        self.elliptic_table = backend.EllipticTable(elliptic_table_tolerance) if two_d and elliptic_table_tolerance is not None else None
      
     def get_active_elements(self):
         pass
@@ -131,7 +156,11 @@ class Solver:
         two_d = self.is_2d()
         higher_order = self.is_higher_order()
          
-        if self.is_3d() or not self.is_higher_order():
+        if self.is_3d() and self.is_higher_order():
+            # Point (1/3, 1/3) of the curved triangle, see position_and_jacobian_3d_higher_order
+            corners, midpoints = self.vertices[index][:3], self.vertices[index][3:]
+            return -1/9*np.sum(corners, axis=0) + 4/9*np.sum(midpoints, axis=0)
+        elif self.is_3d() or not self.is_higher_order():
             return np.mean(self.vertices[index], axis=0)
         else:
             v0, v1, v2, v3 = self.vertices[index]
@@ -142,47 +171,143 @@ class Solver:
         pass
          
     def get_matrix(self):
-        assert (self.is_3d() and not self.is_higher_order()) or \
-            (self.is_2d() and self.is_higher_order()), "2D mesh needs to be higher order (consider upgrading mesh), 3D mesh needs to be simple (higher order not supported)."
+        assert self.is_3d() or self.is_higher_order(), "2D mesh needs to be higher order (consider upgrading mesh)."
          
         N_matrix = self.get_number_of_matrix_elements()
         matrix = np.zeros( (N_matrix, N_matrix) )
-        logging.log_info(f'Using matrix solver, number of elements: {N_matrix}, size of matrix: {N_matrix} ({matrix.nbytes/1e6:.0f} MB), symmetry: {self.excitation.symmetry}, higher order: {self.excitation.mesh.is_higher_order()}')
+        logging.log_info(f'Using matrix solver, number of elements: {N_matrix}, size of matrix: {N_matrix} ({matrix.nbytes/1e6:.0f} MB), symmetry: {self.get_symmetry_description()}, higher order: {self.excitation.mesh.is_higher_order()}')
          
-        fill_fun = backend.fill_matrix_3d if self.is_3d() else backend.fill_matrix_radial
-        
-        def fill_matrix_rows(rows):
-            fill_fun(matrix,
-                self.vertices,
-                self.excitation_types,
-                self.excitation_values,
-                self.jac_buffer, self.pos_buffer, rows[0], rows[-1])
-        
         st = time.time()
-        util.split_collect(fill_matrix_rows, np.arange(N_matrix))    
+        self.fill_matrix_rows(matrix, np.arange(N_matrix))
         logging.log_info(f'Time for building matrix: {(time.time()-st)*1000:.0f} ms')
-
-        if not self.is_3d():
-            # Technical detail: radial cannot compute their own self potential/field
-            # need to fill it in here
-            for i in range(N_matrix):
-                type_ = self.excitation_types[i]
-                val = self.excitation_values[i]
-                
-                if type_ == E.ExcitationType.DIELECTRIC or type_ == E.ExcitationType.MAGNETIZABLE:
-                    # -1 follows from matrix equation
-                    matrix[i, i] = backend.self_field_dot_normal_radial(self.vertices[i], self.excitation_values[i]) - 1
-                else:
-                    matrix[i, i] = backend.self_potential_radial(self.vertices[i])
         
         assert np.all(np.isfinite(matrix))
          
         return matrix
     
+    def fill_matrix_rows(self, matrix, rows):
+        """(Re)compute the given rows of the matrix returned by `get_matrix`, in place."""
+        threads = 1 if backend.DEBUG else util.get_number_of_threads()
+        
+        matrix[rows] = 0.
+        
+        if self.discrete_symmetry is not None and self.is_3d():
+            backend.fill_matrix_3d_symmetric_rows(matrix, self.vertices, self.excitation_types, self.excitation_values,
+                self.image_vertices, self.image_jac_buffer, self.image_pos_buffer, self.discrete_symmetry.characters, rows, N_threads=threads)
+        elif self.discrete_symmetry is not None:
+            backend.fill_matrix_radial_mirror_rows(matrix, self.vertices, self.excitation_types, self.excitation_values,
+                self.jac_buffer, self.pos_buffer, rows, self.discrete_symmetry.characters[1], N_threads=threads, table=self.elliptic_table)
+        elif self.is_3d():
+            backend.fill_matrix_3d_rows(matrix, self.vertices, self.excitation_types, self.excitation_values,
+                self.jac_buffer, self.pos_buffer, rows, N_threads=threads)
+        else:
+            backend.fill_matrix_radial_rows(matrix, self.vertices, self.excitation_types, self.excitation_values,
+                self.jac_buffer, self.pos_buffer, rows, N_threads=threads, table=self.elliptic_table)
+        
+        if not self.is_3d():
+            # Technical detail: radial cannot compute their own self potential/field
+            # need to fill it in here (the mirrored matrix already contains the contribution of the image)
+            if self.discrete_symmetry is None:
+                matrix[rows, rows] = self.get_self_terms_radial(rows)
+            else:
+                matrix[rows, rows] += self.get_self_terms_radial(rows)
+    
+    def get_matrix_columns(self, columns):
+        """Compute the given columns of the matrix returned by `get_matrix`. Only supported when `supports_matrix_columns` returns True."""
+        assert self.supports_matrix_columns(), "Computing matrix columns is not supported for this solver"
+        threads = 1 if backend.DEBUG else util.get_number_of_threads()
+        
+        if self.is_3d():
+            return backend.fill_matrix_3d_columns(self.vertices, self.excitation_types, self.excitation_values,
+                self.jac_buffer, self.pos_buffer, columns, N_threads=threads)
+        else:
+            # Only the diagonal entries of the requested columns use the self terms
+            self_terms = np.zeros(self.get_number_of_matrix_elements())
+            self_terms[columns] = self.get_self_terms_radial(columns)
+            
+            return backend.fill_matrix_radial_columns(self.vertices, self.excitation_types, self.excitation_values,
+                self.jac_buffer, self.pos_buffer, self_terms, columns, N_threads=threads)
+    
+    def supports_matrix_columns(self):
+        # The columns are computed using the exact kernels of the matrix-free operator, which would not agree
+        # with rows computed using an elliptic table
+        return self.discrete_symmetry is None and not (self.is_3d() and self.is_higher_order()) and self.elliptic_table is None
+    
+    def get_symmetry_description(self):
+        if self.discrete_symmetry is None:
+            return str(self.excitation.symmetry)
+        
+        return f'{self.excitation.symmetry}, {len(self.discrete_symmetry)} sectors ({self.discrete_symmetry})'
+    
+    def get_point_charges(self, charges):
+        """Get the effective point charges corresponding to the solution of the linear system. For geometries with
+        a discrete symmetry the charges on the images of the meshed sector are included."""
+        if self.discrete_symmetry is None:
+            return EffectivePointCharges(charges, self.jac_buffer, self.pos_buffer)
+        
+        charges = np.concatenate([c*charges for c in self.discrete_symmetry.characters])
+        return EffectivePointCharges(charges, self.image_jac_buffer, self.image_pos_buffer)
+    
+    def get_self_terms_radial(self, indices=None):
+        indices = np.arange(self.get_number_of_matrix_elements()) if indices is None else indices
+        threads = 1 if backend.DEBUG else util.get_number_of_threads()
+        return backend.self_terms_radial(self.vertices, self.excitation_types, self.excitation_values, indices, N_threads=threads)
+    
+    def get_operator(self, tree_theta=None):
+        """Get a matrix-free representation of the matrix returned by `get_matrix`. Only O(N) memory
+        is needed, which allows solving much larger geometries using an iterative solver. For radial symmetric
+        geometries `tree_theta` can be given to compute the matrix-vector products using a tree code (see `backend.RadialTree`)."""
+        assert self.discrete_symmetry is None, "Discrete symmetries are only supported by the (default) direct solver"
+        assert not (self.is_3d() and self.is_higher_order()), "3D higher order meshes are only supported by the (default) direct solver"
+        N_matrix = self.get_number_of_matrix_elements()
+        threads = 1 if backend.DEBUG else util.get_number_of_threads()
+        
+        st = time.time()
+        if self.is_3d():
+            operator = backend.BEMOperator.three_d(self.vertices, self.excitation_types, self.excitation_values,
+                self.jac_buffer, self.pos_buffer, N_threads=threads)
+        else:
+            operator = backend.BEMOperator.radial(self.vertices, self.excitation_types, self.excitation_values,
+                self.jac_buffer, self.pos_buffer, self.get_self_terms_radial(), N_threads=threads, tree_theta=tree_theta)
+        logging.log_info(f'Time for building matrix-free operator: {(time.time()-st)*1000:.0f} ms')
+         
+        return operator
+    
     def charges_to_field(self, charges):
         pass
          
-    def solve_matrix(self, right_hand_side=None):
+    def solve_matrix(self, right_hand_side=None, factorization_cache=None):
+        F = np.array([self.get_right_hand_side()]) if right_hand_side is None else right_hand_side
+        
+        N = self.get_number_of_matrix_elements()
+         
+        if N == 0:
+            return [self.charges_to_field(EffectivePointCharges.empty_2d() if self.is_2d() else EffectivePointCharges.empty_3d()) \
+                        for _ in range(len(F))]
+        
+        assert all([f.shape == (N,) for f in F])
+        
+        if factorization_cache is None:
+            matrix = self.get_matrix()
+            st = time.time()
+            charges = np.linalg.solve(matrix, F.T).T
+            logging.log_info(f'Time for solving matrix: {(time.time()-st)*1000:.0f} ms')
+        else:
+            charges = factorization_cache.solve(self, F)
+        
+        assert np.all(np.isfinite(charges)) and charges.shape == F.shape
+        
+        result = [self.charges_to_field(self.get_point_charges(c)) for c in charges]
+         
+        assert len(result) == len(F)
+        return result
+        
+    def solve_mixed_precision(self, right_hand_side=None, tolerance=1e-12, max_iterations=20):
+        """Solve the matrix equation using a single precision LU factorization, which halves the memory needed for
+        the matrix and roughly doubles the speed of the factorization compared to `solve_matrix`. Double precision
+        accuracy is recovered by iterative refinement, where the residuals are computed by the (double precision)
+        matrix-free operator returned by `get_operator`. Refinement stops when the norm of the residual relative
+        to the norm of the right hand side is smaller than `tolerance`."""
         F = np.array([self.get_right_hand_side()]) if right_hand_side is None else right_hand_side
         
         N = self.get_number_of_matrix_elements()
@@ -192,21 +317,120 @@ class Solver:
                         for _ in range(len(F))]
         
         assert all([f.shape == (N,) for f in F])
-        matrix = self.get_matrix()
+        operator = self.get_operator()
+        
+        st = time.time()
+        matrix = operator.to_float32_matrix()
+        logging.log_info(f'Using mixed precision solver, number of elements: {N}, size of matrix: {N} ({matrix.nbytes/1e6:.0f} MB), symmetry: {self.get_symmetry_description()}')
+        logging.log_info(f'Time for building single precision matrix: {(time.time()-st)*1000:.0f} ms')
+        assert np.all(np.isfinite(matrix))
+        
+        st = time.time()
+        lu = lu_factor(matrix, overwrite_a=True, check_finite=False)
+        del matrix
+        logging.log_info(f'Time for factorizing matrix: {(time.time()-st)*1000:.0f} ms')
+        
+        result = []
+        
+        for f in F:
+            st = time.time()
+            f_norm = np.linalg.norm(f)
+            charges = np.zeros(N)
+            residual = f
+            
+            for iterations in range(1, max_iterations+1):
+                charges += lu_solve(lu, residual.astype(np.float32), check_finite=False)
+                residual = f - operator.matvec(charges)
+                relative_residual = np.linalg.norm(residual)/f_norm if f_norm > 0. else 0.
+                
+                if relative_residual <= tolerance:
+                    break
+            
+            logging.log_info(f'Time for iterative refinement: {(time.time()-st)*1000:.0f} ms (iterations: {iterations}, relative residual: {relative_residual:.1e})')
+            
+            if not relative_residual <= tolerance:
+                logging.log_warning(f'Iterative refinement did not converge, relative residual {relative_residual:.1e} is larger than tolerance {tolerance:.1e}')
+            
+            assert np.all(np.isfinite(charges))
+            result.append(self.charges_to_field(self.get_point_charges(charges)))
+        
+        return result
+    
+    def solve_out_of_core(self, storage, right_hand_side=None):
+        """Solve the matrix equation using a matrix stored on disk, see `OutOfCoreStorage`."""
+        F = np.array([self.get_right_hand_side()]) if right_hand_side is None else right_hand_side
+        
+        N = self.get_number_of_matrix_elements()
          
+        if N == 0:
+            return [self.charges_to_field(EffectivePointCharges.empty_2d() if self.is_2d() else EffectivePointCharges.empty_3d()) \
+                        for _ in range(len(F))]
+        
+        assert all([f.shape == (N,) for f in F])
+        logging.log_info(f'Using out-of-core solver, number of elements: {N}, size of matrix: {N} ({8*N**2/1e6:.0f} MB), symmetry: {self.get_symmetry_description()}, directory: {storage.directory}')
+        
+        storage.get_factorization(self)
+        
         st = time.time()
-        charges = np.linalg.solve(matrix, F.T).T
+        charges = storage.solve(F)
         logging.log_info(f'Time for solving matrix: {(time.time()-st)*1000:.0f} ms')
         assert np.all(np.isfinite(charges)) and charges.shape == F.shape
         
-        result = [self.charges_to_field(EffectivePointCharges(c, self.jac_buffer, self.pos_buffer)) for c in charges]
+        return [self.charges_to_field(self.get_point_charges(c)) for c in charges]
+    
+    def get_hmatrix(self, tolerance=1e-6):
+        """Get a hierarchical matrix (H-matrix) approximation of the matrix returned by `get_matrix`. Memory use
+        and the cost of matrix-vector products scale close to linearly with the number of elements."""
+        assert self.discrete_symmetry is None, "Discrete symmetries are only supported by the (default) direct solver"
+        assert not (self.is_3d() and self.is_higher_order()), "3D higher order meshes are only supported by the (default) direct solver"
+        N_matrix = self.get_number_of_matrix_elements()
+        threads = 1 if backend.DEBUG else util.get_number_of_threads()
+        
+        st = time.time()
+        if self.is_3d():
+            hmatrix = backend.HMatrix.three_d(self.vertices, self.excitation_types, self.excitation_values,
+                self.jac_buffer, self.pos_buffer, tolerance=tolerance, N_threads=threads)
+        else:
+            hmatrix = backend.HMatrix.radial(self.vertices, self.excitation_types, self.excitation_values,
+                self.jac_buffer, self.pos_buffer, self.get_self_terms_radial(), tolerance=tolerance, N_threads=threads)
+        
+        memory = hmatrix.memory()
+        logging.log_info(f'Time for building H-matrix: {(time.time()-st)*1000:.0f} ms, size: {memory/1e6:.0f} MB ({100*memory/(8*N_matrix**2):.1f}% of full matrix)')
          
-        assert len(result) == len(F)
+        return hmatrix
+    
+    def solve_iterative(self, right_hand_side=None, tolerance=1e-10, hmatrix_tolerance=None, tree_theta=None):
+        F = np.array([self.get_right_hand_side()]) if right_hand_side is None else right_hand_side
+        
+        N = self.get_number_of_matrix_elements()
+         
+        if N == 0:
+            return [self.charges_to_field(EffectivePointCharges.empty_2d() if self.is_2d() else EffectivePointCharges.empty_3d()) \
+                        for _ in range(len(F))]
+        
+        assert all([f.shape == (N,) for f in F])
+        logging.log_info(f'Using iterative solver (GMRES), number of elements: {N}, symmetry: {self.get_symmetry_description()}, tolerance: {tolerance}')
+        operator = self.get_operator(tree_theta) if hmatrix_tolerance is None else self.get_hmatrix(hmatrix_tolerance)
+        
+        result = []
+        
+        for f in F:
+            st = time.time()
+            charges, iterations, residual = operator.gmres(f, tolerance=tolerance)
+            logging.log_info(f'Time for solving iteratively: {(time.time()-st)*1000:.0f} ms (iterations: {iterations}, relative residual: {residual:.1e})')
+            
+            if not residual <= tolerance:
+                logging.log_warning(f'Iterative solver did not converge, relative residual {residual:.1e} is larger than tolerance {tolerance:.1e}')
+            
+            assert np.all(np.isfinite(charges))
+            result.append(self.charges_to_field(self.get_point_charges(charges)))
+        
         return result
         
     def solve_fmm(self, precision=0):
         assert self.is_3d() and not self.is_higher_order(), "Fast multipole method is only supported for simple 3D geometries (non higher order triangles)."
         assert isinstance(precision, int) and -2 <= precision <= 5, "Precision should be an intenger -2 <= precision <= 5"
+        assert self.discrete_symmetry is None, "Discrete symmetries are only supported by the (default) direct solver"
          
         triangles = self.vertices
         logging.log_info(f'Using FMM solver, number of elements: {len(triangles)}, symmetry: {self.excitation.mesh.symmetry}, precision: {precision}')
@@ -277,7 +501,7 @@ class MagnetostaticSolver(Solver):
                 normals[i] = backend.normal_2d(v[0], v[1])
             elif self.is_2d() and self.is_higher_order():
                 normals[i] = backend.higher_order_normal_radial(0.0, v[:, :2])
-            elif self.is_3d() and not self.is_higher_order():
+            elif self.is_3d():
                 normals[i] = backend.normal_3d(1/3, 1/3, v)
         
         self.normals = normals
@@ -320,7 +544,17 @@ class MagnetostaticSolver(Solver):
         if not len(currents):
             return EffectivePointCharges.empty_3d()
         
-        return EffectivePointCharges(np.array(currents), np.array(jacobians), np.array(positions))
+        currents, jacobians, positions = np.array(currents), np.array(jacobians), np.array(positions)
+        
+        if self.discrete_symmetry is not None and self.is_2d():
+            # Only half of the coils are meshed. The magnetostatic potential of a current loop is antisymmetric
+            # under z -> -z, therefore the mirrored coils carry the current -sign (see `Excitation.add_discrete_symmetry`)
+            sign = self.discrete_symmetry.characters[1]
+            currents = np.concatenate([currents, -sign*currents])
+            jacobians = np.concatenate([jacobians, jacobians])
+            positions = np.concatenate([positions, positions*np.array([1., 1., -1.])])
+        
+        return EffectivePointCharges(currents, jacobians, positions)
      
     def get_right_hand_side(self):
         st = time.time()
@@ -411,6 +645,380 @@ class EffectivePointCharges:
 
         
      
+class FactorizationCache:
+    """Cache of BEM matrices and their LU factorizations, which can be passed to `solve_bem`. This speeds up
+    solving the same geometry many times, for example when sweeping the voltages applied to the electrodes.
+    
+    The matrices are keyed on the mesh and the excitation types (which elements are fixed voltage, dielectric, etc.).
+    When only the excitation values change (voltages, currents) the cached factorization is reused and solving
+    only requires a forward and back substitution. When the dielectric constants (or permeabilities) change, only the rows
+    of the matrix belonging to the affected `DIELECTRIC` or `MAGNETIZABLE` elements are recomputed.
+    
+    When the mesh of some of the physical groups changes (for example when a single electrode is moved) while the number of elements
+    in every physical group stays the same, only the rows and columns belonging to the changed groups are recomputed. This is not
+    supported for discrete symmetries, 3D higher order meshes or an elliptic table, in which case a new matrix is computed.
+    
+    Instead of factorizing the matrix again, the factorization of the cached matrix is updated using the Woodbury identity, which
+    is much faster when the changed rows and columns are a small fraction of the matrix. Once the number of changed rows and columns
+    exceeds `max_update_fraction` times the size of the matrix, the matrix is factorized again.
+    
+    Note that every cached geometry keeps both the matrix and its factorization in memory."""
+    
+    def __init__(self, max_update_fraction=0.1):
+        self._entries = {}
+        self.max_update_fraction = max_update_fraction
+    
+    def __len__(self):
+        return len(self._entries)
+    
+    def clear(self):
+        """Remove all cached matrices and factorizations."""
+        self._entries = {}
+    
+    def _key(solver):
+        table = solver.elliptic_table
+        
+        return (type(solver).__name__,
+                solver.excitation.symmetry,
+                str(solver.discrete_symmetry),
+                table.tolerance if table is not None else None,
+                hashlib.sha1(np.ascontiguousarray(solver.vertices).tobytes()).hexdigest(),
+                hashlib.sha1(solver.excitation_types.tobytes()).hexdigest())
+    
+    def _structure_key(solver):
+        # Same as _key, but only depends on the number of elements in the physical groups instead of their positions
+        key = FactorizationCache._key(solver)
+        names = sorted((n, hashlib.sha1(np.asarray(indices, dtype=np.int64).tobytes()).hexdigest()) for n, indices in solver.names.items())
+        return key[:-2] + (solver.vertices.shape, key[-1], tuple(names))
+    
+    def _group_hashes(solver):
+        return {n: hashlib.sha1(np.ascontiguousarray(solver.vertices[indices]).tobytes()).hexdigest() for n, indices in solver.names.items()}
+    
+    def _pop_changed_entry(self, solver):
+        # Find the cached matrix of the same geometry in which the smallest number of elements has moved
+        if not solver.supports_matrix_columns():
+            return None, None
+        
+        structure = FactorizationCache._structure_key(solver)
+        group_hashes = FactorizationCache._group_hashes(solver)
+        best_key, best_changed = None, None
+        
+        for key, entry in self._entries.items():
+            if entry['structure'] != structure:
+                continue
+            
+            changed = [np.asarray(solver.names[n], dtype=np.int64) for n, h in group_hashes.items() if entry['group_hashes'][n] != h]
+            changed = np.sort(np.concatenate([np.zeros(0, dtype=np.int64)] + changed))
+            
+            if best_changed is None or len(changed) < len(best_changed):
+                best_key, best_changed = key, changed
+        
+        if best_key is None:
+            return None, None
+        
+        entry = self._entries.pop(best_key)
+        entry['group_hashes'] = group_hashes
+        return entry, best_changed
+    
+    def _update(self, entry, solver, rows, columns):
+        matrix = entry['matrix']
+        N = len(matrix)
+        update = entry['update']
+        
+        if update is None:
+            empty = np.zeros(0, dtype=np.int64)
+            update = dict(rows=empty, base_rows=np.zeros( (0, N) ), columns=empty, base_columns=np.zeros( (N, 0) ))
+        
+        # Save the rows and columns of the factorized matrix before they are overwritten. Part of the
+        # new rows (columns) might already have been overwritten by a previous update of the columns (rows).
+        new_rows = np.setdiff1d(rows, update['rows'])
+        new_columns = np.setdiff1d(columns, update['columns'])
+        
+        base_rows = matrix[new_rows]
+        base_rows[:, update['columns']] = update['base_columns'][new_rows]
+        base_columns = matrix[:, new_columns]
+        base_columns[update['rows']] = update['base_rows'][:, new_columns]
+        
+        update = dict(rows=np.concatenate([update['rows'], new_rows]),
+                      base_rows=np.concatenate([update['base_rows'], base_rows]),
+                      columns=np.concatenate([update['columns'], new_columns]),
+                      base_columns=np.concatenate([update['base_columns'], base_columns], axis=1))
+        
+        st = time.time()
+        if len(columns):
+            matrix[:, columns] = solver.get_matrix_columns(columns)
+        solver.fill_matrix_rows(matrix, rows)
+        logging.log_info(f'Recomputed {len(rows)} rows and {len(columns)} columns of the cached matrix in {(time.time()-st)*1000:.0f} ms')
+        
+        R, C = update['rows'], update['columns']
+        rank = len(R) + len(C)
+        
+        if rank > self.max_update_fraction*N:
+            st = time.time()
+            entry['lu'] = lu_factor(matrix)
+            entry['update'] = None
+            logging.log_info(f'Time for factorizing matrix: {(time.time()-st)*1000:.0f} ms')
+            return
+        
+        # The matrix equals A + E_R X + Y E_C^T = A + U V^T, with A the factorized matrix, E_R (E_C) the columns of the
+        # identity matrix corresponding to the changed rows (columns), U = [E_R, Y] and V^T = [X; E_C^T]. By the Woodbury identity
+        # the inverse is A^-1 - Z (I + V^T Z)^-1 V^T A^-1 with Z = A^-1 U.
+        st = time.time()
+        X = matrix[R] - update['base_rows']
+        Y = matrix[:, C] - update['base_columns']
+        Y[R] = 0.
+        
+        U = np.zeros( (N, rank) )
+        U[R, np.arange(len(R))] = 1.
+        U[:, len(R):] = Y
+        
+        Z = lu_solve(entry['lu'], U)
+        capacitance = np.eye(rank) + np.concatenate([X @ Z, Z[C]])
+        
+        update.update(X=X, Z=Z, capacitance=lu_factor(capacitance))
+        entry['update'] = update
+        logging.log_info(f'Time for updating factorization (rank {rank}): {(time.time()-st)*1000:.0f} ms')
+    
+    def _prepare(self, solver):
+        key = FactorizationCache._key(solver)
+        flux_indices = solver.get_flux_indices()
+        flux_values = solver.excitation_values[flux_indices]
+        
+        entry = self._entries.get(key)
+        columns = np.zeros(0, dtype=np.int64)
+        
+        if entry is None:
+            entry, columns = self._pop_changed_entry(solver)
+            
+            if entry is not None:
+                self._entries[key] = entry
+        
+        if entry is None:
+            matrix = solver.get_matrix()
+            
+            st = time.time()
+            lu = lu_factor(matrix)
+            logging.log_info(f'Time for factorizing matrix: {(time.time()-st)*1000:.0f} ms')
+            
+            entry = dict(matrix=matrix, lu=lu, update=None, flux_values=flux_values,
+                structure=FactorizationCache._structure_key(solver), group_hashes=FactorizationCache._group_hashes(solver))
+            self._entries[key] = entry
+            return entry
+        
+        rows = np.union1d(columns, flux_indices[entry['flux_values'] != flux_values])
+        
+        if len(rows) == 0:
+            logging.log_info('Reusing cached matrix factorization')
+            return entry
+        
+        self._update(entry, solver, rows, columns)
+        entry['flux_values'] = flux_values
+        return entry
+    
+    def solve(self, solver, right_hand_side):
+        """Solve the matrix equation of the given solver for the right hand side(s) of shape (N_rhs, N), using the cache when possible."""
+        entry = self._prepare(solver)
+        update = entry['update']
+        
+        st = time.time()
+        y = lu_solve(entry['lu'], right_hand_side.T)
+        
+        if update is not None:
+            v = np.concatenate([update['X'] @ y, y[update['columns']]])
+            y = y - update['Z'] @ lu_solve(update['capacitance'], v)
+        
+        logging.log_info(f'Time for solving matrix: {(time.time()-st)*1000:.0f} ms')
+        return y.T
+    
+    def get_factorization(self, solver):
+        """Get the LU factorization (as returned by `scipy.linalg.lu_factor`) of the matrix of the given solver, using
+        the cache when possible. A pending low rank update of the factorization is merged by factorizing the matrix again."""
+        entry = self._prepare(solver)
+        
+        if entry['update'] is not None:
+            st = time.time()
+            entry['lu'] = lu_factor(entry['matrix'])
+            entry['update'] = None
+            logging.log_info(f'Time for factorizing matrix: {(time.time()-st)*1000:.0f} ms')
+        
+        return entry['lu']
+
+def _apply_pivots(matrix, pivots, offset):
+    # Apply the row interchanges of a (LAPACK style) LU factorization of a panel starting at row offset
+    for i, p in enumerate(pivots):
+        if p != offset + i:
+            matrix[[offset + i, p]] = matrix[[p, offset + i]]
+
+class OutOfCoreStorage:
+    """Storage of the BEM matrix and its LU factorization in a directory on disk, which can be passed to `solve_bem`. This
+    allows solving geometries for which the matrix does not fit in memory. The rows of the matrix are computed in blocks
+    and written to a memory mapped file, after which the matrix is factorized in place using a blocked (left-looking) LU
+    factorization, which only keeps a few column panels in memory at the same time. Use a directory on a fast local disk.
+    
+    Progress is checkpointed after every block of rows and after every factorized panel. When the computation is interrupted,
+    solving the same geometry again using the same directory resumes from the last checkpoint. After the factorization has completed
+    the directory acts as a persistent factorization cache: solving the same geometry again (with different voltages or currents) only
+    costs a forward and back substitution. A directory stores a single matrix per type of solve: the electrostatic and magnetostatic matrices
+    (for example of an excitation with both electrodes and magnetizable materials) are stored in separate subdirectories. Solving a different
+    geometry starts from scratch.
+    
+    Parameters
+    ----------------------
+    directory: str
+        Directory in which the matrix is stored, created if it does not exist.
+    memory_limit: float
+        Approximate number of bytes used for the blocks of rows and column panels kept in memory."""
+    
+    def __init__(self, directory, memory_limit=1e9):
+        os.makedirs(directory, exist_ok=True)
+        self.directory = directory
+        self.memory_limit = memory_limit
+    
+    def _path(self, name):
+        return path.join(self.solver_directory, name)
+    
+    def _save(self, name, save_fun):
+        # Write to a temporary file first, so a crash never leaves a partially written checkpoint
+        temporary = self._path('tmp.' + name)
+        save_fun(temporary)
+        os.replace(temporary, self._path(name))
+    
+    def _save_progress(self):
+        def save(filename):
+            with open(filename, 'w') as f:
+                json.dump(self.progress, f)
+        
+        self._save('progress.json', save)
+    
+    def _save_array(self, name, array):
+        def save(filename):
+            with open(filename, 'wb') as f:
+                np.save(f, array)
+        
+        self._save(name, save)
+    
+    def _key(solver):
+        flux_values = solver.excitation_values[solver.get_flux_indices()]
+        return hashlib.sha1((repr(FactorizationCache._key(solver)) + flux_values.tobytes().hex()).encode()).hexdigest()
+    
+    def _open(self, solver):
+        N = solver.get_number_of_matrix_elements()
+        key = OutOfCoreStorage._key(solver)
+        
+        self.solver_directory = path.join(self.directory, type(solver).__name__)
+        os.makedirs(self.solver_directory, exist_ok=True)
+        
+        try:
+            with open(self._path('progress.json')) as f:
+                progress = json.load(f)
+        except (FileNotFoundError, ValueError):
+            progress = None
+        
+        if progress is not None and progress['key'] == key and progress['N'] == N:
+            logging.log_info(f'Resuming out-of-core matrix (rows computed: {progress["rows_done"]}/{N}, columns factorized: {progress["columns_done"]}/{N})')
+            self.progress = progress
+            self.matrix = np.memmap(self._path('matrix.dat'), dtype=np.float64, mode='r+', shape=(N, N))
+            factorization_started = progress['columns_done'] > 0 or progress['pending_panel'] is not None
+            self.pivots = np.load(self._path('pivots.npy')) if factorization_started else np.arange(N)
+        else:
+            panel_width = int(min(N, max(1, self.memory_limit // (3*8*N))))
+            self.progress = dict(key=key, N=N, rows_done=0, columns_done=0, panel_width=panel_width, pending_panel=None)
+            self.matrix = np.memmap(self._path('matrix.dat'), dtype=np.float64, mode='w+', shape=(N, N))
+            self.pivots = np.arange(N)
+            self._save_progress()
+        
+        self.N = N
+    
+    def _assemble(self, solver):
+        N = self.N
+        rows_per_block = int(max(1, self.memory_limit // (8*N)))
+        
+        while self.progress['rows_done'] < N:
+            st = time.time()
+            start = self.progress['rows_done']
+            end = min(start + rows_per_block, N)
+            
+            solver.fill_matrix_rows(self.matrix, np.arange(start, end))
+            assert np.all(np.isfinite(self.matrix[start:end]))
+            self.matrix.flush()
+            
+            self.progress['rows_done'] = end
+            self._save_progress()
+            logging.log_info(f'Computed rows {start}-{end} of out-of-core matrix: {(time.time()-st)*1000:.0f} ms')
+    
+    def _commit_panel(self, start, end, panel):
+        # The panel is first saved separately, as overwriting the columns in the matrix cannot be redone after a crash
+        if panel is not None:
+            self._save_array('panel.npy', panel)
+            self._save_array('pivots.npy', self.pivots)
+            self.progress['pending_panel'] = start
+            self._save_progress()
+        else:
+            panel = np.load(self._path('panel.npy'))
+         
+        self.matrix[:, start:end] = panel
+        self.matrix.flush()
+        
+        self.progress['columns_done'] = end
+        self.progress['pending_panel'] = None
+        self._save_progress()
+        os.remove(self._path('panel.npy'))
+    
+    def _factorize(self):
+        N = self.N
+        width = self.progress['panel_width']
+        
+        if self.progress['pending_panel'] is not None:
+            start = self.progress['pending_panel']
+            self._commit_panel(start, min(start + width, N), None)
+        
+        for start in range(self.progress['columns_done'], N, width):
+            st = time.time()
+            end = min(start + width, N)
+            panel = np.array(self.matrix[:, start:end])
+            
+            # Apply the previously factorized panels (left-looking). The rows of the L factors are stored in the order
+            # at the time they were factorized, later row interchanges are applied when using them (as in LINPACK).
+            for j in range(0, start, width):
+                _apply_pivots(panel, self.pivots[j:j+width], j)
+                L = np.array(self.matrix[j:, j:j+width])
+                panel[j:j+width] = solve_triangular(L[:width], panel[j:j+width], lower=True, unit_diagonal=True, check_finite=False)
+                panel[j+width:] -= L[width:] @ panel[j:j+width]
+            
+            lu, pivots = lu_factor(panel[start:], check_finite=False)
+            panel[start:] = lu
+            self.pivots[start:end] = start + pivots
+            
+            self._commit_panel(start, end, panel)
+            logging.log_info(f'Factorized columns {start}-{end} of out-of-core matrix: {(time.time()-st)*1000:.0f} ms')
+    
+    def get_factorization(self, solver):
+        """Compute (or resume computing) the matrix of the given solver and its LU factorization. Returns self, which
+        can be used to solve the system using `OutOfCoreStorage.solve`."""
+        self._open(solver)
+        self._assemble(solver)
+        self._factorize()
+        return self
+    
+    def solve(self, right_hand_side):
+        """Solve the factorized system for the right hand sides (shape (M, N) for M right hand sides)."""
+        assert self.progress['columns_done'] == self.N
+        N, width = self.N, self.progress['panel_width']
+        X = np.array(right_hand_side, dtype=np.float64).T
+        
+        for j in range(0, N, width):
+            _apply_pivots(X, self.pivots[j:j+width], j)
+            L = np.array(self.matrix[j:, j:j+width])
+            X[j:j+width] = solve_triangular(L[:width], X[j:j+width], lower=True, unit_diagonal=True, check_finite=False)
+            X[j+width:] -= L[width:] @ X[j:j+width]
+         
+        for j in reversed(range(0, N, width)):
+            U = np.array(self.matrix[:j+width, j:j+width])
+            X[j:j+width] = solve_triangular(U[j:], X[j:j+width], lower=False, check_finite=False)
+            X[:j] -= U[:j] @ X[j:j+width]
+        
+        return X.T
+
 def _excitation_to_higher_order(excitation):
     logging.log_info('Upgrading mesh to higher to be compatible with matrix solver')
     # Upgrade mesh, such that matrix solver will support it
@@ -419,7 +1027,9 @@ def _excitation_to_higher_order(excitation):
     excitation.mesh = mesh._to_higher_order_mesh()
     return excitation
 
-def solve_bem(excitation, superposition=False, use_fmm=False, fmm_precision=0):
+def solve_bem(excitation, superposition=False, use_fmm=False, fmm_precision=0, use_gmres=False, gmres_tolerance=1e-10,
+        use_hmatrix=False, hmatrix_tolerance=1e-6, factorization_cache=None, elliptic_table_tolerance=None, tree_theta=None,
+        mixed_precision=False, out_of_core=None):
     """
     Solve for the charges on the surface of the geometry by using the Boundary Element Method (BEM) and taking
     into account the specified `excitation`. 
@@ -443,12 +1053,64 @@ def solve_bem(excitation, superposition=False, use_fmm=False, fmm_precision=0):
     fmm_precision : int
         Precision flag passed to the fast multipole library, should be one of -1, 0, 1, 2, 3, 4. Choose higher numbers if more precision is desired.
     
+    use_gmres : bool
+        Solve the matrix equation iteratively (using GMRES) without ever storing the matrix. The matrix-vector products are
+        computed on the fly, which only needs O(N) memory instead of O(N^2). This allows solving much larger geometries.
+        Dielectric and magnetizable materials are supported.
+    
+    gmres_tolerance : float
+        Stop iterating when the norm of the residual relative to the norm of the right hand side is smaller than this value.
+    
+    tree_theta : float
+        Only supported when `use_gmres=True` for radial symmetric geometries. Compute the matrix-vector products using a tree code with
+        the given opening angle (satisfying 0 <= theta < 1), which makes every iteration O(N log N) instead of O(N^2). Smaller values
+        are more accurate, a value of 0.2 typically gives a relative accuracy of about 1e-6. See also `FieldRadialBEM.set_tree_accuracy`.
+    
+    use_hmatrix : bool
+        Compress the matrix as a hierarchical matrix (H-matrix) and solve iteratively (using GMRES). Blocks of the matrix that couple
+        groups of elements which are far apart are approximated by low rank matrices (adaptive cross approximation). Memory use and solve
+        time scale close to linearly with the number of elements, which makes this the preferred option for large meshes.
+    
+    hmatrix_tolerance : float
+        Relative accuracy of the low rank approximations in the H-matrix. Choose smaller values if more precision is desired.
+    
+    factorization_cache : FactorizationCache
+        When given, the factorization of the matrix is stored in (or retrieved from) this cache. Solving the same geometry
+        again with different voltages or currents then only costs a forward and back substitution. When only some electrodes have moved, the
+        cached factorization is updated instead of recomputed (see `FactorizationCache`). Only supported by the (default) direct solver.
+    
+    elliptic_table_tolerance : float
+        Only used for radial symmetric geometries, supported by the (default) direct solver and the out-of-core solver. When given, the elliptic integrals in the Green's function
+        are interpolated from a table with the given maximum relative error while filling the matrix, which is faster than evaluating them exactly.
+        To also use the table for the field evaluations see `FieldRadialBEM.set_elliptic_table_accuracy`.
+    
+    mixed_precision : bool
+        Store and factorize the matrix in single precision, which halves the memory use of the direct solver and makes the
+        factorization faster. The accuracy of double precision is recovered using iterative refinement, see `Solver.solve_mixed_precision`.
+        Not supported in combination with a `factorization_cache`, discrete symmetries or 3D higher order meshes.
+    
+    out_of_core : OutOfCoreStorage
+        When given, the matrix and its factorization are stored on disk (in the directory of the storage) instead of in memory,
+        which allows solving geometries for which the matrix does not fit in memory. Interrupted computations are resumed from the
+        last checkpoint when solving the same geometry again.
+    
     Returns
     -------
     A `FieldRadialBEM` if the geometry (contained in the given `excitation`) is radially symmetric. If the geometry is a generic three
     dimensional geometry `Field3D_BEM` is returned. Alternatively, when `superposition=True` a dictionary is returned, where the keys
     are the physical groups with unity excitation, and the values are the resulting fields.
     """
+    iterative = use_fmm or use_gmres or use_hmatrix
+    
+    assert sum([use_fmm, use_gmres, use_hmatrix, mixed_precision, out_of_core is not None]) <= 1, \
+        "At most one of use_fmm, use_gmres, use_hmatrix, mixed_precision and out_of_core can be given"
+    assert factorization_cache is None or not (iterative or mixed_precision or out_of_core is not None), \
+        "A factorization cache is only supported by the (default) direct solver"
+    assert tree_theta is None or (use_gmres and excitation.mesh.is_2d()), \
+        "tree_theta is only supported by the GMRES solver (use_gmres=True) for radial symmetric geometries"
+    assert elliptic_table_tolerance is None or not (iterative or mixed_precision), \
+        "The elliptic table is only supported by the direct and out-of-core solvers"
+    
     if use_fmm:
         assert not excitation.is_magnetostatic(), "Magnetostatic not yet supported for FMM"
         if superposition:
@@ -460,6 +1122,18 @@ def solve_bem(excitation, superposition=False, use_fmm=False, fmm_precision=0):
         if excitation.mesh.is_2d() and not excitation.mesh.is_higher_order():
             excitation = _excitation_to_higher_order(excitation)
          
+        def solve(solver, right_hand_side=None):
+            if use_hmatrix:
+                return solver.solve_iterative(right_hand_side, tolerance=gmres_tolerance, hmatrix_tolerance=hmatrix_tolerance)
+            elif use_gmres:
+                return solver.solve_iterative(right_hand_side, tolerance=gmres_tolerance, tree_theta=tree_theta)
+            elif out_of_core is not None:
+                return solver.solve_out_of_core(out_of_core, right_hand_side)
+            elif mixed_precision:
+                return solver.solve_mixed_precision(right_hand_side)
+            else:
+                return solver.solve_matrix(right_hand_side, factorization_cache=factorization_cache)
+         
         if superposition:
             # Speedup: invert matrix only once, when using superposition
             excitations = excitation._split_for_superposition()
@@ -467,13 +1141,13 @@ def solve_bem(excitation, superposition=False, use_fmm=False, fmm_precision=0):
             # Solve for elec fields
             elec_names = [n for n, v in excitations.items() if v.is_electrostatic()]
             right_hand_sides = np.array([ElectrostaticSolver(excitations[n]).get_right_hand_side() for n in elec_names])
-            solutions = ElectrostaticSolver(excitation).solve_matrix(right_hand_sides)
+            solutions = solve(ElectrostaticSolver(excitation, elliptic_table_tolerance), right_hand_sides)
             elec_dict = {n:s for n, s in zip(elec_names, solutions)}
             
             # Solve for mag fields 
             mag_names = [n for n, v in excitations.items() if v.is_magnetostatic()]
             right_hand_sides = np.array([MagnetostaticSolver(excitations[n]).get_right_hand_side() for n in mag_names])
-            solutions = MagnetostaticSolver(excitation).solve_matrix(right_hand_sides)
+            solutions = solve(MagnetostaticSolver(excitation, elliptic_table_tolerance), right_hand_sides)
             mag_dict = {n:s for n, s in zip(mag_names, solutions)}
              
             return {**elec_dict, **mag_dict}
@@ -483,13 +1157,13 @@ def solve_bem(excitation, superposition=False, use_fmm=False, fmm_precision=0):
             assert mag or elec, "Solving for an empty excitation"
              
             if mag and elec:
-                elec_field = ElectrostaticSolver(excitation).solve_matrix()[0]
-                mag_field = MagnetostaticSolver(excitation).solve_matrix()[0]
+                elec_field = solve(ElectrostaticSolver(excitation, elliptic_table_tolerance))[0]
+                mag_field = solve(MagnetostaticSolver(excitation, elliptic_table_tolerance))[0]
                 return elec_field + mag_field
             elif elec and not mag:
-                return ElectrostaticSolver(excitation).solve_matrix()[0]
+                return solve(ElectrostaticSolver(excitation, elliptic_table_tolerance))[0]
             elif mag and not elec:
-                return MagnetostaticSolver(excitation).solve_matrix()[0]
+                return solve(MagnetostaticSolver(excitation, elliptic_table_tolerance))[0]
 
 def _get_one_dimensional_high_order_ppoly(z, y, dydz, dydz2):
     bpoly = BPoly.from_derivatives(z, np.array([y, dydz, dydz2]).T)
@@ -565,6 +1239,87 @@ class Field:
          
         raise RuntimeError("Cannot use potential_at_point when both electric and magnetic fields are present, " \
             "use electrostatic_potential_at_point or magnetostatic_potential_at_point")
+    
+    def field_at_points(self, points):
+        """Same as `field_at_point`, but for many points at once. The points are evaluated in a single (multithreaded)
+        call to the backend, which is much faster than calling `field_at_point` for every point.
+
+        Parameters
+        ---------------------
+        points: (N, 2) or (N, 3) np.ndarray of float64
+
+        Returns
+        --------------------
+        (N, 2) or (N, 3) np.ndarray of float64. The electrostatic field \\(\\vec{E}\\) or the magnetostatic field \\(\\vec{H}\\).
+        """
+        elec, mag = self.is_electrostatic(), self.is_magnetostatic()
+        
+        if elec and not mag:
+            return self.electrostatic_field_at_points(points)
+        elif not elec and mag:
+            return self.magnetostatic_field_at_points(points)
+         
+        raise RuntimeError("Cannot use field_at_points when both electric and magnetic fields are present, " \
+            "use electrostatic_field_at_points or magnetostatic_field_at_points")
+    
+    def potential_at_points(self, points):
+        """Same as `potential_at_point`, but for many points at once. The points are evaluated in a single (multithreaded)
+        call to the backend, which is much faster than calling `potential_at_point` for every point.
+
+        Parameters
+        ---------------------
+        points: (N, 2) or (N, 3) np.ndarray of float64
+
+        Returns
+        --------------------
+        (N,) np.ndarray of float64. The electrostatic potential (unit Volt) or magnetostatic scalar potential (unit Ampere)
+        """
+        elec, mag = self.is_electrostatic(), self.is_magnetostatic()
+        
+        if elec and not mag:
+            return self.electrostatic_potential_at_points(points)
+        elif not elec and mag:
+            return self.magnetostatic_potential_at_points(points)
+         
+        raise RuntimeError("Cannot use potential_at_points when both electric and magnetic fields are present, " \
+            "use electrostatic_potential_at_points or magnetostatic_potential_at_points")
+    
+    def electrostatic_field_at_points(self, points):
+        """Same as `electrostatic_field_at_point`, but for an (N, 2) or (N, 3) array of points."""
+        return self._evaluate_at_points(points, False, True)
+    
+    def magnetostatic_field_at_points(self, points):
+        """Same as `magnetostatic_field_at_point`, but for an (N, 2) or (N, 3) array of points."""
+        return self._evaluate_at_points(points, True, True)
+    
+    def electrostatic_potential_at_points(self, points):
+        """Same as `electrostatic_potential_at_point`, but for an (N, 2) or (N, 3) array of points."""
+        return self._evaluate_at_points(points, False, False)
+    
+    def magnetostatic_potential_at_points(self, points):
+        """Same as `magnetostatic_potential_at_point`, but for an (N, 2) or (N, 3) array of points."""
+        return self._evaluate_at_points(points, True, False)
+    
+    def _is_approximated(self):
+        # Whether the field evaluations use an approximation (like a tree) instead of the compiled field
+        return False
+    
+    def _evaluate_at_points(self, points, magnetostatic, field):
+        points = np.asarray(points, dtype=np.float64)
+        assert points.ndim == 2
+        
+        if self._is_approximated():
+            kind = 'magnetostatic' if magnetostatic else 'electrostatic'
+            fun = getattr(self, kind + ('_field_at_point' if field else '_potential_at_point'))
+            return np.array([fun(p) for p in points])
+        
+        threads = 1 if backend.DEBUG else util.get_number_of_threads()
+        compiled = self.get_compiled_field()
+        
+        if field:
+            return compiled.fields(points, magnetostatic=magnetostatic, N_threads=threads)
+        
+        return compiled.potentials(points, magnetostatic=magnetostatic, N_threads=threads)
      
     
     
@@ -581,6 +1336,7 @@ class FieldBEM(Field):
         self.magnetostatic_point_charges = magnetostatic_point_charges
         self.current_point_charges = current_point_charges
         self.field_bounds = None
+        self._compiled_field = None
      
     def set_bounds(self, bounds):
         """Set the field bounds. Outside the field bounds the field always returns zero (i.e. no field). Note
@@ -594,6 +1350,16 @@ class FieldBEM(Field):
         """
         self.field_bounds = np.array(bounds)
         assert self.field_bounds.shape == (3,2)
+        self._compiled_field = None
+    
+    def get_compiled_field(self):
+        """Get the field compiled in the backend (see `backend.CompiledField`), which is used for the field evaluations
+        and tracing when no faster approximation (like a tree) is enabled. The field is compiled once, on the first field evaluation,
+        therefore the point charges should not be modified afterwards."""
+        if self._compiled_field is None:
+            self._compiled_field = self._compile()
+        
+        return self._compiled_field
     
     def is_electrostatic(self):
         return len(self.electrostatic_point_charges) > 0
@@ -690,8 +1456,104 @@ class FieldRadialBEM(FieldBEM):
             current_point_charges = EffectivePointCharges.empty_3d()
          
         self.symmetry = E.Symmetry.RADIAL
+        self.elliptic_table_tolerance = None
+        self._elliptic_table = None
+        self.tree_theta = None
+        self._trees = None
+        self.quadrature_tolerance = None
+        self._adaptive_charges = None
         super().__init__(electrostatic_point_charges, magnetostatic_point_charges, current_point_charges)
+    
+    def set_tree_accuracy(self, theta):
+        """Speed up the field evaluations (including the field evaluations while tracing) by grouping far away
+        rings of charge in a tree. The effect of a group of rings is approximated by a small number of rings at Chebyshev points
+        inside the bounding box of the group, when the ratio of the group size to the distance of the evaluation point is smaller than `theta`.
+        The trees are built once, on the first field evaluation. The field of the currents is still computed directly.
+        
+        Parameters
+        -------------------
+        theta: float or None
+            Opening angle, satisfying 0 <= theta < 1. Smaller values are more accurate but slower. A value of 0.2 typically
+            gives a relative accuracy of the field of about 1e-6, while 0.5 gives about 1e-3. Use None to go back to direct summation.
+        """
+        assert theta is None or 0. <= theta < 1., "Opening angle theta should satisfy 0 <= theta < 1"
+        self.tree_theta = theta
+        self._trees = None
+    
+    def get_trees(self):
+        """Get the trees of the electrostatic and magnetostatic charges, or None if no tree accuracy is set."""
+        if self.tree_theta is None:
+            return None
+        
+        if self._trees is None:
+            st = time.time()
+            self._trees = (backend.RadialTree(self.electrostatic_point_charges, self.tree_theta),
+                           backend.RadialTree(self.magnetostatic_point_charges, self.tree_theta))
+            logging.log_info(f'Building radial trees took {(time.time()-st)*1000:.0f} ms (theta={self.tree_theta})')
          
+        return self._trees
+    
+    def set_quadrature_tolerance(self, tolerance):
+        """Speed up the field evaluations (including the field evaluations while tracing) by using fewer quadrature
+        points for line elements far away from the evaluation point. Far away line elements are represented by a single ring,
+        line elements at intermediate distance by four rings and close line elements by the full quadrature rule.
+        The number of rings is chosen such that the estimated relative error of the contribution of every line element is below `tolerance`.
+        The aggregated charges are computed once, on the first field evaluation. A tree accuracy (see `set_tree_accuracy`) takes precedence.
+        
+        Parameters
+        -------------------
+        tolerance: float or None
+            Relative error per line element. Since the error decreases with the distance squared, the speed up is largest for
+            loose tolerances (1e-3 to 1e-5). Use None to go back to the full quadrature rule.
+        """
+        assert tolerance is None or tolerance >= 0.
+        self.quadrature_tolerance = tolerance
+        self._adaptive_charges = None
+    
+    def get_adaptive_charges(self):
+        """Get the adaptive charges (see `backend.AdaptiveChargesRadial`) of the electrostatic and magnetostatic charges,
+        or None if no quadrature tolerance is set."""
+        if self.quadrature_tolerance is None:
+            return None
+        
+        if self._adaptive_charges is None:
+            self._adaptive_charges = (backend.AdaptiveChargesRadial(self.electrostatic_point_charges, self.quadrature_tolerance),
+                                      backend.AdaptiveChargesRadial(self.magnetostatic_point_charges, self.quadrature_tolerance))
+         
+        return self._adaptive_charges
+    
+    def set_elliptic_table_accuracy(self, tolerance):
+        """Speed up the field evaluations (including the field evaluations while tracing) by interpolating the
+        elliptic integrals in the Green's function of the charged rings from a table, instead of evaluating them exactly.
+        The table is built once, on the first field evaluation.
+        
+        Parameters
+        -------------------
+        tolerance: float or None
+            Maximum relative error of the tabulated elliptic integrals (at least 1e-14). Use None to go back to the exact Green's function.
+        """
+        assert tolerance is None or tolerance > 0.
+        self.elliptic_table_tolerance = tolerance
+        self._elliptic_table = None
+        self._compiled_field = None
+    
+    def get_elliptic_table(self):
+        """Get the table of elliptic integrals used to evaluate the field, or None if no table accuracy is set."""
+        if self.elliptic_table_tolerance is None:
+            return None
+        
+        if self._elliptic_table is None:
+            self._elliptic_table = backend.EllipticTable(self.elliptic_table_tolerance)
+         
+        return self._elliptic_table
+     
+    def _is_approximated(self):
+        return self.tree_theta is not None or self.quadrature_tolerance is not None
+    
+    def _compile(self):
+        return backend.CompiledField.radial(self.electrostatic_point_charges, self.magnetostatic_point_charges,
+            self.current_point_charges, field_bounds=self.field_bounds, table=self.get_elliptic_table())
+     
     def current_field_at_point(self, point):
         currents = self.current_point_charges.charges
         jacobians = self.current_point_charges.jacobians
@@ -719,10 +1581,14 @@ class FieldRadialBEM(FieldBEM):
         Numpy array containing the field strengths (in units of V/mm) in the r and z directions.   
         """
         assert point.shape == (2,) or point.shape == (3,)
-        charges = self.electrostatic_point_charges.charges
-        jacobians = self.electrostatic_point_charges.jacobians
-        positions = self.electrostatic_point_charges.positions
-        return backend.field_radial(point, charges, jacobians, positions)
+        
+        if self.tree_theta is not None:
+            return self.get_trees()[0].field(point)
+        
+        if self.quadrature_tolerance is not None:
+            return self.get_adaptive_charges()[0].field(point, table=self.get_elliptic_table())
+        
+        return self.get_compiled_field().field(point)
      
     def electrostatic_potential_at_point(self, point):
         """
@@ -739,10 +1605,14 @@ class FieldRadialBEM(FieldBEM):
         """
         point = np.array(point).astype(np.float64)
         assert point.shape == (2,) or point.shape == (3,)
-        charges = self.electrostatic_point_charges.charges
-        jacobians = self.electrostatic_point_charges.jacobians
-        positions = self.electrostatic_point_charges.positions
-        return backend.potential_radial(point, charges, jacobians, positions)
+        
+        if self.tree_theta is not None:
+            return self.get_trees()[0].potential(point)
+        
+        if self.quadrature_tolerance is not None:
+            return self.get_adaptive_charges()[0].potential(point, table=self.get_elliptic_table())
+        
+        return self.get_compiled_field().potential(point)
     
     def magnetostatic_field_at_point(self, point):
         """
@@ -759,15 +1629,16 @@ class FieldRadialBEM(FieldBEM):
         """
         point = np.array(point).astype(np.float64)
         assert point.shape == (2,)
-        current_field = self.current_field_at_point(point)
         
-        charges = self.magnetostatic_point_charges.charges
-        jacobians = self.magnetostatic_point_charges.jacobians
-        positions = self.magnetostatic_point_charges.positions
+        if self.tree_theta is not None:
+            mag_field = self.get_trees()[1].field(point)
+        elif self.quadrature_tolerance is not None:
+            mag_field = self.get_adaptive_charges()[1].field(point, table=self.get_elliptic_table())
+        else:
+            # The compiled field includes the field of the currents
+            return self.get_compiled_field().field(point, magnetostatic=True)
         
-        mag_field = backend.field_radial(point, charges, jacobians, positions)
-
-        return current_field + mag_field
+        return self.current_field_at_point(point) + mag_field
 
     def magnetostatic_potential_at_point(self, point):
         """
@@ -784,10 +1655,14 @@ class FieldRadialBEM(FieldBEM):
         """
 
         assert point.shape == (2,)
-        charges = self.magnetostatic_point_charges.charges
-        jacobians = self.magnetostatic_point_charges.jacobians
-        positions = self.magnetostatic_point_charges.positions
-        return backend.potential_radial(point, charges, jacobians, positions)
+        
+        if self.tree_theta is not None:
+            return self.get_trees()[1].potential(point)
+        
+        if self.quadrature_tolerance is not None:
+            return self.get_adaptive_charges()[1].potential(point, table=self.get_elliptic_table())
+        
+        return self.get_compiled_field().potential(point, magnetostatic=True)
     
     def current_potential_axial(self, z):
         assert isinstance(z, float)
@@ -813,7 +1688,8 @@ class FieldRadialBEM(FieldBEM):
         charges = self.electrostatic_point_charges.charges
         jacobians = self.electrostatic_point_charges.jacobians
         positions = self.electrostatic_point_charges.positions
-        return backend.axial_derivatives_radial(z, charges, jacobians, positions)
+        threads = 1 if backend.DEBUG else util.get_number_of_threads()
+        return backend.axial_derivatives_radial(z, charges, jacobians, positions, N_threads=threads)
     
     def get_magnetostatic_axial_potential_derivatives(self, z):
         """
@@ -833,7 +1709,8 @@ class FieldRadialBEM(FieldBEM):
         jacobians = self.magnetostatic_point_charges.jacobians
         positions = self.magnetostatic_point_charges.positions
          
-        derivs_magnetic = backend.axial_derivatives_radial(z, charges, jacobians, positions)
+        threads = 1 if backend.DEBUG else util.get_number_of_threads()
+        derivs_magnetic = backend.axial_derivatives_radial(z, charges, jacobians, positions, N_threads=threads)
         derivs_current = self.get_current_axial_potential_derivatives(z)
         return derivs_magnetic + derivs_current
      
@@ -855,7 +1732,8 @@ class FieldRadialBEM(FieldBEM):
         currents = self.current_point_charges.charges
         jacobians = self.current_point_charges.jacobians
         positions = self.current_point_charges.positions
-        return backend.current_axial_derivatives_radial(z, currents, jacobians, positions)
+        threads = 1 if backend.DEBUG else util.get_number_of_threads()
+        return backend.current_axial_derivatives_radial(z, currents, jacobians, positions, N_threads=threads)
       
     def axial_derivative_interpolation(self, zmin, zmax, N=None):
         """
@@ -886,10 +1764,10 @@ class FieldRadialBEM(FieldBEM):
         z = np.linspace(zmin, zmax, N)
         
         st = time.time()
-        elec_derivs = np.concatenate(util.split_collect(self.get_electrostatic_axial_potential_derivatives, z), axis=0)
+        elec_derivs = self.get_electrostatic_axial_potential_derivatives(z)
         elec_coeffs = _quintic_spline_coefficients(z, elec_derivs.T)
         
-        mag_derivs = np.concatenate(util.split_collect(self.get_magnetostatic_axial_potential_derivatives, z), axis=0)
+        mag_derivs = self.get_magnetostatic_axial_potential_derivatives(z)
         mag_coeffs = _quintic_spline_coefficients(z, mag_derivs.T)
         
         logging.log_info(f'Computing derivative interpolation took {(time.time()-st)*1000:.2f} ms ({len(z)} items)')
@@ -915,12 +1793,80 @@ class Field3D_BEM(FieldBEM):
         super().__init__(electrostatic_point_charges, magnetostatic_point_charges, EffectivePointCharges.empty_3d())
         
         self.symmetry = E.Symmetry.THREE_D
+        self.octree_theta = None
+        self._octrees = None
+        self.quadrature_tolerance = None
+        self._adaptive_charges = None
 
         for eff in [electrostatic_point_charges, magnetostatic_point_charges]:
             N = len(eff.charges)
             assert eff.charges.shape == (N,)
             assert eff.jacobians.shape == (N, backend.N_TRIANGLE_QUAD)
             assert eff.positions.shape == (N, backend.N_TRIANGLE_QUAD, 3)
+    
+    def _is_approximated(self):
+        return self.octree_theta is not None or self.quadrature_tolerance is not None
+    
+    def _compile(self):
+        return backend.CompiledField.three_d(self.electrostatic_point_charges, self.magnetostatic_point_charges, field_bounds=self.field_bounds)
+    
+    def set_octree_accuracy(self, theta):
+        """Speed up the field evaluations (including the field evaluations while tracing) by grouping far away
+        charges in an octree (Barnes-Hut algorithm). Groups of charges are approximated by a multipole expansion
+        (up to quadrupole order) when the ratio of the group size to the distance of the evaluation point is smaller than `theta`.
+        The octree is built once, on the first field evaluation.
+        
+        Parameters
+        -------------------
+        theta: float or None
+            Opening angle, satisfying 0 <= theta < 1. Smaller values are more accurate but slower. A value of 0.2 typically
+            gives a relative accuracy of the field of about 1e-4, while 0.5 gives about 1e-2. Use None to go back to direct summation.
+        """
+        assert theta is None or 0. <= theta < 1., "Opening angle theta should satisfy 0 <= theta < 1"
+        self.octree_theta = theta
+        self._octrees = None
+    
+    def get_octrees(self):
+        """Get the octrees of the electrostatic and magnetostatic charges, or None if no octree accuracy is set."""
+        if self.octree_theta is None:
+            return None
+        
+        if self._octrees is None:
+            st = time.time()
+            self._octrees = (backend.Octree3D(self.electrostatic_point_charges, self.octree_theta),
+                             backend.Octree3D(self.magnetostatic_point_charges, self.octree_theta))
+            logging.log_info(f'Building octrees took {(time.time()-st)*1000:.0f} ms (theta={self.octree_theta})')
+         
+        return self._octrees
+    
+    def set_quadrature_tolerance(self, tolerance):
+        """Speed up the field evaluations (including the field evaluations while tracing) by using fewer quadrature
+        points for triangles far away from the evaluation point. Far away triangles are represented by a single point charge,
+        triangles at intermediate distance by three point charges and close triangles by the full quadrature rule.
+        The number of points is chosen such that the estimated relative error of the contribution of every triangle is below `tolerance`.
+        The aggregated charges are computed once, on the first field evaluation. An octree accuracy (see `set_octree_accuracy`) takes precedence.
+        
+        Parameters
+        -------------------
+        tolerance: float or None
+            Relative error per triangle. Since the error decreases with the distance squared, the speed up is largest for
+            loose tolerances (1e-3 to 1e-5). Use None to go back to the full quadrature rule.
+        """
+        assert tolerance is None or tolerance >= 0.
+        self.quadrature_tolerance = tolerance
+        self._adaptive_charges = None
+    
+    def get_adaptive_charges(self):
+        """Get the adaptive charges (see `backend.AdaptiveCharges3D`) of the electrostatic and magnetostatic charges,
+        or None if no quadrature tolerance is set."""
+        if self.quadrature_tolerance is None:
+            return None
+        
+        if self._adaptive_charges is None:
+            self._adaptive_charges = (backend.AdaptiveCharges3D(self.electrostatic_point_charges, self.quadrature_tolerance),
+                                      backend.AdaptiveCharges3D(self.magnetostatic_point_charges, self.quadrature_tolerance))
+         
+        return self._adaptive_charges
      
     def electrostatic_field_at_point(self, point):
         """
@@ -936,10 +1882,14 @@ class Field3D_BEM(FieldBEM):
         Numpy array containing the field strengths (in units of V/mm) in the x, y and z directions.
         """
         assert point.shape == (3,)
-        charges = self.electrostatic_point_charges.charges
-        jacobians = self.electrostatic_point_charges.jacobians
-        positions = self.electrostatic_point_charges.positions
-        return backend.field_3d(point, charges, jacobians, positions)
+        
+        if self.octree_theta is not None:
+            return self.get_octrees()[0].field(point)
+        
+        if self.quadrature_tolerance is not None:
+            return self.get_adaptive_charges()[0].field(point)
+         
+        return self.get_compiled_field().field(point)
      
     def electrostatic_potential_at_point(self, point):
         """
@@ -956,10 +1906,14 @@ class Field3D_BEM(FieldBEM):
         """
         point = np.array(point).astype(np.float64)
         assert point.shape == (3,)
-        charges = self.electrostatic_point_charges.charges
-        jacobians = self.electrostatic_point_charges.jacobians
-        positions = self.electrostatic_point_charges.positions
-        return backend.potential_3d(point, charges, jacobians, positions)
+        
+        if self.octree_theta is not None:
+            return self.get_octrees()[0].potential(point)
+        
+        if self.quadrature_tolerance is not None:
+            return self.get_adaptive_charges()[0].potential(point)
+         
+        return self.get_compiled_field().potential(point)
      
     def magnetostatic_field_at_point(self, point):
         """
@@ -976,10 +1930,14 @@ class Field3D_BEM(FieldBEM):
         """
         point = np.array(point).astype(np.float64)
         assert point.shape == (3,)
-        charges = self.magnetostatic_point_charges.charges
-        jacobians = self.magnetostatic_point_charges.jacobians
-        positions = self.magnetostatic_point_charges.positions
-        return backend.field_3d(point, charges, jacobians, positions)
+        
+        if self.octree_theta is not None:
+            return self.get_octrees()[1].field(point)
+        
+        if self.quadrature_tolerance is not None:
+            return self.get_adaptive_charges()[1].field(point)
+         
+        return self.get_compiled_field().field(point, magnetostatic=True)
      
     def magnetostatic_potential_at_point(self, point):
         """
@@ -995,10 +1953,14 @@ class Field3D_BEM(FieldBEM):
         Potential as a float value (in units of A).
         """
         assert point.shape == (3,)
-        charges = self.magnetostatic_point_charges.charges
-        jacobians = self.magnetostatic_point_charges.jacobians
-        positions = self.magnetostatic_point_charges.positions
-        return backend.potential_3d(point, charges, jacobians, positions)
+        
+        if self.octree_theta is not None:
+            return self.get_octrees()[1].potential(point)
+        
+        if self.quadrature_tolerance is not None:
+            return self.get_adaptive_charges()[1].potential(point)
+         
+        return self.get_compiled_field().potential(point, magnetostatic=True)
     
     
     def axial_derivative_interpolation(self, zmin, zmax, N=None):
@@ -1041,8 +2003,8 @@ class Field3D_BEM(FieldBEM):
         charges = eff.charges
         jacobians = eff.jacobians
         positions = eff.positions
-        coeffs = util.split_collect(lambda z: backend.axial_coefficients_3d(charges, jacobians, positions, z), z)
-        coeffs = np.concatenate(coeffs, axis=0)
+        threads = 1 if backend.DEBUG else util.get_number_of_threads()
+        coeffs = backend.axial_coefficients_3d(charges, jacobians, positions, z, N_threads=threads)
         interpolated_coeffs = CubicSpline(z, coeffs).c
         interpolated_coeffs = np.moveaxis(interpolated_coeffs, 0, -1)
         return np.require(interpolated_coeffs, requirements=('C_CONTIGUOUS', 'ALIGNED'))
@@ -1073,6 +2035,15 @@ class FieldAxial(Field):
         
         self.has_electrostatic = np.any(self.electrostatic_coeffs != 0.)
         self.has_magnetostatic = np.any(self.magnetostatic_coeffs != 0.)
+        self._compiled_field = None
+    
+    def get_compiled_field(self):
+        """Get the field compiled in the backend (see `backend.CompiledField`), which is used for the field evaluations
+        and tracing. The field is compiled once, on the first field evaluation."""
+        if self._compiled_field is None:
+            self._compiled_field = self._compile()
+        
+        return self._compiled_field
      
     def is_electrostatic(self):
         return self.has_electrostatic
@@ -1120,6 +2091,9 @@ class FieldRadialAxial(FieldAxial):
         assert self.magnetostatic_coeffs.shape == (len(z)-1, backend.DERIV_2D_MAX, 6)
         self.symmetry = E.Symmetry.RADIAL
     
+    def _compile(self):
+        return backend.CompiledField.radial_axial(self.z, self.electrostatic_coeffs, self.magnetostatic_coeffs)
+    
     def electrostatic_field_at_point(self, point):
         """
         Compute the electric field, \( \\vec{E} = -\\nabla \phi \)
@@ -1134,7 +2108,7 @@ class FieldRadialAxial(FieldAxial):
         Numpy array containing the field strengths (in units of V/mm) in the r and z directions.
         """
         assert point.shape == (2,)
-        return backend.field_radial_derivs(point, self.z, self.electrostatic_coeffs)
+        return self.get_compiled_field().field(point)
     
     def magnetostatic_field_at_point(self, point):
         """
@@ -1151,7 +2125,7 @@ class FieldRadialAxial(FieldAxial):
         """
         point = np.array(point).astype(np.float64)
         assert point.shape == (2,)
-        return backend.field_radial_derivs(point, self.z, self.magnetostatic_coeffs)
+        return self.get_compiled_field().field(point, magnetostatic=True)
      
     def electrostatic_potential_at_point(self, point):
         """
@@ -1168,7 +2142,7 @@ class FieldRadialAxial(FieldAxial):
         """
         point = np.array(point).astype(np.float64)
         assert point.shape == (2,)
-        return backend.potential_radial_derivs(point, self.z, self.electrostatic_coeffs)
+        return self.get_compiled_field().potential(point)
     
     def magnetostatic_potential_at_point(self, point):
         """
@@ -1184,7 +2158,7 @@ class FieldRadialAxial(FieldAxial):
         Potential as a float value (in units of A).
         """
         assert point.shape == (2,)
-        return backend.potential_radial_derivs(point, self.z, self.magnetostatic_coeffs)
+        return self.get_compiled_field().potential(point, magnetostatic=True)
     
 class Field3DAxial(FieldAxial):
     """Field computed using a radial series expansion around the optical axis (z-axis). See comments at the start of this page.
@@ -1197,6 +2171,9 @@ class Field3DAxial(FieldAxial):
         assert magnetostatic_coeffs.shape == (len(z)-1, 2, backend.NU_MAX, backend.M_MAX, 4)
         
         self.symmetry = E.Symmetry.THREE_D
+    
+    def _compile(self):
+        return backend.CompiledField.three_d_axial(self.z, self.electrostatic_coeffs, self.magnetostatic_coeffs)
      
     def electrostatic_field_at_point(self, point):
         """
@@ -1212,7 +2189,7 @@ class Field3DAxial(FieldAxial):
         Numpy array containing the field strengths (in units of V/mm) in the x, y and z directions.
         """
         assert point.shape == (3,)
-        return backend.field_3d_derivs(point, self.z, self.electrostatic_coeffs)
+        return self.get_compiled_field().field(point)
      
     def electrostatic_potential_at_point(self, point):
         """
@@ -1229,7 +2206,7 @@ class Field3DAxial(FieldAxial):
         """
         point = np.array(point).astype(np.float64)
         assert point.shape == (3,)
-        return backend.potential_3d_derivs(point, self.z, self.electrostatic_coeffs)
+        return self.get_compiled_field().potential(point)
     
     def magnetostatic_field_at_point(self, point):
         """
@@ -1246,7 +2223,7 @@ class Field3DAxial(FieldAxial):
         """
         point = np.array(point).astype(np.float64)
         assert point.shape == (3,)
-        return backend.field_3d_derivs(point, self.z, self.magnetostatic_coeffs)
+        return self.get_compiled_field().field(point, magnetostatic=True)
      
     def magnetostatic_potential_at_point(self, point):
         """
@@ -1262,7 +2239,7 @@ class Field3DAxial(FieldAxial):
         Potential as a float value (in units of A).
         """
         assert point.shape == (3,)
-        return backend.potential_3d_derivs(point, self.z, self.magnetostatic_coeffs)
+        return self.get_compiled_field().potential(point, magnetostatic=True)
     
 
     
@@ -1,11 +1,16 @@
-"""The tracing module allows to trace electrons within any field type returned by the `traceon.solver` module. The tracing algorithm
-used is RK45 with adaptive step size control [1]. The tracing code is implemented in C (see `traceon.backend`) and has therefore
+"""The tracing module allows to trace electrons within any field type returned by the `traceon.solver` module. The default tracing algorithm
+is RK45 with adaptive step size control [1]. The higher order DOP853 method [2] and the low order Bogacki-Shampine method [3] are also available
+(see the `method` argument of `Tracer`). The tracing code is implemented in C (see `traceon.backend`) and has therefore
 excellent performance. The module also provides various helper functions to define appropriate initial velocity vectors and to
 compute intersections of the computed traces with various planes.
 
 ### References
 [1] Erwin Fehlberg. Low-Order Classical Runge-Kutta Formulas With Stepsize Control and their Application to Some Heat
-Transfer Problems. 1969. National Aeronautics and Space Administration."""
+Transfer Problems. 1969. National Aeronautics and Space Administration.
+
+[2] E. Hairer, S.P. Norsett, G. Wanner. Solving Ordinary Differential Equations I: Nonstiff Problems. 1993. Springer.
+
+[3] P. Bogacki, L.F. Shampine. A 3(2) pair of Runge-Kutta formulas. 1989. Applied Mathematics Letters."""
 
 
 from math import sqrt, cos, sin, atan2
@@ -21,6 +26,7 @@ from scipy.constants import m_e, e
 from . import solver as S
 from . import backend
 from . import logging
+from . import util
 
 def velocity_vec(eV, direction):
     """Compute an initial velocity vector in the correct units and direction.
@@ -104,9 +110,20 @@ class Tracer:
         Once the electron reaches one of the boundaries the tracing stops. The bounds are of the form ( (xmin, xmax), (ymin, ymax), (zmin, zmax) ).
     atol: float
         Absolute tolerance determining the accuracy of the trace.
+    method: str
+        Integration method, one of 'rkf45' (Runge-Kutta-Fehlberg 4(5), the default), 'dop853' (Dormand-Prince 8(5,3)) or 'bs32'
+        (Bogacki-Shampine 3(2)). At tight tolerances 'dop853' needs considerably fewer field evaluations, since it is allowed to take
+        larger steps. Therefore the trajectories contain fewer points. 'bs32' is cheap per step but low order, and only useful for quick previews
+        with a loose tolerance.
+    decimation: int
+        Only store every `decimation`-th step of the trajectories. The accuracy of the trace is not affected, but the memory
+        needed to store the trajectories of many electrons is reduced. The initial and final position are always stored.
+    spacing: float
+        Only store a step if the electron moved at least this distance (in mm) since the previously stored step. Can be combined
+        with `decimation`, in which case a step is stored only if both conditions are satisfied.
     """
     
-    def __init__(self, field, bounds, atol=1e-10):
+    def __init__(self, field, bounds, atol=1e-10, method='rkf45', decimation=1, spacing=0.):
           
         self.field = field
         assert isinstance(field, S.FieldRadialBEM) or isinstance(field, S.FieldRadialAxial) or \
@@ -116,6 +133,13 @@ class Tracer:
         assert bounds.shape == (3,2)
         self.bounds = bounds
         self.atol = atol
+        
+        assert method in backend.TRACING_METHODS, f"Unknown tracing method '{method}', choose one of {list(backend.TRACING_METHODS)}"
+        self.method = method
+        
+        assert decimation >= 1 and spacing >= 0.
+        self.decimation = int(decimation)
+        self.spacing = float(spacing)
     
     def __str__(self):
         field_name = self.field.__class__.__name__
@@ -142,28 +166,97 @@ class Tracer:
         The first three elements in the `positions[i]` array contain the x,y,z positions.
         The last three elements in `positions[i]` contain the vx,vy,vz velocities.
         """
-         
+        # A single electron is traced as a batch of one, such that the dispatch on the type of field is in one place
+        times, positions, _ = self._trace_many(np.array([position], dtype=np.float64), np.array([velocity], dtype=np.float64))
+        return times, positions
+    
+    def trace_many(self, positions, velocities):
+        """Trace many electrons at once. All electrons are traced inside the backend, distributed
+        over multiple threads (see the `TRACEON_THREADS` environment variable). This is much faster
+        than calling the tracer once for every electron.
+
+        Parameters
+        ----------
+        positions: (N, 2) or (N, 3) np.ndarray of float64
+            Initial positions of the electrons.
+        velocities: (N, 2) or (N, 3) np.ndarray of float64
+            Initial velocities (expressed in vectors whose magnitude has units of eV).
+        
+        Returns
+        -------
+        `(times, positions, offsets)`. The trajectories of all electrons are packed in the `times` array (shape (M,))
+        and the `positions` array (shape (M, 6)), see `__call__` for the meaning of these arrays. The trajectory
+        of electron `i` is given by `times[offsets[i]:offsets[i+1]]` and `positions[offsets[i]:offsets[i+1]]`.
+        The `offsets` array has shape (N+1,).
+        """
+        return self._trace_many(positions, velocities)
+    
+    def trace_to_plane(self, positions, velocities, p0, normal):
+        """Trace many electrons until they cross a plane, and return the state of the electrons at the crossing. The
+        trajectories are not stored, which makes this function much faster and more memory efficient than
+        calling `trace_many` followed by `plane_intersection` when only the final state of the electrons is needed. The
+        crossing is found by interpolation within the step that crosses the plane, followed by a refinement using
+        the integration method itself. Therefore the crossing is as accurate as the trace.
+
+        Parameters
+        ----------
+        positions: (N, 2) or (N, 3) np.ndarray of float64
+            Initial positions of the electrons.
+        velocities: (N, 2) or (N, 3) np.ndarray of float64
+            Initial velocities (expressed in vectors whose magnitude has units of eV).
+        p0: (2,) or (3,) np.ndarray of float64
+            A point that lies in the plane.
+        normal: (2,) or (3,) np.ndarray of float64
+            A vector that is normal to the plane. A point p lies in the plane iff `dot(normal, p - p0) = 0`.
+        
+        Returns
+        -------
+        `(times, states, found)`. `times` has shape (N,) and contains the times at which the electrons cross the plane,
+        `states` has shape (N, 6) and contains the positions and velocities of the electrons at the crossing. `found` is a boolean
+        array of shape (N,), equal to False for electrons that left the bounds without crossing the plane. For these electrons the
+        time and state are NaN.
+        """
+        times, states, offsets = self._trace_many(positions, velocities, plane=(p0, normal))
+        found = (offsets[1:] - offsets[:-1]) == 1
+        
+        times_out = np.full(len(found), np.nan)
+        states_out = np.full( (len(found), 6), np.nan)
+        times_out[found] = times
+        states_out[found] = states
+        
+        return times_out, states_out, found
+    
+    def _trace_many(self, positions, velocities, plane=None):
         f = self.field
+        
+        positions = np.array(positions, dtype=np.float64)
+        velocities = np.array(velocities, dtype=np.float64)
+        assert positions.shape == velocities.shape and positions.ndim == 2
+         
+        # Convert the velocities in eV to m/s
+        speed_eV = np.linalg.norm(velocities, axis=1)
+        speed = np.sqrt(2*speed_eV*e/m_e)
+        velocities = velocities * (speed/speed_eV)[:, np.newaxis]
          
-        # Convert the velocity in eV to m/s
-        speed_eV = np.linalg.norm(velocity)
-        speed = sqrt(2*speed_eV*e/m_e)
-        direction = velocity / speed_eV
-        velocity = speed * direction
+        # No more threads than electrons, a single electron (see __call__) is traced without starting extra threads
+        threads = 1 if backend.DEBUG else max(1, min(len(positions), util.get_number_of_threads()))
         
-        if isinstance(self.field, S.FieldRadialBEM):
-            return backend.trace_particle_radial(position, velocity, self.bounds, self.atol, 
-                f.electrostatic_point_charges, f.magnetostatic_point_charges, f.current_point_charges, field_bounds=f.field_bounds)
-        elif isinstance(self.field, S.FieldRadialAxial):
-            elec, mag = self.field.electrostatic_coeffs, self.field.magnetostatic_coeffs
-            return backend.trace_particle_radial_derivs(position, velocity, self.bounds, self.atol, self.field.z, elec, mag)
-        elif isinstance(self.field, S.Field3D_BEM):
-            bounds = self.field.field_bounds
-            elec, mag = self.field.electrostatic_point_charges, self.field.magnetostatic_point_charges
-            return backend.trace_particle_3d(position, velocity, self.bounds, self.atol, elec, mag)
-        elif isinstance(self.field, S.Field3DAxial):
-            return backend.trace_particle_3d_derivs(position, velocity, self.bounds, self.atol,
-                    self.field.z, self.field.electrostatic_coeffs, self.field.magnetostatic_coeffs)
+        if isinstance(f, S.FieldRadialBEM) and f.get_trees() is not None:
+            return backend.trace_particles_radial_tree(positions, velocities, self.bounds, self.atol,
+                *f.get_trees(), f.current_point_charges, field_bounds=f.field_bounds, N_threads=threads, method=self.method, plane=plane, decimation=self.decimation, spacing=self.spacing)
+        elif isinstance(f, S.FieldRadialBEM) and f.get_adaptive_charges() is not None:
+            return backend.trace_particles_radial_adaptive(positions, velocities, self.bounds, self.atol,
+                *f.get_adaptive_charges(), f.current_point_charges, field_bounds=f.field_bounds, N_threads=threads, method=self.method, plane=plane, decimation=self.decimation, spacing=self.spacing,
+                table=f.get_elliptic_table())
+        elif isinstance(f, S.Field3D_BEM) and f.get_octrees() is not None:
+            return backend.trace_particles_3d_octree(positions, velocities, self.bounds, self.atol,
+                *f.get_octrees(), field_bounds=f.field_bounds, N_threads=threads, method=self.method, plane=plane, decimation=self.decimation, spacing=self.spacing)
+        elif isinstance(f, S.Field3D_BEM) and f.get_adaptive_charges() is not None:
+            return backend.trace_particles_3d_adaptive(positions, velocities, self.bounds, self.atol,
+                *f.get_adaptive_charges(), field_bounds=f.field_bounds, N_threads=threads, method=self.method, plane=plane, decimation=self.decimation, spacing=self.spacing)
+        elif isinstance(f, S.FieldBEM) or isinstance(f, S.FieldAxial):
+            return backend.trace_particles_compiled(positions, velocities, self.bounds, self.atol, f.get_compiled_field(),
+                N_threads=threads, method=self.method, plane=plane, decimation=self.decimation, spacing=self.spacing)
  
 
 def plane_intersection(positions, p0, normal):